@@ -5,7 +5,7 @@
  *      Author: prateek
  *
  *  1. Compile :
- *  g++ producer.cc  -o producer.o -lrdkafka++ -I${HOME}/.local/include -L${HOME}/.local/lib
+ *  g++ producer.cc ../common/event_loop.cpp ../common/timer_wheel.cpp ../common/trace.cpp ../common/capture_file.cpp ../common/shutdown.cpp ../common/spill_buffer.cpp -I../common -o producer.o -lrdkafka++ -lrdkafka -I${HOME}/.local/include -L${HOME}/.local/lib
  *
  *  2) Produce :
 	$>./producer.o localhost:9092 prateek
@@ -20,15 +20,38 @@
 	>$ kafka-console-consumer.sh --bootstrap-server localhost:9092 --topic prateek --from-beginning
  	 Test message
 	Kafka is awesome
+
+	4) Replay traffic captured by the consumer ( consumer.o -w prateek.kcap ) :
+	$>./producer.o -R prateek.kcap localhost:9092 prateek			( original timing )
+	$>./producer.o -R prateek.kcap -s 10 -T localhost:9092 prateek	( 10x faster, original timestamps )
+
+	5) Keep messages that could not be delivered before exit, and produce them on the next start :
+	$>./producer.o -S prateek.spill -t 5000 localhost:9092 prateek
+
+	6) Keep reading input while the brokers are unreachable, buffering on disk :
+	$>./producer.o -D /var/spool/producer -F 100 localhost:9092 prateek
  *
  */
 #include <iostream>
 #include <string>
+#include <deque>
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 #include <csignal>
+#include <cerrno>
 #include <cstring>
+#include <functional>
+#include <getopt.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
 #include <librdkafka/rdkafkacpp.h>
+#include "capture_file.h"
+#include "event_loop.h"
+#include "shutdown.h"
+#include "spill_buffer.h"
+#include "trace.h"
 
 
 // Signal handler
@@ -45,8 +68,51 @@ static void sigterm (int sig) {
 class ExampleDeliveryReportCb : public RdKafka::DeliveryReportCb
 {
 public:
+	bool print_deliveries = true;	// else only failures are printed
+	CaptureWriter *spill = NULL;	// purged messages are written here at shutdown, if set
+	uint64_t spilled = 0;
+	SpillBuffer *disk_buffer = NULL;	// lines produced from it are released there, or queued there again
+	uint64_t requeued = 0;
+
 	void dr_cb(RdKafka::Message &message)
 	{
+		// latency from produce() to the report, as measured by librdkafka
+		tracePoint<TraceStage::DeliveryReport>(message.latency());
+
+		/*
+		 * Produced from the disk buffer ( its segment is the opaque ) : the segment is kept until this report. Lines
+		 * that timed out or were purged are queued again ahead of everything else, so the order is kept, and their
+		 * segment stays : purged at shutdown they are produced on the next start.
+		 */
+		if( disk_buffer && message.msg_opaque() )
+		{
+			const uint64_t segment = reinterpret_cast<uintptr_t>(message.msg_opaque()) - 1;
+			if( message.err() == RdKafka::ERR__MSG_TIMED_OUT || message.err() == RdKafka::ERR__PURGE_QUEUE ||
+				message.err() == RdKafka::ERR__PURGE_INFLIGHT )
+			{
+				disk_buffer->requeue(segment, message.key_pointer(), message.key_len(), message.payload(), message.len());
+				requeued++;
+				return;
+			}
+			disk_buffer->delivered(segment);
+		}
+
+		// purged at shutdown : kept for the next start
+		if( spill && (message.err() == RdKafka::ERR__PURGE_QUEUE || message.err() == RdKafka::ERR__PURGE_INFLIGHT) )
+		{
+			try
+			{
+				spill->append(message);
+				spilled++;
+				return;
+			}
+			catch( const std::runtime_error &e )
+			{
+				std::cerr << "% Failed to spill: " << e.what() << std::endl;
+				spill = NULL;
+			}
+		}
+
 		/*
 		 * If message.err() is non zero the message delivery failed permanently
 		 * for the message
@@ -55,7 +121,7 @@ public:
 		{
 			std::cerr<< "% Message delivery failed : "<< message.errstr() <<std::endl;
 		}
-		else
+		else if( print_deliveries )
 		{
 			std::cerr << "% Message delivered to topic "
 					<< message.topic_name () << " [" << message.partition ()
@@ -65,18 +131,72 @@ public:
 };
 
 
-// ./producer <broker> <topic>
+// ./producer [-R <capture> [-s <speed>] [-T] [-P]] [-S <spill file>] [-t <ms>] [-D <dir> [-F <ms>] [-O]] <broker> <topic>
 int main(int argc, char **argv)
 {
-	if ( argc != 3 )
+	std::string replay_file, spill_file;
+	double replay_speed = 1;
+	bool keep_timestamps = false, keep_partitions = false;
+	int shutdown_ms = 10000;
+	std::string spill_dir;
+	SpillBuffer::Policy spill_policy;
+	int opt;
+	while( (opt = getopt(argc, argv, "R:s:TPS:t:D:F:O")) != -1 )
+	{
+		switch( opt )
+		{
+			case 'D':
+				spill_dir = optarg;
+				break;
+			case 'F':
+				spill_policy.syncIntervalMs = atoi(optarg);
+				break;
+			case 'O':
+				spill_policy.directIo = true;
+				break;
+			case 'S':
+				spill_file = optarg;
+				break;
+			case 't':
+				shutdown_ms = atoi(optarg);
+				break;
+			case 'R':
+				replay_file = optarg;
+				break;
+			case 's':
+				replay_speed = atof(optarg);
+				break;
+			case 'T':
+				keep_timestamps = true;
+				break;
+			case 'P':
+				keep_partitions = true;
+				break;
+			default:
+				argc = 0;	// usage
+				break;
+		}
+	}
+
+	if ( argc - optind != 2 )
 	{
-		std::cerr << "Usage: " << argv[0] << " <brokers> <topic>\n";
+		std::cerr << "Usage: " << argv[0] << " [-R <capture> [-s <speed>] [-T] [-P]] [-S <spill file>] [-t <ms>]\n"
+				<< "       [-D <dir> [-F <ms>] [-O]] <brokers> <topic>\n"
+				<< "  -R <capture>  Replay messages captured by the consumer ( -w ) instead of reading stdin\n"
+				<< "  -s <speed>    Replay at this multiple of the original pace, 0 for as fast as possible (1)\n"
+				<< "  -T            Keep the captured timestamps ( default: produce time )\n"
+				<< "  -P            Keep the captured partitions ( default: partitioner )\n"
+				<< "  -S <file>     Spill messages not delivered at exit to file, produce them on the next start\n"
+				<< "  -t <ms>       Time to shut down in, from stopping input to spilling (10000)\n"
+				<< "  -D <dir>      Buffer lines on disk while the internal queue is full, instead of pausing input\n"
+				<< "  -F <ms>       Sync the disk buffer this often, 0 for every line, -1 never (1000)\n"
+				<< "  -O            Write the disk buffer with O_DIRECT\n";
 		exit (1);
 	}
 
 	// Store broker address and topic to produce to
-	std::string brokers = argv[1];
-	std::string topic = argv[2];
+	std::string brokers = argv[optind];
+	std::string topic = argv[optind + 1];
 
 	// Create configuration object
 	RdKafka::Conf *conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);
@@ -137,29 +257,57 @@ int main(int argc, char **argv)
 	delete conf;
 
 	/*
-	 * Read the messages from stdin and producer to broker
+	 * Disk buffer ( -D ) : when the internal queue is full, lines go to segment files on disk and input is read on.
+	 * Once anything is on disk, new lines queue behind it, so the order is kept; they are produced again from the
+	 * oldest as the queue has room. Lines left on disk at exit are produced on the next start.
 	 */
-	std::cout << "% Type message value and hit enter " << "to produce message."
-			<< std::endl;
-
-	for( std::string line ; run /* run will be 0 in case Signal received */ && std::getline(std::cin, line) ; )
+	SpillBuffer *spill_buffer = NULL;
+	bool spill_error = false, spilling = false;	// spill_error : the last disk buffer operation failed
+	if( !spill_dir.empty() )
 	{
-		if( line.empty() )
+		try
 		{
-			// call poll(0) , callbacks will be called for each message which we have producer earlier
-			producer->poll(0);
-			continue;
+			spill_buffer = new SpillBuffer(spill_dir, spill_policy);
+		}
+		catch( const std::runtime_error &e )
+		{
+			std::cerr << "% Failed to open disk buffer: " << e.what() << std::endl;
+			exit(1);
+		}
+		exampleDeliveryCallback.disk_buffer = spill_buffer;
+		if( !spill_buffer->empty() )
+		{
+			std::cerr << "% " << spill_buffer->diskBytes() << " bytes buffered in " << spill_dir
+					<< " by an earlier run, producing them first" << std::endl;
+			spilling = true;
 		}
+	}
 
-		/*
-		 * Produce/Send Message:
-		 * 1) This is asynchronous call, on success it will only enqueue the message on the internal producer queue.
-		 * 2) The actual delivery attempts to the broker are handled by background threads.
-		 * 3) The previously registered delivery report callback is used to signal back to the application when the
-		 * message has been delivered. ( or failed permanently after retries).
-		 */
-		retry:
+	/*
+	 * Read the messages from stdin and producer to broker
+	 *
+	 * 1) One epoll wait serves both directions: stdin becoming readable, and librdkafka signalling that delivery
+	 * reports are waiting on the producer's main queue. Nothing wakes up on a timeout to look.
+	 * 2) Lines read are queued in `lines` until produce() accepts them.
+	 */
+	EventLoop loop;
+	std::deque<std::string> lines;
+	std::string input;
+	bool input_done = false, reading = true;
 
+	/*
+	 * Produce/Send Message:
+	 * 1) This is asynchronous call, on success it will only enqueue the message on the internal producer queue.
+	 * 2) The actual delivery attempts to the broker are handled by background threads.
+	 * 3) The previously registered delivery report callback is used to signal back to the application when the
+	 * message has been delivered. ( or failed permanently after retries).
+	 *
+	 * Returns false if the internal queue is full: the line stays queued.
+	 */
+	auto produce_line = [&](const std::string &line)
+	{
+		TraceScope<TraceStage::ProduceEnqueue> probe;
+		probe.value(line.size());
 		RdKafka::ErrorCode err = producer->produce(
 													/* Topic name */
 													topic,
@@ -184,64 +332,553 @@ int main(int argc, char **argv)
 												   /* Per message opaque value passed to delivery report */
 												   NULL);
 
+		if( err == RdKafka::ERR__QUEUE_FULL )
+		{
+			return false;
+		}
 		if( err != RdKafka::ERR_NO_ERROR )
 		{
 			std::cerr << "% Failed to produce to topic " << topic << ": "
 					<< RdKafka::err2str (err) << std::endl;
+		}
+		else
+		{
+			std::cerr << "% Enqueued message (" << line.size () << " bytes) "
+					<< "for topic " << topic << std::endl;
+		}
+		return true;
+	};
+
+	/*
+	 * If the internal queue is full, stop reading stdin until messages are delivered and then retry.
+	 * The internal queue represents both messages to be sent and messages that have been sent or failed,
+	 * awaiting their delivery report callback to be called.
+	 *
+	 * The internal queue is limited by the configuration property queue.buffering.max.messages
+	 */
+	auto produce_lines = [&]()
+	{
+		while( !lines.empty() && (!spill_buffer || spill_buffer->empty()) && produce_line(lines.front()) )
+		{
+			lines.pop_front();
+		}
+		// after a failure ( spill_error ) every call tries again, it may have been transient
+		if( !lines.empty() && spill_buffer )
+		{
+			if( !spilling )
+			{
+				std::cerr << "% Internal queue full, buffering in " << spill_dir << std::endl;
+				spilling = true;
+			}
+			try
+			{
+				while( !lines.empty() )
+				{
+					spill_buffer->append(NULL, 0, lines.front().data(), lines.front().size());
+					lines.pop_front();
+				}
+				if( spill_error )
+				{
+					std::cerr << "% Buffering in " << spill_dir << " again" << std::endl;
+					spill_error = false;
+				}
+			}
+			catch( const std::runtime_error &e )
+			{
+				// e.g. the disk is full: back to waiting for deliveries, reported once
+				if( !spill_error )
+				{
+					std::cerr << "% Failed to buffer on disk: " << e.what() << std::endl;
+					spill_error = true;
+				}
+			}
+		}
+		if( !lines.empty() && reading )
+		{
+			std::cerr << "% Failed to produce to topic " << topic << ": "
+					<< RdKafka::err2str (RdKafka::ERR__QUEUE_FULL) << ", waiting for deliveries" << std::endl;
+			loop.unwatch(STDIN_FILENO);
+			reading = false;
+		}
+	};
 
-			if ( err == RdKafka::ERR__QUEUE_FULL )
+	/*
+	 * Produce buffered lines, oldest first, until the internal queue is full again. They are copied: the segment
+	 * they are read from is unmapped once read, and deleted once all its lines are delivered.
+	 */
+	auto drain_spill = [&]()
+	{
+		if( !spill_buffer )
+		{
+			return;
+		}
+		try
+		{
+			SpilledRecord record;
+			while( spill_buffer->front(record) )
+			{
+				RdKafka::ErrorCode err = producer->produce(topic, RdKafka::Topic::PARTITION_UA,
+														   RdKafka::Producer::RK_MSG_COPY,
+														   const_cast<char*>(record.value), record.valueLen,
+														   record.key, record.keyLen,
+														   0, NULL,
+														   /* the segment, released by the delivery report */
+														   reinterpret_cast<void*>(static_cast<uintptr_t>(record.segment + 1)));
+				if( err == RdKafka::ERR__QUEUE_FULL )
+				{
+					return;
+				}
+				spill_buffer->pop();
+				if( err != RdKafka::ERR_NO_ERROR )
+				{
+					std::cerr << "% Failed to produce buffered line to topic " << topic << ": "
+							<< RdKafka::err2str (err) << std::endl;
+					spill_buffer->delivered(record.segment);
+				}
+			}
+			if( spilling && spill_buffer->empty() )
+			{
+				std::cerr << "% Disk buffer drained, " << spill_buffer->popped() << " line(s) produced from it so far"
+						<< std::endl;
+				spilling = false;
+			}
+			spill_buffer->sync();
+		}
+		catch( const std::runtime_error &e )
+		{
+			// retried from the timer, reported once
+			if( !spill_error )
+			{
+				std::cerr << "% Disk buffer failed: " << e.what() << std::endl;
+				spill_error = true;
+			}
+		}
+	};
+
+	auto read_input = [&]()
+	{
+		char buf[64 * 1024];
+		ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+		if( n < 0 && (errno == EINTR || errno == EAGAIN) )
+		{
+			// level triggered: called again while there is input
+			return;
+		}
+		if( n <= 0 )
+		{
+			if( n < 0 )
+			{
+				std::cerr << "% Failed to read input: " << strerror(errno) << std::endl;
+			}
+			// end of input: a last line without newline is a message too
+			if( !input.empty() )
 			{
-				/* If the internal queue is full, wait for
-				 * messages to be delivered and then retry.
-				 * The internal queue represents both
-				 * messages to be sent and messages that have
-				 * been sent or failed, awaiting their
-				 * delivery report callback to be called.
-				 *
-				 * The internal queue is limited by the
-				 * configuration property
-				 * queue.buffering.max.messages */
-				producer->poll (1000/*block for max 1000ms*/);
-				goto retry;
+				lines.push_back(input);
 			}
+			input_done = true;
+			loop.unwatch(STDIN_FILENO);
+			reading = false;
 		}
 		else
 		{
-			std::cerr << "% Enqueued message (" << line.size () << " bytes) "
-					<< "for topic " << topic << std::endl;
+			input.append(buf, n);
+			size_t start = 0, end;
+			while( (end = input.find('\n', start)) != std::string::npos )
+			{
+				// empty lines are not produced
+				if( end > start )
+				{
+					lines.push_back(input.substr(start, end - start));
+				}
+				start = end + 1;
+			}
+			input.erase(0, start);
 		}
+		produce_lines();
+	};
 
-		/*
-		 * 1) A producer application should continually serve the delivery report queue by calling poll()
-		 * at frequent intervals.
-		 *
-		 * 2) Either put the poll call in your main loop , or in a dedicated thread , or call it after every
-		 * produce() call.
-		 *
-		 * 3) Just make sure that poll() is still called during periods where you are not producing
-		 * any messages to make sure previously produced messages have their delivery report callback served.
-		 * (and any other callbacks you register)
-		 */
+	/*
+	 * Replay : the messages of a capture are produced in their captured order and spacing, divided by the speed.
+	 * 1) Values are produced straight from the mapped capture without RK_MSG_COPY: librdkafka references them until
+	 * they are delivered, and the capture stays mapped until the producer is deleted. Keys and headers are copied.
+	 * 2) A timer produces every message that is due in one go, then is scheduled again for the next one: no sleep
+	 * per message, and delivery reports are served in between.
+	 * 3) If the internal queue is full, replay resumes from the delivery reports and catches up with the schedule.
+	 */
+	CaptureReader *capture = NULL;
+	CapturedMessage captured;
+	bool have_captured = false, replay_stalled = false;
+	int64_t replay_start_ms = 0, first_capture_us = 0;
+	uint64_t replayed = 0;
+
+	/*
+	 * Returns false if the internal queue is full: the message is tried again.
+	 * A spilled message goes back where it was going: its own topic, partition and timestamp.
+	 */
+	auto produce_captured = [&](const CapturedMessage &m, bool spilled)
+	{
+		TraceScope<TraceStage::ProduceEnqueue> probe;
+		probe.value(m.valueLen);
+		RdKafka::Headers *headers = NULL;
+		if( !m.headers.empty() )
+		{
+			headers = RdKafka::Headers::create();
+			for( size_t i = 0 ; i < m.headers.size() ; i++ )
+			{
+				const CapturedHeader &h = m.headers[i];
+				headers->add(std::string(h.name, h.nameLen), h.value, h.valueLen);
+			}
+		}
+
+		RdKafka::ErrorCode err = producer->produce(spilled ? *m.topic : topic,
+												   spilled || keep_partitions ? m.partition : RdKafka::Topic::PARTITION_UA,
+												   /* No copy : the value stays in the mapped capture */
+												   0,
+												   const_cast<char*>(m.value), m.valueLen,
+												   m.key, m.keyLen,
+												   spilled || keep_timestamps ? m.timestamp : 0,
+												   /* Owned by the message once produced */
+												   headers,
+												   NULL);
+		if( err != RdKafka::ERR_NO_ERROR )
+		{
+			delete headers;
+		}
+		if( err == RdKafka::ERR__QUEUE_FULL )
+		{
+			return false;
+		}
+		if( err != RdKafka::ERR_NO_ERROR )
+		{
+			std::cerr << "% Failed to replay " << *m.topic << " [" << m.partition << "] offset "
+					<< m.offset << ": " << RdKafka::err2str (err) << std::endl;
+		}
+		else
+		{
+			replayed++;
+		}
+		return true;
+	};
+
+	std::function<void()> replay = [&]()
+	{
+		int64_t now_ms = CoarseClock::nowMs();
+		// bounded like the consumer's drain: the rest is taken on the next turn of the loop
+		for( int i = 0 ; have_captured && i < 10000 ; i++ )
+		{
+			if( replay_speed > 0 )
+			{
+				int64_t due_ms = replay_start_ms + (int64_t) ((captured.captureUs - first_capture_us) / 1000.0 / replay_speed);
+				if( due_ms > now_ms )
+				{
+					loop.timers().schedule(due_ms - now_ms, replay);
+					return;
+				}
+			}
+			if( !produce_captured(captured, false) )
+			{
+				replay_stalled = true;
+				return;
+			}
+			have_captured = capture->next(captured);
+		}
+		if( have_captured )
+		{
+			loop.timers().schedule(0, replay);
+		}
+		else
+		{
+			input_done = true;
+		}
+	};
+
+	/*
+	 * Spill : messages that could not be delivered before the last exit are produced first.
+	 * 1) The spill file is renamed to <spill>.replay and kept mapped until the producer is deleted; only then is it
+	 * removed, as its messages are delivered or spilled again by now. If the process dies before, the next start
+	 * produces them again: at least once, not exactly once.
+	 * 2) This run's spill is written aside ( <spill>.tmp ) and renamed into place at exit, it never overwrites a
+	 * file that is still mapped.
+	 */
+	std::vector<CaptureReader*> spill_replays;
+	std::vector<std::string> spill_replay_paths;
+	if( !spill_file.empty() )
+	{
+		std::string replay_path = spill_file + ".replay";
+		if( access(replay_path.c_str(), F_OK) == 0 )
+		{
+			spill_replay_paths.push_back(replay_path);
+		}
+		if( access(spill_file.c_str(), F_OK) == 0 )
+		{
+			// after a crash both may exist: the older one is replayed first
+			if( spill_replay_paths.empty() && rename(spill_file.c_str(), replay_path.c_str()) == 0 )
+			{
+				spill_replay_paths.push_back(replay_path);
+			}
+			else
+			{
+				spill_replay_paths.push_back(spill_file);
+			}
+		}
+
+		for( size_t i = 0 ; i < spill_replay_paths.size() && run ; i++ )
+		{
+			try
+			{
+				spill_replays.push_back(new CaptureReader(spill_replay_paths[i]));
+			}
+			catch( const std::runtime_error &e )
+			{
+				std::cerr << "% Failed to read spilled messages: " << e.what() << std::endl;
+				exit(1);
+			}
+
+			CapturedMessage m;
+			while( run && spill_replays.back()->next(m) )
+			{
+				while( run && !produce_captured(m, true) )
+				{
+					producer->poll(100);
+				}
+				producer->poll(0);
+			}
+			std::cerr << "% Produced " << replayed << " spilled message(s) from " << spill_replay_paths[i] << std::endl;
+			replayed = 0;
+		}
+	}
+
+	/*
+	 * 1) A producer application should continually serve the delivery report queue by calling poll()
+	 * at frequent intervals.
+	 *
+	 * 2) Here librdkafka wakes the loop as soon as a delivery report is queued, and poll(0) serves all of them.
+	 * Delivered messages free room in the internal queue, so lines waiting for it are retried and stdin is read
+	 * again.
+	 */
+	int delivery_reports = loop.watchMain(producer, [&]()
+	{
 		producer->poll(0);
+		drain_spill();
+		if( replay_stalled )
+		{
+			replay_stalled = false;
+			replay();
+		}
+		if( !lines.empty() )
+		{
+			produce_lines();
+		}
+		if( !capture && lines.empty() && !input_done && !reading )
+		{
+			loop.watch(STDIN_FILENO, read_input);
+			reading = true;
+		}
+	});
+	if( !replay_file.empty() )
+	{
+		try
+		{
+			capture = new CaptureReader(replay_file);
+		}
+		catch( const std::runtime_error &e )
+		{
+			std::cerr << "% Failed to replay: " << e.what() << std::endl;
+			exit(1);
+		}
+		exampleDeliveryCallback.print_deliveries = false;
+		reading = false;
+		have_captured = capture->next(captured);
+		input_done = !have_captured;
+		replay_start_ms = CoarseClock::nowMs();
+		first_capture_us = have_captured ? captured.captureUs : 0;
+		replay();
+	}
+	else
+	{
+		loop.watch(STDIN_FILENO, read_input);
+
+		std::cout << "% Type message value and hit enter " << "to produce message."
+				<< std::endl;
+	}
+
+	// the disk buffer is drained from delivery reports, synced and retried from a timer as well
+	if( spill_buffer )
+	{
+		loop.timers().every(100, drain_spill);
+		drain_spill();
+	}
+
+	// run will be 0 in case Signal received, epoll_wait returns early then
+	while( run && !(input_done && lines.empty() && (!spill_buffer || spill_buffer->empty())) )
+	{
+		loop.runOnce(1000);
 	}
 
 	/*
-	 * 1) Wait for final messages to be delivered or fail.
-	 * 2) flush() is an abstraction over poll() which waits for all messages to be delivered.
+	 * Shutdown, within -t ms altogether, every phase ending as soon as its work is done :
+	 * 1) stop intake : no more stdin or replay.
+	 * 2) drain : lines read but waiting for queue room are produced, or buffered on disk ( -D ) for the next start.
+	 * Lines already on disk stay there : produced now, they would only be cut short by the flush.
+	 * 3) flush : wait for final messages to be delivered or fail. flush() is an abstraction over poll() which waits
+	 * for all messages to be delivered, called here in slices to report progress.
+	 * 4) spill ( -S ) : what is left, in the internal queue or waiting for it, is purged and written to the spill
+	 * file from the delivery reports. Purged in-flight messages may have reached the broker: produced again on the
+	 * next start, they can be duplicates.
+	 * With a spill file, draining and flushing leave time for spilling.
 	 */
-	std::cerr << "% Flushing final messages..." << std::endl;
-	producer->flush(10*1000 /* wait for max 10 seconds */);
+	ShutdownCoordinator shutdown(shutdown_ms);
+	CaptureWriter *spill = NULL;
+	std::string spill_tmp = spill_file + ".tmp";
+	bool spill_failed = false, spill_written = false;
 
+	shutdown.phase("stop intake", 0, [&](int)
+	{
+		if( reading )
+		{
+			loop.unwatch(STDIN_FILENO);
+			reading = false;
+		}
+		have_captured = false;
+		return true;
+	});
+	shutdown.phase("drain", spill_file.empty() ? 0 : shutdown_ms / 4, [&](int slice_ms)
+	{
+		producer->poll(slice_ms);
+		produce_lines();
+		return lines.empty();
+	}, [&]() { return std::to_string(lines.size()) + " line(s) waiting for queue room"; });
+	shutdown.phase("flush", spill_file.empty() ? 0 : shutdown_ms / 2, [&](int slice_ms)
+	{
+		producer->flush(slice_ms);
+		return producer->outq_len() == 0;
+	}, [&]() { return std::to_string(producer->outq_len()) + " message(s) in queue"; });
+	if( !spill_file.empty() )
+	{
+		shutdown.phase("spill", 0, [&](int)
+		{
+			if( spill_failed || (lines.empty() && producer->outq_len() == 0) )
+			{
+				return true;
+			}
+			if( !spill )
+			{
+				try
+				{
+					spill = new CaptureWriter(spill_tmp);
+				}
+				catch( const std::runtime_error &e )
+				{
+					std::cerr << "% Failed to spill: " << e.what() << std::endl;
+					spill_failed = true;
+					return true;
+				}
+				exampleDeliveryCallback.spill = spill;
+			}
+			try
+			{
+				for( size_t i = 0 ; i < lines.size() ; i++ )
+				{
+					spill->append(topic, RdKafka::Topic::PARTITION_UA, NULL, 0, lines[i].data(), lines[i].size(), 0);
+					exampleDeliveryCallback.spilled++;
+				}
+			}
+			catch( const std::runtime_error &e )
+			{
+				std::cerr << "% Failed to spill: " << e.what() << std::endl;
+				spill_failed = true;
+				return true;
+			}
+			lines.clear();
+
+			// purged messages come back as delivery reports, which write them to the spill
+			producer->purge(RdKafka::Producer::PURGE_QUEUE | RdKafka::Producer::PURGE_INFLIGHT);
+			producer->poll(0);
+			spill_failed = !exampleDeliveryCallback.spill;
+			return spill_failed || producer->outq_len() == 0;
+		}, [&]() { return std::to_string(producer->outq_len()) + " message(s) to spill"; });
+	}
+
+	std::cerr << "% Shutting down..." << std::endl;
+	shutdown.run();
+	std::cerr << "% Shutdown: " << shutdown.report() << std::endl;
+
+	if( spill )
+	{
+		exampleDeliveryCallback.spill = NULL;
+		try
+		{
+			spill->flush();
+		}
+		catch( const std::runtime_error &e )
+		{
+			std::cerr << "% Failed to spill: " << e.what() << std::endl;
+			spill_failed = true;
+		}
+		delete spill;
+		spill_written = !spill_failed;
+		if( spill_written )
+		{
+			std::cerr << "% Spilled " << exampleDeliveryCallback.spilled << " message(s) to " << spill_file << std::endl;
+		}
+	}
 
 	// Get size of out queue. Messages waiting to be sent to OR acknowledged by broker
-	if ( producer->outq_len () > 0 )
+	if ( producer->outq_len () + lines.size() > 0 )
 	{
-		std::cerr << "% " << producer->outq_len ()
+		std::cerr << "% " << producer->outq_len () + lines.size()
 				<< " message(s) were not delivered" << std::endl;
 	}
 
+	// where the time went, with KAFKA_TRACE=1
+	if( Trace::enabled() )
+	{
+		std::cerr << "% Trace: " << Trace::report() << std::endl;
+	}
+
+	// the loop holds a reference to the main queue, release it before the producer goes
+	loop.unwatchQueue(delivery_reports);
+
 	// delete producer
 	delete producer;
 
+	if( spill_buffer )
+	{
+		if( exampleDeliveryCallback.requeued )
+		{
+			std::cerr << "% " << exampleDeliveryCallback.requeued << " line(s) from the disk buffer failed and were"
+					<< " queued again" << std::endl;
+		}
+		// with lines not delivered, their segments are kept as well
+		if( !spill_buffer->empty() || spill_buffer->undelivered() )
+		{
+			std::cerr << "% " << spill_buffer->diskBytes() << " bytes left buffered in " << spill_dir
+					<< ", produced on the next start" << std::endl;
+		}
+		delete spill_buffer;
+	}
+
+	// only now: undelivered values pointed into the capture
+	if( capture )
+	{
+		std::cerr << "% Replayed " << replayed << " messages from " << replay_file
+				<< (capture->truncated() ? " ( capture ends in a torn record )" : "") << std::endl;
+		delete capture;
+	}
+
+	// the spilled messages produced at start are delivered or spilled again by now
+	for( size_t i = 0 ; i < spill_replays.size() ; i++ )
+	{
+		delete spill_replays[i];
+		if( !spill_failed )
+		{
+			unlink(spill_replay_paths[i].c_str());
+		}
+	}
+	if( spill_written && rename(spill_tmp.c_str(), spill_file.c_str()) != 0 )
+	{
+		std::cerr << "% Failed to rename " << spill_tmp << ": " << strerror(errno) << std::endl;
+	}
+
 	return 0;
 }
@@ -0,0 +1,372 @@
+/*
+ * materialize.cpp
+ *
+ * Keeps the latest value of every key of a topic in a local state store, backed by a compacted changelog topic.
+ *  1) On start the store is opened from its last snapshot and log, then brought up to date from the changelog
+ *     ( only the part written after the snapshot ).
+ *  2) Every consumed message is applied to the store and written to the changelog, on the same partition.
+ *  3) Input offsets are committed once the changelog writes before them are delivered; a snapshot is taken
+ *     whenever the log outgrows -S MB.
+ *
+ * The changelog must be created with cleanup.policy=compact and as many partitions as the input.
+ *
+ * Run:
+ *  ./materialize -b localhost:9092 -d /var/lib/prateek-0 -p 0,1 prateek
+ *  ./materialize -b localhost:9092 -d /var/lib/prateek-0 -p 0,1 -q some-key prateek        ( restore and look up )
+ */
+#include "commit_manager.h"
+#include "librdkafka/rdkafkacpp.h"
+#include "state_store.h"
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+class MaterializeEventCb : public RdKafka::EventCb
+{
+public:
+    void event_cb(RdKafka::Event &event)
+    {
+        switch (event.type())
+        {
+        case RdKafka::Event::EVENT_ERROR:
+            if (event.fatal())
+            {
+                std::cerr << "FATAL ";
+                run = 0;
+            }
+            std::cerr << "ERROR (" << RdKafka::err2str(event.err()) << ") : " << event.str() << std::endl;
+            break;
+        case RdKafka::Event::EVENT_LOG:
+            fprintf(stderr, "LOG-%i-%s: %s\n", event.severity(), event.fac().c_str(), event.str().c_str());
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+/*
+ * Delivered changelog writes advance the store's changelog offsets, which a snapshot records so that a
+ * restore can skip everything before them. Served from flush() / poll() on the main thread.
+ */
+class ChangelogDeliveryReportCb : public RdKafka::DeliveryReportCb
+{
+public:
+    explicit ChangelogDeliveryReportCb(StateStore &store) : store_{store} {}
+
+    void dr_cb(RdKafka::Message &message)
+    {
+        if (message.err() != RdKafka::ERR_NO_ERROR)
+        {
+            std::cerr << "% Changelog write failed: " << message.errstr() << std::endl;
+            failed = true;
+            return;
+        }
+        store_.setChangelogOffset(message.partition(), message.offset());
+    }
+
+    bool failed{false};
+
+private:
+    StateStore &store_;
+};
+
+static void setConf(RdKafka::Conf *conf, const std::vector<std::pair<std::string, std::string>> &props)
+{
+    std::string errstr;
+    for (const auto &prop : props)
+    {
+        if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+    }
+}
+
+static std::vector<int32_t> parsePartitions(const char *arg)
+{
+    std::vector<int32_t> partitions;
+    for (const char *p = arg; p && *p;)
+    {
+        partitions.push_back(atoi(p));
+        if ((p = strchr(p, ',')))
+        {
+            p++;
+        }
+    }
+    return partitions;
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092";
+    std::string group = "materialize";
+    std::string dir, changelog, queryKey;
+    std::vector<std::pair<std::string, std::string>> props;
+    std::vector<int32_t> partitions;
+    size_t snapshotMb = 256;
+    int commitIntervalMs = 1000;
+    bool query = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:g:d:c:p:S:i:q:X:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'g':
+            group = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'c':
+            changelog = optarg;
+            break;
+        case 'p':
+            partitions = parsePartitions(optarg);
+            break;
+        case 'S':
+            snapshotMb = std::max(1, atoi(optarg));
+            break;
+        case 'i':
+            commitIntervalMs = std::max(1, atoi(optarg));
+            break;
+        case 'q':
+            queryKey = optarg;
+            query = true;
+            break;
+        case 'X':
+        {
+            char *name = optarg, *val;
+            if (!(val = strchr(name, '=')))
+            {
+                std::cerr << "%% Expected -X property=value, not " << name << std::endl;
+                exit(1);
+            }
+            *val++ = '\0';
+            props.emplace_back(name, val);
+            break;
+        }
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1 || dir.empty() || partitions.empty())
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s -d <dir> -p <partitions> [options] topic\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -g <group>       Consumer group (materialize)\n"
+                "  -d <dir>         State store directory, one per set of partitions\n"
+                "  -c <topic>       Changelog topic (<topic>-changelog)\n"
+                "  -p <p1,p2..>     Partitions of the topic to materialize\n"
+                "  -S <MB>          Snapshot when the log exceeds this size (256)\n"
+                "  -i <ms>          Commit interval (1000)\n"
+                "  -q <key>         Restore, print the value of key and exit\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property\n"
+                "                   (applied to consumer and producer)\n"
+                "\n",
+                argv[0]);
+        exit(1);
+    }
+    const std::string topic = argv[optind];
+    if (changelog.empty())
+    {
+        changelog = topic + "-changelog";
+    }
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        auto start = Clock::now();
+        StateStore store{dir};
+        std::cerr << "% Opened " << store.size() << " keys from " << store.snapshotBytes() << " byte snapshot and "
+                  << store.logBytes() << " byte log in " << elapsedMs(start) << " ms" << std::endl;
+
+        MaterializeEventCb eventCb;
+        std::string errstr;
+
+        // restore reads with assign(), the group id is only required by the consumer
+        std::unique_ptr<RdKafka::Conf> restoreConf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+        setConf(restoreConf.get(), {{"bootstrap.servers", brokers},
+                                    {"group.id", group + "-restore"},
+                                    {"enable.auto.commit", "false"},
+                                    {"fetch.max.bytes", "52428800"}});
+        setConf(restoreConf.get(), props);
+        start = Clock::now();
+        const auto restored = restoreFromChangelog(store, restoreConf.get(), changelog, partitions, 30000);
+        std::cerr << "% Restored " << restored << " changelog record(s) in " << elapsedMs(start) << " ms, "
+                  << store.size() << " keys" << std::endl;
+
+        if (query)
+        {
+            const char *value;
+            size_t valueLen;
+            if (!store.get(queryKey, value, valueLen))
+            {
+                std::cerr << "% " << queryKey << " not found" << std::endl;
+                return 1;
+            }
+            fwrite(value, 1, valueLen, stdout);
+            fputc('\n', stdout);
+            return 0;
+        }
+
+        // every call to maybeCommit() commits, the main loop decides when
+        CommitManager commits{CommitManager::Policy{1, 0}};
+        ChangelogDeliveryReportCb drCb{store};
+
+        std::unique_ptr<RdKafka::Conf> producerConf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+        setConf(producerConf.get(), {{"bootstrap.servers", brokers}, {"enable.idempotence", "true"}});
+        setConf(producerConf.get(), props);
+        if (producerConf->set("event_cb", &eventCb, errstr) != RdKafka::Conf::CONF_OK ||
+            producerConf->set("dr_cb", &drCb, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+        std::unique_ptr<RdKafka::Producer> producer{RdKafka::Producer::create(producerConf.get(), errstr)};
+        if (!producer)
+        {
+            throw std::runtime_error{"producer: " + errstr};
+        }
+
+        std::unique_ptr<RdKafka::Conf> consumerConf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+        setConf(consumerConf.get(), {{"bootstrap.servers", brokers},
+                                     {"group.id", group},
+                                     {"enable.auto.commit", "false"},
+                                     {"auto.offset.reset", "earliest"}});
+        setConf(consumerConf.get(), props);
+        if (consumerConf->set("event_cb", &eventCb, errstr) != RdKafka::Conf::CONF_OK ||
+            consumerConf->set("offset_commit_cb", &commits, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+        std::unique_ptr<RdKafka::KafkaConsumer> consumer{RdKafka::KafkaConsumer::create(consumerConf.get(), errstr)};
+        if (!consumer)
+        {
+            throw std::runtime_error{"consumer: " + errstr};
+        }
+
+        // fixed partitions: the store holds exactly these, from their committed offsets on
+        std::vector<RdKafka::TopicPartition *> assignment;
+        for (const auto partition : partitions)
+        {
+            assignment.push_back(RdKafka::TopicPartition::create(topic, partition));
+        }
+        auto err = consumer->assign(assignment);
+        RdKafka::TopicPartition::destroy(assignment);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            throw std::runtime_error{"assign: " + RdKafka::err2str(err)};
+        }
+
+        const auto snapshotBytes = snapshotMb << 20;
+        auto lastCommit = Clock::now();
+        uint64_t applied = 0;
+
+        while (run)
+        {
+            std::unique_ptr<RdKafka::Message> msg{consumer->consume(100)};
+            switch (msg->err())
+            {
+            case RdKafka::ERR_NO_ERROR:
+            {
+                const std::string key{static_cast<const char *>(msg->key_pointer()), msg->key_len()};
+                if (msg->payload())
+                {
+                    store.put(key, msg->payload(), msg->len());
+                }
+                else
+                {
+                    store.remove(key);
+                }
+
+                // a null payload is a tombstone in the changelog too
+                while ((err = producer->produce(changelog, msg->partition(), RdKafka::Producer::RK_MSG_COPY,
+                                                msg->payload(), msg->len(), msg->key_pointer(), msg->key_len(), 0,
+                                                nullptr)) == RdKafka::ERR__QUEUE_FULL)
+                {
+                    producer->poll(100);
+                }
+                if (err != RdKafka::ERR_NO_ERROR)
+                {
+                    throw std::runtime_error{"changelog produce: " + RdKafka::err2str(err)};
+                }
+                producer->poll(0);
+                commits.processed(*msg);
+                applied++;
+                break;
+            }
+            case RdKafka::ERR__TIMED_OUT:
+            case RdKafka::ERR__PARTITION_EOF:
+                break;
+            default:
+                std::cerr << "% Consume failed: " << msg->errstr() << std::endl;
+                run = 0;
+            }
+
+            if (Clock::now() - lastCommit >= std::chrono::milliseconds(commitIntervalMs) || !run)
+            {
+                // input is committed only behind delivered changelog writes
+                err = producer->flush(30000);
+                if (err != RdKafka::ERR_NO_ERROR || drCb.failed)
+                {
+                    throw std::runtime_error{"changelog not delivered: " + RdKafka::err2str(err)};
+                }
+                commits.maybeCommit(consumer.get());
+                if (store.logBytes() > snapshotBytes)
+                {
+                    start = Clock::now();
+                    store.snapshot();
+                    std::cerr << "% Snapshot of " << store.size() << " keys, " << store.snapshotBytes()
+                              << " bytes in " << elapsedMs(start) << " ms" << std::endl;
+                }
+                lastCommit = Clock::now();
+            }
+        }
+
+        commits.commitSync(consumer.get());
+        store.sync();
+        consumer->close();
+        std::cerr << "% Applied " << applied << " message(s), " << store.size() << " keys. Commits: " << commits.report()
+                  << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Materialize failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    RdKafka::wait_destroyed(5000);
+    return 0;
+}
@@ -0,0 +1,710 @@
+/*
+ * archiver.cpp
+ *
+ * Archives topics to columnar files. Every consumed batch becomes one Arrow record batch
+ * ( topic, partition, offset, timestamp, key, value, headers ) appended to the current Arrow IPC or Parquet file,
+ * instead of one write per record.
+ *  1) Files are written as <dir>/<prefix>-<pid>-<opened ms>.<arrow|parquet>.tmp and rolled after -S MB or
+ *     -R seconds, whichever comes first.
+ *  2) A rolled file is closed, fsync'ed and renamed without .tmp; only then are the offsets of its messages
+ *     committed. A crash loses at most the unfinished .tmp file, whose messages are consumed again; a crash
+ *     between rename and commit archives one file's messages twice.
+ *  3) When partitions are revoked the current file is rolled first, and messages of the revoked partitions in the
+ *     batch being accumulated are dropped, they belong to the next owner.
+ *
+ * Give every instance its own directory or -p prefix if several archive into the same place.
+ *
+ * Run:
+ *  ./archiver -b localhost:9092 -g archiver -d /data/archive prateek
+ *  ./archiver -b localhost:9092 -g archiver -d /data/archive -f parquet -z zstd -S 512 -R 600 prateek
+ */
+#include "commit_manager.h"
+#include "librdkafka/rdkafka.h"
+#include "librdkafka/rdkafkacpp.h"
+#include "timer_wheel.h"
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/writer.h>
+#include <arrow/util/compression.h>
+#include <parquet/arrow/writer.h>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static void check(const arrow::Status &status, const char *what)
+{
+    if (!status.ok())
+    {
+        throw std::runtime_error{std::string{what} + ": " + status.ToString()};
+    }
+}
+
+template <typename T>
+static T check(arrow::Result<T> result, const char *what)
+{
+    check(result.status(), what);
+    return std::move(result).ValueUnsafe();
+}
+
+/*
+ * Builds one record batch per consumed batch. Builders keep their capacity between batches, so after the
+ * first few batches appending is a copy into existing buffers.
+ */
+class RecordBatchBuilder
+{
+public:
+    RecordBatchBuilder()
+    {
+        auto *pool = arrow::default_memory_pool();
+        headerType_ = arrow::struct_({arrow::field("key", arrow::utf8(), false), arrow::field("value", arrow::binary())});
+        headerKey_ = std::make_shared<arrow::StringBuilder>(pool);
+        headerValue_ = std::make_shared<arrow::BinaryBuilder>(pool);
+        header_ = std::make_shared<arrow::StructBuilder>(
+            headerType_, pool, std::vector<std::shared_ptr<arrow::ArrayBuilder>>{headerKey_, headerValue_});
+        headers_ = std::make_unique<arrow::ListBuilder>(pool, header_, arrow::list(headerType_));
+
+        schema_ = arrow::schema({arrow::field("topic", arrow::utf8(), false),
+                                 arrow::field("partition", arrow::int32(), false),
+                                 arrow::field("offset", arrow::int64(), false),
+                                 arrow::field("timestamp", arrow::timestamp(arrow::TimeUnit::MILLI)),
+                                 arrow::field("key", arrow::binary()),
+                                 arrow::field("value", arrow::binary()),
+                                 arrow::field("headers", arrow::list(headerType_))});
+    }
+
+    const std::shared_ptr<arrow::Schema> &schema() const { return schema_; }
+
+    std::shared_ptr<arrow::RecordBatch> build(const std::vector<RdKafka::Message *> &messages)
+    {
+        size_t keyBytes = 0, valueBytes = 0, topicBytes = 0;
+        for (const auto *msg : messages)
+        {
+            keyBytes += msg->key_len();
+            valueBytes += msg->len();
+            topicBytes += msg->topic_name().size();
+        }
+        const auto n = static_cast<int64_t>(messages.size());
+        check(topic_.Reserve(n), "reserve");
+        check(topic_.ReserveData(topicBytes), "reserve");
+        check(partition_.Reserve(n), "reserve");
+        check(offset_.Reserve(n), "reserve");
+        check(timestamp_.Reserve(n), "reserve");
+        check(key_.Reserve(n), "reserve");
+        check(key_.ReserveData(keyBytes), "reserve");
+        check(value_.Reserve(n), "reserve");
+        check(value_.ReserveData(valueBytes), "reserve");
+        check(headers_->Reserve(n), "reserve");
+
+        for (auto *msg : messages)
+        {
+            const auto &topic = msg->topic_name();
+            topic_.UnsafeAppend(topic.data(), static_cast<int32_t>(topic.size()));
+            partition_.UnsafeAppend(msg->partition());
+            offset_.UnsafeAppend(msg->offset());
+
+            const auto ts = msg->timestamp();
+            if (ts.type == RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE)
+            {
+                timestamp_.UnsafeAppendNull();
+            }
+            else
+            {
+                timestamp_.UnsafeAppend(ts.timestamp);
+            }
+
+            if (msg->key_pointer())
+            {
+                key_.UnsafeAppend(static_cast<const uint8_t *>(msg->key_pointer()), static_cast<int32_t>(msg->key_len()));
+            }
+            else
+            {
+                key_.UnsafeAppendNull();
+            }
+            if (msg->payload())
+            {
+                value_.UnsafeAppend(static_cast<const uint8_t *>(msg->payload()), static_cast<int32_t>(msg->len()));
+            }
+            else
+            {
+                value_.UnsafeAppendNull();
+            }
+
+            appendHeaders(*msg);
+        }
+
+        std::vector<std::shared_ptr<arrow::Array>> columns(7);
+        check(topic_.Finish(&columns[0]), "topic");
+        check(partition_.Finish(&columns[1]), "partition");
+        check(offset_.Finish(&columns[2]), "offset");
+        check(timestamp_.Finish(&columns[3]), "timestamp");
+        check(key_.Finish(&columns[4]), "key");
+        check(value_.Finish(&columns[5]), "value");
+        check(headers_->Finish(&columns[6]), "headers");
+        return arrow::RecordBatch::Make(schema_, n, std::move(columns));
+    }
+
+private:
+    // Headers are read in place through the C API, the C++ accessor copies every header
+    void appendHeaders(RdKafka::Message &msg)
+    {
+        check(headers_->Append(), "headers");
+
+        rd_kafka_headers_t *hdrs;
+        if (rd_kafka_message_headers(msg.c_ptr(), &hdrs) != RD_KAFKA_RESP_ERR_NO_ERROR)
+        {
+            return;     // no headers: empty list
+        }
+
+        const char *name;
+        const void *value;
+        size_t size;
+        for (size_t i = 0; rd_kafka_header_get_all(hdrs, i, &name, &value, &size) == RD_KAFKA_RESP_ERR_NO_ERROR; i++)
+        {
+            check(header_->Append(), "headers");
+            check(headerKey_->Append(name, static_cast<int32_t>(strlen(name))), "headers");
+            check(value ? headerValue_->Append(static_cast<const uint8_t *>(value), static_cast<int32_t>(size))
+                        : headerValue_->AppendNull(),
+                  "headers");
+        }
+    }
+
+    std::shared_ptr<arrow::Schema> schema_;
+    std::shared_ptr<arrow::DataType> headerType_;
+    arrow::StringBuilder topic_;
+    arrow::Int32Builder partition_;
+    arrow::Int64Builder offset_;
+    arrow::TimestampBuilder timestamp_{arrow::timestamp(arrow::TimeUnit::MILLI), arrow::default_memory_pool()};
+    arrow::BinaryBuilder key_;
+    arrow::BinaryBuilder value_;
+    std::shared_ptr<arrow::StringBuilder> headerKey_;
+    std::shared_ptr<arrow::BinaryBuilder> headerValue_;
+    std::shared_ptr<arrow::StructBuilder> header_;
+    std::unique_ptr<arrow::ListBuilder> headers_;
+};
+
+struct FileOptions
+{
+    std::string dir;
+    std::string prefix{"archive"};
+    bool parquet{false};
+    arrow::Compression::type codec{arrow::Compression::UNCOMPRESSED};
+};
+
+/*
+ * One archive file. Written under a .tmp name, made durable and renamed by close().
+ */
+class ArchiveFile
+{
+public:
+    ArchiveFile(const FileOptions &opts, const std::shared_ptr<arrow::Schema> &schema)
+    {
+        const auto openedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::system_clock::now().time_since_epoch()).count();
+        path_ = opts.dir + "/" + opts.prefix + "-" + std::to_string(getpid()) + "-" + std::to_string(openedMs) +
+                (opts.parquet ? ".parquet" : ".arrow");
+        dir_ = opts.dir;
+
+        stream_ = check(arrow::io::FileOutputStream::Open(path_ + ".tmp"), "open");
+        if (opts.parquet)
+        {
+            auto props = parquet::WriterProperties::Builder().compression(opts.codec)->build();
+            parquet_ = check(parquet::arrow::FileWriter::Open(*schema, arrow::default_memory_pool(), stream_, props),
+                             "parquet writer");
+        }
+        else
+        {
+            auto options = arrow::ipc::IpcWriteOptions::Defaults();
+            if (opts.codec != arrow::Compression::UNCOMPRESSED)
+            {
+                options.codec = std::shared_ptr<arrow::util::Codec>{check(arrow::util::Codec::Create(opts.codec), "codec")};
+            }
+            ipc_ = check(arrow::ipc::MakeFileWriter(stream_, schema, options), "ipc writer");
+        }
+        opened_ = Clock::now();
+    }
+
+    ~ArchiveFile()
+    {
+        if (stream_ && !stream_->closed())
+        {
+            // not closed: abandoned, e.g. on an error
+            (void)stream_->Close();
+            unlink((path_ + ".tmp").c_str());
+        }
+    }
+
+    void write(const arrow::RecordBatch &batch)
+    {
+        if (parquet_ && rows_ > 0)
+        {
+            // a row group per batch: the previous one is written out, so bytes() lags the file by one batch at most
+            // and no more is held in memory ( started only here, close() would leave an empty row group )
+            check(parquet_->NewBufferedRowGroup(), "row group");
+        }
+        check(parquet_ ? parquet_->WriteRecordBatch(batch) : ipc_->WriteRecordBatch(batch), "write");
+        rows_ += batch.num_rows();
+    }
+
+    // Footer, fsync, rename, fsync of the directory: the file and its name survive a crash once this returns
+    void close()
+    {
+        check(parquet_ ? parquet_->Close() : ipc_->Close(), "close");
+        size_ = check(stream_->Tell(), "tell");
+        if (fsync(stream_->file_descriptor()) != 0)
+        {
+            throw std::runtime_error{"fsync " + path_ + ": " + strerror(errno)};
+        }
+        check(stream_->Close(), "close");
+
+        if (rename((path_ + ".tmp").c_str(), path_.c_str()) != 0)
+        {
+            throw std::runtime_error{"rename " + path_ + ": " + strerror(errno)};
+        }
+        const int fd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0 || fsync(fd) != 0)
+        {
+            const int e = errno;
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            throw std::runtime_error{"fsync " + dir_ + ": " + strerror(e)};
+        }
+        ::close(fd);
+    }
+
+    // Bytes written so far, the last Parquet row group not included
+    int64_t bytes() const { return stream_->closed() ? size_ : check(stream_->Tell(), "tell"); }
+    int64_t rows() const { return rows_; }
+    Clock::time_point opened() const { return opened_; }
+    const std::string &path() const { return path_; }
+
+private:
+    std::string path_, dir_;
+    std::shared_ptr<arrow::io::FileOutputStream> stream_;
+    std::unique_ptr<parquet::arrow::FileWriter> parquet_;
+    std::shared_ptr<arrow::ipc::RecordBatchWriter> ipc_;
+    int64_t rows_{0};
+    int64_t size_{0};
+    Clock::time_point opened_;
+};
+
+/*
+ * Owns the batch being accumulated, the open file and the pending commits. Rebalance callbacks are served from
+ * consume(), i.e. while a batch is being accumulated.
+ */
+class Archiver : public RdKafka::RebalanceCb
+{
+public:
+    Archiver(const FileOptions &opts, int64_t rollBytes, int64_t rollMs)
+        : opts_{opts}, rollBytes_{rollBytes}, rollMs_{rollMs}, commits_{CommitManager::Policy{}}
+    {
+    }
+
+    ~Archiver() { clearBatch(); }
+
+    CommitManager &commits() { return commits_; }
+
+    /*
+     * Accumulate batchSize messages, but wait no longer than batchTimeoutMs. The deadline is a timer, the clock
+     * is not read per message.
+     */
+    void consumeBatch(RdKafka::KafkaConsumer *consumer, size_t batchSize, int batchTimeoutMs)
+    {
+        clearBatch();
+        batch_.reserve(batchSize);
+
+        bool done = false;
+        wheel_.advance();
+        const auto deadline = wheel_.schedule(batchTimeoutMs, [&done] { done = true; });
+
+        while (!done && batch_.size() < batchSize)
+        {
+            std::unique_ptr<RdKafka::Message> msg{consumer->consume(wheel_.timeout(batchTimeoutMs))};
+
+            switch (msg->err())
+            {
+            case RdKafka::ERR__TIMED_OUT:
+                break;
+            case RdKafka::ERR_NO_ERROR:
+                batch_.push_back(msg.release());
+                break;
+            default:
+                std::cerr << "% Consumer error: " << msg->errstr() << std::endl;
+                run = 0;
+                done = true;
+            }
+            wheel_.advance();
+        }
+        wheel_.cancel(deadline);
+    }
+
+    // Append the accumulated batch to the current file, rolling it if it is due
+    void archiveBatch(RdKafka::KafkaConsumer *consumer)
+    {
+        if (!batch_.empty())
+        {
+            if (!file_)
+            {
+                file_.reset(new ArchiveFile{opts_, builder_.schema()});
+            }
+            const auto start = Clock::now();
+            file_->write(*builder_.build(batch_));
+            writeMs_ += elapsedMs(start);
+            for (const auto *msg : batch_)
+            {
+                commits_.processed(*msg);
+                bytes_ += msg->len() + msg->key_len();
+            }
+            clearBatch();
+        }
+
+        if (file_ && (file_->bytes() >= rollBytes_ ||
+                      Clock::now() - file_->opened() >= std::chrono::milliseconds(rollMs_)))
+        {
+            roll(consumer);
+        }
+    }
+
+    // Close the current file durably, then commit the offsets of its messages
+    void roll(RdKafka::KafkaConsumer *consumer)
+    {
+        if (!file_)
+        {
+            return;
+        }
+
+        const auto start = Clock::now();
+        file_->close();
+        const auto closeMs = elapsedMs(start);
+        const auto err = commits_.commitSync(consumer);
+
+        std::cerr << "% Archived " << file_->rows() << " messages, " << bytes_ / 1024 << " KB of keys and values, to "
+                  << file_->path() << " ( " << file_->bytes() << " bytes ): write " << writeMs_ << " ms, close "
+                  << closeMs << " ms, " << (writeMs_ + closeMs > 0 ? bytes_ / 1048.576 / (writeMs_ + closeMs) : 0)
+                  << " MB/s" << (err ? ", commit failed: " + RdKafka::err2str(err) : "") << std::endl;
+
+        file_.reset();
+        writeMs_ = 0;
+        bytes_ = 0;
+    }
+
+    void rebalance_cb(RdKafka::KafkaConsumer *consumer, RdKafka::ErrorCode err,
+                      std::vector<RdKafka::TopicPartition *> &partitions)
+    {
+        const bool cooperative = consumer->rebalance_protocol() == "COOPERATIVE";
+        RdKafka::Error *error = nullptr;
+        RdKafka::ErrorCode ret = RdKafka::ERR_NO_ERROR;
+
+        if (err == RdKafka::ERR__ASSIGN_PARTITIONS)
+        {
+            if (cooperative)
+            {
+                error = consumer->incremental_assign(partitions);
+            }
+            else
+            {
+                ret = consumer->assign(partitions);
+            }
+        }
+        else
+        {
+            dropRevoked(partitions, cooperative);
+
+            // a lost assignment was already taken over and its commit fails: the file is kept and its messages
+            // are archived again by the new owner
+            roll(consumer);
+
+            if (cooperative)
+            {
+                error = consumer->incremental_unassign(partitions);
+            }
+            else
+            {
+                ret = consumer->unassign();
+            }
+        }
+
+        if (error)
+        {
+            std::cerr << "% Incremental assign failed: " << error->str() << std::endl;
+            delete error;
+        }
+        else if (ret)
+        {
+            std::cerr << "% Assign failed: " << RdKafka::err2str(ret) << std::endl;
+        }
+    }
+
+private:
+    void clearBatch()
+    {
+        for (auto *msg : batch_)
+        {
+            delete msg;
+        }
+        batch_.clear();
+    }
+
+    // Messages of revoked partitions consumed so far in this batch are left to the next owner
+    void dropRevoked(const std::vector<RdKafka::TopicPartition *> &partitions, bool cooperative)
+    {
+        auto revoked = [&](const RdKafka::Message *msg) {
+            if (!cooperative)
+            {
+                return true;
+            }
+            for (const auto *tp : partitions)
+            {
+                if (tp->partition() == msg->partition() && tp->topic() == msg->topic_name())
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        auto keep = std::stable_partition(batch_.begin(), batch_.end(), [&](const RdKafka::Message *msg) { return !revoked(msg); });
+        for (auto it = keep; it != batch_.end(); ++it)
+        {
+            delete *it;
+        }
+        batch_.erase(keep, batch_.end());
+    }
+
+    FileOptions opts_;
+    int64_t rollBytes_;
+    int64_t rollMs_;
+    CommitManager commits_;
+    RecordBatchBuilder builder_;
+    std::vector<RdKafka::Message *> batch_;
+    TimerWheel wheel_;
+    std::unique_ptr<ArchiveFile> file_;
+    double writeMs_{0};
+    uint64_t bytes_{0};
+};
+
+class ArchiverEventCb : public RdKafka::EventCb
+{
+public:
+    void event_cb(RdKafka::Event &event)
+    {
+        switch (event.type())
+        {
+        case RdKafka::Event::EVENT_ERROR:
+            if (event.fatal())
+            {
+                std::cerr << "FATAL ";
+                run = 0;
+            }
+            std::cerr << "ERROR (" << RdKafka::err2str(event.err()) << ") : " << event.str() << std::endl;
+            break;
+        case RdKafka::Event::EVENT_LOG:
+            fprintf(stderr, "LOG-%i-%s: %s\n", event.severity(), event.fac().c_str(), event.str().c_str());
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+static arrow::Compression::type parseCodec(const std::string &name)
+{
+    if (name == "none")
+    {
+        return arrow::Compression::UNCOMPRESSED;
+    }
+    if (name == "lz4")
+    {
+        return arrow::Compression::LZ4_FRAME;
+    }
+    auto codec = arrow::util::Codec::GetCompressionType(name);
+    if (!codec.ok())
+    {
+        throw std::invalid_argument{"unknown codec " + name};
+    }
+    return *codec;
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092";
+    std::string group = "archiver";
+    std::string codec = "none";
+    std::vector<std::pair<std::string, std::string>> props;
+    FileOptions fileOpts;
+    size_t batchSize = 10000;
+    int batchTimeoutMs = 1000;
+    int64_t rollMb = 256;
+    int64_t rollSeconds = 300;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:g:d:p:f:z:B:T:S:R:X:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'g':
+            group = optarg;
+            break;
+        case 'd':
+            fileOpts.dir = optarg;
+            break;
+        case 'p':
+            fileOpts.prefix = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "arrow") && strcmp(optarg, "parquet"))
+            {
+                goto usage;
+            }
+            fileOpts.parquet = !strcmp(optarg, "parquet");
+            break;
+        case 'z':
+            codec = optarg;
+            break;
+        case 'B':
+            batchSize = std::max(1, atoi(optarg));
+            break;
+        case 'T':
+            batchTimeoutMs = std::max(1, atoi(optarg));
+            break;
+        case 'S':
+            rollMb = std::max(1, atoi(optarg));
+            break;
+        case 'R':
+            rollSeconds = std::max(1, atoi(optarg));
+            break;
+        case 'X':
+        {
+            char *name = optarg, *val;
+            if (!(val = strchr(name, '=')))
+            {
+                std::cerr << "%% Expected -X property=value, not " << name << std::endl;
+                exit(1);
+            }
+            *val++ = '\0';
+            props.emplace_back(name, val);
+            break;
+        }
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind == argc || fileOpts.dir.empty())
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s -d <dir> [options] topic1 topic2..\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -g <group>       Consumer group (archiver)\n"
+                "  -d <dir>         Directory of the archive files\n"
+                "  -p <prefix>      File name prefix (archive)\n"
+                "  -f <format>      arrow (IPC file) or parquet (arrow)\n"
+                "  -z <codec>       none, lz4, zstd, snappy (parquet only) or gzip (parquet only) (none)\n"
+                "  -B <messages>    Messages per batch / record batch (10000)\n"
+                "  -T <ms>          How long to wait for a batch to fill (1000)\n"
+                "  -S <MB>          Roll files at this size (256)\n"
+                "  -R <seconds>     Roll files at this age (300)\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property\n"
+                "\n",
+                argv[0]);
+        exit(1);
+    }
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        std::vector<std::string> topics(argv + optind, argv + argc);
+        fileOpts.codec = parseCodec(codec);
+        Archiver archiver{fileOpts, rollMb << 20, rollSeconds * 1000};
+        ArchiverEventCb eventCb;
+        std::string errstr;
+
+        std::unique_ptr<RdKafka::Conf> conf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+        for (const auto &prop : std::vector<std::pair<std::string, std::string>>{{"bootstrap.servers", brokers},
+                                                                                {"group.id", group},
+                                                                                {"enable.auto.commit", "false"},
+                                                                                {"auto.offset.reset", "earliest"}})
+        {
+            if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+            {
+                throw std::runtime_error{errstr};
+            }
+        }
+        for (const auto &prop : props)
+        {
+            if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+            {
+                throw std::runtime_error{errstr};
+            }
+        }
+        if (conf->set("event_cb", &eventCb, errstr) != RdKafka::Conf::CONF_OK ||
+            conf->set("rebalance_cb", &archiver, errstr) != RdKafka::Conf::CONF_OK ||
+            conf->set("offset_commit_cb", &archiver.commits(), errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+
+        std::unique_ptr<RdKafka::KafkaConsumer> consumer{RdKafka::KafkaConsumer::create(conf.get(), errstr)};
+        if (!consumer)
+        {
+            throw std::runtime_error{"consumer: " + errstr};
+        }
+        const auto err = consumer->subscribe(topics);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            throw std::runtime_error{"subscribe: " + RdKafka::err2str(err)};
+        }
+
+        while (run)
+        {
+            archiver.consumeBatch(consumer.get(), batchSize, batchTimeoutMs);
+            archiver.archiveBatch(consumer.get());
+        }
+
+        // everything consumed is archived and committed before the group is left
+        archiver.roll(consumer.get());
+        consumer->close();
+        std::cerr << "% Commits: " << archiver.commits().report() << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Archiver failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    RdKafka::wait_destroyed(5000);
+    return 0;
+}
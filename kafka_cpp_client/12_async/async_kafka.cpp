@@ -0,0 +1,277 @@
+/*
+ * async_kafka.cpp
+ */
+#include "async_kafka.h"
+#include "librdkafka/rdkafka.h"
+#include "trace.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace
+{
+// Headers of a consumed message, copied for produce() ( which takes ownership on success )
+RdKafka::Headers *copyHeaders(RdKafka::Message &message)
+{
+    rd_kafka_headers_t *hdrs;
+    if (rd_kafka_message_headers(message.c_ptr(), &hdrs) != RD_KAFKA_RESP_ERR_NO_ERROR)
+    {
+        return nullptr;
+    }
+    auto *headers = RdKafka::Headers::create();
+    const char *name;
+    const void *data;
+    size_t size;
+    for (size_t i = 0; rd_kafka_header_get_all(hdrs, i, &name, &data, &size) == RD_KAFKA_RESP_ERR_NO_ERROR; i++)
+    {
+        headers->add(name, data, size);
+    }
+    return headers;
+}
+}
+
+void AsyncLoop::spawn(Task<> task)
+{
+    task.start();
+    tasks_.push_back(std::move(task));
+}
+
+void AsyncLoop::run()
+{
+    while (!stopped())
+    {
+        for (auto it = tasks_.begin(); it != tasks_.end();)
+        {
+            if (!it->done())
+            {
+                ++it;
+                continue;
+            }
+            auto task = std::move(*it);
+            it = tasks_.erase(it);
+            task.result();  // rethrows
+        }
+        if (tasks_.empty())
+        {
+            break;
+        }
+        runOnce(1000);
+    }
+}
+
+AsyncConsumer::AsyncConsumer(AsyncLoop &loop, RdKafka::Conf *conf) : loop_{loop}
+{
+    std::string errstr;
+    consumer_.reset(RdKafka::KafkaConsumer::create(conf, errstr));
+    if (!consumer_)
+    {
+        throw std::runtime_error{"consumer: " + errstr};
+    }
+    // the main queue ( events, rebalances ) is forwarded to the consumer queue
+    watch_ = loop_.watchConsumer(consumer_.get(), [this] { readable(); });
+}
+
+AsyncConsumer::~AsyncConsumer()
+{
+    loop_.unwatchQueue(watch_);
+}
+
+void AsyncConsumer::close()
+{
+    loop_.unwatchQueue(watch_);
+    watch_ = -1;
+    consumer_->close();
+}
+
+// Whatever is queued now, without waiting
+void AsyncConsumer::fill(Batch &batch, size_t maxMessages)
+{
+    while (batch.size() < maxMessages)
+    {
+        std::unique_ptr<RdKafka::Message> msg{consumer_->consume(0)};
+        if (msg->err() == RdKafka::ERR__TIMED_OUT)
+        {
+            return;
+        }
+        if (msg->err() != RdKafka::ERR__PARTITION_EOF)
+        {
+            batch.push_back(std::move(msg));
+        }
+    }
+}
+
+void AsyncConsumer::readable()
+{
+    if (!waiter_)
+    {
+        // the next nextBatch() takes them: its await_ready() drains the queue first
+        return;
+    }
+    auto *waiter = waiter_;
+    fill(waiter->batch_, waiter->maxMessages_);
+    if (!waiter->batch_.empty())
+    {
+        waiter_ = nullptr;
+        loop_.timers().cancel(waiter->timer_);
+        waiter->handle_.resume();
+    }
+}
+
+bool AsyncConsumer::NextBatch::await_ready()
+{
+    consumer_.fill(batch_, maxMessages_);
+    return !batch_.empty() || timeoutMs_ == 0;
+}
+
+void AsyncConsumer::NextBatch::await_suspend(std::coroutine_handle<> handle)
+{
+    handle_ = handle;
+    consumer_.waiter_ = this;
+    timer_ = consumer_.loop_.timers().schedule(timeoutMs_, [this]
+    {
+        consumer_.waiter_ = nullptr;
+        handle_.resume();
+    });
+}
+
+AsyncProducer::AsyncProducer(AsyncLoop &loop, RdKafka::Conf *conf) : loop_{loop}
+{
+    std::string errstr;
+    if (conf->set("dr_cb", this, errstr) != RdKafka::Conf::CONF_OK)
+    {
+        throw std::runtime_error{errstr};
+    }
+    producer_.reset(RdKafka::Producer::create(conf, errstr));
+    if (!producer_)
+    {
+        throw std::runtime_error{"producer: " + errstr};
+    }
+    // delivery reports are served from the main queue
+    watch_ = loop_.watchMain(producer_.get(), [this] { readable(); });
+}
+
+AsyncProducer::~AsyncProducer()
+{
+    loop_.unwatchQueue(watch_);
+}
+
+int AsyncProducer::flush(int timeoutMs)
+{
+    producer_->flush(timeoutMs);
+    return producer_->outq_len();
+}
+
+void AsyncProducer::readable()
+{
+    producer_->poll(0);
+
+    // delivery reports made room: retry in order, a later send must not overtake a stalled one
+    while (!stalled_.empty())
+    {
+        auto *op = stalled_.front();
+        if (!op->enqueue())
+        {
+            break;
+        }
+        stalled_.pop_front();
+        if (op->complete())
+        {
+            op->handle_.resume();
+        }
+    }
+}
+
+void AsyncProducer::dr_cb(RdKafka::Message &message)
+{
+    tracePoint<TraceStage::DeliveryReport>(message.latency());
+    auto *op = static_cast<Operation *>(message.msg_opaque());
+    op->outstanding_--;
+    op->delivered(message);
+    if (op->complete())
+    {
+        op->handle_.resume();
+    }
+}
+
+bool AsyncProducer::Operation::await_suspend(std::coroutine_handle<> handle)
+{
+    handle_ = handle;
+    if (!producer_.stalled_.empty() || !enqueue())
+    {
+        producer_.stalled_.push_back(this);
+        return true;
+    }
+    return !complete();     // failed right away: do not suspend
+}
+
+bool AsyncProducer::Send::enqueue()
+{
+    const auto err = producer_.producer_->produce(topic_, partition_, RdKafka::Producer::RK_MSG_COPY,
+                                                  const_cast<void *>(value_), len_, key_, keyLen_, timestamp_,
+                                                  headers_, this);
+    if (err == RdKafka::ERR__QUEUE_FULL)
+    {
+        return false;
+    }
+    queued_ = true;
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        report_.err = err;
+        return true;
+    }
+    headers_ = nullptr;     // owned by librdkafka now
+    outstanding_++;
+    return true;
+}
+
+void AsyncProducer::Send::delivered(RdKafka::Message &message)
+{
+    report_.err = message.err();
+    report_.partition = message.partition();
+    report_.offset = message.offset();
+}
+
+bool AsyncProducer::SendBatch::enqueue()
+{
+    for (; next_ < messages_.size(); next_++)
+    {
+        auto &msg = *messages_[next_];
+        auto *headers = copyHeaders(msg);
+        const auto ts = msg.timestamp();
+        const auto err = producer_.producer_->produce(
+            topic_, RdKafka::Topic::PARTITION_UA, RdKafka::Producer::RK_MSG_COPY, msg.payload(), msg.len(),
+            msg.key_pointer(), msg.key_len(),
+            ts.type == RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE ? 0 : ts.timestamp, headers, this);
+        if (err == RdKafka::ERR__QUEUE_FULL)
+        {
+            delete headers;
+            return false;
+        }
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            delete headers;
+            report_.failed++;
+            if (report_.firstError == RdKafka::ERR_NO_ERROR)
+            {
+                report_.firstError = err;
+            }
+            continue;
+        }
+        outstanding_++;
+    }
+    queued_ = true;
+    return true;
+}
+
+void AsyncProducer::SendBatch::delivered(RdKafka::Message &message)
+{
+    if (message.err() == RdKafka::ERR_NO_ERROR)
+    {
+        report_.delivered++;
+        return;
+    }
+    report_.failed++;
+    if (report_.firstError == RdKafka::ERR_NO_ERROR)
+    {
+        report_.firstError = message.err();
+    }
+}
@@ -0,0 +1,453 @@
+/*
+ * async_kafka.h
+ *
+ * C++20 coroutines over librdkafka, so that one thread can run thousands of logical streams:
+ *
+ *  Task<> relay(AsyncConsumer &consumer, AsyncProducer &producer)
+ *  {
+ *      for (;;)
+ *      {
+ *          auto batch = co_await consumer.nextBatch(500, 1000);
+ *          ...
+ *          auto report = co_await producer.send("out", RdKafka::Topic::PARTITION_UA, key, value);
+ *      }
+ *  }
+ *
+ * Nothing blocks: librdkafka signals an eventfd when a queue ( consumer queue, delivery reports ) becomes non
+ * empty ( io_event_enable ), the AsyncLoop waits for those fds with epoll and for timers on a TimerWheel, and
+ * resumes the coroutines waiting for them. Every coroutine runs on the thread that calls AsyncLoop::run(), so
+ * they share state without locks, but must not call blocking librdkafka functions ( flush, commitSync .. )
+ * other than at startup and shutdown.
+ *
+ * Not thread safe.
+ */
+#pragma once
+
+#include "event_loop.h"
+#include "librdkafka/rdkafkacpp.h"
+#include "timer_wheel.h"
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+template <typename T = void>
+class Task;
+
+/*
+ * Promise of a Task: the task starts when it is awaited ( or spawned ) and resumes its awaiter when it returns
+ */
+class TaskPromiseBase
+{
+public:
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            auto continuation = handle.promise().continuation_;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception_ = std::current_exception(); }
+
+    std::coroutine_handle<> continuation_;
+    std::exception_ptr exception_;
+};
+
+template <typename T>
+class TaskPromise : public TaskPromiseBase
+{
+public:
+    Task<T> get_return_object();
+    void return_value(T value) { value_.emplace(std::move(value)); }
+
+    T result()
+    {
+        if (exception_)
+        {
+            std::rethrow_exception(exception_);
+        }
+        return std::move(*value_);
+    }
+
+private:
+    std::optional<T> value_;
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase
+{
+public:
+    Task<void> get_return_object();
+    void return_void() {}
+
+    void result()
+    {
+        if (exception_)
+        {
+            std::rethrow_exception(exception_);
+        }
+    }
+};
+
+/*
+ * A coroutine returning T. Awaiting it runs it to completion and returns its value or rethrows its exception.
+ */
+template <typename T>
+class Task
+{
+public:
+    typedef TaskPromise<T> promise_type;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_{handle} {}
+    Task(Task &&other) noexcept : handle_{std::exchange(other.handle_, nullptr)} {}
+    Task &operator=(Task &&other) noexcept
+    {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (handle_)
+        {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle_.promise().continuation_ = awaiter;
+        return handle_;
+    }
+
+    T await_resume() { return handle_.promise().result(); }
+
+    // Run until the first suspension, for tasks nobody awaits ( see AsyncLoop::spawn )
+    void start() { handle_.resume(); }
+    bool done() const { return handle_.done(); }
+    T result() { return handle_.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>{std::coroutine_handle<TaskPromise<T>>::from_promise(*this)};
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>{std::coroutine_handle<TaskPromise<void>>::from_promise(*this)};
+}
+
+/*
+ * Unbounded queue between coroutines, with one receiver. push() resumes a waiting receiver right away, on the
+ * pushing coroutine's stack, until the receiver suspends again.
+ */
+template <typename T>
+class Channel
+{
+public:
+    class Receive
+    {
+    public:
+        explicit Receive(Channel &channel) : channel_{channel} {}
+
+        bool await_ready() const noexcept { return !channel_.items_.empty() || channel_.closed_; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept { channel_.receiver_ = handle; }
+
+        // nullopt once the channel is closed and empty
+        std::optional<T> await_resume()
+        {
+            if (channel_.items_.empty())
+            {
+                return std::nullopt;
+            }
+            return channel_.pop();
+        }
+
+    private:
+        Channel &channel_;
+    };
+
+    void push(T value)
+    {
+        items_.push_back(std::move(value));
+        wake();
+    }
+
+    // Receivers get what is queued, then nullopt
+    void close()
+    {
+        closed_ = true;
+        wake();
+    }
+
+    // Drop what is queued, e.g. messages of a revoked partition
+    void clear() { items_.clear(); }
+
+    Receive receive() { return Receive{*this}; }
+
+    // Take a queued item without waiting, size() must be > 0
+    T pop()
+    {
+        T value = std::move(items_.front());
+        items_.pop_front();
+        return value;
+    }
+
+    size_t size() const { return items_.size(); }
+    bool closed() const { return closed_; }
+
+private:
+    void wake()
+    {
+        if (receiver_)
+        {
+            std::exchange(receiver_, nullptr).resume();
+        }
+    }
+
+    std::deque<T> items_;
+    std::coroutine_handle<> receiver_;
+    bool closed_{false};
+};
+
+/*
+ * EventLoop running coroutines: spawned tasks, and Sleep on its timers
+ */
+class AsyncLoop : public EventLoop
+{
+public:
+    class Sleep
+    {
+    public:
+        Sleep(AsyncLoop &loop, int64_t ms) : loop_{loop}, ms_{ms} {}
+        bool await_ready() const noexcept { return ms_ <= 0; }
+        void await_suspend(std::coroutine_handle<> handle) { loop_.timers().schedule(ms_, [handle] { handle.resume(); }); }
+        void await_resume() noexcept {}
+
+    private:
+        AsyncLoop &loop_;
+        int64_t ms_;
+    };
+
+    // Start a task that nobody awaits. An exception it lets escape ends run() and is rethrown there.
+    void spawn(Task<> task);
+
+    // Serve fds and timers until every spawned task returned, or stop()
+    void run();
+
+    Sleep sleep(int64_t ms) { return Sleep{*this, ms}; }
+
+private:
+    std::vector<Task<>> tasks_;
+};
+
+/*
+ * KafkaConsumer whose consumer queue wakes the loop. Rebalance, offset commit and event callbacks are served
+ * on the loop thread, from nextBatch().
+ */
+class AsyncConsumer
+{
+public:
+    typedef std::vector<std::unique_ptr<RdKafka::Message>> Batch;
+
+    class NextBatch
+    {
+    public:
+        NextBatch(AsyncConsumer &consumer, size_t maxMessages, int timeoutMs)
+            : consumer_{consumer}, maxMessages_{maxMessages}, timeoutMs_{timeoutMs}
+        {
+        }
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> handle);
+        Batch await_resume() { return std::move(batch_); }
+
+    private:
+        friend class AsyncConsumer;
+        AsyncConsumer &consumer_;
+        size_t maxMessages_;
+        int timeoutMs_;
+        Batch batch_;
+        std::coroutine_handle<> handle_;
+        TimerWheel::TimerId timer_{0};
+    };
+
+    // @throws std::runtime_error if the consumer can not be created
+    AsyncConsumer(AsyncLoop &loop, RdKafka::Conf *conf);
+    ~AsyncConsumer();
+
+    /*
+     * Up to maxMessages messages, waiting at most timeoutMs for the first one ( empty on timeout ). Consume
+     * errors are returned as messages, partition EOF is not. One waiter at a time.
+     */
+    NextBatch nextBatch(size_t maxMessages, int timeoutMs) { return NextBatch{*this, maxMessages, timeoutMs}; }
+
+    RdKafka::KafkaConsumer *get() { return consumer_.get(); }
+
+    // Leave the group ( serves the revoke ), blocking: not from a coroutine while others run
+    void close();
+
+private:
+    void fill(Batch &batch, size_t maxMessages);
+    void readable();
+
+    AsyncLoop &loop_;
+    std::unique_ptr<RdKafka::KafkaConsumer> consumer_;
+    int watch_{-1};
+    NextBatch *waiter_{nullptr};
+};
+
+/*
+ * Producer whose delivery reports resume the coroutines awaiting them. A send that finds the producer queue full
+ * waits for delivery reports to make room instead of failing.
+ */
+class AsyncProducer : public RdKafka::DeliveryReportCb
+{
+public:
+    struct Report
+    {
+        RdKafka::ErrorCode err{RdKafka::ERR_NO_ERROR};
+        int32_t partition{-1};
+        int64_t offset{-1};
+    };
+
+    struct BatchReport
+    {
+        size_t delivered{0};
+        size_t failed{0};
+        RdKafka::ErrorCode firstError{RdKafka::ERR_NO_ERROR};
+    };
+
+    // A produce awaiting its delivery report(s), lives in the awaiting coroutine's frame
+    class Operation
+    {
+    public:
+        Operation(const Operation &) = delete;
+        Operation &operator=(const Operation &) = delete;
+        virtual ~Operation() = default;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+
+    protected:
+        friend class AsyncProducer;
+        explicit Operation(AsyncProducer &producer) : producer_{producer} {}
+
+        // Produce what is left. @returns false if the queue is full
+        virtual bool enqueue() = 0;
+        virtual void delivered(RdKafka::Message &message) = 0;
+        bool complete() const { return queued_ && outstanding_ == 0; }
+
+        AsyncProducer &producer_;
+        std::coroutine_handle<> handle_;
+        size_t outstanding_{0};
+        bool queued_{false};
+    };
+
+    class Send : public Operation
+    {
+    public:
+        Send(AsyncProducer &producer, std::string topic, int32_t partition, const void *key, size_t keyLen,
+             const void *value, size_t len, int64_t timestamp, RdKafka::Headers *headers)
+            : Operation{producer}, topic_{std::move(topic)}, partition_{partition}, key_{key}, keyLen_{keyLen},
+              value_{value}, len_{len}, timestamp_{timestamp}, headers_{headers}
+        {
+        }
+        ~Send() { delete headers_; }
+        Report await_resume() const { return report_; }
+
+    private:
+        bool enqueue() override;
+        void delivered(RdKafka::Message &message) override;
+
+        std::string topic_;
+        int32_t partition_;
+        const void *key_;
+        size_t keyLen_;
+        const void *value_;
+        size_t len_;
+        int64_t timestamp_;
+        RdKafka::Headers *headers_;     // owned until librdkafka takes it
+        Report report_;
+    };
+
+    class SendBatch : public Operation
+    {
+    public:
+        SendBatch(AsyncProducer &producer, std::string topic, const AsyncConsumer::Batch &messages)
+            : Operation{producer}, topic_{std::move(topic)}, messages_{messages}
+        {
+        }
+        BatchReport await_resume() const { return report_; }
+
+    private:
+        bool enqueue() override;
+        void delivered(RdKafka::Message &message) override;
+
+        std::string topic_;
+        const AsyncConsumer::Batch &messages_;
+        size_t next_{0};
+        BatchReport report_;
+    };
+
+    /*
+     * conf gets this producer as dr_cb
+     * @throws std::runtime_error if the producer can not be created
+     */
+    AsyncProducer(AsyncLoop &loop, RdKafka::Conf *conf);
+    ~AsyncProducer();
+
+    /*
+     * Produce one message ( copied ) and resume with its delivery report. headers are owned by the operation.
+     */
+    Send send(const std::string &topic, int32_t partition, const std::string &key, const std::string &value,
+              int64_t timestamp = 0, RdKafka::Headers *headers = nullptr)
+    {
+        return Send{*this, topic, partition, key.data(), key.size(), value.data(), value.size(), timestamp, headers};
+    }
+
+    /*
+     * Produce consumed messages to topic, keys, values, headers and timestamps preserved, partitioned by key,
+     * and resume once all were delivered ( or failed ). messages must outlive the operation.
+     */
+    SendBatch sendBatch(const std::string &topic, const AsyncConsumer::Batch &messages)
+    {
+        return SendBatch{*this, topic, messages};
+    }
+
+    RdKafka::Producer *get() { return producer_.get(); }
+
+    void dr_cb(RdKafka::Message &message);
+
+    // Wait for outstanding deliveries, blocking: at shutdown. @returns messages still not delivered
+    int flush(int timeoutMs);
+
+private:
+    void readable();
+
+    AsyncLoop &loop_;
+    std::unique_ptr<RdKafka::Producer> producer_;
+    int watch_;
+    std::deque<Operation *> stalled_;   // found the queue full, in order
+};
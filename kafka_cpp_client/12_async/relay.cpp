@@ -0,0 +1,359 @@
+/*
+ * relay.cpp
+ *
+ * Copies topics to an output topic on a single thread, with one coroutine per input partition:
+ *  1) A dispatcher awaits batches from the consumer and hands every message to the stream of its partition.
+ *  2) A partition stream produces what it was given, keys, values, headers and timestamps preserved, and awaits
+ *     the delivery reports before marking the input offsets processed. Partitions never wait for each other, and
+ *     messages of one partition are copied in order.
+ *  3) Processed offsets are committed every -c messages or -i ms. A revoked partition's stream stops without
+ *     marking what it was sending: the next owner starts again from the last commit ( at least once ).
+ *
+ * Run:
+ *  ./relay -b localhost:9092 -g relay -o prateek-copy prateek
+ *  ./relay -b localhost:9092 -g relay -o prateek-copy -B 1000 -c 10000 -i 5000 prateek
+ */
+#include "async_kafka.h"
+#include "commit_manager.h"
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+struct Options
+{
+    std::string output;
+    size_t batchSize{500};
+    int batchTimeoutMs{1000};
+};
+
+// Messages of one input partition, and whether it is still ours
+struct PartitionStream
+{
+    Channel<std::unique_ptr<RdKafka::Message>> messages;
+    bool revoked{false};
+};
+
+typedef std::map<std::pair<std::string, int32_t>, std::shared_ptr<PartitionStream>> Streams;
+
+class RelayEventCb : public RdKafka::EventCb
+{
+public:
+    void event_cb(RdKafka::Event &event)
+    {
+        switch (event.type())
+        {
+        case RdKafka::Event::EVENT_ERROR:
+            if (event.fatal())
+            {
+                std::cerr << "FATAL ";
+                run = 0;
+            }
+            std::cerr << "ERROR (" << RdKafka::err2str(event.err()) << ") : " << event.str() << std::endl;
+            break;
+        case RdKafka::Event::EVENT_LOG:
+            fprintf(stderr, "LOG-%i-%s: %s\n", event.severity(), event.fac().c_str(), event.str().c_str());
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+/*
+ * Served on the loop thread, from nextBatch(): streams of revoked partitions are stopped before their processed
+ * offsets are committed
+ */
+class RelayRebalanceCb : public RdKafka::RebalanceCb
+{
+public:
+    RelayRebalanceCb(Streams &streams, CommitManager &commits) : streams_{streams}, commits_{commits} {}
+
+    void rebalance_cb(RdKafka::KafkaConsumer *consumer, RdKafka::ErrorCode err,
+                      std::vector<RdKafka::TopicPartition *> &partitions)
+    {
+        const bool cooperative = consumer->rebalance_protocol() == "COOPERATIVE";
+        RdKafka::Error *error = nullptr;
+
+        if (err == RdKafka::ERR__ASSIGN_PARTITIONS)
+        {
+            if (cooperative)
+            {
+                error = consumer->incremental_assign(partitions);
+            }
+            else
+            {
+                consumer->assign(partitions);
+            }
+        }
+        else
+        {
+            for (const auto *tp : partitions)
+            {
+                auto it = streams_.find(std::make_pair(tp->topic(), tp->partition()));
+                if (it != streams_.end())
+                {
+                    it->second->revoked = true;
+                    it->second->messages.clear();
+                    it->second->messages.close();
+                    streams_.erase(it);
+                }
+            }
+            if (!consumer->assignment_lost())
+            {
+                commits_.revoke(consumer, partitions);
+            }
+            if (cooperative)
+            {
+                error = consumer->incremental_unassign(partitions);
+            }
+            else
+            {
+                consumer->unassign();
+            }
+        }
+
+        if (error)
+        {
+            std::cerr << "% Incremental rebalance failed: " << error->str() << std::endl;
+            delete error;
+        }
+    }
+
+private:
+    Streams &streams_;
+    CommitManager &commits_;
+};
+
+static uint64_t relayed = 0;
+
+static Task<> relayPartition(std::shared_ptr<PartitionStream> stream, AsyncProducer &producer, AsyncConsumer &consumer,
+                             CommitManager &commits, const Options &opts)
+{
+    AsyncConsumer::Batch batch;
+    while (auto first = co_await stream->messages.receive())
+    {
+        // everything that queued up while the last batch was in flight goes out together
+        batch.clear();
+        batch.push_back(std::move(*first));
+        while (stream->messages.size() > 0 && batch.size() < opts.batchSize)
+        {
+            batch.push_back(stream->messages.pop());
+        }
+
+        const auto report = co_await producer.sendBatch(opts.output, batch);
+        if (report.failed > 0)
+        {
+            std::cerr << "% " << report.failed << " message(s) of " << batch.back()->topic_name() << " ["
+                      << batch.back()->partition() << "] not delivered: " << RdKafka::err2str(report.firstError)
+                      << ", stopping" << std::endl;
+            run = 0;
+            co_return;
+        }
+        if (stream->revoked)
+        {
+            co_return;
+        }
+        relayed += batch.size();
+        commits.processed(*batch.back());
+        commits.maybeCommit(consumer.get());
+    }
+}
+
+static Task<> dispatch(AsyncLoop &loop, AsyncConsumer &consumer, AsyncProducer &producer, CommitManager &commits,
+                       Streams &streams, const Options &opts)
+{
+    while (run)
+    {
+        auto batch = co_await consumer.nextBatch(opts.batchSize, opts.batchTimeoutMs);
+        for (auto &msg : batch)
+        {
+            if (msg->err() != RdKafka::ERR_NO_ERROR)
+            {
+                std::cerr << "% Consumer error: " << msg->errstr() << std::endl;
+                run = 0;
+                break;
+            }
+            auto &stream = streams[std::make_pair(msg->topic_name(), msg->partition())];
+            if (!stream)
+            {
+                stream = std::make_shared<PartitionStream>();
+                loop.spawn(relayPartition(stream, producer, consumer, commits, opts));
+            }
+            stream->messages.push(std::move(msg));
+        }
+        // the interval commit, also when idle
+        commits.maybeCommit(consumer.get());
+    }
+
+    // let the streams finish what they were given
+    for (auto &entry : streams)
+    {
+        entry.second->messages.close();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092", group = "relay";
+    std::vector<std::string> topics;
+    std::vector<std::pair<std::string, std::string>> props;
+    CommitManager::Policy commitPolicy;
+    Options opts;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:g:o:B:T:c:i:X:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'g':
+            group = optarg;
+            break;
+        case 'o':
+            opts.output = optarg;
+            break;
+        case 'B':
+            opts.batchSize = std::max(1, atoi(optarg));
+            break;
+        case 'T':
+            // 0 would never suspend the dispatch coroutine, nor run the loop serving delivery reports
+            opts.batchTimeoutMs = std::max(1, atoi(optarg));
+            break;
+        case 'c':
+            commitPolicy.maxMessages = atoi(optarg);
+            break;
+        case 'i':
+            commitPolicy.intervalMs = atoi(optarg);
+            break;
+        case 'X':
+        {
+            char *name = optarg, *val;
+            if (!(val = strchr(name, '=')))
+            {
+                std::cerr << "%% Expected -X property=value, not " << name << std::endl;
+                exit(1);
+            }
+            *val++ = '\0';
+            props.emplace_back(name, val);
+            break;
+        }
+        default:
+            goto usage;
+        }
+    }
+
+    for (; optind < argc; optind++)
+    {
+        topics.push_back(argv[optind]);
+    }
+
+    if (topics.empty() || opts.output.empty())
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s -o <output topic> [options] topic1 topic2..\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -g <group>       Consumer group (relay)\n"
+                "  -o <topic>       Output topic\n"
+                "  -B <messages>    Batch size, per consume and per partition produce (500)\n"
+                "  -T <ms>          Batch timeout, at least 1 (1000)\n"
+                "  -c <messages>    Commit after this many relayed messages (1000)\n"
+                "  -i <ms>          Commit at least this often (1000)\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property\n"
+                "                   (applied to consumer and producer)\n"
+                "\n",
+                argv[0]);
+        exit(1);
+    }
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        AsyncLoop loop;
+        Streams streams;
+        CommitManager commits{commitPolicy};
+        RelayRebalanceCb rebalanceCb{streams, commits};
+        RelayEventCb eventCb;
+        std::string errstr;
+
+        auto setConf = [&errstr](RdKafka::Conf *conf, const std::vector<std::pair<std::string, std::string>> &props)
+        {
+            for (const auto &prop : props)
+            {
+                if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+                {
+                    throw std::runtime_error{errstr};
+                }
+            }
+        };
+
+        std::unique_ptr<RdKafka::Conf> producerConf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+        setConf(producerConf.get(), {{"bootstrap.servers", brokers}, {"enable.idempotence", "true"}});
+        setConf(producerConf.get(), props);
+        if (producerConf->set("event_cb", &eventCb, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+        AsyncProducer producer{loop, producerConf.get()};
+
+        std::unique_ptr<RdKafka::Conf> consumerConf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+        setConf(consumerConf.get(), {{"bootstrap.servers", brokers},
+                                     {"group.id", group},
+                                     {"enable.auto.commit", "false"},
+                                     {"enable.partition.eof", "false"}});
+        setConf(consumerConf.get(), props);
+        if (consumerConf->set("event_cb", &eventCb, errstr) != RdKafka::Conf::CONF_OK ||
+            consumerConf->set("rebalance_cb", &rebalanceCb, errstr) != RdKafka::Conf::CONF_OK ||
+            consumerConf->set("offset_commit_cb", &commits, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+        AsyncConsumer consumer{loop, consumerConf.get()};
+
+        const auto err = consumer.get()->subscribe(topics);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            throw std::runtime_error{"subscribe: " + RdKafka::err2str(err)};
+        }
+
+        // returns once the dispatcher stopped and every stream delivered what it was given
+        loop.spawn(dispatch(loop, consumer, producer, commits, streams, opts));
+        loop.run();
+
+        commits.commitSync(consumer.get());
+        std::cerr << "% Relayed " << relayed << " messages, " << producer.flush(10000)
+                  << " not delivered at exit\n% Commits: " << commits.report() << std::endl;
+        consumer.close();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Relay failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    RdKafka::wait_destroyed(5000);
+    return 0;
+}
@@ -0,0 +1,609 @@
+/*
+ * lag_monitor.cpp
+ *
+ * Lag of many consumer groups, continuously, from one process:
+ *  1) Every -i ms the committed offsets of every group are listed with the admin API ( one ListConsumerGroupOffsets
+ *     request per group, that is all a request can carry ), at most -r requests per second and -n in flight.
+ *  2) The high watermarks of all partitions the groups committed are then listed in batched ListOffsets requests.
+ *  3) Lag is the high watermark minus the committed offset. Lag in time is how long ago the high watermark was at the
+ *     committed offset, interpolated from the watermarks of the last -k rounds ( a lower bound once the committed
+ *     offset is older than that ).
+ *
+ * Lag per partition and per group is exported in the Prometheus text format ( -E file, -H port ), and a line per
+ * group is printed every round.
+ *
+ * Run:
+ *  ./lag_monitor -b localhost:9092 -g orders -g billing
+ *  ./lag_monitor -b localhost:9092 -a -i 30000 -r 20 -H 9465       ( every group of the cluster )
+ */
+#include "event_loop.h"
+#include "librdkafka/rdkafka.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+struct Options
+{
+    std::vector<std::string> groups;
+    bool allGroups{false};
+    int intervalMs{10000};
+    int requestsPerSecond{50};
+    int maxInFlight{10};
+    size_t history{64};             // high watermark samples kept per partition
+    size_t partitionsPerRequest{1000};
+    int timeoutMs{30000};
+    int verbosity{1};
+};
+
+typedef std::pair<std::string, int32_t> TopicPartition;
+
+struct Sample
+{
+    int64_t offset;
+    int64_t timeMs;
+};
+
+class LagMonitor
+{
+public:
+    LagMonitor(EventLoop &loop, rd_kafka_t *rk, Metrics &metrics, const Options &opts);
+    ~LagMonitor();
+
+    // Start a round, unless the last one is still running
+    void round();
+
+private:
+    void send();
+    void listOffsets();
+    void results();
+    void groupsListed(rd_kafka_event_t *event);
+    void offsetsListed(rd_kafka_event_t *event);
+    void watermarksListed(rd_kafka_event_t *event);
+    void requestWatermarks();
+    void publish();
+    int64_t lagMs(const TopicPartition &tp, int64_t committed, int64_t nowMs) const;
+    rd_kafka_AdminOptions_t *adminOptions(rd_kafka_admin_op_t op);
+    bool failed(rd_kafka_event_t *event, const char *what);
+
+    EventLoop &loop_;
+    rd_kafka_t *rk_;
+    rd_kafka_queue_t *queue_;
+    int watch_;
+    Metrics &metrics_;
+    const Options &opts_;
+
+    std::deque<std::function<void()>> pending_;     // requests waiting for the rate limit
+    int inFlight_{0};
+    bool running_{false};
+    int64_t roundStartMs_{0};
+
+    std::set<std::string> groups_;
+    std::map<std::string, std::map<TopicPartition, int64_t>> committed_;
+    std::map<TopicPartition, std::deque<Sample>> watermarks_;
+    std::set<std::string> exported_;
+
+    Counter &requests_;
+    Counter &errors_;
+    Histogram &roundMs_;
+};
+
+LagMonitor::LagMonitor(EventLoop &loop, rd_kafka_t *rk, Metrics &metrics, const Options &opts)
+    : loop_{loop}, rk_{rk}, queue_{rd_kafka_queue_new(rk)}, metrics_{metrics}, opts_{opts},
+      groups_{opts.groups.begin(), opts.groups.end()},
+      requests_{metrics.counter("lag_monitor_requests_total", "Admin requests sent")},
+      errors_{metrics.counter("lag_monitor_request_errors_total", "Admin requests or groups that failed")},
+      roundMs_{metrics.histogram("lag_monitor_round_ms", "Duration of a round over all groups")}
+{
+    // admin results wake the loop, the loop destroys the queue with the watch
+    watch_ = loop_.watchQueue(queue_, [this] { results(); });
+    loop_.timers().every(std::max(1, 1000 / std::max(1, opts_.requestsPerSecond)), [this] { send(); });
+}
+
+LagMonitor::~LagMonitor()
+{
+    loop_.unwatchQueue(watch_);
+}
+
+rd_kafka_AdminOptions_t *LagMonitor::adminOptions(rd_kafka_admin_op_t op)
+{
+    char errstr[512];
+    auto *options = rd_kafka_AdminOptions_new(rk_, op);
+    if (rd_kafka_AdminOptions_set_request_timeout(options, opts_.timeoutMs, errstr, sizeof(errstr)) !=
+        RD_KAFKA_RESP_ERR_NO_ERROR)
+    {
+        rd_kafka_AdminOptions_destroy(options);
+        throw std::runtime_error{errstr};
+    }
+    return options;
+}
+
+// One request per tick of the rate limit
+void LagMonitor::send()
+{
+    if (pending_.empty() || inFlight_ >= opts_.maxInFlight)
+    {
+        return;
+    }
+    auto request = std::move(pending_.front());
+    pending_.pop_front();
+    inFlight_++;
+    requests_.add();
+    request();
+}
+
+void LagMonitor::round()
+{
+    if (running_)
+    {
+        std::cerr << "% Round still running after " << CoarseClock::nowMs() - roundStartMs_
+                  << " ms, skipping one: raise -i, -r or -n" << std::endl;
+        return;
+    }
+    running_ = true;
+    roundStartMs_ = CoarseClock::nowMs();
+
+    if (opts_.allGroups)
+    {
+        pending_.push_back([this]
+        {
+            auto *options = adminOptions(RD_KAFKA_ADMIN_OP_LISTCONSUMERGROUPS);
+            rd_kafka_ListConsumerGroups(rk_, options, queue_);
+            rd_kafka_AdminOptions_destroy(options);
+        });
+    }
+    else
+    {
+        listOffsets();
+    }
+}
+
+void LagMonitor::listOffsets()
+{
+    for (const auto &group : groups_)
+    {
+        pending_.push_back([this, group]
+        {
+            // no partitions: every partition the group committed
+            auto *request = rd_kafka_ListConsumerGroupOffsets_new(group.c_str(), nullptr);
+            auto *options = adminOptions(RD_KAFKA_ADMIN_OP_LISTCONSUMERGROUPOFFSETS);
+            rd_kafka_ListConsumerGroupOffsets(rk_, &request, 1, options, queue_);
+            rd_kafka_AdminOptions_destroy(options);
+            rd_kafka_ListConsumerGroupOffsets_destroy(request);
+        });
+    }
+    if (groups_.empty())
+    {
+        publish();
+    }
+}
+
+void LagMonitor::results()
+{
+    while (auto *event = rd_kafka_queue_poll(queue_, 0))
+    {
+        inFlight_--;
+        switch (rd_kafka_event_type(event))
+        {
+        case RD_KAFKA_EVENT_LISTCONSUMERGROUPS_RESULT:
+            groupsListed(event);
+            break;
+        case RD_KAFKA_EVENT_LISTCONSUMERGROUPOFFSETS_RESULT:
+            offsetsListed(event);
+            break;
+        case RD_KAFKA_EVENT_LISTOFFSETS_RESULT:
+            watermarksListed(event);
+            break;
+        default:
+            inFlight_++;    // not a response to a request
+            break;
+        }
+        rd_kafka_event_destroy(event);
+    }
+}
+
+bool LagMonitor::failed(rd_kafka_event_t *event, const char *what)
+{
+    if (rd_kafka_event_error(event) == RD_KAFKA_RESP_ERR_NO_ERROR)
+    {
+        return false;
+    }
+    errors_.add();
+    std::cerr << "% " << what << " failed: " << rd_kafka_event_error_string(event) << std::endl;
+    return true;
+}
+
+void LagMonitor::groupsListed(rd_kafka_event_t *event)
+{
+    if (!failed(event, "Listing groups"))
+    {
+        size_t count;
+        const auto **listings =
+            rd_kafka_ListConsumerGroups_result_valid(rd_kafka_event_ListConsumerGroups_result(event), &count);
+        groups_.clear();
+        for (size_t i = 0; i < count; i++)
+        {
+            groups_.insert(rd_kafka_ConsumerGroupListing_group_id(listings[i]));
+        }
+        // groups that went away are not exported any more
+        for (auto it = committed_.begin(); it != committed_.end();)
+        {
+            it = groups_.count(it->first) ? std::next(it) : committed_.erase(it);
+        }
+    }
+
+    // the round continues with the groups known
+    listOffsets();
+}
+
+void LagMonitor::offsetsListed(rd_kafka_event_t *event)
+{
+    if (!failed(event, "Listing committed offsets"))
+    {
+        size_t count;
+        const auto **groups = rd_kafka_ListConsumerGroupOffsets_result_groups(
+            rd_kafka_event_ListConsumerGroupOffsets_result(event), &count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const char *name = rd_kafka_group_result_name(groups[i]);
+            if (const auto *error = rd_kafka_group_result_error(groups[i]))
+            {
+                errors_.add();
+                std::cerr << "% Group " << name << ": " << rd_kafka_error_string(error) << std::endl;
+                continue;
+            }
+            auto &offsets = committed_[name];
+            offsets.clear();
+            const auto *partitions = rd_kafka_group_result_partitions(groups[i]);
+            for (int p = 0; partitions && p < partitions->cnt; p++)
+            {
+                const auto &tp = partitions->elems[p];
+                // partitions without a commit have no lag to report
+                if (tp.err == RD_KAFKA_RESP_ERR_NO_ERROR && tp.offset >= 0)
+                {
+                    offsets[TopicPartition{tp.topic, tp.partition}] = tp.offset;
+                }
+            }
+        }
+    }
+
+    if (pending_.empty() && inFlight_ == 0)
+    {
+        requestWatermarks();
+    }
+}
+
+// Batched: every partition any group committed, partitionsPerRequest at a time
+void LagMonitor::requestWatermarks()
+{
+    std::set<TopicPartition> partitions;
+    for (const auto &group : committed_)
+    {
+        for (const auto &entry : group.second)
+        {
+            partitions.insert(entry.first);
+        }
+    }
+    if (partitions.empty())
+    {
+        publish();
+        return;
+    }
+
+    std::vector<TopicPartition> chunk;
+    auto flush = [this, &chunk]
+    {
+        pending_.push_back([this, chunk]
+        {
+            auto *list = rd_kafka_topic_partition_list_new(static_cast<int>(chunk.size()));
+            for (const auto &tp : chunk)
+            {
+                rd_kafka_topic_partition_list_add(list, tp.first.c_str(), tp.second)->offset =
+                    RD_KAFKA_OFFSET_SPEC_LATEST;
+            }
+            auto *options = adminOptions(RD_KAFKA_ADMIN_OP_LISTOFFSETS);
+            rd_kafka_ListOffsets(rk_, list, options, queue_);
+            rd_kafka_AdminOptions_destroy(options);
+            rd_kafka_topic_partition_list_destroy(list);
+        });
+        chunk.clear();
+    };
+    for (const auto &tp : partitions)
+    {
+        chunk.push_back(tp);
+        if (chunk.size() == opts_.partitionsPerRequest)
+        {
+            flush();
+        }
+    }
+    if (!chunk.empty())
+    {
+        flush();
+    }
+
+    // partitions nobody commits any more are forgotten
+    for (auto it = watermarks_.begin(); it != watermarks_.end();)
+    {
+        it = partitions.count(it->first) ? std::next(it) : watermarks_.erase(it);
+    }
+}
+
+void LagMonitor::watermarksListed(rd_kafka_event_t *event)
+{
+    if (!failed(event, "Listing high watermarks"))
+    {
+        const int64_t now = CoarseClock::wallMs();
+        size_t count;
+        const auto **infos = rd_kafka_ListOffsets_result_infos(rd_kafka_event_ListOffsets_result(event), &count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto *tp = rd_kafka_ListOffsetsResultInfo_topic_partition(infos[i]);
+            if (tp->err != RD_KAFKA_RESP_ERR_NO_ERROR)
+            {
+                continue;
+            }
+            auto &samples = watermarks_[TopicPartition{tp->topic, tp->partition}];
+            if (samples.empty() || samples.back().offset != tp->offset)
+            {
+                samples.push_back(Sample{tp->offset, now});
+            }
+            else
+            {
+                // the newest time at a watermark makes the interpolation tighter
+                samples.back().timeMs = now;
+            }
+            if (samples.size() > opts_.history)
+            {
+                samples.pop_front();
+            }
+        }
+    }
+
+    if (pending_.empty() && inFlight_ == 0)
+    {
+        publish();
+    }
+}
+
+/*
+ * How long ago the high watermark passed committed: between the last sample at or below it and the first above it,
+ * assuming a steady produce rate in between
+ */
+int64_t LagMonitor::lagMs(const TopicPartition &tp, int64_t committed, int64_t nowMs) const
+{
+    auto it = watermarks_.find(tp);
+    if (it == watermarks_.end() || it->second.empty() || committed >= it->second.back().offset)
+    {
+        return 0;
+    }
+    const auto &samples = it->second;
+    auto above = std::upper_bound(samples.begin(), samples.end(), committed,
+                                  [](int64_t offset, const Sample &sample) { return offset < sample.offset; });
+    if (above == samples.begin())
+    {
+        // older than the history: at least this late
+        return nowMs - above->timeMs;
+    }
+    const auto &below = *std::prev(above);
+    const double fraction = static_cast<double>(committed - below.offset) / (above->offset - below.offset);
+    const auto passedMs = below.timeMs + static_cast<int64_t>(fraction * (above->timeMs - below.timeMs));
+    return std::max<int64_t>(0, nowMs - passedMs);
+}
+
+void LagMonitor::publish()
+{
+    const int64_t now = CoarseClock::wallMs();
+    std::set<std::string> exported;
+    auto set = [this, &exported](const std::string &name, const char *help, int64_t value)
+    {
+        metrics_.gauge(name, help).set(value);
+        exported.insert(name);
+    };
+
+    for (const auto &group : committed_)
+    {
+        const auto groupLabel = Metrics::label("group", group.first);
+        int64_t groupLag = 0, groupLagMs = 0;
+        size_t known = 0;
+        for (const auto &entry : group.second)
+        {
+            auto it = watermarks_.find(entry.first);
+            if (it == watermarks_.end() || it->second.empty())
+            {
+                continue;
+            }
+            const auto lag = std::max<int64_t>(0, it->second.back().offset - entry.second);
+            const auto ms = lagMs(entry.first, entry.second, now);
+            const auto labels = "{" + groupLabel + "," + Metrics::label("topic", entry.first.first) + "," +
+                                Metrics::label("partition", std::to_string(entry.first.second)) + "}";
+            set("kafka_consumergroup_lag" + labels, "Messages behind the high watermark", lag);
+            set("kafka_consumergroup_lag_ms" + labels, "How long ago the high watermark was at the committed offset", ms);
+            if (opts_.verbosity >= 2)
+            {
+                std::cout << "%   " << group.first << " " << entry.first.first << " [" << entry.first.second
+                          << "] committed " << entry.second << " high " << it->second.back().offset << " lag " << lag
+                          << " (" << ms << " ms)" << std::endl;
+            }
+            groupLag += lag;
+            groupLagMs = std::max(groupLagMs, ms);
+            known++;
+        }
+        set("kafka_consumergroup_group_lag{" + groupLabel + "}", "Messages behind, all partitions of the group",
+            groupLag);
+        set("kafka_consumergroup_group_lag_ms{" + groupLabel + "}", "Largest lag in time of the group", groupLagMs);
+        if (opts_.verbosity >= 1)
+        {
+            std::cout << "% " << group.first << ": lag " << groupLag << " messages, " << groupLagMs << " ms behind, "
+                      << known << " partition(s)" << std::endl;
+        }
+    }
+
+    for (const auto &name : exported_)
+    {
+        if (!exported.count(name))
+        {
+            metrics_.remove(name);
+        }
+    }
+    exported_.swap(exported);
+
+    roundMs_.observe(CoarseClock::nowMs() - roundStartMs_);
+    running_ = false;
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092", metricsFile;
+    int metricsPort = 0;
+    std::vector<std::pair<std::string, std::string>> props;
+    Options opts;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:g:ai:r:n:k:E:H:X:qv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'g':
+            opts.groups.push_back(optarg);
+            break;
+        case 'a':
+            opts.allGroups = true;
+            break;
+        case 'i':
+            opts.intervalMs = std::max(100, atoi(optarg));
+            break;
+        case 'r':
+            opts.requestsPerSecond = std::max(1, atoi(optarg));
+            break;
+        case 'n':
+            opts.maxInFlight = std::max(1, atoi(optarg));
+            break;
+        case 'k':
+            opts.history = std::max(2, atoi(optarg));
+            break;
+        case 'E':
+            metricsFile = optarg;
+            break;
+        case 'H':
+            metricsPort = atoi(optarg);
+            break;
+        case 'X':
+        {
+            char *name = optarg, *val;
+            if (!(val = strchr(name, '=')))
+            {
+                std::cerr << "%% Expected -X property=value, not " << name << std::endl;
+                exit(1);
+            }
+            *val++ = '\0';
+            props.emplace_back(name, val);
+            break;
+        }
+        case 'q':
+            opts.verbosity--;
+            break;
+        case 'v':
+            opts.verbosity++;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if ((opts.groups.empty() && !opts.allGroups) || optind != argc)
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s -g <group> [-g <group>..] | -a [options]\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -g <group>       Consumer group to monitor, repeatable\n"
+                "  -a               Monitor every consumer group, listed every round\n"
+                "  -i <ms>          Round interval (10000)\n"
+                "  -r <requests/s>  Admin request rate limit (50)\n"
+                "  -n <requests>    Admin requests in flight at most (10)\n"
+                "  -k <rounds>      High watermarks kept per partition for lag in time (64)\n"
+                "  -E <file>        Write metrics to file every 5s (Prometheus text format)\n"
+                "  -H <port>        Serve metrics over HTTP on port\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property\n"
+                "  -q / -v          Print no group lines / every partition too\n"
+                "\n",
+                argv[0]);
+        exit(1);
+    }
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        char errstr[512];
+        rd_kafka_conf_t *conf = rd_kafka_conf_new();
+        props.insert(props.begin(), std::make_pair(std::string{"bootstrap.servers"}, brokers));
+        for (const auto &prop : props)
+        {
+            if (rd_kafka_conf_set(conf, prop.first.c_str(), prop.second.c_str(), errstr, sizeof(errstr)) !=
+                RD_KAFKA_CONF_OK)
+            {
+                rd_kafka_conf_destroy(conf);
+                throw std::runtime_error{errstr};
+            }
+        }
+        // admin requests only: a producer handle has no group or fetch machinery
+        rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+        if (!rk)
+        {
+            rd_kafka_conf_destroy(conf);
+            throw std::runtime_error{errstr};
+        }
+
+        {
+            Metrics metrics;
+            EventLoop loop;
+            LagMonitor monitor{loop, rk, metrics, opts};
+            std::unique_ptr<MetricsExporter> exporter;
+            if (!metricsFile.empty() || metricsPort > 0)
+            {
+                exporter.reset(new MetricsExporter{metrics, metricsFile, metricsPort});
+            }
+
+            monitor.round();
+            loop.timers().every(opts.intervalMs, [&monitor] { monitor.round(); });
+            while (run)
+            {
+                loop.runOnce(1000);
+            }
+        }
+        rd_kafka_destroy(rk);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Lag monitor failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
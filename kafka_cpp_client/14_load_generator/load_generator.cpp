@@ -0,0 +1,631 @@
+/*
+ * load_generator.cpp
+ *
+ * Produces synthetic traffic at an exact rate, for capacity planning:
+ *  - payload sizes: fixed, uniform, Zipf ( small sizes most frequent ) or replayed from a recorded histogram
+ *  - keys: -k distinct keys, uniformly or Zipf skewed ( -z ), or none
+ *  - headers: -H name=value, repeatable
+ *  - rate: -r messages/s over all -t threads, each thread with its own producer and a token bucket paced on absolute
+ *    deadlines ( sleeping, then spinning the last 50 us ), so the rate holds below a millisecond between messages
+ *    and a late thread catches up at most one burst ( -B ) instead of flooding.
+ *
+ * Every second the achieved rate is printed, and at the end the delivery latency percentiles ( librdkafka's produce
+ * -> delivery report latency ) and the errors per error code.
+ *
+ * Run:
+ *  ./load_generator -b localhost:9092 -r 50000 -t 4 -d 60 -s uniform:100-1000 -k 10000 -z 1.1 loadtest
+ *  ./load_generator -b localhost:9092 -r 0 -n 10000000 -s hist:sizes.txt -X linger.ms=20 loadtest ( as fast as possible )
+ */
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Payload sizes:
+ *  fixed:<bytes> ( or just <bytes> ), uniform:<min>-<max>, zipf:<min>-<max>:<exponent>, hist:<file>
+ * A histogram file has a "<bytes> <count>" line per size, as recorded from production.
+ */
+class SizeDistribution
+{
+public:
+    explicit SizeDistribution(const std::string &spec)
+    {
+        const auto colon = spec.find(':');
+        const auto kind = colon == std::string::npos ? "fixed" : spec.substr(0, colon);
+        const auto args = colon == std::string::npos ? spec : spec.substr(colon + 1);
+        size_t min = 0, max = 0;
+        double exponent = 1.0;
+
+        if (kind == "fixed")
+        {
+            min = max = std::stoul(args);
+        }
+        else if (kind == "uniform" || kind == "zipf")
+        {
+            if (sscanf(args.c_str(), "%zu-%zu:%lf", &min, &max, &exponent) < 2 || min > max)
+            {
+                throw std::runtime_error{"bad size distribution " + spec};
+            }
+        }
+        else if (kind == "hist")
+        {
+            std::ifstream in{args};
+            if (!in)
+            {
+                throw std::runtime_error{"can not read size histogram " + args};
+            }
+            std::vector<double> weights;
+            size_t size;
+            double count;
+            while (in >> size >> count)
+            {
+                sizes_.push_back(size);
+                weights.push_back(count);
+            }
+            if (sizes_.empty())
+            {
+                throw std::runtime_error{"empty size histogram " + args};
+            }
+            discrete_ = std::discrete_distribution<size_t>{weights.begin(), weights.end()};
+            max_ = *std::max_element(sizes_.begin(), sizes_.end());
+            return;
+        }
+        else
+        {
+            throw std::runtime_error{"unknown size distribution " + kind};
+        }
+
+        max_ = max;
+        if (kind == "zipf")
+        {
+            // rank r ( 1 = min ) weighs 1 / r^exponent
+            std::vector<double> weights;
+            for (size_t s = min; s <= max; s++)
+            {
+                sizes_.push_back(s);
+                weights.push_back(1.0 / std::pow(static_cast<double>(s - min + 1), exponent));
+            }
+            discrete_ = std::discrete_distribution<size_t>{weights.begin(), weights.end()};
+        }
+        else
+        {
+            uniform_ = std::uniform_int_distribution<size_t>{min, max};
+        }
+    }
+
+    size_t sample(std::mt19937_64 &rng)
+    {
+        return sizes_.empty() ? uniform_(rng) : sizes_[discrete_(rng)];
+    }
+
+    size_t max() const { return max_; }
+
+private:
+    std::vector<size_t> sizes_;
+    std::discrete_distribution<size_t> discrete_;
+    std::uniform_int_distribution<size_t> uniform_;
+    size_t max_{0};
+};
+
+// Key index in [0, cardinality), Zipf skewed for exponent > 0
+class KeyDistribution
+{
+public:
+    KeyDistribution(size_t cardinality, double exponent) : cardinality_{cardinality}
+    {
+        if (cardinality > 0 && exponent > 0)
+        {
+            std::vector<double> weights(cardinality);
+            for (size_t i = 0; i < cardinality; i++)
+            {
+                weights[i] = 1.0 / std::pow(static_cast<double>(i + 1), exponent);
+            }
+            skewed_ = std::discrete_distribution<size_t>{weights.begin(), weights.end()};
+            isSkewed_ = true;
+        }
+        else if (cardinality > 0)
+        {
+            uniform_ = std::uniform_int_distribution<size_t>{0, cardinality - 1};
+        }
+    }
+
+    size_t cardinality() const { return cardinality_; }
+    size_t sample(std::mt19937_64 &rng) { return isSkewed_ ? skewed_(rng) : uniform_(rng); }
+
+private:
+    size_t cardinality_;
+    bool isSkewed_{false};
+    std::discrete_distribution<size_t> skewed_;
+    std::uniform_int_distribution<size_t> uniform_;
+};
+
+/*
+ * Token bucket on absolute deadlines: the n-th token is due at start + n * period, at most burst tokens early.
+ * Not thread safe: one per thread.
+ */
+class Pacer
+{
+public:
+    Pacer(double ratePerSecond, int64_t burst)
+        : periodNs_{ratePerSecond > 0 ? 1e9 / ratePerSecond : 0}, burst_{std::max<int64_t>(1, burst)}, start_{nowNs()}
+    {
+    }
+
+    // Wait for the next token
+    void acquire()
+    {
+        if (periodNs_ == 0)
+        {
+            return;
+        }
+        const auto due = start_ + static_cast<int64_t>(next_ * periodNs_);
+        auto now = nowNs();
+        if (now - due > burst_ * periodNs_)
+        {
+            // stalled ( e.g. queue full ): forget the backlog beyond one burst
+            start_ = now - static_cast<int64_t>(next_ * periodNs_) - static_cast<int64_t>(burst_ * periodNs_);
+        }
+        else if (due - now > kSpinNs)
+        {
+            const auto wake = due - kSpinNs;
+            struct timespec ts = {static_cast<time_t>(wake / 1000000000), static_cast<long>(wake % 1000000000)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR && run)
+            {
+            }
+        }
+        while (nowNs() < due)
+        {
+        }
+        next_++;
+    }
+
+private:
+    static constexpr int64_t kSpinNs = 50000;
+
+    double periodNs_;
+    int64_t burst_;
+    int64_t start_;
+    uint64_t next_{0};
+};
+
+/*
+ * Log-linear latency histogram ( us ): 32 linear sub-buckets per power of two, within 3% of the real value
+ */
+class LatencyHistogram
+{
+public:
+    void record(int64_t us)
+    {
+        const auto v = static_cast<uint64_t>(std::max<int64_t>(0, us));
+        counts_[index(v)]++;
+        count_++;
+        max_ = std::max(max_, v);
+    }
+
+    void merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < counts_.size(); i++)
+        {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t percentile(double p) const
+    {
+        const auto rank = static_cast<uint64_t>(std::ceil(p / 100 * count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++)
+        {
+            seen += counts_[i];
+            if (seen >= rank && seen > 0)
+            {
+                return std::min(max_, upper(i));
+            }
+        }
+        return max_;
+    }
+
+    uint64_t count() const { return count_; }
+
+private:
+    static constexpr int kSubBits = 5;
+    static constexpr uint64_t kSub = 1 << kSubBits;
+
+    static size_t index(uint64_t v)
+    {
+        if (v < kSub)
+        {
+            return v;
+        }
+        const int msb = 63 - __builtin_clzll(v);
+        const int shift = msb - kSubBits;
+        return (shift + 1) * kSub + ((v >> shift) - kSub);
+    }
+
+    static uint64_t upper(size_t i)
+    {
+        if (i < kSub)
+        {
+            return i;
+        }
+        const int shift = static_cast<int>(i / kSub) - 1;
+        return ((kSub + i % kSub + 1) << shift) - 1;
+    }
+
+    std::array<uint64_t, (64 - kSubBits + 1) * kSub> counts_{};
+    uint64_t count_{0};
+    uint64_t max_{0};
+};
+
+// Totals of all threads, for the report every second
+struct Totals
+{
+    std::atomic<uint64_t> produced{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> queueFull{0};
+};
+
+class GeneratorDeliveryReportCb : public RdKafka::DeliveryReportCb
+{
+public:
+    explicit GeneratorDeliveryReportCb(Totals &totals) : totals_{totals} {}
+
+    void dr_cb(RdKafka::Message &message)
+    {
+        if (message.err())
+        {
+            totals_.failed++;
+            errors[message.err()]++;
+            return;
+        }
+        totals_.delivered++;
+        latency.record(message.latency());
+    }
+
+    LatencyHistogram latency;
+    std::map<RdKafka::ErrorCode, uint64_t> errors;
+
+private:
+    Totals &totals_;
+};
+
+struct Options
+{
+    std::string topic;
+    std::vector<std::pair<std::string, std::string>> props;
+    std::vector<std::pair<std::string, std::string>> headers;
+    double rate{1000};
+    int threads{1};
+    int64_t burst{0};
+    uint64_t count{0};          // per run, 0: until -d or stopped
+    int durationS{0};
+};
+
+struct ThreadResult
+{
+    LatencyHistogram latency;
+    std::map<RdKafka::ErrorCode, uint64_t> errors;
+    int notDelivered{0};
+};
+
+static void generate(const Options &opts, SizeDistribution sizes, KeyDistribution keys, const std::string &payload,
+                     uint64_t count, int64_t endNs, unsigned seed, Totals &totals, ThreadResult &result)
+{
+    std::string errstr;
+    GeneratorDeliveryReportCb drCb{totals};
+    std::unique_ptr<RdKafka::Conf> conf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+    for (const auto &prop : opts.props)
+    {
+        if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+    }
+    if (conf->set("dr_cb", &drCb, errstr) != RdKafka::Conf::CONF_OK)
+    {
+        throw std::runtime_error{errstr};
+    }
+    std::unique_ptr<RdKafka::Producer> producer{RdKafka::Producer::create(conf.get(), errstr)};
+    if (!producer)
+    {
+        throw std::runtime_error{"producer: " + errstr};
+    }
+
+    std::mt19937_64 rng{seed};
+    Pacer pacer{opts.rate / opts.threads, opts.burst > 0 ? opts.burst : std::max<int64_t>(1, opts.rate / opts.threads / 1000)};
+    char key[32];
+    for (uint64_t n = 0; run && (count == 0 || n < count) && (endNs == 0 || nowNs() < endNs); n++)
+    {
+        pacer.acquire();
+
+        // payloads are views into one random buffer, not copied ( librdkafka does not free them )
+        const size_t size = sizes.sample(rng);
+        const char *value = payload.data() + (payload.size() > size ? rng() % (payload.size() - size) : 0);
+        int keyLen = 0;
+        if (keys.cardinality() > 0)
+        {
+            keyLen = snprintf(key, sizeof(key), "key-%zu", keys.sample(rng));
+        }
+        RdKafka::Headers *headers = nullptr;
+        if (!opts.headers.empty())
+        {
+            headers = RdKafka::Headers::create();
+            for (const auto &header : opts.headers)
+            {
+                headers->add(header.first, header.second);
+            }
+        }
+
+        for (;;)
+        {
+            const auto err = producer->produce(opts.topic, RdKafka::Topic::PARTITION_UA, 0, const_cast<char *>(value),
+                                               size, keyLen ? key : nullptr, keyLen, 0, headers, nullptr);
+            if (err == RdKafka::ERR_NO_ERROR)
+            {
+                totals.produced++;
+                totals.bytes += size;
+                break;
+            }
+            if (err != RdKafka::ERR__QUEUE_FULL || !run)
+            {
+                delete headers;
+                totals.failed++;
+                drCb.errors[err]++;
+                break;
+            }
+            // backpressure: serve delivery reports until there is room
+            totals.queueFull++;
+            producer->poll(1);
+        }
+        producer->poll(0);
+    }
+
+    producer->flush(30000);
+    result.notDelivered = producer->outq_len();
+    result.latency = drCb.latency;
+    result.errors = drCb.errors;
+}
+
+static std::pair<std::string, std::string> split(const char *arg, const char *what)
+{
+    const char *eq = strchr(arg, '=');
+    if (!eq)
+    {
+        std::cerr << "%% Expected " << what << " name=value, not " << arg << std::endl;
+        exit(1);
+    }
+    return std::make_pair(std::string(arg, eq - arg), std::string(eq + 1));
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092", sizeSpec = "100";
+    size_t keyCardinality = 0;
+    double keySkew = 0;
+    Options opts;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:r:t:B:n:d:s:k:z:H:X:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'r':
+            opts.rate = atof(optarg);
+            break;
+        case 't':
+            opts.threads = std::max(1, atoi(optarg));
+            break;
+        case 'B':
+            opts.burst = atoll(optarg);
+            break;
+        case 'n':
+            opts.count = strtoull(optarg, nullptr, 10);
+            break;
+        case 'd':
+            opts.durationS = atoi(optarg);
+            break;
+        case 's':
+            sizeSpec = optarg;
+            break;
+        case 'k':
+            keyCardinality = strtoull(optarg, nullptr, 10);
+            break;
+        case 'z':
+            keySkew = atof(optarg);
+            break;
+        case 'H':
+            opts.headers.push_back(split(optarg, "-H"));
+            break;
+        case 'X':
+            opts.props.push_back(split(optarg, "-X"));
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s [options] <topic>\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -r <msgs/s>      Target rate over all threads, 0 for as fast as possible (1000)\n"
+                "  -t <threads>     Producer threads, one producer each (1)\n"
+                "  -B <messages>    Burst a late thread may catch up (1 ms worth)\n"
+                "  -n <messages>    Stop after this many messages\n"
+                "  -d <seconds>     Stop after this long\n"
+                "  -s <sizes>       Payload size distribution (100):\n"
+                "                   <bytes> | uniform:<min>-<max> | zipf:<min>-<max>:<exponent>\n"
+                "                   | hist:<file of \"<bytes> <count>\" lines>\n"
+                "  -k <keys>        Distinct keys, 0 for no key (0)\n"
+                "  -z <exponent>    Zipf skew of keys, 0 for uniform (0)\n"
+                "  -H <name=value>  Header on every message, repeatable\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property\n"
+                "\n",
+                argv[0]);
+        exit(1);
+    }
+    opts.topic = argv[optind];
+    opts.props.insert(opts.props.begin(), std::make_pair(std::string{"bootstrap.servers"}, brokers));
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        SizeDistribution sizes{sizeSpec};
+        KeyDistribution keys{keyCardinality, keySkew};
+
+        // random, so compression does not flatter the broker
+        std::string payload(std::max<size_t>(sizes.max() * 2, 1 << 20), '\0');
+        std::mt19937_64 fill{42};
+        for (auto &c : payload)
+        {
+            c = static_cast<char>('a' + fill() % 26);
+        }
+
+        Totals totals;
+        std::vector<ThreadResult> results(opts.threads);
+        std::vector<std::thread> threads;
+        std::mutex errorLock;
+        std::string error;
+        const int64_t start = nowNs();
+        const int64_t endNs = opts.durationS > 0 ? start + static_cast<int64_t>(opts.durationS) * 1000000000 : 0;
+        for (int t = 0; t < opts.threads; t++)
+        {
+            // the count is split, the remainder goes to the first threads
+            const uint64_t count = opts.count == 0 ? 0 : opts.count / opts.threads + (t < static_cast<int>(opts.count % opts.threads));
+            threads.emplace_back([&, t, count]
+            {
+                try
+                {
+                    generate(opts, sizes, keys, payload, count, endNs, 1000 + t, totals, results[t]);
+                }
+                catch (const std::exception &e)
+                {
+                    std::lock_guard<std::mutex> lock{errorLock};
+                    error = e.what();
+                    run = 0;
+                }
+            });
+        }
+
+        // every second until the threads are done
+        uint64_t lastProduced = 0, lastBytes = 0;
+        int64_t last = start;
+        std::atomic<int> finished{0};
+        std::thread joiner{[&]
+        {
+            for (auto &thread : threads)
+            {
+                thread.join();
+            }
+            finished = 1;
+        }};
+        while (!finished)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            const int64_t now = nowNs();
+            if (now - last < 1000000000 && !finished)
+            {
+                continue;
+            }
+            const double seconds = (now - last) / 1e9;
+            const uint64_t produced = totals.produced, bytes = totals.bytes;
+            fprintf(stderr, "%% %.0f msgs/s %.2f MB/s, delivered %lu failed %lu queue full %lu\n",
+                    (produced - lastProduced) / seconds, (bytes - lastBytes) / seconds / 1e6,
+                    static_cast<unsigned long>(totals.delivered.load()), static_cast<unsigned long>(totals.failed.load()),
+                    static_cast<unsigned long>(totals.queueFull.load()));
+            lastProduced = produced;
+            lastBytes = bytes;
+            last = now;
+        }
+        joiner.join();
+        if (!error.empty())
+        {
+            throw std::runtime_error{error};
+        }
+
+        LatencyHistogram latency;
+        std::map<RdKafka::ErrorCode, uint64_t> errors;
+        int notDelivered = 0;
+        for (const auto &result : results)
+        {
+            latency.merge(result.latency);
+            for (const auto &e : result.errors)
+            {
+                errors[e.first] += e.second;
+            }
+            notDelivered += result.notDelivered;
+        }
+
+        const double seconds = (nowNs() - start) / 1e9;
+        fprintf(stderr,
+                "%% Produced %lu messages (%.2f MB) in %.1f s: %.0f msgs/s, %.2f MB/s\n"
+                "%% Delivered %lu, latency us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+                static_cast<unsigned long>(totals.produced.load()), totals.bytes / 1e6, seconds,
+                totals.produced / seconds, totals.bytes / seconds / 1e6,
+                static_cast<unsigned long>(latency.count()), static_cast<unsigned long>(latency.percentile(50)),
+                static_cast<unsigned long>(latency.percentile(90)), static_cast<unsigned long>(latency.percentile(99)),
+                static_cast<unsigned long>(latency.percentile(99.9)), static_cast<unsigned long>(latency.percentile(100)));
+        for (const auto &e : errors)
+        {
+            std::cerr << "% " << e.second << " x " << RdKafka::err2str(e.first) << std::endl;
+        }
+        if (notDelivered > 0)
+        {
+            std::cerr << "% " << notDelivered << " message(s) not delivered at exit" << std::endl;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Load generator failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    RdKafka::wait_destroyed(5000);
+    return 0;
+}
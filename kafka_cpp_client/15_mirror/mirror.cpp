@@ -0,0 +1,857 @@
+/*
+ * mirror.cpp
+ *
+ * Mirrors topics from a source cluster to a target cluster, at network speed from one process per host:
+ *  1) Each of -t threads has a consumer in the -g group on the source and an idempotent producer on the target, so
+ *     the group spreads the partitions over the threads ( and over the hosts running the mirror ).
+ *  2) Messages are consumed in batches of up to -B, or what arrived within -w ms ( rd_kafka_consume_batch_queue(): one
+ *     queue lock per batch, not per message ), and produced with their key, headers, timestamp and, unless -p, source
+ *     partition, to <prefix><source topic>.
+ *  3) The payload is not copied: the consumed message is kept until its delivery report, then destroyed.
+ *  4) Source offsets are committed only for delivered messages ( CommitManager, every -c messages or -i ms ), and all
+ *     in flight is delivered before partitions are given up in a rebalance: a crash mirrors again at most what was
+ *     in flight, a rebalance nothing.
+ *  5) The offset translation map ( -m file ) records where source offsets landed in the target, for consumers failing
+ *     over to it: a "<source topic> <partition> <source offset> <target topic> <target offset>" line for the first
+ *     message of a partition and every -S messages after. -L translates a committed source offset with it.
+ *
+ * Batches are produced compressed again, not forwarded as fetched: librdkafka decompresses on fetch and has no way to
+ * produce an already built record batch. The target producer compresses with -z ( lz4 by default, match the source )
+ * in batches as large as the broker takes, so the target sees the same bandwidth for some CPU on the mirror.
+ *
+ * Translation: a consumer that committed source offset N resumes on the target at the offset N landed at if it was
+ * recorded, otherwise just after the closest recorded offset below N. That never skips a message, and duplicates at
+ * most -S messages, also across mirror restarts ( which mirror again what was in flight ).
+ *
+ * Run:
+ *  ./mirror -s dc1:9092 -d dc2:9092 -g mirror-dc1 -P dc1. -m /var/lib/mirror/orders.map orders payments
+ *  ./mirror -s dc1:9092 -d dc2:9092 -t 4 -B 20000 -z zstd -Y linger.ms=50 '^events\..*'
+ *  ./mirror -m /var/lib/mirror/orders.map -L orders:3:1842211        ( target offset for a committed source offset )
+ */
+#include "commit_manager.h"
+#include "librdkafka/rdkafka.h"
+#include "librdkafka/rdkafkacpp.h"
+#include "shutdown.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+typedef std::vector<std::pair<std::string, std::string>> Properties;
+
+struct Options
+{
+    std::string sourceBrokers{"localhost:9092"};
+    std::string targetBrokers;
+    std::string group{"mirror"};
+    std::vector<std::string> topics;
+    std::string prefix;
+    int threads{1};
+    size_t batchSize{10000};
+    int batchWaitMs{100};
+    bool preservePartition{true};
+    std::string codec{"lz4"};
+    CommitManager::Policy commit{10000, 1000};
+    uint64_t syncEvery{10000};
+    int revokeTimeoutMs{30000};
+    int shutdownMs{30000};
+    Properties sourceProps;
+    Properties targetProps;
+};
+
+struct Totals
+{
+    std::atomic<uint64_t> consumed{0};
+    std::atomic<uint64_t> mirrored{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> queueFull{0};
+    std::atomic<uint64_t> consumeErrors{0};
+};
+
+/*
+ * Offset translation map file, appended by every mirror thread. Lines are buffered: flush() from a timer, the
+ * map only has to be as recent as the commits a failover starts from.
+ */
+class OffsetMap
+{
+public:
+    explicit OffsetMap(const std::string &path) : path_{path}, file_{fopen(path.c_str(), "a")}
+    {
+        if (!file_)
+        {
+            throw std::runtime_error{"can not open " + path + ": " + strerror(errno)};
+        }
+    }
+
+    ~OffsetMap() { fclose(file_); }
+
+    OffsetMap(const OffsetMap &) = delete;
+    OffsetMap &operator=(const OffsetMap &) = delete;
+
+    void record(const std::string &sourceTopic, int32_t partition, int64_t sourceOffset, const std::string &targetTopic,
+                int64_t targetOffset)
+    {
+        std::lock_guard<std::mutex> lock{lock_};
+        fprintf(file_, "%s %d %lld %s %lld\n", sourceTopic.c_str(), partition, static_cast<long long>(sourceOffset),
+                targetTopic.c_str(), static_cast<long long>(targetOffset));
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock{lock_};
+        if (fflush(file_) != 0)
+        {
+            throw std::runtime_error{"can not write " + path_ + ": " + strerror(errno)};
+        }
+    }
+
+    /*
+     * Target topic and offset a consumer resumes at, for committed source offset of topic partition
+     * @throws std::runtime_error if the map has nothing at or below offset
+     */
+    static std::pair<std::string, int64_t> translate(const std::string &path, const std::string &topic,
+                                                     int32_t partition, int64_t offset)
+    {
+        std::ifstream in{path};
+        if (!in)
+        {
+            throw std::runtime_error{"can not open " + path};
+        }
+
+        // later lines win: a restarted mirror writes the same source offset again, further on in the target
+        std::map<int64_t, std::pair<std::string, int64_t>> syncs;
+        std::string line, sourceTopic, targetTopic;
+        int32_t sourcePartition;
+        int64_t sourceOffset, targetOffset;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields{line};
+            if (fields >> sourceTopic >> sourcePartition >> sourceOffset >> targetTopic >> targetOffset &&
+                sourceTopic == topic && sourcePartition == partition)
+            {
+                syncs[sourceOffset] = std::make_pair(targetTopic, targetOffset);
+            }
+        }
+
+        auto it = syncs.upper_bound(offset);
+        if (it == syncs.begin())
+        {
+            throw std::runtime_error{"no offset of " + topic + " [" + std::to_string(partition) + "] at or below " +
+                                     std::to_string(offset) + " in " + path};
+        }
+        --it;
+        // the messages after the recorded one landed after it, wherever exactly
+        return std::make_pair(it->second.first, it->second.second + (it->first == offset ? 0 : 1));
+    }
+
+private:
+    std::string path_;
+    FILE *file_;
+    std::mutex lock_;
+};
+
+/*
+ * One consumer and one producer, run on one thread. Consumer callbacks ( rebalance, events, commits ) are served by
+ * the batch consume call and delivery reports by polling the producer, both on that thread: no locks.
+ */
+class Mirror : public RdKafka::RebalanceCb, public RdKafka::EventCb
+{
+public:
+    Mirror(const Options &opts, OffsetMap *map, Totals &totals);
+    ~Mirror();
+
+    Mirror(const Mirror &) = delete;
+    Mirror &operator=(const Mirror &) = delete;
+
+    // Mirror until ::run is cleared, then shut down within the budget. @throws std::runtime_error
+    void mirror();
+
+    void rebalance_cb(RdKafka::KafkaConsumer *consumer, RdKafka::ErrorCode err,
+                      std::vector<RdKafka::TopicPartition *> &partitions) override;
+    void event_cb(RdKafka::Event &event) override;
+
+private:
+    struct Target
+    {
+        std::string source;
+        std::string name;
+        rd_kafka_topic_t *rkt;
+    };
+
+    struct PartitionState
+    {
+        const Target *target;
+        uint64_t sinceSync;
+    };
+
+    struct PartitionKey
+    {
+        const rd_kafka_topic_t *rkt;
+        int32_t partition;
+        bool operator==(const PartitionKey &o) const { return rkt == o.rkt && partition == o.partition; }
+    };
+
+    struct PartitionKeyHash
+    {
+        size_t operator()(const PartitionKey &k) const
+        {
+            return std::hash<const void *>()(k.rkt) * 31 + static_cast<size_t>(k.partition);
+        }
+    };
+
+    static void deliveryReport(rd_kafka_t *, const rd_kafka_message_t *report, void *opaque);
+    static void producerError(rd_kafka_t *rk, int, const char *reason, void *opaque);
+
+    bool produce(rd_kafka_message_t *message);
+    void delivered(const rd_kafka_message_t *report);
+    const Target &target(const rd_kafka_topic_t *source);
+    void stop(const std::string &why);
+    void shutdown();
+
+    const Options &opts_;
+    OffsetMap *map_;
+    Totals &totals_;
+    CommitManager commits_;
+    RdKafka::KafkaConsumer *consumer_{nullptr};
+    rd_kafka_queue_t *queue_{nullptr};
+    rd_kafka_t *producer_{nullptr};
+    // source topic handle -> target topic; the name is checked in case a handle is freed and its address reused
+    std::unordered_map<const rd_kafka_topic_t *, Target> targets_;
+    std::unordered_map<PartitionKey, PartitionState, PartitionKeyHash> partitions_;
+    // set on the first delivery failure: nothing delivered after it is committed, it would skip the failed message
+    bool failed_{false};
+    std::string error_;
+};
+
+Mirror::Mirror(const Options &opts, OffsetMap *map, Totals &totals)
+    : opts_{opts}, map_{map}, totals_{totals}, commits_{opts.commit}
+{
+    std::string errstr;
+    std::unique_ptr<RdKafka::Conf> conf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+    Properties props{
+        {"bootstrap.servers", opts.sourceBrokers},
+        {"group.id", opts.group},
+        {"enable.auto.commit", "false"},
+        {"enable.partition.eof", "false"},
+        {"auto.offset.reset", "earliest"},
+        {"fetch.max.bytes", "104857600"},
+        {"max.partition.fetch.bytes", "8388608"},
+        {"queued.max.messages.kbytes", "262144"},
+    };
+    props.insert(props.end(), opts.sourceProps.begin(), opts.sourceProps.end());
+    for (const auto &prop : props)
+    {
+        if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+    }
+    conf->set("rebalance_cb", static_cast<RdKafka::RebalanceCb *>(this), errstr);
+    conf->set("event_cb", static_cast<RdKafka::EventCb *>(this), errstr);
+    conf->set("offset_commit_cb", &commits_, errstr);
+
+    char cerr[512];
+    rd_kafka_conf_t *pconf = rd_kafka_conf_new();
+    props = {
+        {"bootstrap.servers", opts.targetBrokers},
+        {"enable.idempotence", "true"},
+        {"compression.codec", opts.codec},
+        {"linger.ms", "20"},
+        {"batch.size", "1000000"},
+        {"batch.num.messages", "100000"},
+        {"queue.buffering.max.messages", "1000000"},
+        {"queue.buffering.max.kbytes", "1048576"},
+    };
+    props.insert(props.end(), opts.targetProps.begin(), opts.targetProps.end());
+    for (const auto &prop : props)
+    {
+        if (rd_kafka_conf_set(pconf, prop.first.c_str(), prop.second.c_str(), cerr, sizeof(cerr)) != RD_KAFKA_CONF_OK)
+        {
+            rd_kafka_conf_destroy(pconf);
+            throw std::runtime_error{cerr};
+        }
+    }
+    rd_kafka_conf_set_dr_msg_cb(pconf, deliveryReport);
+    rd_kafka_conf_set_error_cb(pconf, producerError);
+    rd_kafka_conf_set_opaque(pconf, this);
+    if (!(producer_ = rd_kafka_new(RD_KAFKA_PRODUCER, pconf, cerr, sizeof(cerr))))
+    {
+        rd_kafka_conf_destroy(pconf);
+        throw std::runtime_error{cerr};
+    }
+
+    if (!(consumer_ = RdKafka::KafkaConsumer::create(conf.get(), errstr)))
+    {
+        rd_kafka_destroy(producer_);
+        throw std::runtime_error{"consumer: " + errstr};
+    }
+    queue_ = rd_kafka_queue_get_consumer(consumer_->c_ptr());
+}
+
+Mirror::~Mirror()
+{
+    rd_kafka_queue_destroy(queue_);
+    delete consumer_;
+    for (auto &entry : targets_)
+    {
+        rd_kafka_topic_destroy(entry.second.rkt);
+    }
+    rd_kafka_destroy(producer_);
+}
+
+void Mirror::deliveryReport(rd_kafka_t *, const rd_kafka_message_t *report, void *opaque)
+{
+    static_cast<Mirror *>(opaque)->delivered(report);
+}
+
+void Mirror::producerError(rd_kafka_t *rk, int, const char *reason, void *opaque)
+{
+    char errstr[512];
+    // an idempotent producer that lost messages or their order can not go on
+    if (rd_kafka_fatal_error(rk, errstr, sizeof(errstr)) != RD_KAFKA_RESP_ERR_NO_ERROR)
+    {
+        static_cast<Mirror *>(opaque)->stop(std::string{"target producer: "} + errstr);
+        return;
+    }
+    std::cerr << "% Target producer error: " << reason << std::endl;
+}
+
+void Mirror::event_cb(RdKafka::Event &event)
+{
+    if (event.type() != RdKafka::Event::EVENT_ERROR)
+    {
+        return;
+    }
+    if (event.fatal())
+    {
+        stop("source consumer: " + event.str());
+        return;
+    }
+    std::cerr << "% Source consumer error: " << RdKafka::err2str(event.err()) << ": " << event.str() << std::endl;
+}
+
+void Mirror::rebalance_cb(RdKafka::KafkaConsumer *consumer, RdKafka::ErrorCode err,
+                          std::vector<RdKafka::TopicPartition *> &partitions)
+{
+    const bool cooperative = consumer->rebalance_protocol() == "COOPERATIVE";
+
+    if (err == RdKafka::ERR__ASSIGN_PARTITIONS)
+    {
+        if (cooperative)
+        {
+            delete consumer->incremental_assign(partitions);
+        }
+        else
+        {
+            consumer->assign(partitions);
+        }
+        return;
+    }
+
+    /*
+     * Everything consumed so far was produced, deliver it so its offsets are committed before the partitions go:
+     * the next owner starts after the last mirrored message instead of mirroring it again
+     */
+    if (!failed_)
+    {
+        rd_kafka_flush(producer_, opts_.revokeTimeoutMs);
+        const int undelivered = rd_kafka_outq_len(producer_);
+        if (undelivered > 0)
+        {
+            stop(std::to_string(undelivered) + " message(s) not delivered before partitions were revoked");
+        }
+    }
+    // the first message of a partition assigned again gets a map line
+    partitions_.clear();
+    if (!failed_ && !consumer->assignment_lost())
+    {
+        if (cooperative)
+        {
+            commits_.revoke(consumer, partitions);
+        }
+        else
+        {
+            commits_.revokeAll(consumer);
+        }
+    }
+
+    if (cooperative)
+    {
+        delete consumer->incremental_unassign(partitions);
+    }
+    else
+    {
+        consumer->unassign();
+    }
+}
+
+void Mirror::stop(const std::string &why)
+{
+    if (!failed_)
+    {
+        error_ = why;
+        failed_ = true;
+    }
+    run = 0;
+}
+
+const Mirror::Target &Mirror::target(const rd_kafka_topic_t *source)
+{
+    const char *name = rd_kafka_topic_name(source);
+    auto it = targets_.find(source);
+    if (it != targets_.end() && it->second.source == name)
+    {
+        return it->second;
+    }
+    if (it != targets_.end())
+    {
+        rd_kafka_topic_destroy(it->second.rkt);
+        targets_.erase(it);
+    }
+
+    const std::string targetName = opts_.prefix + name;
+    rd_kafka_topic_t *rkt = rd_kafka_topic_new(producer_, targetName.c_str(), nullptr);
+    if (!rkt)
+    {
+        throw std::runtime_error{"target topic " + targetName + ": " + rd_kafka_err2str(rd_kafka_last_error())};
+    }
+    return targets_.emplace(source, Target{name, targetName, rkt}).first->second;
+}
+
+/*
+ * Produce a consumed message, which is destroyed by its delivery report ( or here, if it is not produced ).
+ * @returns false if mirroring stops: the rest of the batch must not be produced either, or its offsets would be
+ *          committed past this message
+ */
+bool Mirror::produce(rd_kafka_message_t *message)
+{
+    if (message->err)
+    {
+        // transient, librdkafka retries; reported here because the batch API returns errors as messages
+        std::cerr << "% Consume error: " << rd_kafka_err2str(message->err) << std::endl;
+        totals_.consumeErrors++;
+        rd_kafka_message_destroy(message);
+        return true;
+    }
+
+    totals_.consumed++;
+    const Target &to = target(message->rkt);
+    rd_kafka_headers_t *headers = nullptr;
+    if (rd_kafka_message_headers(message, &headers) == RD_KAFKA_RESP_ERR_NO_ERROR)
+    {
+        // the producer takes ownership of the copy, the consumed message keeps its own
+        headers = rd_kafka_headers_copy(headers);
+    }
+    rd_kafka_timestamp_type_t timestampType;
+    int64_t timestamp = rd_kafka_message_timestamp(message, &timestampType);
+
+    rd_kafka_resp_err_t err;
+    for (;;)
+    {
+        err = rd_kafka_producev(producer_, RD_KAFKA_V_RKT(to.rkt),
+                                RD_KAFKA_V_PARTITION(opts_.preservePartition ? message->partition : RD_KAFKA_PARTITION_UA),
+                                RD_KAFKA_V_MSGFLAGS(0), RD_KAFKA_V_VALUE(message->payload, message->len),
+                                RD_KAFKA_V_KEY(message->key, message->key_len), RD_KAFKA_V_HEADERS(headers),
+                                RD_KAFKA_V_TIMESTAMP(timestampType == RD_KAFKA_TIMESTAMP_NOT_AVAILABLE ? 0 : timestamp),
+                                RD_KAFKA_V_OPAQUE(message), RD_KAFKA_V_END);
+        if (err != RD_KAFKA_RESP_ERR__QUEUE_FULL || !run)
+        {
+            break;
+        }
+        // the target is slower than the source: wait for deliveries, which is what throttles the consumer
+        totals_.queueFull++;
+        rd_kafka_poll(producer_, 10);
+    }
+
+    if (err)
+    {
+        if (headers)
+        {
+            rd_kafka_headers_destroy(headers);
+        }
+        if (err != RD_KAFKA_RESP_ERR__QUEUE_FULL)
+        {
+            stop("produce to " + to.name + " [" + std::to_string(message->partition) + "]: " + rd_kafka_err2str(err));
+        }
+        rd_kafka_message_destroy(message);
+        return false;
+    }
+    return true;
+}
+
+void Mirror::delivered(const rd_kafka_message_t *report)
+{
+    auto *source = static_cast<rd_kafka_message_t *>(report->_private);
+
+    if (report->err)
+    {
+        if (!failed_)
+        {
+            stop("delivery of " + std::string{rd_kafka_topic_name(source->rkt)} + " [" +
+                 std::to_string(source->partition) + "] offset " + std::to_string(source->offset) +
+                 " failed: " + rd_kafka_err2str(report->err));
+        }
+    }
+    else if (!failed_)
+    {
+        auto &state = partitions_[PartitionKey{source->rkt, source->partition}];
+        if (!state.target || state.target->source != rd_kafka_topic_name(source->rkt))
+        {
+            state = PartitionState{&target(source->rkt), 0};
+        }
+
+        commits_.processed(state.target->source, source->partition, source->offset);
+        if (map_ && (state.sinceSync == 0 || state.sinceSync >= opts_.syncEvery))
+        {
+            map_->record(state.target->source, source->partition, source->offset, state.target->name, report->offset);
+            state.sinceSync = 0;
+        }
+        state.sinceSync++;
+
+        totals_.mirrored++;
+        totals_.bytes += source->len;
+    }
+
+    rd_kafka_message_destroy(source);
+}
+
+void Mirror::mirror()
+{
+    RdKafka::ErrorCode err = consumer_->subscribe(opts_.topics);
+    if (err)
+    {
+        throw std::runtime_error{"subscribe: " + RdKafka::err2str(err)};
+    }
+
+    std::vector<rd_kafka_message_t *> batch(opts_.batchSize);
+    while (run)
+    {
+        const ssize_t count = rd_kafka_consume_batch_queue(queue_, opts_.batchWaitMs, batch.data(), batch.size());
+        if (count < 0)
+        {
+            throw std::runtime_error{std::string{"consume: "} + rd_kafka_err2str(rd_kafka_last_error())};
+        }
+
+        ssize_t i = 0;
+        while (i < count && produce(batch[i++]))
+        {
+        }
+        while (i < count)
+        {
+            rd_kafka_message_destroy(batch[i++]);
+        }
+
+        rd_kafka_poll(producer_, 0);
+        commits_.maybeCommit(consumer_);
+    }
+
+    shutdown();
+    if (failed_)
+    {
+        throw std::runtime_error{error_};
+    }
+}
+
+void Mirror::shutdown()
+{
+    ShutdownCoordinator coordinator{opts_.shutdownMs};
+
+    coordinator.phase("flush", 0,
+                      [&](int sliceMs)
+                      {
+                          rd_kafka_flush(producer_, sliceMs);
+                          return rd_kafka_outq_len(producer_) == 0;
+                      },
+                      [&] { return std::to_string(rd_kafka_outq_len(producer_)) + " message(s) in flight"; });
+    coordinator.phase("commit", 0,
+                      [&](int)
+                      {
+                          return commits_.commitSync(consumer_) == RdKafka::ERR_NO_ERROR;
+                      });
+    coordinator.phase("close", 0,
+                      [&](int)
+                      {
+                          // undelivered messages are mirrored again by the next owner, nothing past them is committed
+                          const int undelivered = rd_kafka_outq_len(producer_);
+                          if (undelivered > 0)
+                          {
+                              stop(std::to_string(undelivered) + " message(s) not delivered at shutdown");
+                              rd_kafka_purge(producer_, RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+                              rd_kafka_poll(producer_, 0);
+                          }
+                          consumer_->close();
+                          return true;
+                      });
+
+    const bool clean = coordinator.run();
+    std::cerr << "% Shutdown" << (clean ? "" : " ( incomplete )") << ": " << coordinator.report() << std::endl;
+}
+
+static std::pair<std::string, std::string> split(const char *arg, const char *option)
+{
+    const char *val = strchr(arg, '=');
+    if (!val)
+    {
+        std::cerr << "% Expected " << option << " property=value, not " << arg << std::endl;
+        exit(1);
+    }
+    return std::make_pair(std::string{arg, val}, std::string{val + 1});
+}
+
+int main(int argc, char **argv)
+{
+    std::string mapFile, lookup;
+    Options opts;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:g:P:t:B:w:pz:c:i:m:S:L:T:X:Y:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            opts.sourceBrokers = optarg;
+            break;
+        case 'd':
+            opts.targetBrokers = optarg;
+            break;
+        case 'g':
+            opts.group = optarg;
+            break;
+        case 'P':
+            opts.prefix = optarg;
+            break;
+        case 't':
+            opts.threads = std::max(1, atoi(optarg));
+            break;
+        case 'B':
+            opts.batchSize = std::max(1, atoi(optarg));
+            break;
+        case 'w':
+            opts.batchWaitMs = std::max(0, atoi(optarg));
+            break;
+        case 'p':
+            opts.preservePartition = false;
+            break;
+        case 'z':
+            opts.codec = optarg;
+            break;
+        case 'c':
+            opts.commit.maxMessages = std::max(1, atoi(optarg));
+            break;
+        case 'i':
+            opts.commit.intervalMs = std::max(1, atoi(optarg));
+            break;
+        case 'm':
+            mapFile = optarg;
+            break;
+        case 'S':
+            opts.syncEvery = std::max(1ULL, strtoull(optarg, nullptr, 10));
+            break;
+        case 'L':
+            lookup = optarg;
+            break;
+        case 'T':
+            opts.shutdownMs = std::max(0, atoi(optarg));
+            break;
+        case 'X':
+            opts.sourceProps.push_back(split(optarg, "-X"));
+            break;
+        case 'Y':
+            opts.targetProps.push_back(split(optarg, "-Y"));
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (!lookup.empty() ? mapFile.empty() || optind != argc
+                        : opts.targetBrokers.empty() || optind == argc || (!mapFile.empty() && !opts.preservePartition))
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s -d <target brokers> [options] <topic|^regex> [<topic>..]\n"
+                "       %s -m <map file> -L <topic>:<partition>:<committed offset>\n"
+                "\n"
+                " Options:\n"
+                "  -s <brokers>     Source cluster (localhost:9092)\n"
+                "  -d <brokers>     Target cluster\n"
+                "  -g <group>       Consumer group on the source (mirror)\n"
+                "  -P <prefix>      Target topic is prefix + source topic\n"
+                "  -t <threads>     Consumer / producer pairs (1)\n"
+                "  -B <messages>    Batch size (10000)\n"
+                "  -w <ms>          Batch wait (100)\n"
+                "  -p               Let the target partitioner pick partitions, no offset map\n"
+                "  -z <codec>       Target compression, match the source's (lz4)\n"
+                "  -c <messages>    Commit delivered source offsets every this many messages (10000)\n"
+                "  -i <ms>          .. or this often (1000)\n"
+                "  -m <file>        Append the offset translation map to file\n"
+                "  -S <messages>    Offset map line every this many messages per partition (10000)\n"
+                "  -L <t>:<p>:<o>   Translate a committed source offset with the -m map and exit\n"
+                "  -T <ms>          Shutdown budget (30000)\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property on the source consumer\n"
+                "  -Y <prop=name>   Set arbitrary librdkafka configuration property on the target producer\n"
+                "\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+
+    if (!lookup.empty())
+    {
+        const auto offsetColon = lookup.rfind(':');
+        const auto partitionColon = offsetColon == std::string::npos || offsetColon == 0
+                                        ? std::string::npos
+                                        : lookup.rfind(':', offsetColon - 1);
+        if (partitionColon == std::string::npos)
+        {
+            std::cerr << "% Expected -L <topic>:<partition>:<offset>, not " << lookup << std::endl;
+            exit(1);
+        }
+        try
+        {
+            const auto target = OffsetMap::translate(
+                mapFile, lookup.substr(0, partitionColon),
+                atoi(lookup.substr(partitionColon + 1, offsetColon - partitionColon - 1).c_str()),
+                atoll(lookup.substr(offsetColon + 1).c_str()));
+            std::cout << target.first << " " << target.second << std::endl;
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "% Offset translation failed: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    opts.topics.assign(argv + optind, argv + argc);
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        std::unique_ptr<OffsetMap> map;
+        if (!mapFile.empty())
+        {
+            map.reset(new OffsetMap{mapFile});
+        }
+
+        Totals totals;
+        std::vector<std::unique_ptr<Mirror>> mirrors;
+        for (int t = 0; t < opts.threads; t++)
+        {
+            mirrors.emplace_back(new Mirror{opts, map.get(), totals});
+        }
+
+        std::vector<std::thread> threads;
+        std::mutex errorLock;
+        std::string error;
+        std::atomic<int> running{opts.threads};
+        for (auto &mirror : mirrors)
+        {
+            threads.emplace_back([&, m = mirror.get()]
+            {
+                try
+                {
+                    m->mirror();
+                }
+                catch (const std::exception &e)
+                {
+                    std::lock_guard<std::mutex> lock{errorLock};
+                    if (error.empty())
+                    {
+                        error = e.what();
+                    }
+                    run = 0;
+                }
+                running--;
+            });
+        }
+
+        // every 5 seconds until the threads are done, the offset map every second
+        uint64_t lastMirrored = 0, lastBytes = 0;
+        auto last = std::chrono::steady_clock::now(), lastFlush = last;
+        bool mapFailed = false;
+        while (running > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            const auto now = std::chrono::steady_clock::now();
+            if (map && !mapFailed && now - lastFlush >= std::chrono::seconds(1))
+            {
+                // a write error ( disk full ) stops the threads: they must be joined before it is thrown
+                try
+                {
+                    map->flush();
+                }
+                catch (const std::exception &e)
+                {
+                    std::lock_guard<std::mutex> lock{errorLock};
+                    if (error.empty())
+                    {
+                        error = std::string{"offset map: "} + e.what();
+                    }
+                    run = 0;
+                    mapFailed = true;
+                }
+                lastFlush = now;
+            }
+            const double seconds = std::chrono::duration<double>(now - last).count();
+            if (seconds < 5 || !run)
+            {
+                continue;
+            }
+            const uint64_t mirrored = totals.mirrored, bytes = totals.bytes;
+            fprintf(stderr, "%% %.0f msgs/s %.2f MB/s, in flight %lu, queue full %lu, consume errors %lu\n",
+                    (mirrored - lastMirrored) / seconds, (bytes - lastBytes) / seconds / 1e6,
+                    static_cast<unsigned long>(totals.consumed - mirrored),
+                    static_cast<unsigned long>(totals.queueFull.load()),
+                    static_cast<unsigned long>(totals.consumeErrors.load()));
+            lastMirrored = mirrored;
+            lastBytes = bytes;
+            last = now;
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        mirrors.clear();
+        if (map && !mapFailed)
+        {
+            map->flush();
+        }
+
+        std::cerr << "% Mirrored " << totals.mirrored << " message(s), " << totals.bytes << " bytes" << std::endl;
+        if (!error.empty())
+        {
+            throw std::runtime_error{error};
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Mirror failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
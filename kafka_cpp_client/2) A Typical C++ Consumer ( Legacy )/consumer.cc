@@ -9,21 +9,32 @@
  *  Example of a sync + async consumer
  *
  *  1) Compile
- *  g++ consumer.cc  -o consumer.o -lrdkafka++ -I${HOME}/.local/include -L${HOME}/.local/lib
+ *  g++ consumer.cc ../common/message_filter.cpp -I../common -o consumer.o -lrdkafka++ -I${HOME}/.local/include -L${HOME}/.local/lib
  *
  *  2) Run producer
  *  $>./producer.o localhost:9092 prateek
  *
  *  3) Run Consumer
  *  ./consumer.o localhost:9092 prateek random  0 1
+ *
+ *  4) Run Consumer on many partitions sharing one queue
+ *  ./consumer.o localhost:9092 prateek all  0 2
+ *
+ *  5) Run Consumer, keeping only messages with a key starting with "eu-"
+ *  ./consumer.o localhost:9092 prateek all  0 2 'key ^= "eu-"'
  */
 
 #include <librdkafka/rdkafkacpp.h>
+#include "message_filter.h"
+#include <algorithm>
 #include <cstdlib>
 #include <csignal>
 #include <string>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
 
 // Signal handler
 static volatile sig_atomic_t run = 1;
@@ -34,6 +45,9 @@ static void sigterm (int sig) {
 // flag to set if last message is received
 static bool exit_eof = false;
 
+// messages not matching are dropped before anything is copied or printed, NULL if disabled
+static MessageFilter *message_filter = NULL;
+
 // Function which will be called in consumer callback
 // This function prints the info of the message received with the actual message value
 void msg_consume(RdKafka::Message *message, void *opaque)
@@ -45,7 +59,11 @@ void msg_consume(RdKafka::Message *message, void *opaque)
 		case RdKafka::ERR__TIMED_OUT:
 			break;
 		case RdKafka::ERR_NO_ERROR:
-			/* Real message */
+			/* Real message, unless filtered out */
+			if( message_filter && !message_filter->matches(*message) )
+			{
+				break;
+			}
 			std::cout << "Read msg at offset "<< message->offset() << std::endl;
 			if( message->key() )
 			{
@@ -117,7 +135,62 @@ public:
 };
 
 
-// ./consumer.o <broker> <topic> <partition> <offset> <Use consumer callback flag : 1 or 0  >
+/*
+ * Parse partition argument :
+ * 	"random"  : PARTITION_UA ( single partition )
+ * 	"all"     : every partition of the topic, read from metadata
+ * 	"0,3,5"   : comma separated list of partitions
+ */
+static std::vector<int32_t> parse_partitions(RdKafka::Consumer *consumer, RdKafka::Topic *topic_handle, const char *arg)
+{
+	std::vector<int32_t> partitions;
+
+	if( !strcmp(arg, "random") )
+	{
+		partitions.push_back(RdKafka::Topic::PARTITION_UA);
+	}
+	else if( !strcmp(arg, "all") )
+	{
+		RdKafka::Metadata *metadata = NULL;
+		RdKafka::ErrorCode err = consumer->metadata(false, topic_handle, &metadata, 5000);
+		if( err != RdKafka::ERR_NO_ERROR )
+		{
+			std::cerr << "Failed to get metadata: " << RdKafka::err2str (err) << std::endl;
+			exit(1);
+		}
+
+		const RdKafka::TopicMetadata::PartitionMetadataVector *parts = (*metadata->topics())[0]->partitions();
+		for( size_t i = 0 ; i < parts->size() ; i++ )
+		{
+			partitions.push_back((*parts)[i]->id());
+		}
+		delete metadata;
+	}
+	else
+	{
+		for( const char *p = arg ; p && *p ; )
+		{
+			partitions.push_back(atoi(p));
+			if( (p = strchr(p, ',')) )
+			{
+				p++;
+			}
+		}
+	}
+
+	return partitions;
+}
+
+
+/*
+ * ./consumer.o <broker> <topic> <partition> <offset> <consume mode>
+ *
+ * consume mode :
+ * 	0 : consume() one message at a time, partition by partition
+ * 	1 : consume_callback() per partition
+ * 	2 : all partitions started on one shared RdKafka::Queue which is drained with consume_callback().
+ * 	    A single call serves every partition that has messages, instead of one call ( and one timeout ) per partition.
+ */
 int main(int argc, char **argv)
 {
 	// Register signal handler
@@ -128,28 +201,31 @@ int main(int argc, char **argv)
 	RdKafka::Conf *conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);		// consumer configuration
 	RdKafka::Conf *tconf = RdKafka::Conf::create(RdKafka::Conf::CONF_TOPIC);		// topic configuration ( starting with topic.* )
 
-	if( argc != 6 )
+	if( argc != 6 && argc != 7 )
 	{
-		std::cout <<"Usage : ./consumer.o <brokers> <topic> <partition> <offset> <Use consumer callback flag : 1 or 0  >"<<std::endl;
+		std::cout <<"Usage : ./consumer.o <brokers> <topic> <partition|random|all|p1,p2,..> <offset> <consume mode : 0, 1 or 2 > [filter]"<<std::endl;
+		std::cout <<"        filter : e.g. 'key ^= \"eu-\" && header.type == \"order\" && ts >= <ms>'"<<std::endl;
 		exit(1);
 	}
 
+	if( argc == 7 )
+	{
+		try
+		{
+			message_filter = new MessageFilter(argv[6]);
+		}
+		catch( const std::invalid_argument &e )
+		{
+			std::cerr << e.what() << std::endl;
+			exit(1);
+		}
+	}
+
 	std::string errstr;
 	std::string brokers = argv[1];
 	std::string topic = argv[2];
-	int32_t partition = RdKafka::Topic::PARTITION_UA;
-	uint32_t offset = atoi(argv[4]);
-	uint32_t isUseCallback = atoi(argv[5]);
-
-	 // Get partition to use
-	 if (strcmp(argv[3], "random"))
-	 {
-		 ;// default
-	 }
-	 else
-	 {
-		 partition = atoi(argv[3]);
-	 }
+	int64_t offset = strtoll(argv[4], NULL, 10);		// offsets are 64 bit, negative values are the logical OFFSET_* constants
+	uint32_t consumeMode = atoi(argv[5]);
 
 	/* Set Configuration */
 	conf->set("metadata.broker.list", brokers, errstr);
@@ -176,34 +252,63 @@ int main(int argc, char **argv)
 		exit (1);
 	}
 
+	 // Get partitions to use
+	std::vector<int32_t> partitions = parse_partitions(consumer, topic_handle, argv[3]);
+
+	// Shared queue, all partitions are forwarded to it in consume mode 2
+	RdKafka::Queue *queue = NULL;
+	if( consumeMode == 2 )
+	{
+		queue = RdKafka::Queue::create(consumer);
+	}
+
 	/*
 	 * Start consumer for topic + partition at start offset
-	 * Fetch message from broker and place it in inyternal queue
+	 * Fetch message from broker and place it in inyternal queue ( or the shared queue )
 	 */
-	RdKafka::ErrorCode resp = consumer->start(topic_handle, partition, offset);
-	if ( resp != RdKafka::ERR_NO_ERROR )
+	for( size_t i = 0 ; i < partitions.size() ; i++ )
 	{
-		std::cerr << "Failed to start consumer: " << RdKafka::err2str (resp) << std::endl;
-		exit (1);
+		RdKafka::ErrorCode resp = queue ? consumer->start(topic_handle, partitions[i], offset, queue)
+										: consumer->start(topic_handle, partitions[i], offset);
+		if ( resp != RdKafka::ERR_NO_ERROR )
+		{
+			std::cerr << "Failed to start consumer: " << RdKafka::err2str (resp) << std::endl;
+			exit (1);
+		}
 	}
 
 	ExampleConsumerCb ex_consume_cb;
 
+	// Per partition calls share the 1000ms wait, otherwise an idle partition delays all others. At least 1ms : with
+	// more than 1000 partitions a 0 timeout would spin.
+	int partitionTimeout = partitions.size() > 1 ? std::max(1, (int) (1000 / partitions.size())) : 1000;
+
 	/* Start consuming messages from internal queue */
 	while( run )
 	{
 		// Whether to use callback consumer or without
-		if( isUseCallback )
+		if( consumeMode == 2 )
 		{
-			// Non blocking
-			consumer->consume_callback(topic_handle, partition, 1000, &ex_consume_cb, &isUseCallback);
+			// Serves all messages currently on the shared queue, from any partition
+			consumer->consume_callback(queue, 1000, &ex_consume_cb, &consumeMode);
 		}
 		else
 		{
-			// blocking
-			RdKafka::Message *msg = consumer->consume(topic_handle, partition, 1000);
-			msg_consume(msg, NULL);
-			delete msg;
+			for( size_t i = 0 ; run && i < partitions.size() ; i++ )
+			{
+				if( consumeMode == 1 )
+				{
+					// Non blocking
+					consumer->consume_callback(topic_handle, partitions[i], partitionTimeout, &ex_consume_cb, &consumeMode);
+				}
+				else
+				{
+					// blocking
+					RdKafka::Message *msg = consumer->consume(topic_handle, partitions[i], partitionTimeout);
+					msg_consume(msg, NULL);
+					delete msg;
+				}
+			}
 		}
 
 		/*
@@ -224,11 +329,21 @@ int main(int argc, char **argv)
 	 /*
 	 * Stop consumer
 	 */
-	consumer->stop (topic_handle, partition);
+	for( size_t i = 0 ; i < partitions.size() ; i++ )
+	{
+		consumer->stop (topic_handle, partitions[i]);
+	}
 	consumer->poll (1000);
+	delete queue;
 	delete topic_handle;
 	delete consumer;
 
+	if( message_filter )
+	{
+		std::cerr << "% Filter " << message_filter->str() << ": " << message_filter->report() << std::endl;
+		delete message_filter;
+	}
+
 	/*
 	 * Wait for RdKafka to decommission.
 	 * This is not strictly needed (when check outq_len() above), but
@@ -6,42 +6,81 @@
  *      Refer : https://github.com/edenhill/librdkafka/blob/master/examples/rdkafka_complex_consumer_example.cpp
  *
  *	Compile :
- *		g++ consumer.cc  -o consumer.o -lrdkafka++ -I${HOME}/.local/include -L${HOME}/.local/lib
+ *		g++ consumer.cc ../common/stats_parser.cpp ../common/prefetch_budget.cpp ../common/commit_manager.cpp ../common/message_filter.cpp ../common/failure_router.cpp ../common/timer_wheel.cpp ../common/event_loop.cpp ../common/trace.cpp ../common/metrics.cpp ../common/capture_file.cpp ../common/shutdown.cpp -I../common -pthread -o consumer.o -lrdkafka++ -lrdkafka -I${HOME}/.local/include -L${HOME}/.local/lib
  *	Run:
  *	./consumer.o -g 1 -b localhost:9092  -v prateek
+ *	./consumer.o -g 1 -b localhost:9092  -m 64 -vv prateek		( keep at most 64 MB fetched but unprocessed )
+ *	./consumer.o -g 1 -b localhost:9092  -c 1000 -i 1000 prateek	( commit processed offsets explicitly )
+ *	./consumer.o -g 1 -b localhost:9092  -f 'key ^= "eu-" && header.type == "order"' prateek	( drop everything else on fetch )
+ *	./consumer.o -g 1 -b localhost:9092  -r 1000,60000 -N 3 prateek	( route poison messages to prateek-retry-<ms> / prateek-dlq )
+ *	./consumer.o -g 1 -b localhost:9092  -H 9464 -E consumer.prom prateek	( curl localhost:9464 for metrics )
+ *	./consumer.o -g 1 -b localhost:9092  -q -w prateek.kcap prateek	( capture traffic, replay with producer -R )
  */
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <cstdlib>
 #include <cstdio>
 #include <csignal>
 #include <cstring>
-#include <sys/time.h>
+#include <ctime>
+#include <functional>
 #include <getopt.h>
+#include <stdexcept>
 #include <librdkafka/rdkafkacpp.h>
+#include "capture_file.h"
+#include "commit_manager.h"
+#include "failure_router.h"
+#include "message_filter.h"
+#include "metrics.h"
+#include "prefetch_budget.h"
+#include "shutdown.h"
+#include "stats_parser.h"
+#include "timer_wheel.h"
+#include "event_loop.h"
+#include "trace.h"
 
 
-static int partition_count = 0;	// partition count
-static int eof_cnt = 0;
-static long msg_cnt = 0;		// Number of message received
-static int64_t msg_bytes = 0;	// Number of bytes received
+/*
+ * Counters live in a registry rather than in plain globals: any thread may update them, and they are exported
+ * while running ( -E / -H )
+ */
+static Metrics metrics;
+static Gauge &partition_count = metrics.gauge("consumer_assigned_partitions", "Partitions assigned");
+static Gauge &eof_cnt = metrics.gauge("consumer_eof_partitions", "Partitions at end of log since the last rebalance");
+static Counter &msg_cnt = metrics.counter("consumer_messages_total", "Messages received");
+static Counter &msg_bytes = metrics.counter("consumer_bytes_total", "Payload bytes received");
+static Histogram &msg_size = metrics.histogram("consumer_message_bytes", "Payload size of messages received");
 static int verbosity = 1;		// info verbosity
 static volatile sig_atomic_t run = 1;
 static bool exit_eof = false;
+static PrefetchBudget *prefetch_budget = NULL;	// global prefetch memory budget, NULL if disabled
+static bool budget_dirty = false;				// new statistics arrived, budget should be enforced
+static CommitManager *commit_manager = NULL;	// explicit commits of processed offsets, NULL if auto commit is used
+static MessageFilter *message_filter = NULL;	// messages not matching are dropped unprocessed, NULL if disabled
+static FailureRouter *failure_router = NULL;	// retry / dead letter topics for failed messages, NULL if disabled
+static CaptureWriter *capture_writer = NULL;	// consumed messages are captured for replay, NULL if disabled
 static void sigterm (int sig) {
   run = 0;
 }
 
 /*
- * Format a string timestamp from the current time
+ * Format a string timestamp from the current time.
+ * The coarse clock costs no system call, and the date is only formatted again once the second changes.
  */
 static void print_time ()
 {
-	struct timeval tv;
-	char buf[64];
-	gettimeofday (&tv, NULL);
-	strftime (buf, sizeof(buf) - 1, "%Y-%m-%d %H:%M:%S", localtime (&tv.tv_sec));
-	fprintf (stderr, "%s.%03d: ", buf, (int) (tv.tv_usec / 1000));
+	static time_t last_sec = -1;
+	static char buf[64];
+	int64_t now_ms = CoarseClock::wallMs();
+	time_t sec = (time_t) (now_ms / 1000);
+	if( sec != last_sec )
+	{
+		struct tm tm;
+		strftime (buf, sizeof(buf) - 1, "%Y-%m-%d %H:%M:%S", localtime_r (&sec, &tm));
+		last_sec = sec;
+	}
+	fprintf (stderr, "%s.%03d: ", buf, (int) (now_ms % 1000));
 }
 
 
@@ -70,6 +109,35 @@ public:
 				std::cerr << "ERROR ("<<RdKafka::err2str(event.err()) << ") : "<< event.str() << std::endl;
 				break;
 			case RdKafka::Event::EVENT_STATS:
+				if( prefetch_budget )
+				{
+					ConsumerStats stats;
+					if( parseConsumerStats(event.str(), stats) )
+					{
+						prefetch_budget->observeStats(stats);
+						budget_dirty = true;
+					}
+
+					// buffered bytes per partition
+					std::cerr << "% Buffered " << prefetch_budget->buffered() << " of " << prefetch_budget->budget()
+							<< " bytes, " << prefetch_budget->pausedCount() << " partition(s) paused" << std::endl;
+					if( verbosity >= 2 )
+					{
+						std::cerr << prefetch_budget->report();
+					}
+					if( verbosity < 3 )
+					{
+						break;
+					}
+				}
+				if( commit_manager )
+				{
+					std::cerr << "% Commits: " << commit_manager->report() << std::endl;
+				}
+				if( failure_router )
+				{
+					std::cerr << "% Failures: " << failure_router->report() << std::endl;
+				}
 				std::cerr<< "\"STATS\":"<< event.str() << std::endl;
 				break;
 			case RdKafka::Event::EVENT_LOG:
@@ -107,6 +175,9 @@ private:
 	}
 
 public:
+	// how long a revocation waits for routed messages; 0 once shutdown has spent its drain phase
+	int router_flush_ms = 10000;
+
 	// will be called during partition rebalance
 	void rebalance_cb(RdKafka::KafkaConsumer *consumer,
 					  RdKafka::ErrorCode err,
@@ -132,25 +203,70 @@ public:
 			else
 			{
 				ret_err = consumer->assign(partitions);
+				if( prefetch_budget )
+				{
+					prefetch_budget->revokeAll();
+				}
+			}
+			partition_count.add(partitions.size());
+
+			// start only as many partitions as fit the prefetch budget, the rest start paused
+			if( prefetch_budget && !error && !ret_err )
+			{
+				prefetch_budget->assign(consumer, partitions);
 			}
-			partition_count += (int) partitions.size();
 		}
 		else
 		{
+			// routed messages must be delivered before their offsets are committed
+			bool routed = !failure_router || failure_router->flush(router_flush_ms);
+			if( failure_router )
+			{
+				if( consumer->rebalance_protocol() == "COOPERATIVE" )
+				{
+					failure_router->revoke(partitions);
+				}
+				else
+				{
+					failure_router->revokeAll();
+				}
+			}
+
+			// commit processed offsets while the partitions are still ours
+			if( commit_manager && routed && !consumer->assignment_lost() )
+			{
+				if( consumer->rebalance_protocol() == "COOPERATIVE" )
+				{
+					commit_manager->revoke(consumer, partitions);
+				}
+				else
+				{
+					commit_manager->revokeAll(consumer);
+				}
+			}
+
 			//unassign partitions
 			if ( consumer->rebalance_protocol() == "COOPERATIVE" )
 			{
 				error = consumer->incremental_unassign(partitions);
-				partition_count -= (int) partitions.size();
+				partition_count.add(-(int64_t) partitions.size());
+				if( prefetch_budget )
+				{
+					prefetch_budget->revoke(partitions);
+				}
 			}
 			else
 			{
 				ret_err = consumer->unassign();
-				partition_count = 0;
+				partition_count.set(0);
+				if( prefetch_budget )
+				{
+					prefetch_budget->revokeAll();
+				}
 			}
 		}
 
-		eof_cnt = 0; /* FIXME: Won't work with COOPERATIVE */
+		eof_cnt.set(0); /* FIXME: Won't work with COOPERATIVE */
 
 		if( error )
 		{
@@ -173,9 +289,26 @@ void msg_consume(RdKafka::Message *message, void *opaque)
 		case RdKafka::ERR__TIMED_OUT:
 			break;
 		case RdKafka::ERR_NO_ERROR:
-			/* Real message */
-			msg_cnt++;
-			msg_bytes += message->len();
+			/* Real message, unless filtered out : only key, headers and timestamp are looked at */
+			if( message_filter && !message_filter->matches(*message) )
+			{
+				break;
+			}
+			msg_cnt.add();
+			msg_bytes.add(message->len());
+			msg_size.observe(message->len());
+			if( capture_writer )
+			{
+				try
+				{
+					capture_writer->append(*message);
+				}
+				catch( const std::runtime_error &e )
+				{
+					std::cerr << "% Capture failed: " << e.what() << std::endl;
+					run = 0;
+				}
+			}
 
 			if( verbosity >= 3 )
 			{
@@ -216,9 +349,10 @@ void msg_consume(RdKafka::Message *message, void *opaque)
 
 		case RdKafka::ERR__PARTITION_EOF:
 			/* Last message */
-			if ( exit_eof && ++eof_cnt == partition_count )
+			eof_cnt.add(1);
+			if ( exit_eof && eof_cnt.value() == partition_count.value() )
 			{
-				std::cerr << "%% EOF reached for all " << partition_count << " partition(s)" << std::endl;
+				std::cerr << "%% EOF reached for all " << partition_count.value() << " partition(s)" << std::endl;
 				run = 0;
 			}
 			break;
@@ -246,6 +380,16 @@ int main(int argc, char **argv)
 	std::string debug;
 	std::vector<std::string> topics;
 	bool do_conf_dump = false;
+	int64_t memory_budget_mb = 0;
+	CommitManager::Policy commit_policy;
+	bool manual_commit = false;
+	FailureRouter::Policy failure_policy;
+	bool route_failures = false;
+	std::string metrics_file;
+	int metrics_port = 0;
+	std::string capture_file;
+	int shutdown_ms = 10000;
+	std::vector<std::pair<std::string, std::string> > props;	// -X properties, also given to the router's producer
 	int opt;
 
 	/*
@@ -261,7 +405,7 @@ int main(int argc, char **argv)
 	conf->set("enable.partition.eof", "true", errstr);
 
 	/* Parse Command line arguments */
-	while ((opt = getopt (argc, argv, "g:b:z:qd:eX:AM:qv")) != -1)
+	while ((opt = getopt (argc, argv, "g:b:z:qd:eX:AM:m:c:i:f:r:N:E:H:w:t:qv")) != -1)
 	{
 		switch (opt)
 			{
@@ -298,6 +442,57 @@ int main(int argc, char **argv)
 					exit (1);
 				}
 				break;
+			case 'm':
+				memory_budget_mb = atoi (optarg);
+				break;
+			case 'c':
+				commit_policy.maxMessages = atoi (optarg);
+				manual_commit = true;
+				break;
+			case 'i':
+				commit_policy.intervalMs = atoi (optarg);
+				manual_commit = true;
+				break;
+			case 'f':
+				try
+				{
+					message_filter = new MessageFilter(optarg);
+				}
+				catch( const std::invalid_argument &e )
+				{
+					std::cerr << e.what() << std::endl;
+					exit (1);
+				}
+				break;
+			case 'r':
+				failure_policy.delaysMs.clear();
+				for( const char *p = optarg ; p && *p ; )
+				{
+					failure_policy.delaysMs.push_back(atoll(p));
+					if( (p = strchr(p, ',')) )
+					{
+						p++;
+					}
+				}
+				failure_policy.maxAttempts = (int) failure_policy.delaysMs.size() + 1;
+				route_failures = true;
+				break;
+			case 'N':
+				failure_policy.maxAttempts = atoi (optarg);
+				route_failures = true;
+				break;
+			case 'E':
+				metrics_file = optarg;
+				break;
+			case 'H':
+				metrics_port = atoi (optarg);
+				break;
+			case 'w':
+				capture_file = optarg;
+				break;
+			case 't':
+				shutdown_ms = atoi (optarg);
+				break;
 			case 'X':
 				{
 					char *name, *val;
@@ -326,6 +521,7 @@ int main(int argc, char **argv)
 						std::cerr << errstr << std::endl;
 						exit (1);
 					}
+					props.push_back(std::make_pair(std::string(name), std::string(val)));
 				}
 				break;
 
@@ -366,6 +562,24 @@ int main(int argc, char **argv)
 		            "  -d [facs..]     Enable debugging contexts:\n"
 		            "                  %s\n"
 		            "  -M <intervalms> Enable statistics\n"
+		            "  -m <MB>         Bound fetched but unprocessed messages of all\n"
+		            "                  partitions together, pausing partitions\n"
+		            "  -c <messages>   Commit processed offsets explicitly after this\n"
+		            "                  many messages (disables auto commit)\n"
+		            "  -i <ms>         Commit processed offsets explicitly at least\n"
+		            "                  this often (disables auto commit)\n"
+		            "  -f <expr>       Drop messages not matching expr on fetch, e.g.\n"
+		            "                  key ^= \"eu-\" && header.type == \"order\" && ts >= <ms>\n"
+		            "  -r <ms,ms..>    Route messages that can not be consumed to <topic>-retry-<ms>\n"
+		            "                  tiers and consume those too (commits explicitly)\n"
+		            "  -N <attempts>   Dead letter to <topic>-dlq after this many attempts\n"
+		            "                  (default: tiers + 1)\n"
+		            "  -E <file>       Write metrics to file every 5s (Prometheus text format)\n"
+		            "  -H <port>       Serve metrics over HTTP on port\n"
+		            "  -w <file>       Capture consumed messages to file, for\n"
+		            "                  replay with producer -R\n"
+		            "  -t <ms>         Time to shut down in, from stopping intake\n"
+		            "                  to leaving the group (10000)\n"
 		            "  -X <prop=name>  Set arbitrary librdkafka "
 		            "configuration property\n"
 		            "                  Use '-X list' to see the full list\n"
@@ -407,6 +621,92 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * Prefetch budget : needs per partition fetch queue sizes from the statistics
+	 */
+	if( memory_budget_mb > 0 )
+	{
+		std::string value;
+		if( conf->get("statistics.interval.ms", value) != RdKafka::Conf::CONF_OK || value == "0" )
+		{
+			conf->set("statistics.interval.ms", "1000", errstr);
+		}
+
+		int64_t fetch_bytes = 1048576;	// max.partition.fetch.bytes default
+		if( conf->get("max.partition.fetch.bytes", value) == RdKafka::Conf::CONF_OK && !value.empty() )
+		{
+			fetch_bytes = strtoll(value.c_str(), NULL, 10);
+		}
+
+		// librdkafka's own queue limit may not exceed the budget either, a smaller one is kept
+		int64_t queued_kbytes = 65536;	// queued.max.messages.kbytes default
+		if( conf->get("queued.max.messages.kbytes", value) == RdKafka::Conf::CONF_OK && !value.empty() )
+		{
+			queued_kbytes = strtoll(value.c_str(), NULL, 10);
+		}
+		conf->set("queued.max.messages.kbytes",
+				  std::to_string(std::min<int64_t>(queued_kbytes, memory_budget_mb * 1024)), errstr);
+
+		prefetch_budget = new PrefetchBudget(memory_budget_mb * 1024 * 1024, fetch_bytes);
+	}
+
+	/*
+	 * Commit manager : processed offsets are committed asynchronously and coalesced
+	 * instead of auto committing whatever was consumed
+	 */
+	if( manual_commit )
+	{
+		commit_manager = new CommitManager(commit_policy);
+		if( conf->set("enable.auto.commit", "false", errstr) != RdKafka::Conf::CONF_OK ||
+			conf->set("offset_commit_cb", commit_manager, errstr) != RdKafka::Conf::CONF_OK )
+		{
+			std::cerr << errstr << std::endl;
+			exit(1);
+		}
+	}
+
+	/*
+	 * Failure router : poison messages go to retry / dead letter topics instead of stopping the consumer.
+	 * Offsets are committed explicitly, only behind delivered routed messages.
+	 */
+	if( route_failures )
+	{
+		RdKafka::Conf *router_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);
+		router_conf->set("bootstrap.servers", brokers, errstr);
+		for( size_t i = 0 ; i < props.size() ; i++ )
+		{
+			router_conf->set(props[i].first, props[i].second, errstr);	// consumer only properties are ignored
+		}
+		try
+		{
+			failure_router = new FailureRouter(failure_policy, router_conf);
+		}
+		catch( const std::runtime_error &e )
+		{
+			std::cerr << e.what() << std::endl;
+			exit(1);
+		}
+		delete router_conf;
+
+		size_t topic_count = topics.size();
+		for( size_t i = 0 ; i < topic_count ; i++ )
+		{
+			std::vector<std::string> retry = failure_router->retryTopics(topics[i]);
+			topics.insert(topics.end(), retry.begin(), retry.end());
+		}
+
+		if( !commit_manager )
+		{
+			commit_manager = new CommitManager(commit_policy);
+			if( conf->set("enable.auto.commit", "false", errstr) != RdKafka::Conf::CONF_OK ||
+				conf->set("offset_commit_cb", commit_manager, errstr) != RdKafka::Conf::CONF_OK )
+			{
+				std::cerr << errstr << std::endl;
+				exit(1);
+			}
+		}
+	}
+
 	/* Set Event callback */
 	ExampleEventCb ex_event_cb;
 	conf->set("event_cb", &ex_event_cb, errstr);
@@ -461,23 +761,236 @@ int main(int argc, char **argv)
 
 	/*
 	 * Consume messages
+	 *
+	 * 1) The loop sleeps in epoll until librdkafka signals the consumer queue ( messages; rebalances and events are
+	 * forwarded there too ), then drains it with consume(0).
+	 * 2) The empty consume ending a drain, and a drain every second, do what used to happen on a consume() timeout:
+	 * enforce the budget when idle, commit on the interval, resume partitions whose retries are due.
 	 */
-	while( run )
+	/*
+	 * Export metrics from a thread of its own
+	 */
+	MetricsExporter *metrics_exporter = NULL;
+	if( !metrics_file.empty() || metrics_port > 0 )
+	{
+		try
+		{
+			metrics_exporter = new MetricsExporter(metrics, metrics_file, metrics_port);
+		}
+		catch( const std::exception &e )
+		{
+			std::cerr << "% Failed to export metrics: " << e.what() << std::endl;
+			exit(1);
+		}
+	}
+
+	/*
+	 * Capture : every message processed is appended to the capture file, with the time it arrived
+	 */
+	if( !capture_file.empty() )
 	{
-		RdKafka::Message *msg = consumer->consume(1000);
+		try
+		{
+			capture_writer = new CaptureWriter(capture_file);
+		}
+		catch( const std::runtime_error &e )
+		{
+			std::cerr << "% Failed to capture: " << e.what() << std::endl;
+			exit(1);
+		}
+	}
+
+	EventLoop loop;
+	if( prefetch_budget )
+	{
+		// between statistics, the budget is re-evaluated on a timer rather than by counting messages
+		loop.timers().every(100, []() { budget_dirty = true; });
+	}
+
+	auto handle_message = [&](RdKafka::Message *msg)
+	{
+		if( prefetch_budget )
+		{
+			if( msg->err() == RdKafka::ERR_NO_ERROR )
+			{
+				prefetch_budget->consumed(msg->topic_name(), msg->partition(), msg->len());
+			}
+
+			// re-evaluate on new statistics, on idle and every 100 ms in between
+			if( budget_dirty || msg->err() == RdKafka::ERR__TIMED_OUT )
+			{
+				prefetch_budget->enforce(consumer);
+				budget_dirty = false;
+			}
+		}
+
+		/*
+		 * Failure routing : a retried message that is not due yet is held back, a message that can not be
+		 * consumed is dead lettered and skipped instead of stopping the consumer
+		 */
+		bool held = false, routed = false;
+		if( failure_router )
+		{
+			if( msg->err() == RdKafka::ERR_NO_ERROR )
+			{
+				held = failure_router->hold(consumer, *msg);
+			}
+			else if( FailureRouter::isMessageError(*msg) )
+			{
+				std::cerr << "% Dead lettering " << msg->topic_name() << " [" << msg->partition() << "] at offset "
+						<< msg->offset() << ": " << msg->errstr() << std::endl;
+				failure_router->route(*msg, msg->errstr(), false);
+				FailureRouter::skip(consumer, *msg);
+				routed = true;
+			}
+
+			if( !failure_router->poll(consumer) )
+			{
+				std::cerr << "% Failed messages could not be routed, stopping" << std::endl;
+				run = 0;
+			}
+		}
+
 		// print message
-		msg_consume(msg, NULL);
-		delete msg;
+		if( !held && !routed )
+		{
+			msg_consume(msg, NULL);
+		}
+
+		if( prefetch_budget && msg->err() == RdKafka::ERR_NO_ERROR )
+		{
+			prefetch_budget->processed(msg->topic_name(), msg->partition(), msg->len());
+		}
+		if( commit_manager )
+		{
+			if( (msg->err() == RdKafka::ERR_NO_ERROR && !held) || routed )
+			{
+				commit_manager->processed(*msg);
+			}
+			// nothing is committed ahead of a routed message that is not delivered yet
+			if( !failure_router || failure_router->canCommit() )
+			{
+				commit_manager->maybeCommit(consumer);
+			}
+		}
+	};
+
+	std::function<void()> drain = [&]()
+	{
+		// bounded, so that timers still run under load: the rest is taken on the next turn
+		for( int i = 0; i < 1000 && run; i++ )
+		{
+			RdKafka::Message *msg;
+			{
+				TraceScope<TraceStage::ConsumeReturn> probe;
+				msg = consumer->consume(0);
+				probe.value(msg->len());
+			}
+			bool empty = msg->err() == RdKafka::ERR__TIMED_OUT;
+			handle_message(msg);
+			delete msg;
+			if( empty )
+			{
+				return;
+			}
+		}
+		loop.timers().schedule(0, drain);
+	};
+	int consumer_queue = loop.watchConsumer(consumer, drain);
+	loop.timers().every(1000, drain);
+
+	// run will be 0 in case Signal received, epoll_wait returns early then
+	while( run )
+	{
+		loop.runOnce(1000);
 	}
 
-	 /*
-	 * Stop consumer
+	/*
+	 * Stop consumer, within -t ms altogether, every phase ending as soon as its work is done :
+	 * 1) stop intake : the consumer queue is no longer served.
+	 * 2) drain : routed messages are delivered, nothing may be committed ahead of them.
+	 * 3) commit : the final processed offsets, synchronously.
+	 * 4) close : leave the group; the revocation commits once more from the rebalance callback, without waiting for
+ * routed messages again.
 	 */
-	consumer->close ();
+	ShutdownCoordinator shutdown(shutdown_ms);
+	shutdown.phase("stop intake", 0, [&](int)
+	{
+		loop.unwatchQueue(consumer_queue);
+		return true;
+	});
+	if( failure_router )
+	{
+		shutdown.phase("drain", 0, [&](int slice_ms)
+		{
+			failure_router->flush(slice_ms);
+			return failure_router->drained();
+		}, [&]() { return failure_router->report(); });
+	}
+	if( commit_manager )
+	{
+		shutdown.phase("commit", 0, [&](int)
+		{
+			if( !failure_router || failure_router->canCommit() )
+			{
+				RdKafka::ErrorCode err = commit_manager->commitSync(consumer);
+				if( err )
+				{
+					std::cerr << "% Final commit failed: " << RdKafka::err2str(err) << std::endl;
+				}
+			}
+			return true;
+		});
+	}
+	shutdown.phase("close", 0, [&](int)
+	{
+		// the drain phase had its share of the budget, the revocation must not wait for routed messages again
+		ex_rebalance_cb.router_flush_ms = 0;
+		consumer->close ();
+		return true;
+	});
+	shutdown.run();
+	std::cerr << "% Shutdown: " << shutdown.report() << std::endl;
+
+	if( commit_manager )
+	{
+		std::cerr << "% Commits: " << commit_manager->report() << std::endl;
+	}
+	if( Trace::enabled() )
+	{
+		std::cerr << "% Trace: " << Trace::report() << std::endl;
+	}
 	delete consumer;
+	if( capture_writer )
+	{
+		try
+		{
+			capture_writer->flush();
+			std::cerr << "% Captured " << capture_writer->messages() << " messages (" << capture_writer->bytes()
+					<< " bytes) to " << capture_file << std::endl;
+		}
+		catch( const std::runtime_error &e )
+		{
+			std::cerr << "% Capture incomplete: " << e.what() << std::endl;
+		}
+		delete capture_writer;
+	}
+	delete metrics_exporter;
+	delete prefetch_budget;
+	delete commit_manager;
+	if( failure_router )
+	{
+		std::cerr << "% Failures: " << failure_router->report() << std::endl;
+		delete failure_router;
+	}
 
 	// print no of messages consumed and bytes
-	std::cerr << "% Consumed " << msg_cnt << " messages (" << msg_bytes << " bytes)" << std::endl;
+	std::cerr << "% Consumed " << msg_cnt.value() << " messages (" << msg_bytes.value() << " bytes)" << std::endl;
+	if( message_filter )
+	{
+		std::cerr << "% Filter " << message_filter->str() << ": " << message_filter->report() << std::endl;
+		delete message_filter;
+	}
 
 	 /*
 	   * Wait for RdKafka to decommission.
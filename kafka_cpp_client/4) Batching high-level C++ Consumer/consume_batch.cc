@@ -5,17 +5,39 @@
  *      Author: prateek
  *  Refer : https://github.com/edenhill/librdkafka/blob/master/examples/rdkafka_consume_batch.cpp
  *
+ *	Compile :
+ *		g++ consume_batch.cc ../common/stats_parser.cpp ../common/prefetch_tuner.cpp ../common/commit_manager.cpp ../common/schema_cache.cpp ../common/batch_decoder.cpp ../common/message_filter.cpp ../common/failure_router.cpp ../common/timer_wheel.cpp ../common/trace.cpp ../common/shutdown.cpp -I../common -o consume_batch.o -lrdkafka++ -I${HOME}/.local/include -L${HOME}/.local/lib
+ *	Run:
+ *	./consume_batch.o -g 1 -B 500 -b localhost:9092 prateek
+ *	./consume_batch.o -g 1 -B 500 -b localhost:9092 -A throughput -m 128 prateek		( autotune prefetch )
+ *	./consume_batch.o -g 1 -B 500 -b localhost:9092 -c 5000 -i 2000 prateek			( commit every 5000 messages or 2s )
+ *	./consume_batch.o -g 1 -B 500 -b localhost:9092 -D json -F id:int,price:double,sym:string prateek	( decode into columns )
+ *	./consume_batch.o -g 1 -B 500 -b localhost:9092 -D avro -R ./schemas prateek		( schemas in ./schemas/<id>.avsc )
+ *	./consume_batch.o -g 1 -B 500 -b localhost:9092 -f 'header.type == "order"' prateek	( batch only matching messages )
+ *	./consume_batch.o -g 1 -B 500 -b localhost:9092 -D avro -R ./schemas -r 1000,60000 prateek	( retry undecodable messages )
  */
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <cstdlib>
 #include <cstdio>
 #include <csignal>
 #include <cstring>
 #include <getopt.h>
-#include <sys/time.h>
 #include <unistd.h>
 #include <librdkafka/rdkafkacpp.h>
+#include "batch_decoder.h"
+#include "commit_manager.h"
+#include "failure_router.h"
+#include "message_filter.h"
+#include "prefetch_tuner.h"
+#include "shutdown.h"
+#include "stats_parser.h"
+#include "timer_wheel.h"
+#include "trace.h"
 
 
 static volatile sig_atomic_t run = 1;
@@ -25,56 +47,234 @@ static void sigterm (int sig) {
 }
 
 
-/**
- * @returns the current wall-clock time in milliseconds
+/*
+ * Event callback : reports errors and feeds statistics to the prefetch tuner ( if enabled ).
+ * Events are served from consume(), i.e. on the thread calling consume_batch().
  */
-static int64_t now ()
+class BatchEventCb : public RdKafka::EventCb
 {
-	struct timeval tv;
-	gettimeofday (&tv, NULL);
-	return ((int64_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-}
+public:
+	PrefetchTuner *tuner = NULL;
+	CommitManager *commit_manager = NULL;
+	FailureRouter *router = NULL;
+
+	void event_cb(RdKafka::Event &event)
+	{
+		switch( event.type() )
+		{
+			case RdKafka::Event::EVENT_ERROR:
+				if( event.fatal() )
+				{
+					std::cerr << "FATAL ";
+					run = 0 ;
+				}
+				std::cerr << "ERROR ("<<RdKafka::err2str(event.err()) << ") : "<< event.str() << std::endl;
+				break;
+			case RdKafka::Event::EVENT_STATS:
+				if( tuner )
+				{
+					ConsumerStats stats;
+					if( parseConsumerStats(event.str(), stats) )
+					{
+						tuner->observeStats(stats);
+					}
+				}
+				// commit latency and failures, per statistics interval
+				if( commit_manager )
+				{
+					std::cerr << "% Commits: " << commit_manager->report() << std::endl;
+				}
+				if( router )
+				{
+					std::cerr << "% Failures: " << router->report() << std::endl;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+};
 
 /*
- * Accumulate a batch of batch_size messages, but wait no longer than batch_timeout milliseconds
+ * Rebalance callback : processed offsets of revoked partitions are committed before they are given up,
+ * so the next owner starts exactly after the last processed message.
+ * The callback is served from consume(), i.e. while a batch is accumulated : messages of revoked partitions
+ * already in that batch are dropped, the next owner consumes them again and their offsets are not committed here.
+ */
+class BatchRebalanceCb : public RdKafka::RebalanceCb
+{
+public:
+	CommitManager *commit_manager = NULL;
+	FailureRouter *router = NULL;
+	std::vector<RdKafka::Message*> *batch = NULL;	// batch in progress, set by consume_batch()
+	int router_flush_ms = 10000;	// how long a revocation waits for routed messages; 0 once shutdown drained
+
+	void rebalance_cb(RdKafka::KafkaConsumer *consumer,
+					  RdKafka::ErrorCode err,
+					  std::vector<RdKafka::TopicPartition*> &partitions)
+	{
+		RdKafka::Error *error = NULL;
+		RdKafka::ErrorCode ret_err = RdKafka::ERR_NO_ERROR;
+		bool cooperative = consumer->rebalance_protocol() == "COOPERATIVE";
+
+		if( err == RdKafka::ERR__ASSIGN_PARTITIONS )
+		{
+			if( cooperative )
+				error = consumer->incremental_assign(partitions);
+			else
+				ret_err = consumer->assign(partitions);
+		}
+		else
+		{
+			// routed messages must be delivered before their offsets are committed
+			bool routed = !router || router->flush(router_flush_ms);
+			if( router )
+			{
+				if( cooperative )
+					router->revoke(partitions);
+				else
+					router->revokeAll();
+			}
+
+			drop_revoked(partitions, cooperative);
+
+			// a lost assignment was already taken over, committing would fail
+			if( routed && !consumer->assignment_lost() )
+			{
+				if( cooperative )
+					commit_manager->revoke(consumer, partitions);
+				else
+					commit_manager->revokeAll(consumer);
+			}
+
+			if( cooperative )
+				error = consumer->incremental_unassign(partitions);
+			else
+				ret_err = consumer->unassign();
+		}
+
+		if( error )
+		{
+			std::cerr << "incremental assign failed: " << error->str() << "\n";
+			delete error;
+		}
+		else if (ret_err)
+		{
+			std::cerr << "assign failed: " << RdKafka::err2str(ret_err) << "\n";
+		}
+	}
+
+private:
+	void drop_revoked(const std::vector<RdKafka::TopicPartition*> &partitions, bool cooperative)
+	{
+		if( !batch )
+		{
+			return;
+		}
+
+		auto revoked = [&](const RdKafka::Message *msg) {
+			if( !cooperative )
+			{
+				return true;
+			}
+			for( const auto *tp : partitions )
+			{
+				if( tp->partition() == msg->partition() && tp->topic() == msg->topic_name() )
+				{
+					return true;
+				}
+			}
+			return false;
+		};
+
+		auto keep = std::stable_partition(batch->begin(), batch->end(), [&](const RdKafka::Message *msg) { return !revoked(msg); });
+		for( auto it = keep ; it != batch->end() ; ++it )
+		{
+			delete *it;
+		}
+		batch->erase(keep, batch->end());
+	}
+};
+
+/*
+ * Accumulate a batch of batch_size messages, but wait no longer than batch_timeout milliseconds.
+ * The deadline is a timer on wheel, armed once per batch : consume() waits until the next timer is due and
+ * the clock is only read ( coarse, no system call ) to advance the wheel.
+ * Messages not matching filter are dropped as they are fetched, and count as processed for commits.
+ * With a router, retried messages that are not due yet are held back and messages that can not be
+ * consumed are dead lettered.
  */
 static std::vector<RdKafka::Message *> consume_batch(RdKafka::KafkaConsumer *consumer,
 													 size_t batch_size,
-													 int batch_timeout)
+													 int batch_timeout,
+													 MessageFilter *filter,
+													 FailureRouter *router,
+													 CommitManager &commit_manager,
+													 BatchRebalanceCb &rebalance_cb,
+													 TimerWheel &wheel)
 {
+	TraceScope<TraceStage::BatchFormed> batch_probe;
 	std::vector<RdKafka::Message*> messages;
 	messages.reserve(batch_size);
+	rebalance_cb.batch = &messages;
 
-	int64_t end = now() + batch_timeout;
-	int remaining_timeout = batch_timeout;
+	bool done = false;
+	wheel.advance();	// timers are scheduled from the last advance
+	TimerWheel::TimerId deadline = wheel.schedule(batch_timeout, [&done]() { done = true; });
 
-	while (messages.size () < batch_size)
+	while( !done && messages.size () < batch_size )
 	{
-		RdKafka::Message *msg = consumer->consume(remaining_timeout);
+		// woken early by other timers on the wheel, the deadline decides when the batch is complete
+		RdKafka::Message *msg;
+		{
+			TraceScope<TraceStage::ConsumeReturn> probe;
+			msg = consumer->consume(wheel.timeout(batch_timeout));
+			probe.value(msg->len());
+		}
 
 		switch( msg->err() )
 		{
 			case RdKafka::ERR__TIMED_OUT:
 				delete msg;
-				return messages;		// return batched messages
+				break;
 			case RdKafka::ERR_NO_ERROR:
+				if( router && router->hold(consumer, *msg) )
+				{
+					delete msg;
+					break;
+				}
+				if( filter && !filter->matches(*msg) )
+				{
+					commit_manager.processed(*msg);
+					delete msg;
+					break;
+				}
 				messages.push_back(msg);
 				break;
 			default:
+				if( router && FailureRouter::isMessageError(*msg) )
+				{
+					std::cerr << "% Dead lettering " << msg->topic_name() << " [" << msg->partition() << "] at offset "
+							<< msg->offset() << ": " << msg->errstr() << std::endl;
+					router->route(*msg, msg->errstr(), false);
+					FailureRouter::skip(consumer, *msg);
+					commit_manager.processed(*msg);
+					delete msg;
+					break;
+				}
 				std::cerr<<"%% Consumer error : "<< msg->errstr() << std::endl;
 				run = 0 ;
+				done = true;
 				delete msg;
-				return messages;	// return batched messages
+				break;
 		}
 
-		// timeout still remaining, keep on batching message on vector messages, Else, break
-		remaining_timeout = end-now();
-		if( remaining_timeout < 0 )
-		{
-			break;
-		}
+		wheel.advance();
 	}
 
+	wheel.cancel(deadline);
+	rebalance_cb.batch = NULL;
+	batch_probe.value(messages.size());
 	return messages;
 }
 
@@ -84,6 +284,18 @@ int main(int argc, char **argv) {
 	 std::vector<std::string> topics;
 	 int batch_size = 100;				// default batch size
 	 int batch_tmout = 1000;			// default timeout
+	 std::string tune_goal;				// prefetch autotuning goal : latency or throughput, off if empty
+	 int64_t target_latency_ms = 100;	// latency goal of the autotuner
+	 int64_t memory_budget_mb = 256;	// prefetch memory the autotuner may use
+	 CommitManager::Policy commit_policy;	// commit after this many processed messages or this interval
+	 std::string decode_format;			// decode payloads into columns : json, avro or protobuf, off if empty
+	 std::string decode_fields;			// json : name:type,..
+	 std::string schema_dir;			// avro, protobuf : directory of <id>.avsc / <id>.proto
+	 MessageFilter *filter = NULL;		// messages not matching are dropped on fetch, NULL if disabled
+	 FailureRouter::Policy failure_policy;	// retry tiers and attempts of messages that fail to decode
+	 bool route_failures = false;
+	 int shutdown_ms = 10000;			// shut down within this long, from leaving the batch loop
+	 std::string brokers;
 
 	 // Create configuration object
 	 RdKafka::Conf *conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);
@@ -94,9 +306,16 @@ int main(int argc, char **argv) {
 		 exit(1);
 	 }
 
+	 // offsets are committed explicitly once the batch is processed, see CommitManager
+	 if( conf->set("enable.auto.commit", "false", errstr) != RdKafka::Conf::CONF_OK )
+	 {
+		 std::cerr << errstr << std::endl;
+		 exit(1);
+	 }
+
 	 // Read command line arguments
 	 int opt;
-	while ((opt = getopt (argc, argv, "g:B:T:b:X:")) != -1)
+	while ((opt = getopt (argc, argv, "g:B:T:b:X:A:L:m:c:i:D:F:R:f:r:N:t:")) != -1)
 	{
 		switch (opt)
 			{
@@ -117,7 +336,79 @@ int main(int argc, char **argv) {
 				batch_tmout = atoi (optarg);
 				break;
 
+			case 'A':
+				tune_goal = optarg;
+				if( tune_goal != "latency" && tune_goal != "throughput" )
+				{
+					goto usage;
+				}
+				break;
+
+			case 'L':
+				target_latency_ms = atoi (optarg);
+				break;
+
+			case 'm':
+				memory_budget_mb = atoi (optarg);
+				break;
+
+			case 'c':
+				commit_policy.maxMessages = atoi (optarg);
+				break;
+
+			case 'i':
+				commit_policy.intervalMs = atoi (optarg);
+				break;
+
+			case 'D':
+				decode_format = optarg;
+				break;
+
+			case 'F':
+				decode_fields = optarg;
+				break;
+
+			case 'R':
+				schema_dir = optarg;
+				break;
+
+			case 'r':
+				failure_policy.delaysMs.clear();
+				for( const char *p = optarg ; p && *p ; )
+				{
+					failure_policy.delaysMs.push_back(atoll(p));
+					if( (p = strchr(p, ',')) )
+					{
+						p++;
+					}
+				}
+				failure_policy.maxAttempts = (int) failure_policy.delaysMs.size() + 1;
+				route_failures = true;
+				break;
+
+			case 'N':
+				failure_policy.maxAttempts = atoi (optarg);
+				route_failures = true;
+				break;
+
+			case 't':
+				shutdown_ms = atoi (optarg);
+				break;
+
+			case 'f':
+				try
+				{
+					filter = new MessageFilter(optarg);
+				}
+				catch( const std::invalid_argument &e )
+				{
+					std::cerr << e.what() << std::endl;
+					exit (1);
+				}
+				break;
+
 			case 'b':
+				brokers = optarg;
 				if ( conf->set ("bootstrap.servers", optarg, errstr)
 						!= RdKafka::Conf::CONF_OK )
 				{
@@ -175,6 +466,20 @@ usage:
 	            "  -T <batch-tmout> How long to wait for batch-size to accumulate in milliseconds. (default 1000 ms)\n"
 	            "  -b <brokers>    Broker address (localhost:9092)\n"
 	            "  -X <prop=name>  Set arbitrary librdkafka configuration property\n"
+	            "  -A <goal>       Autotune prefetch for latency or throughput\n"
+	            "  -L <ms>         Autotune latency target (default 100 ms)\n"
+	            "  -m <MB>         Autotune prefetch memory budget (default 256 MB)\n"
+	            "  -c <messages>   Commit after this many processed messages (default 1000)\n"
+	            "  -i <ms>         Commit at least this often (default 1000 ms)\n"
+	            "  -D <format>     Decode payloads into columns: json, avro or protobuf\n"
+	            "  -F <fields>     JSON fields to decode: name:type,.. with type int, double, bool or string\n"
+	            "  -R <dir>        Avro / Protobuf schemas: <dir>/<schema-id>.avsc or .proto\n"
+	            "  -f <expr>       Drop messages not matching expr on fetch, e.g.\n"
+	            "                  key ^= \"eu-\" && header.type == \"order\" && ts >= <ms>\n"
+	            "  -r <ms,ms..>    Route messages that fail to decode or can not be consumed to\n"
+	            "                  <topic>-retry-<ms> tiers and consume those too\n"
+	            "  -N <attempts>   Dead letter to <topic>-dlq after this many attempts (default: tiers + 1)\n"
+	            "  -t <ms>         Time to shut down in (default 10000 ms)\n"
 	            "\n",
 	            argv[0],
 	            RdKafka::version_str().c_str(), RdKafka::version());
@@ -184,6 +489,89 @@ usage:
 	signal (SIGINT, sigterm);
 	signal (SIGTERM, sigterm);
 
+	/*
+	 * Deserialization : each batch is decoded into one ColumnarBatch, reused across batches
+	 */
+	std::unique_ptr<BatchDecoder> decoder;
+	ColumnarBatch columns;
+	if( !decode_format.empty() )
+	{
+		try
+		{
+			decoder = BatchDecoder::create(decode_format, decode_fields, schema_dir);
+		}
+		catch( const std::invalid_argument &e )
+		{
+			std::cerr << "% Decoder: " << e.what() << std::endl;
+			exit (1);
+		}
+	}
+
+	/*
+	 * Prefetch autotuning : the tuner needs statistics, and starts from whatever -X set
+	 */
+	BatchEventCb ex_event_cb;
+	PrefetchTuner *tuner = NULL;
+	if( !tune_goal.empty() )
+	{
+		std::string interval;
+		if( conf->get("statistics.interval.ms", interval) != RdKafka::Conf::CONF_OK || interval == "0" )
+		{
+			conf->set("statistics.interval.ms", "1000", errstr);
+		}
+
+		PrefetchConfig initial;
+		initial.load(conf);
+		tuner = new PrefetchTuner(tune_goal == "latency" ? PrefetchTuner::Goal::Latency : PrefetchTuner::Goal::Throughput,
+								  target_latency_ms, memory_budget_mb * 1024, initial);
+		if( !tuner->current().apply(conf, errstr) )
+		{
+			std::cerr << errstr << std::endl;
+			exit (1);
+		}
+		ex_event_cb.tuner = tuner;
+	}
+	conf->set("event_cb", &ex_event_cb, errstr);
+
+	/*
+	 * Commit manager : coalesced asynchronous commits of processed offsets
+	 */
+	CommitManager commit_manager(commit_policy);
+	BatchRebalanceCb ex_rebalance_cb;
+	ex_event_cb.commit_manager = &commit_manager;
+	ex_rebalance_cb.commit_manager = &commit_manager;
+	conf->set("offset_commit_cb", &commit_manager, errstr);
+	conf->set("rebalance_cb", &ex_rebalance_cb, errstr);
+
+	/*
+	 * Failure router : its own producer, on the consumer's brokers
+	 */
+	FailureRouter *router = NULL;
+	if( route_failures )
+	{
+		RdKafka::Conf *router_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);
+		router_conf->set("bootstrap.servers", brokers, errstr);
+		try
+		{
+			router = new FailureRouter(failure_policy, router_conf);
+		}
+		catch( const std::runtime_error &e )
+		{
+			std::cerr << e.what() << std::endl;
+			exit (1);
+		}
+		delete router_conf;
+
+		size_t topic_count = topics.size();
+		for( size_t i = 0 ; i < topic_count ; i++ )
+		{
+			std::vector<std::string> retry = router->retryTopics(topics[i]);
+			topics.insert(topics.end(), retry.begin(), retry.end());
+		}
+		ex_event_cb.router = router;
+		ex_rebalance_cb.router = router;
+	}
+
 	/* Create consumer */
 	RdKafka::KafkaConsumer *consumer = RdKafka::KafkaConsumer::create (conf,
 																		errstr);
@@ -193,8 +581,6 @@ usage:
 		exit (1);
 	}
 
-	delete conf;
-
 	/* Subscribe to topics */
 	RdKafka::ErrorCode err = consumer->subscribe (topics);
 	if ( err )
@@ -204,25 +590,153 @@ usage:
 	}
 
 	/* Consume messages in batches of batch size */
+	TimerWheel wheel;
 	while( run )
 	{
 		// Get Batch of message once ready or timeout happened
-		auto messages = consume_batch(consumer, batch_size, batch_tmout);
+		int64_t batch_start = CoarseClock::nowMs();
+		auto messages = consume_batch(consumer, batch_size, batch_tmout, filter, router, commit_manager, ex_rebalance_cb, wheel);
+		int64_t batch_end = CoarseClock::nowMs();
+
+		if( decoder )
+		{
+			auto decode_start = std::chrono::steady_clock::now();
+			decoder->decode(messages, columns);
+			auto decode_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - decode_start).count();
 
-		std::cout << "Accumulated " << messages.size () << " messages:" << std::endl;
+			std::cout << "Decoded " << columns.rows << " messages into " << columns.columns.size () << " columns, "
+					<< columns.errors << " malformed, in " << decode_us << " us" << std::endl;
 
+			// malformed payloads are retried, then dead lettered, instead of being lost
+			for( size_t i = 0 ; router && i < columns.failed.size() ; i++ )
+			{
+				router->route(*messages[columns.failed[i]], "payload could not be decoded as " + decode_format);
+			}
+		}
+		else
+		{
+			std::cout << "Accumulated " << messages.size () << " messages:" << std::endl;
+		}
+
+		size_t batch_bytes = 0;
 		for ( auto &msg : messages )
 		{
-			std::cout << " Message in " << msg->topic_name ()
-					<< " [" << msg->partition () << "] at offset " << msg->offset ()
-					<< std::endl;
+			if( !decoder )
+			{
+				std::cout << " Message in " << msg->topic_name ()
+						<< " [" << msg->partition () << "] at offset " << msg->offset ()
+						<< std::endl;
+			}
+			batch_bytes += msg->len();
+			commit_manager.processed(*msg);
 			delete msg;
 		}
+
+		if( router && !router->poll(consumer) )
+		{
+			std::cerr << "% Failed messages could not be routed, stopping" << std::endl;
+			run = 0;
+		}
+
+		// nothing is committed ahead of a routed message that is not delivered yet
+		if( !router || router->canCommit() )
+		{
+			commit_manager.maybeCommit(consumer);
+		}
+
+		if( !tuner )
+		{
+			continue;
+		}
+
+		/*
+		 * Prefetch settings can only change on a new consumer : close ( commits stored offsets and leaves
+		 * the group ) and re-create it with the tuned configuration, rejoining with the same group id.
+		 */
+		tuner->observeBatch(messages.size(), batch_size, batch_bytes, batch_end - batch_start);
+
+		PrefetchConfig next;
+		if( run && tuner->retune(batch_end, next) )
+		{
+			std::cerr << "% Retuning prefetch: " << next.str() << std::endl;
+
+			if( !router || router->flush(10000) )
+			{
+				commit_manager.commitSync(consumer);
+			}
+			consumer->close ();
+			delete consumer;
+
+			if( !next.apply(conf, errstr) ||
+				!(consumer = RdKafka::KafkaConsumer::create (conf, errstr)) )
+			{
+				std::cerr << "Failed to re-create consumer: " << errstr << std::endl;
+				exit (1);
+			}
+
+			if ( (err = consumer->subscribe (topics)) )
+			{
+				std::cerr << "Failed to subscribe to " << topics.size () << " topics: " << RdKafka::err2str (err) << std::endl;
+				exit (1);
+			}
+		}
 	}
 
-	/* Close and destroy consumer */
-	consumer->close ();
+	/*
+	 * Shut down within -t ms altogether, every phase ending as soon as its work is done :
+	 * 1) drain : routed messages are delivered, nothing may be committed ahead of them.
+	 * 2) commit : the final processed offsets, synchronously.
+	 * 3) close : leave the group; the revocation commits once more from the rebalance callback, without waiting for
+	 * routed messages again.
+	 */
+	ShutdownCoordinator shutdown(shutdown_ms);
+	if( router )
+	{
+		shutdown.phase("drain", 0, [&](int slice_ms)
+		{
+			router->flush(slice_ms);
+			return router->drained();
+		}, [&]() { return router->report(); });
+	}
+	shutdown.phase("commit", 0, [&](int)
+	{
+		if( !router || router->canCommit() )
+		{
+			RdKafka::ErrorCode err = commit_manager.commitSync(consumer);
+			if( err )
+			{
+				std::cerr << "% Final commit failed: " << RdKafka::err2str(err) << std::endl;
+			}
+		}
+		return true;
+	});
+	shutdown.phase("close", 0, [&](int)
+	{
+		ex_rebalance_cb.router_flush_ms = 0;
+		consumer->close ();
+		return true;
+	});
+	shutdown.run();
+	std::cerr << "% Shutdown: " << shutdown.report() << std::endl;
+
+	std::cerr << "% Commits: " << commit_manager.report() << std::endl;
+	if( Trace::enabled() )
+	{
+		std::cerr << "% Trace: " << Trace::report() << std::endl;
+	}
+	if( filter )
+	{
+		std::cerr << "% Filter " << filter->str() << ": " << filter->report() << std::endl;
+	}
 	delete consumer;
+	delete conf;
+	delete tuner;
+	delete filter;
+	if( router )
+	{
+		std::cerr << "% Failures: " << router->report() << std::endl;
+		delete router;
+	}
 
 	return 0;
 }
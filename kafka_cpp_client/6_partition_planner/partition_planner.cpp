@@ -0,0 +1,618 @@
+/*
+ * partition_planner.cpp
+ *
+ * Reads full cluster metadata, reports per-broker replica/leader skew and writes
+ *  1) a minimal-movement reassignment plan     ( kafka-reassign-partitions.sh --execute --reassignment-json-file )
+ *  2) a preferred-leader-election plan         ( kafka-leader-election.sh --election-type preferred --path-to-json-file )
+ *
+ * Plans are rack-unaware: broker metadata carries no rack, so a replica may be moved onto a broker in the same rack
+ * as another replica of its partition. Check plans for clusters relying on broker.rack before executing them.
+ *
+ * Run:
+ *  ./partition_planner -b localhost:9092 -o plan -t 50000000
+ *  ./partition_planner -S 12:100000:3          ( plan a synthetic 12 broker / 100k partition cluster, no broker needed )
+ */
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Flat cluster model.
+ * Broker ids are mapped to dense indices so per-broker counters are plain arrays, and replica lists of all
+ * partitions live in one pool so a 100k partition cluster is a handful of allocations.
+ */
+struct PartitionInfo
+{
+    uint32_t topicIdx;
+    int32_t partition;
+    int32_t leader;             // dense broker index of current leader, -1 if none
+    uint32_t replicaOffset;     // first replica in ClusterModel::replicaPool
+    uint32_t isrOffset;         // first isr in ClusterModel::isrPool
+    uint16_t replicaCount;
+    uint16_t isrCount;
+    bool moved;                 // replica set changed by the plan
+    bool reordered;             // only the replica order ( preferred leader ) changed
+};
+
+struct ClusterModel
+{
+    std::vector<int32_t> brokerIds;                 // dense index -> broker id
+    std::unordered_map<int32_t, int32_t> brokerIdx; // broker id -> dense index
+    std::vector<std::string> topics;
+    std::vector<PartitionInfo> partitions;
+    std::vector<int32_t> replicaPool;
+    std::vector<int32_t> isrPool;
+
+    int32_t addBroker(int32_t brokerId)
+    {
+        auto it = brokerIdx.find(brokerId);
+        if (it != brokerIdx.end())
+        {
+            return it->second;
+        }
+        const auto idx = static_cast<int32_t>(brokerIds.size());
+        brokerIds.push_back(brokerId);
+        brokerIdx.emplace(brokerId, idx);
+        return idx;
+    }
+
+    int32_t *replicas(const PartitionInfo &p) { return &replicaPool[p.replicaOffset]; }
+    const int32_t *replicas(const PartitionInfo &p) const { return &replicaPool[p.replicaOffset]; }
+
+    bool inIsr(const PartitionInfo &p, int32_t broker) const
+    {
+        if (!p.isrCount)
+        {
+            return false;
+        }
+        const auto *isr = &isrPool[p.isrOffset];
+        return std::find(isr, isr + p.isrCount, broker) != isr + p.isrCount;
+    }
+
+    bool hasReplica(const PartitionInfo &p, int32_t broker) const
+    {
+        if (!p.replicaCount)
+        {
+            return false;
+        }
+        const auto *r = replicas(p);
+        return std::find(r, r + p.replicaCount, broker) != r + p.replicaCount;
+    }
+};
+
+/*
+ * Per-broker load and the imbalance cost of the current state.
+ * cost = sum over brokers of (count - mean)^2, updated in O(1) per candidate move so a plan over
+ * 100k partitions is evaluated without ever rescanning the cluster.
+ */
+struct LoadVector
+{
+    std::vector<int64_t> count;
+    double mean{0};
+
+    void reset(size_t brokers) { count.assign(brokers, 0); }
+
+    double moveDelta(int32_t from, int32_t to) const
+    {
+        // (a-1-m)^2 + (b+1-m)^2 - (a-m)^2 - (b-m)^2
+        return 2.0 * (static_cast<double>(count[to]) - static_cast<double>(count[from]) + 1.0);
+    }
+
+    double cost() const
+    {
+        double c = 0;
+        for (auto v : count)
+        {
+            c += (v - mean) * (v - mean);
+        }
+        return c;
+    }
+
+    int32_t argmax() const { return static_cast<int32_t>(std::max_element(count.begin(), count.end()) - count.begin()); }
+    int32_t argmin() const { return static_cast<int32_t>(std::min_element(count.begin(), count.end()) - count.begin()); }
+};
+
+struct SkewReport
+{
+    int64_t min;
+    int64_t max;
+    double mean;
+    double stddev;
+};
+
+static SkewReport skew(const LoadVector &load)
+{
+    SkewReport r{};
+    if (load.count.empty())
+    {
+        return r;
+    }
+    r.min = *std::min_element(load.count.begin(), load.count.end());
+    r.max = *std::max_element(load.count.begin(), load.count.end());
+    r.mean = load.mean;
+    r.stddev = std::sqrt(load.cost() / load.count.size());
+    return r;
+}
+
+static void printSkew(const char *what, const SkewReport &r)
+{
+    std::cerr << "  " << what << ": min " << r.min << " max " << r.max << " mean " << r.mean << " stddev " << r.stddev;
+    if (r.mean > 0)
+    {
+        std::cerr << " ( max/mean " << r.max / r.mean << " )";
+    }
+    std::cerr << std::endl;
+}
+
+// Fill the model from broker metadata
+static void loadMetadata(ClusterModel &model, const std::string &brokers, const uint32_t timeoutMs)
+{
+    std::string errstr;
+    std::unique_ptr<RdKafka::Conf> conf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+    if (conf->set("bootstrap.servers", brokers, errstr) != RdKafka::Conf::CONF_OK)
+    {
+        throw std::runtime_error{errstr};
+    }
+
+    std::unique_ptr<RdKafka::Producer> handle{RdKafka::Producer::create(conf.get(), errstr)};
+    if (!handle)
+    {
+        throw std::runtime_error{errstr};
+    }
+
+    RdKafka::Metadata *pMetadata{nullptr};
+    auto err = handle->metadata(true, nullptr, &pMetadata, timeoutMs);
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        throw std::runtime_error{"metadata request failed: " + RdKafka::err2str(err)};
+    }
+    std::unique_ptr<RdKafka::Metadata> metadata{pMetadata};
+
+    for (const auto *broker : *metadata->brokers())
+    {
+        model.addBroker(broker->id());
+    }
+
+    for (const auto *topic : *metadata->topics())
+    {
+        // internal topics are managed by the cluster itself
+        if (topic->err() != RdKafka::ERR_NO_ERROR || topic->topic().rfind("__", 0) == 0)
+        {
+            continue;
+        }
+
+        const auto topicIdx = static_cast<uint32_t>(model.topics.size());
+        model.topics.push_back(topic->topic());
+
+        for (const auto *partition : *topic->partitions())
+        {
+            PartitionInfo p{};
+            p.topicIdx = topicIdx;
+            p.partition = partition->id();
+            p.leader = partition->leader() >= 0 ? model.addBroker(partition->leader()) : -1;
+            p.replicaOffset = static_cast<uint32_t>(model.replicaPool.size());
+            p.isrOffset = static_cast<uint32_t>(model.isrPool.size());
+            for (auto id : *partition->replicas())
+            {
+                model.replicaPool.push_back(model.addBroker(id));
+            }
+            for (auto id : *partition->isrs())
+            {
+                model.isrPool.push_back(model.addBroker(id));
+            }
+            p.replicaCount = static_cast<uint16_t>(partition->replicas()->size());
+            p.isrCount = static_cast<uint16_t>(partition->isrs()->size());
+            model.partitions.push_back(p);
+        }
+    }
+}
+
+/*
+ * Synthetic cluster "brokers:partitions:rf" for evaluating the planner at scale.
+ * Replicas are placed with a skew towards low broker ids, as happens after adding brokers to a cluster.
+ */
+static void loadSynthetic(ClusterModel &model, const std::string &spec)
+{
+    unsigned brokers = 0, partitions = 0, rf = 0;
+    if (sscanf(spec.c_str(), "%u:%u:%u", &brokers, &partitions, &rf) != 3 || !brokers || !rf || rf > brokers)
+    {
+        throw std::runtime_error{"expected -S <brokers>:<partitions>:<replication factor>, not " + spec};
+    }
+
+    for (unsigned b = 0; b < brokers; b++)
+    {
+        model.addBroker(static_cast<int32_t>(b + 1));
+    }
+
+    std::mt19937 rng{42};
+    std::geometric_distribution<unsigned> pick{std::min(1.0, 3.0 / brokers)};
+    const unsigned partitionsPerTopic = 50;
+
+    for (unsigned i = 0; i < partitions; i++)
+    {
+        if (i % partitionsPerTopic == 0)
+        {
+            model.topics.push_back("synthetic_" + std::to_string(i / partitionsPerTopic));
+        }
+
+        PartitionInfo p{};
+        p.topicIdx = static_cast<uint32_t>(model.topics.size() - 1);
+        p.partition = static_cast<int32_t>(i % partitionsPerTopic);
+        p.replicaOffset = static_cast<uint32_t>(model.replicaPool.size());
+        p.isrOffset = static_cast<uint32_t>(model.isrPool.size());
+        p.replicaCount = static_cast<uint16_t>(rf);
+        p.isrCount = static_cast<uint16_t>(rf);
+
+        const auto first = pick(rng) % brokers;
+        for (unsigned r = 0; r < rf; r++)
+        {
+            const auto b = static_cast<int32_t>((first + r) % brokers);
+            model.replicaPool.push_back(b);
+            model.isrPool.push_back(b);
+        }
+        // a quarter of partitions have failed over away from their preferred leader
+        p.leader = (i % 4 == 0) ? model.replicaPool[p.replicaOffset + rf - 1] : model.replicaPool[p.replicaOffset];
+        model.partitions.push_back(p);
+    }
+}
+
+struct Planner
+{
+    ClusterModel &model;
+    LoadVector replicaLoad;     // replicas hosted per broker
+    LoadVector leaderLoad;      // preferred leaders ( replicas[0] ) per broker
+    LoadVector currentLeaders;  // actual leaders per broker
+    std::vector<std::vector<uint32_t>> followers;   // partition indices following on each broker
+    std::vector<std::vector<uint32_t>> leading;     // partition indices preferring each broker as leader
+    size_t replicaMoves{0};
+    size_t leaderSwaps{0};
+
+    explicit Planner(ClusterModel &m) : model{m}
+    {
+        const auto brokers = model.brokerIds.size();
+        replicaLoad.reset(brokers);
+        leaderLoad.reset(brokers);
+        currentLeaders.reset(brokers);
+        followers.assign(brokers, {});
+        leading.assign(brokers, {});
+
+        size_t totalReplicas = 0;
+        for (uint32_t i = 0; i < model.partitions.size(); i++)
+        {
+            const auto &p = model.partitions[i];
+            // offline partitions: no replicas, nothing in the pool to point at
+            if (!p.replicaCount)
+            {
+                continue;
+            }
+            const auto *r = model.replicas(p);
+            for (uint16_t j = 0; j < p.replicaCount; j++)
+            {
+                replicaLoad.count[r[j]]++;
+                (j ? followers : leading)[r[j]].push_back(i);
+            }
+            totalReplicas += p.replicaCount;
+            if (p.replicaCount)
+            {
+                leaderLoad.count[r[0]]++;
+            }
+            if (p.leader >= 0)
+            {
+                currentLeaders.count[p.leader]++;
+            }
+        }
+
+        if (brokers)
+        {
+            replicaLoad.mean = static_cast<double>(totalReplicas) / brokers;
+            leaderLoad.mean = static_cast<double>(model.partitions.size()) / brokers;
+            currentLeaders.mean = leaderLoad.mean;
+        }
+    }
+
+    /*
+     * Move replicas off the most loaded broker onto the least loaded one until every broker is within
+     * one replica of the mean. Every move strictly reduces the cost, so the number of moves is the
+     * minimum needed to reach that band. Followers are moved before preferred leaders to avoid leader churn.
+     * When every partition on the most loaded broker already has a replica on the least loaded one, the next
+     * pair that still reduces the cost is tried, most loaded sources and least loaded destinations first.
+     */
+    void balanceReplicas(size_t maxMoves)
+    {
+        std::vector<int32_t> order(replicaLoad.count.size());
+        while (replicaMoves < maxMoves && moveBest(order))
+        {
+            replicaMoves++;
+        }
+    }
+
+    bool moveBest(std::vector<int32_t> &order)
+    {
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = static_cast<int32_t>(i);
+        }
+        std::sort(order.begin(), order.end(),
+                  [this](int32_t a, int32_t b) { return replicaLoad.count[a] > replicaLoad.count[b]; });
+
+        for (size_t s = 0; s < order.size(); s++)
+        {
+            const auto src = order[s];
+            for (size_t d = order.size(); d-- > s + 1;)
+            {
+                const auto dst = order[d];
+                // destinations only get more loaded from here on
+                if (replicaLoad.moveDelta(src, dst) >= 0)
+                {
+                    break;
+                }
+                if (moveOne(followers, src, dst) || moveOne(leading, src, dst))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool moveOne(std::vector<std::vector<uint32_t>> &lists, int32_t src, int32_t dst)
+    {
+        auto &list = lists[src];
+        for (size_t i = list.size(); i-- > 0;)
+        {
+            auto &p = model.partitions[list[i]];
+            if (model.hasReplica(p, dst))
+            {
+                continue;
+            }
+
+            auto *r = model.replicas(p);
+            const auto pos = std::find(r, r + p.replicaCount, src) - r;
+            r[pos] = dst;
+            p.moved = true;
+            if (pos == 0)
+            {
+                leaderLoad.count[src]--;
+                leaderLoad.count[dst]++;
+            }
+            replicaLoad.count[src]--;
+            replicaLoad.count[dst]++;
+            lists[dst].push_back(list[i]);
+            list[i] = list.back();
+            list.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    /*
+     * Rebalance preferred leaders by reordering replica lists ( no data movement ).
+     * For each over-loaded broker pick partitions it leads and hand the lead to the least loaded in-sync replica.
+     */
+    void balanceLeaders()
+    {
+        const auto target = static_cast<int64_t>(std::ceil(leaderLoad.mean));
+
+        for (uint32_t i = 0; i < model.partitions.size(); i++)
+        {
+            auto &p = model.partitions[i];
+            if (p.replicaCount < 2)
+            {
+                continue;
+            }
+
+            auto *r = model.replicas(p);
+            const auto cur = r[0];
+            if (leaderLoad.count[cur] <= target)
+            {
+                continue;
+            }
+
+            int32_t best = -1;
+            double bestDelta = 0;
+            for (uint16_t j = 1; j < p.replicaCount; j++)
+            {
+                // a replica that is not yet in sync cannot be elected; newly placed replicas will be
+                const auto canLead = p.moved || model.inIsr(p, r[j]);
+                const auto delta = leaderLoad.moveDelta(cur, r[j]);
+                if (canLead && delta < bestDelta)
+                {
+                    best = j;
+                    bestDelta = delta;
+                }
+            }
+
+            if (best > 0)
+            {
+                std::swap(r[0], r[best]);
+                leaderLoad.count[cur]--;
+                leaderLoad.count[r[0]]++;
+                if (!p.moved)
+                {
+                    p.reordered = true;
+                }
+                leaderSwaps++;
+            }
+        }
+    }
+};
+
+static void writeReassignment(const ClusterModel &model, const std::string &path)
+{
+    std::ofstream out{path};
+    if (!out)
+    {
+        throw std::runtime_error{"unable to open " + path};
+    }
+
+    out << "{\"version\":1,\"partitions\":[";
+    bool first = true;
+    for (const auto &p : model.partitions)
+    {
+        if ((!p.moved && !p.reordered) || !p.replicaCount)
+        {
+            continue;
+        }
+        out << (first ? "" : ",") << "\n{\"topic\":\"" << model.topics[p.topicIdx] << "\",\"partition\":" << p.partition
+            << ",\"replicas\":[";
+        const auto *r = model.replicas(p);
+        for (uint16_t j = 0; j < p.replicaCount; j++)
+        {
+            out << (j ? "," : "") << model.brokerIds[r[j]];
+        }
+        out << "]}";
+        first = false;
+    }
+    out << "\n]}\n";
+}
+
+// partitions whose current leader is not the ( new ) preferred replica
+static size_t writeElection(const ClusterModel &model, const std::string &path)
+{
+    std::ofstream out{path};
+    if (!out)
+    {
+        throw std::runtime_error{"unable to open " + path};
+    }
+
+    size_t count = 0;
+    out << "{\"partitions\":[";
+    for (const auto &p : model.partitions)
+    {
+        if (!p.replicaCount || p.leader == model.replicas(p)[0])
+        {
+            continue;
+        }
+        // a moved replica must catch up before it can be elected; the election is re-run after the reassignment
+        if (!p.moved && !model.inIsr(p, model.replicas(p)[0]))
+        {
+            continue;
+        }
+        out << (count ? "," : "") << "\n{\"topic\":\"" << model.topics[p.topicIdx] << "\",\"partition\":" << p.partition << "}";
+        count++;
+    }
+    out << "\n]}\n";
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092";
+    std::string synthetic;
+    std::string outPrefix = "plan";
+    uint64_t throttle = 50 * 1000 * 1000;   // bytes/sec per broker while moving replicas
+    size_t maxMoves = SIZE_MAX;
+    uint32_t timeoutMs = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:S:o:t:m:T:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'S':
+            synthetic = optarg;
+            break;
+        case 'o':
+            outPrefix = optarg;
+            break;
+        case 't':
+            throttle = strtoull(optarg, nullptr, 10);
+            break;
+        case 'm':
+            maxMoves = strtoull(optarg, nullptr, 10);
+            break;
+        case 'T':
+            timeoutMs = static_cast<uint32_t>(atoi(optarg));
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [options]\n"
+                    "\n"
+                    " Options:\n"
+                    "  -b <brokers>      Broker address (localhost:9092)\n"
+                    "  -S <b:p:rf>       Plan a synthetic cluster instead of reading metadata\n"
+                    "  -o <prefix>       Output file prefix (plan)\n"
+                    "  -t <bytes/sec>    Replication throttle while reassigning (50000000)\n"
+                    "  -m <moves>        Maximum number of replica moves\n"
+                    "  -T <timeout ms>   Metadata request timeout (10000)\n"
+                    "\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+
+    try
+    {
+        ClusterModel model;
+        if (synthetic.empty())
+        {
+            loadMetadata(model, brokers, timeoutMs);
+        }
+        else
+        {
+            loadSynthetic(model, synthetic);
+        }
+
+        std::cerr << "% " << model.brokerIds.size() << " brokers, " << model.topics.size() << " topics, "
+                  << model.partitions.size() << " partitions" << std::endl;
+
+        const auto start = std::chrono::steady_clock::now();
+        Planner planner{model};
+
+        std::cerr << "% Before:" << std::endl;
+        printSkew("replicas       ", skew(planner.replicaLoad));
+        printSkew("leaders        ", skew(planner.currentLeaders));
+        printSkew("preferred lead.", skew(planner.leaderLoad));
+
+        planner.balanceReplicas(maxMoves);
+        planner.balanceLeaders();
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        std::cerr << "% After:" << std::endl;
+        printSkew("replicas       ", skew(planner.replicaLoad));
+        printSkew("leaders        ", skew(planner.leaderLoad));
+        std::cerr << "% Planned " << planner.replicaMoves << " replica move(s) and " << planner.leaderSwaps
+                  << " preferred leader change(s) in " << elapsed.count() / 1000.0 << " ms" << std::endl;
+
+        const auto reassignFile = outPrefix + "-reassignment.json";
+        const auto electionFile = outPrefix + "-election.json";
+        writeReassignment(model, reassignFile);
+        const auto elections = writeElection(model, electionFile);
+
+        // kafka-reassign-partitions.sh sets and, with --verify, removes the per topic throttled replica lists itself
+        std::cout << "# 1. move replicas ( throttled to " << throttle << " bytes/sec per broker )\n"
+                  << "kafka-reassign-partitions.sh --bootstrap-server " << brokers << " --execute --reassignment-json-file "
+                  << reassignFile << " --throttle " << throttle << "\n"
+                  << "# 2. wait for completion, this also clears the throttle\n"
+                  << "kafka-reassign-partitions.sh --bootstrap-server " << brokers << " --verify --reassignment-json-file "
+                  << reassignFile << "\n"
+                  << "# 3. move leadership to the preferred replicas ( " << elections << " partition(s) )\n"
+                  << "kafka-leader-election.sh --bootstrap-server " << brokers << " --election-type preferred --path-to-json-file "
+                  << electionFile << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Planning failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
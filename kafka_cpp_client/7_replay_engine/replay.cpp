@@ -0,0 +1,517 @@
+/*
+ * replay.cpp
+ *
+ * Replays every partition of the given topics between two points in time.
+ *  1) Start and end offsets of all partitions are resolved with offsetsForTimes() in two requests.
+ *  2) Partitions are spread over worker threads, each with its own consumer assigned at the start offsets.
+ *  3) Prefetch of all workers together is bounded by a memory budget.
+ *  4) Each partition stops exactly at its end offset ( the first offset with a timestamp >= end time ).
+ *
+ * Run:
+ *  ./replay -b localhost:9092 -s 2021-05-13T10:00:00 -e 2021-05-13T11:00:00 -w 8 prateek > backfill.txt
+ *  ./replay -b localhost:9092 -s 1620900000000 -e now -v prateek
+ */
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+struct PartitionRange
+{
+    std::string topic;
+    int32_t partition;
+    int64_t start;  // first offset to replay
+    int64_t end;    // first offset NOT to replay
+};
+
+/*
+ * Parse "now", milliseconds since epoch or an ISO-8601 UTC time "YYYY-MM-DDTHH:MM:SS"
+ * @returns milliseconds since epoch
+ */
+static int64_t parseTime(const std::string &str)
+{
+    if (str == "now")
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    if (str.find_first_not_of("0123456789") == std::string::npos)
+    {
+        return strtoll(str.c_str(), nullptr, 10);
+    }
+
+    struct tm tm{};
+    if (!strptime(str.c_str(), "%Y-%m-%dT%H:%M:%S", &tm))
+    {
+        throw std::runtime_error{"unable to parse time " + str};
+    }
+    return static_cast<int64_t>(timegm(&tm)) * 1000;
+}
+
+static std::unique_ptr<RdKafka::Conf> createConf(const std::string &brokers,
+                                                 const std::vector<std::pair<std::string, std::string>> &props)
+{
+    std::string errstr;
+    std::unique_ptr<RdKafka::Conf> conf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+
+    // a replay never joins a group or moves committed offsets, but the high-level consumer requires a group id
+    if (conf->set("bootstrap.servers", brokers, errstr) != RdKafka::Conf::CONF_OK ||
+        conf->set("group.id", "replay", errstr) != RdKafka::Conf::CONF_OK ||
+        conf->set("enable.auto.commit", "false", errstr) != RdKafka::Conf::CONF_OK ||
+        conf->set("enable.auto.offset.store", "false", errstr) != RdKafka::Conf::CONF_OK ||
+        conf->set("enable.partition.eof", "true", errstr) != RdKafka::Conf::CONF_OK)
+    {
+        throw std::runtime_error{errstr};
+    }
+
+    for (const auto &prop : props)
+    {
+        if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+    }
+    return conf;
+}
+
+/*
+ * Resolve [start, end) offsets of every partition of the topics.
+ * offsetsForTimes() returns the earliest offset whose timestamp is >= the requested time, or
+ * OFFSET_END ( -1 ) if there is none, in which case the high watermark is used.
+ */
+static std::vector<PartitionRange> resolveRanges(RdKafka::KafkaConsumer *consumer,
+                                                 const std::vector<std::string> &topics,
+                                                 int64_t startMs, int64_t endMs, int timeoutMs)
+{
+    std::vector<RdKafka::TopicPartition *> startOffsets, endOffsets;
+
+    for (const auto &topicName : topics)
+    {
+        std::string errstr;
+        std::unique_ptr<RdKafka::Topic> topic{RdKafka::Topic::create(consumer, topicName, nullptr, errstr)};
+        if (!topic)
+        {
+            throw std::runtime_error{errstr};
+        }
+
+        RdKafka::Metadata *pMetadata{nullptr};
+        auto err = consumer->metadata(false, topic.get(), &pMetadata, timeoutMs);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            throw std::runtime_error{"metadata for " + topicName + " failed: " + RdKafka::err2str(err)};
+        }
+        std::unique_ptr<RdKafka::Metadata> metadata{pMetadata};
+
+        for (const auto *topicMetadata : *metadata->topics())
+        {
+            if (topicMetadata->err() != RdKafka::ERR_NO_ERROR)
+            {
+                throw std::runtime_error{topicName + ": " + RdKafka::err2str(topicMetadata->err())};
+            }
+            for (const auto *partition : *topicMetadata->partitions())
+            {
+                startOffsets.push_back(RdKafka::TopicPartition::create(topicName, partition->id(), startMs));
+                endOffsets.push_back(RdKafka::TopicPartition::create(topicName, partition->id(), endMs));
+            }
+        }
+    }
+
+    // one request per direction for all partitions
+    auto err = consumer->offsetsForTimes(startOffsets, timeoutMs);
+    if (err == RdKafka::ERR_NO_ERROR)
+    {
+        err = consumer->offsetsForTimes(endOffsets, timeoutMs);
+    }
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        RdKafka::TopicPartition::destroy(startOffsets);
+        RdKafka::TopicPartition::destroy(endOffsets);
+        throw std::runtime_error{"offsetsForTimes failed: " + RdKafka::err2str(err)};
+    }
+
+    std::vector<PartitionRange> ranges;
+    ranges.reserve(startOffsets.size());
+    for (size_t i = 0; i < startOffsets.size(); i++)
+    {
+        PartitionRange range{startOffsets[i]->topic(), startOffsets[i]->partition(), startOffsets[i]->offset(), endOffsets[i]->offset()};
+
+        if (range.start < 0 || range.end < 0)
+        {
+            int64_t low = 0, high = 0;
+            err = consumer->query_watermark_offsets(range.topic, range.partition, &low, &high, timeoutMs);
+            if (err != RdKafka::ERR_NO_ERROR)
+            {
+                RdKafka::TopicPartition::destroy(startOffsets);
+                RdKafka::TopicPartition::destroy(endOffsets);
+                throw std::runtime_error{"watermarks for " + range.topic + " failed: " + RdKafka::err2str(err)};
+            }
+            if (range.start < 0)
+            {
+                range.start = high;
+            }
+            if (range.end < 0)
+            {
+                range.end = high;
+            }
+        }
+
+        if (range.end > range.start)
+        {
+            ranges.push_back(range);
+        }
+    }
+
+    RdKafka::TopicPartition::destroy(startOffsets);
+    RdKafka::TopicPartition::destroy(endOffsets);
+    return ranges;
+}
+
+/*
+ * Output shared by all workers.
+ * Workers format into a private buffer and hand over whole chunks, so the lock is taken once per chunk.
+ */
+class ReplaySink
+{
+public:
+    explicit ReplaySink(bool verbose) : verbose_{verbose} {}
+
+    void append(std::string &buf, const RdKafka::Message &msg) const
+    {
+        if (verbose_)
+        {
+            buf += msg.topic_name();
+            buf += " [" + std::to_string(msg.partition()) + "] @" + std::to_string(msg.offset()) + " " +
+                   std::to_string(msg.timestamp().timestamp) + ": ";
+        }
+        buf.append(static_cast<const char *>(msg.payload()), msg.len());
+        buf += '\n';
+    }
+
+    void flush(std::string &buf)
+    {
+        if (buf.empty())
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock{mutex_};
+        fwrite(buf.data(), 1, buf.size(), stdout);
+        buf.clear();
+    }
+
+private:
+    bool verbose_;
+    std::mutex mutex_;
+};
+
+struct WorkerStats
+{
+    std::atomic<uint64_t> messages{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<size_t> partitionsDone{0};
+};
+
+/*
+ * One consumer per worker, assigned a fixed set of partitions.
+ * A partition is unassigned as soon as its position reaches the end offset, and the worker exits once
+ * all its partitions are done, so no message at or past an end offset is ever delivered.
+ */
+static void replayWorker(std::unique_ptr<RdKafka::KafkaConsumer> consumer, std::vector<PartitionRange> ranges,
+                         ReplaySink &sink, WorkerStats &stats, const size_t chunkBytes)
+{
+    std::unordered_map<std::string, std::vector<int64_t>> endOffset;     // topic -> partition -> end
+    std::vector<RdKafka::TopicPartition *> assignment;
+
+    for (const auto &range : ranges)
+    {
+        auto &ends = endOffset[range.topic];
+        if (ends.size() <= static_cast<size_t>(range.partition))
+        {
+            ends.resize(range.partition + 1, -1);
+        }
+        ends[range.partition] = range.end;
+        assignment.push_back(RdKafka::TopicPartition::create(range.topic, range.partition, range.start));
+    }
+
+    // incremental so that finished partitions can be removed one by one
+    RdKafka::Error *error = consumer->incremental_assign(assignment);
+    RdKafka::TopicPartition::destroy(assignment);
+    if (error)
+    {
+        std::cerr << "% Assign failed: " << error->str() << std::endl;
+        delete error;
+        run = 0;
+        return;
+    }
+
+    std::string buf;
+    buf.reserve(chunkBytes + 4096);
+    size_t remaining = ranges.size();
+
+    auto finish = [&](const std::string &topic, int32_t partition)
+    {
+        auto &end = endOffset[topic][partition];
+        if (end < 0)
+        {
+            return;
+        }
+        end = -1;
+        std::vector<RdKafka::TopicPartition *> done{RdKafka::TopicPartition::create(topic, partition)};
+        RdKafka::Error *error = consumer->incremental_unassign(done);
+        if (error)
+        {
+            // fall back to pausing, the partition just has to stop fetching
+            delete error;
+            consumer->pause(done);
+        }
+        RdKafka::TopicPartition::destroy(done);
+        remaining--;
+        stats.partitionsDone++;
+    };
+
+    while (run && remaining)
+    {
+        std::unique_ptr<RdKafka::Message> msg{consumer->consume(100)};
+
+        switch (msg->err())
+        {
+        case RdKafka::ERR_NO_ERROR:
+        {
+            const auto end = endOffset[msg->topic_name()][msg->partition()];
+            if (msg->offset() >= end)
+            {
+                // past the end: prefetched before the partition was unassigned, or the last offsets below the end
+                // are markers and new writes mean no PARTITION_EOF comes
+                finish(msg->topic_name(), msg->partition());
+                break;
+            }
+            sink.append(buf, *msg);
+            stats.messages++;
+            stats.bytes += msg->len();
+            if (msg->offset() + 1 >= end)
+            {
+                finish(msg->topic_name(), msg->partition());
+            }
+            if (buf.size() >= chunkBytes)
+            {
+                sink.flush(buf);
+            }
+            break;
+        }
+
+        case RdKafka::ERR__PARTITION_EOF:
+            // compaction or transaction markers can leave the last offsets without a message
+            if (msg->offset() >= endOffset[msg->topic_name()][msg->partition()])
+            {
+                finish(msg->topic_name(), msg->partition());
+            }
+            break;
+
+        case RdKafka::ERR__TIMED_OUT:
+            sink.flush(buf);
+            break;
+
+        default:
+            std::cerr << "% Consume failed: " << msg->errstr() << std::endl;
+            run = 0;
+        }
+    }
+
+    sink.flush(buf);
+    consumer->close();
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092";
+    std::string startStr, endStr = "now";
+    std::vector<std::pair<std::string, std::string>> props;
+    std::vector<std::string> topics;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    size_t memoryMb = 256;
+    int timeoutMs = 10000;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:e:w:m:T:X:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 's':
+            startStr = optarg;
+            break;
+        case 'e':
+            endStr = optarg;
+            break;
+        case 'w':
+            workers = std::max(1, atoi(optarg));
+            break;
+        case 'm':
+            memoryMb = std::max(1, atoi(optarg));
+            break;
+        case 'T':
+            timeoutMs = atoi(optarg);
+            break;
+        case 'X':
+        {
+            char *name = optarg, *val;
+            if (!(val = strchr(name, '=')))
+            {
+                std::cerr << "%% Expected -X property=value, not " << name << std::endl;
+                exit(1);
+            }
+            *val++ = '\0';
+            props.emplace_back(name, val);
+            break;
+        }
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    for (; optind < argc; optind++)
+    {
+        topics.push_back(argv[optind]);
+    }
+
+    if (topics.empty() || startStr.empty())
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s -s <start> [options] topic1 topic2..\n"
+                "\n"
+                " Times are milliseconds since epoch, YYYY-MM-DDTHH:MM:SS (UTC) or now\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -s <start>       Replay messages with timestamp >= start\n"
+                "  -e <end>         Stop before the first message with timestamp >= end (now)\n"
+                "  -w <workers>     Parallel consumers, at most one per MB of -m (number of cores)\n"
+                "  -m <MB>          Prefetch memory budget across all workers (256)\n"
+                "  -T <timeout ms>  Offset lookup timeout (10000)\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property\n"
+                "  -v               Prefix each payload with topic, partition, offset and timestamp\n"
+                "\n",
+                argv[0]);
+        exit(1);
+    }
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        const auto startMs = parseTime(startStr);
+        const auto endMs = parseTime(endStr);
+        if (endMs <= startMs)
+        {
+            throw std::runtime_error{"end time must be after start time"};
+        }
+
+        std::string errstr;
+        auto conf = createConf(brokers, props);
+        std::unique_ptr<RdKafka::KafkaConsumer> resolver{RdKafka::KafkaConsumer::create(conf.get(), errstr)};
+        if (!resolver)
+        {
+            throw std::runtime_error{errstr};
+        }
+        auto ranges = resolveRanges(resolver.get(), topics, startMs, endMs, timeoutMs);
+        resolver->close();
+        resolver.reset();
+
+        uint64_t total = 0;
+        for (const auto &range : ranges)
+        {
+            total += range.end - range.start;
+        }
+        std::cerr << "% Replaying " << total << " offsets from " << ranges.size() << " partition(s)" << std::endl;
+        if (ranges.empty())
+        {
+            return 0;
+        }
+
+        // largest ranges first onto the least loaded worker; every worker gets at least 1 MB of the budget
+        workers = std::min({workers, ranges.size(), memoryMb});
+        std::sort(ranges.begin(), ranges.end(), [](const PartitionRange &a, const PartitionRange &b)
+                  { return a.end - a.start > b.end - b.start; });
+        std::vector<std::vector<PartitionRange>> perWorker(workers);
+        std::vector<int64_t> load(workers, 0);
+        for (const auto &range : ranges)
+        {
+            const auto w = std::min_element(load.begin(), load.end()) - load.begin();
+            perWorker[w].push_back(range);
+            load[w] += range.end - range.start;
+        }
+
+        // the whole budget is split over the workers' fetch queues; a single fetch response may not exceed its share
+        const auto perWorkerKb = memoryMb * 1024 / workers;
+        props.emplace_back("queued.max.messages.kbytes", std::to_string(perWorkerKb));
+        props.emplace_back("fetch.max.bytes", std::to_string(std::min<size_t>(perWorkerKb * 1024 / 2, 52428800)));
+
+        // all consumers before any thread: a failure must not leave joinable threads behind
+        std::vector<std::unique_ptr<RdKafka::KafkaConsumer>> consumers;
+        for (size_t w = 0; w < workers; w++)
+        {
+            auto workerConf = createConf(brokers, props);
+            consumers.emplace_back(RdKafka::KafkaConsumer::create(workerConf.get(), errstr));
+            if (!consumers.back())
+            {
+                throw std::runtime_error{errstr};
+            }
+        }
+
+        ReplaySink sink{verbose};
+        WorkerStats stats;
+        std::vector<std::thread> threads;
+        const auto start = std::chrono::steady_clock::now();
+
+        for (size_t w = 0; w < workers; w++)
+        {
+            threads.emplace_back(replayWorker, std::move(consumers[w]), std::move(perWorker[w]), std::ref(sink),
+                                 std::ref(stats), size_t{256 * 1024});
+        }
+
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        fflush(stdout);
+
+        const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "% Replayed " << stats.messages << " messages (" << stats.bytes << " bytes) from "
+                  << stats.partitionsDone << "/" << ranges.size() << " partition(s) in " << elapsed << " s" << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Replay failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    RdKafka::wait_destroyed(5000);
+    return 0;
+}
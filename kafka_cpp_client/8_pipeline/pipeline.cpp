@@ -0,0 +1,740 @@
+/*
+ * pipeline.cpp
+ *
+ * Consume-transform-produce with exactly-once semantics.
+ *  1) Messages are consumed in batches ( as in the batching consumer example ).
+ *  2) The transform runs on a pool of worker threads, each taking slices of the batch; output order is kept.
+ *  3) Results are produced and the consumer offsets sent in the same transaction, so a batch is either
+ *     written and marked consumed, or neither. An aborted batch is consumed again.
+ *  4) Per stage throughput and latency counters show where the time goes.
+ *
+ * Run:
+ *  ./pipeline -b localhost:9092 -g pipeline -o prateek-upper -t upper -w 4 prateek
+ *  ./pipeline -b localhost:9092 -g pipeline -o prateek-copy -B 5000 -s 5000 prateek
+ */
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * Output of the transform for one input message.
+ * keep == false drops the message, it is still marked consumed.
+ */
+struct Record
+{
+    bool keep{false};
+    std::string key;
+    std::string value;
+};
+
+/*
+ * The user supplied transform. Called concurrently from the worker threads, so it must not touch shared
+ * state without synchronisation.
+ */
+typedef std::function<void(const RdKafka::Message &in, Record &out)> Transform;
+
+static Transform makeTransform(const std::string &name)
+{
+    if (name == "copy")
+    {
+        return [](const RdKafka::Message &in, Record &out)
+        {
+            out.keep = true;
+            out.key.assign(static_cast<const char *>(in.key_pointer()), in.key_len());
+            out.value.assign(static_cast<const char *>(in.payload()), in.len());
+        };
+    }
+    if (name == "upper")
+    {
+        return [](const RdKafka::Message &in, Record &out)
+        {
+            out.keep = true;
+            out.key.assign(static_cast<const char *>(in.key_pointer()), in.key_len());
+            out.value.assign(static_cast<const char *>(in.payload()), in.len());
+            std::transform(out.value.begin(), out.value.end(), out.value.begin(),
+                           [](unsigned char c) { return static_cast<char>(toupper(c)); });
+        };
+    }
+    if (name == "nonempty")
+    {
+        return [](const RdKafka::Message &in, Record &out)
+        {
+            out.keep = in.len() > 0;
+            if (out.keep)
+            {
+                out.key.assign(static_cast<const char *>(in.key_pointer()), in.key_len());
+                out.value.assign(static_cast<const char *>(in.payload()), in.len());
+            }
+        };
+    }
+    throw std::runtime_error{"unknown transform " + name};
+}
+
+/*
+ * Fixed pool of threads running one parallel loop at a time.
+ * The caller takes part in the loop too, so a pool of n threads gives n + 1 way parallelism.
+ * Work is handed out in slices from an atomic cursor, so slow messages do not hold up a whole thread's share.
+ */
+class WorkerPool
+{
+public:
+    explicit WorkerPool(size_t threads)
+    {
+        for (size_t i = 0; i < threads; i++)
+        {
+            threads_.emplace_back([this] { loop(); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &t : threads_)
+        {
+            t.join();
+        }
+    }
+
+    // Run fn(begin, end) over [0, count) in slices of sliceSize, returns when all slices are done
+    void parallelFor(size_t count, size_t sliceSize, const std::function<void(size_t, size_t)> &fn)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            fn_ = &fn;
+            count_ = count;
+            slice_ = std::max<size_t>(1, sliceSize);
+            cursor_ = 0;
+            active_ = threads_.size();
+            generation_++;
+        }
+        wake_.notify_all();
+
+        work();
+
+        std::unique_lock<std::mutex> lock{mutex_};
+        done_.wait(lock, [this] { return active_ == 0; });
+        fn_ = nullptr;
+    }
+
+private:
+    void work()
+    {
+        for (;;)
+        {
+            const auto begin = cursor_.fetch_add(slice_);
+            if (begin >= count_)
+            {
+                return;
+            }
+            (*fn_)(begin, std::min(begin + slice_, count_));
+        }
+    }
+
+    void loop()
+    {
+        uint64_t seen = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock{mutex_};
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_)
+                {
+                    return;
+                }
+                seen = generation_;
+            }
+
+            work();
+
+            std::lock_guard<std::mutex> lock{mutex_};
+            if (--active_ == 0)
+            {
+                done_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_, done_;
+    const std::function<void(size_t, size_t)> *fn_{nullptr};
+    size_t count_{0};
+    size_t slice_{1};
+    std::atomic<size_t> cursor_{0};
+    size_t active_{0};
+    uint64_t generation_{0};
+    bool stop_{false};
+};
+
+/*
+ * Throughput and latency of one pipeline stage.
+ * busy is the share of wall time spent in the stage, the stage closest to 100% is the bottleneck.
+ */
+class StageCounter
+{
+public:
+    explicit StageCounter(std::string name) : name_{std::move(name)} {}
+
+    void record(size_t messages, size_t bytes, Clock::duration elapsed)
+    {
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        batches_++;
+        messages_ += messages;
+        bytes_ += bytes;
+        busyUs_ += us;
+        maxUs_ = std::max<int64_t>(maxUs_, us);
+    }
+
+    // One line for the interval since the last report, then starts a new interval
+    std::string report(double intervalSec)
+    {
+        std::ostringstream out;
+        out.precision(1);
+        out << std::fixed << name_ << ": " << messages_ / intervalSec << " msg/s " << bytes_ / intervalSec / 1048576
+            << " MB/s, per batch avg " << (batches_ ? busyUs_ / 1000.0 / batches_ : 0) << " ms max " << maxUs_ / 1000.0
+            << " ms, busy " << busyUs_ / 10000.0 / intervalSec << "%";
+        totalMessages_ += messages_;
+        batches_ = messages_ = bytes_ = 0;
+        busyUs_ = maxUs_ = 0;
+        return out.str();
+    }
+
+    uint64_t totalMessages() const { return totalMessages_ + messages_; }
+
+private:
+    std::string name_;
+    uint64_t batches_{0}, messages_{0}, bytes_{0};
+    int64_t busyUs_{0}, maxUs_{0};
+    uint64_t totalMessages_{0};
+};
+
+class PipelineDeliveryReportCb : public RdKafka::DeliveryReportCb
+{
+public:
+    std::atomic<uint64_t> failed{0};
+
+    void dr_cb(RdKafka::Message &message)
+    {
+        // a failed delivery makes commit_transaction() fail, so the batch is retried as a whole
+        if (message.err() != RdKafka::ERR_NO_ERROR)
+        {
+            failed++;
+            std::cerr << "% Delivery failed: " << message.errstr() << std::endl;
+        }
+    }
+};
+
+class PipelineEventCb : public RdKafka::EventCb
+{
+public:
+    void event_cb(RdKafka::Event &event)
+    {
+        switch (event.type())
+        {
+        case RdKafka::Event::EVENT_ERROR:
+            if (event.fatal())
+            {
+                std::cerr << "FATAL ";
+                run = 0;
+            }
+            std::cerr << "ERROR (" << RdKafka::err2str(event.err()) << ") : " << event.str() << std::endl;
+            break;
+        case RdKafka::Event::EVENT_LOG:
+            fprintf(stderr, "LOG-%i-%s: %s\n", event.severity(), event.fac().c_str(), event.str().c_str());
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+static std::unique_ptr<RdKafka::Conf> createConf(const std::vector<std::pair<std::string, std::string>> &props,
+                                                 RdKafka::EventCb *eventCb)
+{
+    std::string errstr;
+    std::unique_ptr<RdKafka::Conf> conf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+    for (const auto &prop : props)
+    {
+        if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+    }
+    if (conf->set("event_cb", eventCb, errstr) != RdKafka::Conf::CONF_OK)
+    {
+        throw std::runtime_error{errstr};
+    }
+    return conf;
+}
+
+/*
+ * Consume up to batchSize messages or for at most batchTimeoutMs, whichever comes first.
+ * Offsets are never stored or committed by the consumer, only through the transaction.
+ */
+static std::vector<std::unique_ptr<RdKafka::Message>> consumeBatch(RdKafka::KafkaConsumer *consumer, size_t batchSize,
+                                                                   int batchTimeoutMs)
+{
+    std::vector<std::unique_ptr<RdKafka::Message>> messages;
+    messages.reserve(batchSize);
+
+    const auto end = Clock::now() + std::chrono::milliseconds(batchTimeoutMs);
+    auto remaining = batchTimeoutMs;
+
+    while (messages.size() < batchSize && remaining >= 0)
+    {
+        std::unique_ptr<RdKafka::Message> msg{consumer->consume(remaining)};
+
+        switch (msg->err())
+        {
+        case RdKafka::ERR__TIMED_OUT:
+            return messages;
+        case RdKafka::ERR_NO_ERROR:
+            messages.push_back(std::move(msg));
+            break;
+        default:
+            std::cerr << "% Consumer error: " << msg->errstr() << std::endl;
+            run = 0;
+            return messages;
+        }
+
+        remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(end - Clock::now()).count());
+    }
+    return messages;
+}
+
+/*
+ * Next offset to consume for every partition in the batch, and the first offset of the batch to rewind to
+ * if the transaction is aborted.
+ */
+struct BatchOffsets
+{
+    std::map<std::pair<std::string, int32_t>, std::pair<int64_t, int64_t>> range;  // first, next
+
+    explicit BatchOffsets(const std::vector<std::unique_ptr<RdKafka::Message>> &batch)
+    {
+        for (const auto &msg : batch)
+        {
+            auto it = range.emplace(std::make_pair(msg->topic_name(), msg->partition()),
+                                    std::make_pair(msg->offset(), msg->offset() + 1)).first;
+            it->second.first = std::min(it->second.first, msg->offset());
+            it->second.second = std::max(it->second.second, msg->offset() + 1);
+        }
+    }
+
+    std::vector<RdKafka::TopicPartition *> next() const
+    {
+        std::vector<RdKafka::TopicPartition *> offsets;
+        for (const auto &entry : range)
+        {
+            offsets.push_back(RdKafka::TopicPartition::create(entry.first.first, entry.first.second, entry.second.second));
+        }
+        return offsets;
+    }
+
+    // Consume the batch again after an abort ( partitions revoked meanwhile are skipped by seek() )
+    void rewind(RdKafka::KafkaConsumer *consumer, int timeoutMs) const
+    {
+        for (const auto &entry : range)
+        {
+            std::unique_ptr<RdKafka::TopicPartition> tp{
+                RdKafka::TopicPartition::create(entry.first.first, entry.first.second, entry.second.first)};
+            const auto err = consumer->seek(*tp, timeoutMs);
+            if (err != RdKafka::ERR_NO_ERROR)
+            {
+                std::cerr << "% Rewind of " << entry.first.first << " [" << entry.first.second
+                          << "] failed: " << RdKafka::err2str(err) << std::endl;
+            }
+        }
+    }
+};
+
+/*
+ * Handle a transactional API error.
+ * @returns true if the transaction was aborted, throws if the producer can not continue
+ */
+static bool handleTxnError(RdKafka::Producer *producer, RdKafka::Error *error, const char *what, int timeoutMs)
+{
+    std::unique_ptr<RdKafka::Error> owned{error};
+    std::cerr << "% " << what << " failed: " << error->str() << std::endl;
+
+    if (error->is_fatal())
+    {
+        throw std::runtime_error{std::string{what} + ": " + error->str()};
+    }
+
+    // abortable or unknown outcome: abort and start over from the batch's first offsets
+    std::unique_ptr<RdKafka::Error> abortError{producer->abort_transaction(timeoutMs)};
+    if (abortError)
+    {
+        throw std::runtime_error{"abort transaction: " + abortError->str()};
+    }
+    return true;
+}
+
+struct Options
+{
+    std::string outputTopic;
+    std::string transform{"copy"};
+    size_t batchSize{1000};
+    int batchTimeoutMs{1000};
+    size_t workers{std::max(1u, std::thread::hardware_concurrency()) - 1};
+    size_t sliceSize{64};
+    int txnTimeoutMs{30000};
+    int statsIntervalMs{10000};
+};
+
+static void runPipeline(RdKafka::KafkaConsumer *consumer, RdKafka::Producer *producer, const Transform &transform,
+                        const Options &opts, PipelineDeliveryReportCb &drCb)
+{
+    StageCounter consumeStage{"consume"}, transformStage{"transform"}, produceStage{"produce"}, commitStage{"commit"};
+    WorkerPool pool{opts.workers};
+    std::vector<Record> records;
+    uint64_t transactions = 0, aborts = 0;
+    auto lastReport = Clock::now();
+
+    auto report = [&](Clock::time_point now)
+    {
+        const auto interval = std::chrono::duration<double>(now - lastReport).count();
+        std::cerr << "% " << consumeStage.report(interval) << "\n% " << transformStage.report(interval) << "\n% "
+                  << produceStage.report(interval) << "\n% " << commitStage.report(interval) << "\n% "
+                  << transactions << " transaction(s), " << aborts << " aborted" << std::endl;
+        lastReport = now;
+    };
+
+    while (run)
+    {
+        // Consume : rebalances are served here, between transactions, so no transaction is open when
+        // partitions are revoked
+        auto start = Clock::now();
+        auto batch = consumeBatch(consumer, opts.batchSize, opts.batchTimeoutMs);
+        size_t inBytes = 0;
+        for (const auto &msg : batch)
+        {
+            inBytes += msg->len();
+        }
+        consumeStage.record(batch.size(), inBytes, Clock::now() - start);
+
+        if (!batch.empty())
+        {
+            // Transform
+            start = Clock::now();
+            records.clear();
+            records.resize(batch.size());
+            pool.parallelFor(batch.size(), opts.sliceSize, [&](size_t begin, size_t end)
+                             {
+                                 for (size_t i = begin; i < end; i++)
+                                 {
+                                     transform(*batch[i], records[i]);
+                                 }
+                             });
+            transformStage.record(batch.size(), inBytes, Clock::now() - start);
+
+            // Produce : payloads are not copied, records stay alive until the transaction completed
+            start = Clock::now();
+            const BatchOffsets offsets{batch};
+            bool aborted = false;
+            if (RdKafka::Error *error = producer->begin_transaction())
+            {
+                // a transaction can only fail to begin if the producer is unusable
+                std::unique_ptr<RdKafka::Error> owned{error};
+                throw std::runtime_error{"begin transaction: " + error->str()};
+            }
+
+            size_t produced = 0, outBytes = 0;
+            for (auto &record : records)
+            {
+                if (!record.keep)
+                {
+                    continue;
+                }
+                RdKafka::ErrorCode err;
+                while ((err = producer->produce(opts.outputTopic, RdKafka::Topic::PARTITION_UA, 0,
+                                                const_cast<char *>(record.value.data()), record.value.size(),
+                                                record.key.empty() ? nullptr : record.key.data(), record.key.size(),
+                                                0, nullptr)) == RdKafka::ERR__QUEUE_FULL)
+                {
+                    producer->poll(100);
+                }
+                if (err != RdKafka::ERR_NO_ERROR)
+                {
+                    std::cerr << "% Produce failed: " << RdKafka::err2str(err) << std::endl;
+                    aborted = handleTxnError(producer, RdKafka::Error::create(err, nullptr), "produce", opts.txnTimeoutMs);
+                    break;
+                }
+                produced++;
+                outBytes += record.value.size();
+            }
+            producer->poll(0);
+            produceStage.record(produced, outBytes, Clock::now() - start);
+
+            // Commit : offsets and output become visible together
+            start = Clock::now();
+            if (!aborted)
+            {
+                std::unique_ptr<RdKafka::ConsumerGroupMetadata> group{consumer->groupMetadata()};
+                auto next = offsets.next();
+                RdKafka::Error *error = producer->send_offsets_to_transaction(next, group.get(), opts.txnTimeoutMs);
+                RdKafka::TopicPartition::destroy(next);
+                if (error)
+                {
+                    aborted = handleTxnError(producer, error, "send offsets", opts.txnTimeoutMs);
+                }
+            }
+            if (!aborted)
+            {
+                RdKafka::Error *error;
+                // retriable: the outcome is not known yet, commit_transaction() may be called again
+                while ((error = producer->commit_transaction(opts.txnTimeoutMs)) && error->is_retriable() && run)
+                {
+                    std::cerr << "% Commit transaction: " << error->str() << ", retrying" << std::endl;
+                    delete error;
+                }
+                if (error)
+                {
+                    aborted = handleTxnError(producer, error, "commit transaction", opts.txnTimeoutMs);
+                }
+            }
+            commitStage.record(batch.size(), outBytes, Clock::now() - start);
+
+            if (aborted)
+            {
+                aborts++;
+                offsets.rewind(consumer, opts.txnTimeoutMs);
+            }
+            else
+            {
+                transactions++;
+            }
+        }
+
+        const auto now = Clock::now();
+        if (opts.statsIntervalMs > 0 && now - lastReport >= std::chrono::milliseconds(opts.statsIntervalMs))
+        {
+            report(now);
+        }
+    }
+
+    report(Clock::now());
+    std::cerr << "% Transformed " << transformStage.totalMessages() << " messages, produced "
+              << produceStage.totalMessages() << ", " << drCb.failed << " delivery failure(s)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092";
+    std::string group = "pipeline";
+    std::string transactionalId;
+    std::vector<std::pair<std::string, std::string>> props;
+    std::vector<std::string> topics;
+    Options opts;
+    bool debug = false;
+    std::string debugContexts;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:g:o:t:x:B:W:w:S:T:s:X:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'g':
+            group = optarg;
+            break;
+        case 'o':
+            opts.outputTopic = optarg;
+            break;
+        case 't':
+            opts.transform = optarg;
+            break;
+        case 'x':
+            transactionalId = optarg;
+            break;
+        case 'B':
+            opts.batchSize = std::max(1, atoi(optarg));
+            break;
+        case 'W':
+            opts.batchTimeoutMs = atoi(optarg);
+            break;
+        case 'w':
+            opts.workers = std::max(0, atoi(optarg));
+            break;
+        case 'S':
+            opts.sliceSize = std::max(1, atoi(optarg));
+            break;
+        case 'T':
+            opts.txnTimeoutMs = atoi(optarg);
+            break;
+        case 's':
+            opts.statsIntervalMs = atoi(optarg);
+            break;
+        case 'X':
+        {
+            char *name = optarg, *val;
+            if (!(val = strchr(name, '=')))
+            {
+                std::cerr << "%% Expected -X property=value, not " << name << std::endl;
+                exit(1);
+            }
+            *val++ = '\0';
+            props.emplace_back(name, val);
+            break;
+        }
+        case 'd':
+            debug = true;
+            debugContexts = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    for (; optind < argc; optind++)
+    {
+        topics.push_back(argv[optind]);
+    }
+
+    if (topics.empty() || opts.outputTopic.empty())
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s -o <output topic> [options] topic1 topic2..\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -g <group>       Consumer group (pipeline)\n"
+                "  -o <topic>       Output topic\n"
+                "  -t <transform>   copy, upper or nonempty (copy)\n"
+                "  -x <id>          transactional.id, must be stable across restarts of\n"
+                "                   the same instance (<group>-<hostname>)\n"
+                "  -B <messages>    Batch size, one transaction per batch (1000)\n"
+                "  -W <ms>          Batch timeout (1000)\n"
+                "  -w <threads>     Transform worker threads besides the main thread\n"
+                "                   (number of cores - 1)\n"
+                "  -S <messages>    Messages a worker takes at a time (64)\n"
+                "  -T <ms>          Transaction timeout (30000)\n"
+                "  -s <ms>          Stage statistics interval, 0 to disable (10000)\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property\n"
+                "                   (applied to consumer and producer)\n"
+                "  -d [facs..]      Enable debugging contexts: %s\n"
+                "\n",
+                argv[0], RdKafka::get_debug_contexts().c_str());
+        exit(1);
+    }
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        if (transactionalId.empty())
+        {
+            char host[256] = "localhost";
+            gethostname(host, sizeof(host) - 1);
+            transactionalId = group + "-" + host;
+        }
+        const auto transform = makeTransform(opts.transform);
+
+        std::vector<std::pair<std::string, std::string>> common{{"bootstrap.servers", brokers}};
+        if (debug)
+        {
+            common.emplace_back("debug", debugContexts);
+        }
+        common.insert(common.end(), props.begin(), props.end());
+
+        PipelineEventCb eventCb;
+        PipelineDeliveryReportCb drCb;
+        std::string errstr;
+
+        // only committed input is read, output of aborted upstream transactions is skipped
+        auto consumerProps = common;
+        consumerProps.insert(consumerProps.begin(), {{"group.id", group},
+                                                     {"enable.auto.commit", "false"},
+                                                     {"isolation.level", "read_committed"},
+                                                     {"auto.offset.reset", "earliest"}});
+        auto consumerConf = createConf(consumerProps, &eventCb);
+        std::unique_ptr<RdKafka::KafkaConsumer> consumer{RdKafka::KafkaConsumer::create(consumerConf.get(), errstr)};
+        if (!consumer)
+        {
+            throw std::runtime_error{"consumer: " + errstr};
+        }
+
+        auto producerProps = common;
+        producerProps.insert(producerProps.begin(), {{"transactional.id", transactionalId},
+                                                     {"transaction.timeout.ms", std::to_string(opts.txnTimeoutMs)}});
+        auto producerConf = createConf(producerProps, &eventCb);
+        if (producerConf->set("dr_cb", &drCb, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+        std::unique_ptr<RdKafka::Producer> producer{RdKafka::Producer::create(producerConf.get(), errstr)};
+        if (!producer)
+        {
+            throw std::runtime_error{"producer: " + errstr};
+        }
+
+        // fences off a previous instance with the same transactional.id and aborts its open transaction
+        if (RdKafka::Error *error = producer->init_transactions(opts.txnTimeoutMs))
+        {
+            std::unique_ptr<RdKafka::Error> owned{error};
+            throw std::runtime_error{"init transactions: " + error->str()};
+        }
+
+        const auto err = consumer->subscribe(topics);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            throw std::runtime_error{"subscribe: " + RdKafka::err2str(err)};
+        }
+
+        std::cerr << "% Pipeline " << transactionalId << ": " << opts.transform << " -> " << opts.outputTopic
+                  << " with " << opts.workers + 1 << " transform thread(s)" << std::endl;
+        runPipeline(consumer.get(), producer.get(), transform, opts, drCb);
+
+        consumer->close();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Pipeline failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    RdKafka::wait_destroyed(5000);
+    return 0;
+}
@@ -0,0 +1,480 @@
+/*
+ * aggregator.cpp
+ *
+ * Counts and sums messages per key in event-time windows and writes the result of every closed window
+ * to an output topic.
+ *  1) The window of a message is taken from its timestamp, not from when it was consumed.
+ *  2) Payloads that are numbers are summed, everything else is only counted.
+ *  3) Closed windows are emitted every -e ms as key -> {"start":..,"end":..,"count":..,"sum":..}.
+ *  4) Input offsets are committed only up to the first message still held in an open window, after the
+ *     results of the closed windows were delivered. After a crash the open windows are rebuilt from there.
+ *  5) The watermark of the last emit is committed with every offset ( as commit metadata ). Messages read again
+ *     after a restart or a rebalance do not count in windows ending at or before it: those were emitted already.
+ *
+ * Run:
+ *  ./aggregator -b localhost:9092 -g counts -o prateek-counts -w 60000 prateek                   ( tumbling 1 min )
+ *  ./aggregator -b localhost:9092 -g counts -o prateek-counts -w 300000 -a 60000 -G 5000 prateek  ( 5 min every 1 min )
+ */
+#include "commit_manager.h"
+#include "librdkafka/rdkafkacpp.h"
+#include "timer_wheel.h"
+#include "window_aggregator.h"
+#include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static volatile sig_atomic_t run = 1;
+static void sigterm(int sig)
+{
+    run = 0;
+}
+
+class AggregatorEventCb : public RdKafka::EventCb
+{
+public:
+    void event_cb(RdKafka::Event &event)
+    {
+        switch (event.type())
+        {
+        case RdKafka::Event::EVENT_ERROR:
+            if (event.fatal())
+            {
+                std::cerr << "FATAL ";
+                run = 0;
+            }
+            std::cerr << "ERROR (" << RdKafka::err2str(event.err()) << ") : " << event.str() << std::endl;
+            break;
+        case RdKafka::Event::EVENT_LOG:
+            fprintf(stderr, "LOG-%i-%s: %s\n", event.severity(), event.fac().c_str(), event.str().c_str());
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+/*
+ * Ties the window state to the consumed partitions.
+ * The state of all partitions is mixed in the same windows, so on revoke it is emitted as far as closed,
+ * committed as far as safe and then dropped; whoever gets the partitions next rebuilds the open windows
+ * from the committed offsets. This requires the eager rebalance protocol ( the default ).
+ */
+class Aggregation : public RdKafka::RebalanceCb
+{
+public:
+    Aggregation(WindowAggregator &windows, CommitManager &commits, std::string outputTopic)
+        : windows_{windows}, commits_{commits}, outputTopic_{std::move(outputTopic)}
+    {
+    }
+
+    void setProducer(RdKafka::Producer *producer) { producer_ = producer; }
+
+    void consumed(const RdKafka::Message &msg)
+    {
+        const auto source = sourceId(msg.topic_name(), msg.partition());
+        auto &next = nextOffset_[source];
+        next = std::max(next, msg.offset() + 1);
+
+        int64_t timestamp = msg.timestamp().timestamp;
+        if (msg.timestamp().type == RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE)
+        {
+            timestamp = CoarseClock::wallMs();
+        }
+
+        // not NUL terminated, parse in place
+        double value = 0;
+        const auto *payload = static_cast<const char *>(msg.payload());
+        if (payload)
+        {
+            std::from_chars(payload, payload + msg.len(), value);
+        }
+
+        const auto *key = static_cast<const char *>(msg.key_pointer());
+        windows_.add(key ? key : "", key ? msg.key_len() : 0, timestamp, value, source, msg.offset());
+        messages_++;
+    }
+
+    /*
+     * Emit closed windows, wait for their delivery and commit the input as far as it is no longer needed.
+     * @returns false if the results could not be delivered: the emitted windows are gone, so nothing is
+     *          committed any more and the aggregator stops, to rebuild them from the last commit on restart
+     */
+    bool emit(RdKafka::KafkaConsumer *consumer, int timeoutMs)
+    {
+        char value[160];
+        emitted_ += windows_.evict([&](const WindowAggregator::Result &r)
+                                   {
+                                       const int len = snprintf(value, sizeof(value),
+                                                                "{\"start\":%lld,\"end\":%lld,\"count\":%llu,\"sum\":%.17g}",
+                                                                (long long)r.windowStart, (long long)r.windowEnd,
+                                                                (unsigned long long)r.count, r.sum);
+                                       produce(r.key, r.keyLen, value, len, r.windowEnd);
+                                   });
+
+        const auto err = producer_->flush(timeoutMs);
+        if (err != RdKafka::ERR_NO_ERROR || failed_)
+        {
+            std::cerr << "% Results not delivered (" << RdKafka::err2str(err) << "), stopping" << std::endl;
+            run = 0;
+            return false;
+        }
+
+        for (size_t i = 0; i < sources_.size(); i++)
+        {
+            const auto first = windows_.firstOffset(static_cast<int32_t>(i));
+            const auto safe = first >= 0 ? first : nextOffset_[i];
+            // nothing consumed from it yet: its committed offset and metadata stay
+            if (safe < 0)
+            {
+                continue;
+            }
+            // re-reading after a restart the watermark starts over, what was committed before still holds
+            const auto closed = std::max(windows_.watermark(), committedClosed_[i]);
+            if (safe > committed_[i] || closed > committedClosed_[i])
+            {
+                commits_.processed(sources_[i].first, sources_[i].second, safe - 1,
+                                   closed == INT64_MIN ? std::string{} : std::to_string(closed));
+                committed_[i] = safe;
+                committedClosed_[i] = closed;
+            }
+        }
+        commits_.maybeCommit(consumer);
+        return true;
+    }
+
+    void rebalance_cb(RdKafka::KafkaConsumer *consumer, RdKafka::ErrorCode err, std::vector<RdKafka::TopicPartition *> &partitions)
+    {
+        if (consumer->rebalance_protocol() == "COOPERATIVE")
+        {
+            std::cerr << "% The cooperative rebalance protocol is not supported" << std::endl;
+            run = 0;
+            return;
+        }
+
+        if (err == RdKafka::ERR__ASSIGN_PARTITIONS)
+        {
+            restoreClosed(consumer, partitions);
+            consumer->assign(partitions);
+            return;
+        }
+
+        if (!consumer->assignment_lost() && emit(consumer, 10000))
+        {
+            commits_.revokeAll(consumer);
+        }
+        windows_.clear();
+        sources_.clear();
+        sourceIds_.clear();
+        nextOffset_.clear();
+        committed_.clear();
+        committedClosed_.clear();
+        consumer->unassign();
+    }
+
+    void deliveryFailed() { failed_ = true; }
+
+    std::string report()
+    {
+        std::string out = "consumed " + std::to_string(messages_) + " late " + std::to_string(windows_.late()) +
+                          " open windows " + std::to_string(windows_.openWindows()) + " keys " +
+                          std::to_string(windows_.keys()) + " emitted " + std::to_string(emitted_) +
+                          " watermark " + std::to_string(windows_.watermark());
+        messages_ = emitted_ = 0;
+        return out;
+    }
+
+private:
+    // The windows emitted before, by this or another instance: from the metadata of the committed offsets
+    void restoreClosed(RdKafka::KafkaConsumer *consumer, std::vector<RdKafka::TopicPartition *> &partitions)
+    {
+        std::vector<RdKafka::TopicPartition *> committed;
+        for (const auto *tp : partitions)
+        {
+            committed.push_back(RdKafka::TopicPartition::create(tp->topic(), tp->partition()));
+        }
+        const auto err = consumer->committed(committed, 10000);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            // the windows would be emitted again with partial counts
+            std::cerr << "% Committed offsets not read (" << RdKafka::err2str(err) << "), stopping" << std::endl;
+            run = 0;
+        }
+        for (auto *tp : committed)
+        {
+            const auto metadata = tp->get_metadata();
+            const std::string text{metadata.begin(), metadata.end()};
+            char *end;
+            const auto closed = strtoll(text.c_str(), &end, 10);
+            if (!text.empty() && *end == '\0')
+            {
+                const auto source = sourceId(tp->topic(), tp->partition());
+                windows_.closedUntil(source, closed);
+                committedClosed_[source] = closed;
+            }
+        }
+        RdKafka::TopicPartition::destroy(committed);
+    }
+
+    int32_t sourceId(const std::string &topic, int32_t partition)
+    {
+        auto it = sourceIds_.find(std::make_pair(topic, partition));
+        if (it != sourceIds_.end())
+        {
+            return it->second;
+        }
+        const auto id = static_cast<int32_t>(sources_.size());
+        sourceIds_.emplace(std::make_pair(topic, partition), id);
+        sources_.emplace_back(topic, partition);
+        nextOffset_.push_back(-1);
+        committed_.push_back(-1);
+        committedClosed_.push_back(INT64_MIN);
+        return id;
+    }
+
+    void produce(const char *key, size_t keyLen, char *value, size_t len, int64_t timestamp)
+    {
+        RdKafka::ErrorCode err;
+        while ((err = producer_->produce(outputTopic_, RdKafka::Topic::PARTITION_UA, RdKafka::Producer::RK_MSG_COPY,
+                                         value, len, keyLen ? key : nullptr, keyLen, timestamp, nullptr)) ==
+               RdKafka::ERR__QUEUE_FULL)
+        {
+            producer_->poll(100);
+        }
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            std::cerr << "% Produce failed: " << RdKafka::err2str(err) << std::endl;
+            failed_ = true;
+        }
+    }
+
+    WindowAggregator &windows_;
+    CommitManager &commits_;
+    std::string outputTopic_;
+    RdKafka::Producer *producer_{nullptr};
+    std::map<std::pair<std::string, int32_t>, int32_t> sourceIds_;
+    std::vector<std::pair<std::string, int32_t>> sources_;
+    std::vector<int64_t> nextOffset_;   // per source
+    std::vector<int64_t> committed_;    // per source
+    std::vector<int64_t> committedClosed_;  // per source, the watermark committed as metadata
+    uint64_t messages_{0}, emitted_{0};
+    bool failed_{false};
+};
+
+class AggregatorDeliveryReportCb : public RdKafka::DeliveryReportCb
+{
+public:
+    Aggregation *aggregation{nullptr};
+
+    void dr_cb(RdKafka::Message &message)
+    {
+        if (message.err() != RdKafka::ERR_NO_ERROR)
+        {
+            std::cerr << "% Delivery failed: " << message.errstr() << std::endl;
+            aggregation->deliveryFailed();
+        }
+    }
+};
+
+static void setConf(RdKafka::Conf *conf, const std::vector<std::pair<std::string, std::string>> &props)
+{
+    std::string errstr;
+    for (const auto &prop : props)
+    {
+        if (conf->set(prop.first, prop.second, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092";
+    std::string group = "aggregator";
+    std::string outputTopic;
+    std::vector<std::pair<std::string, std::string>> props;
+    std::vector<std::string> topics;
+    int64_t windowMs = 60000, advanceMs = 0, graceMs = 0;
+    int emitIntervalMs = 1000, statsIntervalMs = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:g:o:w:a:G:e:s:X:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'g':
+            group = optarg;
+            break;
+        case 'o':
+            outputTopic = optarg;
+            break;
+        case 'w':
+            windowMs = strtoll(optarg, nullptr, 10);
+            break;
+        case 'a':
+            advanceMs = strtoll(optarg, nullptr, 10);
+            break;
+        case 'G':
+            graceMs = strtoll(optarg, nullptr, 10);
+            break;
+        case 'e':
+            emitIntervalMs = std::max(1, atoi(optarg));
+            break;
+        case 's':
+            statsIntervalMs = atoi(optarg);
+            break;
+        case 'X':
+        {
+            char *name = optarg, *val;
+            if (!(val = strchr(name, '=')))
+            {
+                std::cerr << "%% Expected -X property=value, not " << name << std::endl;
+                exit(1);
+            }
+            *val++ = '\0';
+            props.emplace_back(name, val);
+            break;
+        }
+        default:
+            goto usage;
+        }
+    }
+
+    for (; optind < argc; optind++)
+    {
+        topics.push_back(argv[optind]);
+    }
+
+    if (topics.empty() || outputTopic.empty())
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s -o <output topic> [options] topic1 topic2..\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -g <group>       Consumer group (aggregator)\n"
+                "  -o <topic>       Output topic for window results\n"
+                "  -w <ms>          Window size (60000)\n"
+                "  -a <ms>          Window advance, less than the size for hopping\n"
+                "                   windows (window size, i.e. tumbling)\n"
+                "  -G <ms>          Grace period for out of order messages (0)\n"
+                "  -e <ms>          Emit closed windows and commit this often (1000)\n"
+                "  -s <ms>          Statistics interval, 0 to disable (10000)\n"
+                "  -X <prop=name>   Set arbitrary librdkafka configuration property\n"
+                "                   (applied to consumer and producer)\n"
+                "\n",
+                argv[0]);
+        exit(1);
+    }
+
+    signal(SIGINT, sigterm);
+    signal(SIGTERM, sigterm);
+
+    try
+    {
+        WindowAggregator windows{windowMs, advanceMs ? advanceMs : windowMs, graceMs};
+        // every call to maybeCommit() commits, emit() decides when
+        CommitManager commits{CommitManager::Policy{1, 0}};
+        Aggregation aggregation{windows, commits, outputTopic};
+        AggregatorEventCb eventCb;
+        AggregatorDeliveryReportCb drCb;
+        drCb.aggregation = &aggregation;
+        std::string errstr;
+
+        std::unique_ptr<RdKafka::Conf> consumerConf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+        setConf(consumerConf.get(), {{"bootstrap.servers", brokers},
+                                     {"group.id", group},
+                                     {"enable.auto.commit", "false"},
+                                     {"auto.offset.reset", "earliest"}});
+        setConf(consumerConf.get(), props);
+        if (consumerConf->set("event_cb", &eventCb, errstr) != RdKafka::Conf::CONF_OK ||
+            consumerConf->set("rebalance_cb", &aggregation, errstr) != RdKafka::Conf::CONF_OK ||
+            consumerConf->set("offset_commit_cb", &commits, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+
+        std::unique_ptr<RdKafka::Conf> producerConf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+        setConf(producerConf.get(), {{"bootstrap.servers", brokers}, {"enable.idempotence", "true"}});
+        setConf(producerConf.get(), props);
+        if (producerConf->set("event_cb", &eventCb, errstr) != RdKafka::Conf::CONF_OK ||
+            producerConf->set("dr_cb", &drCb, errstr) != RdKafka::Conf::CONF_OK)
+        {
+            throw std::runtime_error{errstr};
+        }
+
+        std::unique_ptr<RdKafka::Producer> producer{RdKafka::Producer::create(producerConf.get(), errstr)};
+        if (!producer)
+        {
+            throw std::runtime_error{"producer: " + errstr};
+        }
+        aggregation.setProducer(producer.get());
+
+        std::unique_ptr<RdKafka::KafkaConsumer> consumer{RdKafka::KafkaConsumer::create(consumerConf.get(), errstr)};
+        if (!consumer)
+        {
+            throw std::runtime_error{"consumer: " + errstr};
+        }
+        const auto err = consumer->subscribe(topics);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            throw std::runtime_error{"subscribe: " + RdKafka::err2str(err)};
+        }
+
+        // emitting and statistics run on timers, nothing reads the clock per message
+        TimerWheel wheel;
+        wheel.every(emitIntervalMs, [&] { aggregation.emit(consumer.get(), 10000); });
+        if (statsIntervalMs > 0)
+        {
+            wheel.every(statsIntervalMs, [&]
+            {
+                std::cerr << "% " << aggregation.report() << "\n% Commits: " << commits.report() << std::endl;
+            });
+        }
+        while (run)
+        {
+            std::unique_ptr<RdKafka::Message> msg{consumer->consume(wheel.timeout(100))};
+            switch (msg->err())
+            {
+            case RdKafka::ERR_NO_ERROR:
+                aggregation.consumed(*msg);
+                break;
+            case RdKafka::ERR__TIMED_OUT:
+            case RdKafka::ERR__PARTITION_EOF:
+                break;
+            default:
+                std::cerr << "% Consume failed: " << msg->errstr() << std::endl;
+                run = 0;
+            }
+
+            wheel.advance();
+        }
+
+        // closing revokes the assignment, which emits and commits what is safe
+        consumer->close();
+        producer->flush(10000);
+        std::cerr << "% " << aggregation.report() << "\n% Commits: " << commits.report() << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Aggregator failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    RdKafka::wait_destroyed(5000);
+    return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * legacy_consumer_bench.cpp
+ *
+ * Compares the three ways the legacy ( simple ) consumer can read a set of pinned partitions:
+ *  consume        : Consumer::consume() one message at a time, partition by partition
+ *  partition-cb   : Consumer::consume_callback() once per partition
+ *  shared-queue   : all partitions started onto one RdKafka::Queue drained with consume_callback()
+ *
+ * Every mode reads the same partitions from the beginning with a fresh consumer until either
+ * <count> messages were read or every partition reached EOF. Partitions at EOF are no longer waited on in the
+ * per-partition modes, as the shared queue does not wait on them either.
+ *
+ * Run ( topic should already hold data, e.g. from kafka-producer-perf-test ):
+ *  ./legacy_consumer_bench -b localhost:9092 -c 1000000 performance
+ */
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+enum class Mode
+{
+    Consume,
+    PartitionCallback,
+    SharedQueue
+};
+
+static const char *modeName(Mode mode)
+{
+    switch (mode)
+    {
+    case Mode::Consume:
+        return "consume";
+    case Mode::PartitionCallback:
+        return "partition-cb";
+    default:
+        return "shared-queue";
+    }
+}
+
+struct BenchState
+{
+    uint64_t messages{0};
+    uint64_t bytes{0};
+    std::unordered_set<int32_t> eofs;   // partitions at EOF
+    uint64_t limit{0};
+    bool failed{false};
+
+    bool done(size_t partitions) const { return failed || messages >= limit || eofs.size() >= partitions; }
+
+    void account(const RdKafka::Message &msg)
+    {
+        switch (msg.err())
+        {
+        case RdKafka::ERR_NO_ERROR:
+            messages++;
+            bytes += msg.len();
+            break;
+        case RdKafka::ERR__PARTITION_EOF:
+            eofs.insert(msg.partition());
+            break;
+        case RdKafka::ERR__TIMED_OUT:
+            break;
+        default:
+            std::cerr << "% Consume failed: " << msg.errstr() << std::endl;
+            failed = true;
+        }
+    }
+};
+
+class BenchConsumeCb : public RdKafka::ConsumeCb
+{
+public:
+    void consume_cb(RdKafka::Message &msg, void *opaque)
+    {
+        static_cast<BenchState *>(opaque)->account(msg);
+    }
+};
+
+static double runMode(Mode mode, const std::string &brokers, const std::string &topicName,
+                      const std::vector<int32_t> &partitions, BenchState &state)
+{
+    std::string errstr;
+    std::unique_ptr<RdKafka::Conf> conf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+    conf->set("metadata.broker.list", brokers, errstr);
+    conf->set("enable.partition.eof", "true", errstr);
+
+    std::unique_ptr<RdKafka::Consumer> consumer{RdKafka::Consumer::create(conf.get(), errstr)};
+    if (!consumer)
+    {
+        throw std::runtime_error{errstr};
+    }
+    std::unique_ptr<RdKafka::Topic> topic{RdKafka::Topic::create(consumer.get(), topicName, nullptr, errstr)};
+    if (!topic)
+    {
+        throw std::runtime_error{errstr};
+    }
+
+    std::unique_ptr<RdKafka::Queue> queue;
+    if (mode == Mode::SharedQueue)
+    {
+        queue.reset(RdKafka::Queue::create(consumer.get()));
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (auto partition : partitions)
+    {
+        auto err = queue ? consumer->start(topic.get(), partition, RdKafka::Topic::OFFSET_BEGINNING, queue.get())
+                         : consumer->start(topic.get(), partition, RdKafka::Topic::OFFSET_BEGINNING);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            throw std::runtime_error{"start failed: " + RdKafka::err2str(err)};
+        }
+    }
+
+    BenchConsumeCb cb;
+
+    while (!state.done(partitions.size()))
+    {
+        // the 100ms wait shared by the partitions not at EOF yet
+        const auto partitionTimeout =
+            std::max(1, static_cast<int>(100 / (partitions.size() - state.eofs.size())));
+        switch (mode)
+        {
+        case Mode::Consume:
+            for (auto partition : partitions)
+            {
+                if (state.eofs.count(partition))
+                {
+                    continue;
+                }
+                std::unique_ptr<RdKafka::Message> msg{consumer->consume(topic.get(), partition, partitionTimeout)};
+                state.account(*msg);
+            }
+            break;
+        case Mode::PartitionCallback:
+            for (auto partition : partitions)
+            {
+                if (state.eofs.count(partition))
+                {
+                    continue;
+                }
+                consumer->consume_callback(topic.get(), partition, partitionTimeout, &cb, &state);
+            }
+            break;
+        case Mode::SharedQueue:
+            consumer->consume_callback(queue.get(), 100, &cb, &state);
+            break;
+        }
+    }
+
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (auto partition : partitions)
+    {
+        consumer->stop(topic.get(), partition);
+    }
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    std::string brokers = "localhost:9092";
+    std::string partitionList = "all";
+    uint64_t count = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            brokers = optarg;
+            break;
+        case 'c':
+            count = strtoull(optarg, nullptr, 10);
+            break;
+        case 'p':
+            partitionList = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+    usage:
+        fprintf(stderr,
+                "Usage: %s [options] <topic>\n"
+                "\n"
+                " Options:\n"
+                "  -b <brokers>     Broker address (localhost:9092)\n"
+                "  -c <count>       Messages to read per mode (1000000)\n"
+                "  -p <p1,p2,..>    Partitions to read (all)\n"
+                "\n",
+                argv[0]);
+        exit(1);
+    }
+
+    const std::string topicName = argv[optind];
+
+    try
+    {
+        std::vector<int32_t> partitions;
+        if (partitionList == "all")
+        {
+            std::string errstr;
+            std::unique_ptr<RdKafka::Conf> conf{RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL)};
+            conf->set("metadata.broker.list", brokers, errstr);
+            std::unique_ptr<RdKafka::Consumer> consumer{RdKafka::Consumer::create(conf.get(), errstr)};
+            if (!consumer)
+            {
+                throw std::runtime_error{errstr};
+            }
+            std::unique_ptr<RdKafka::Topic> topic{RdKafka::Topic::create(consumer.get(), topicName, nullptr, errstr)};
+            RdKafka::Metadata *pMetadata{nullptr};
+            auto err = consumer->metadata(false, topic.get(), &pMetadata, 5000);
+            if (err != RdKafka::ERR_NO_ERROR)
+            {
+                throw std::runtime_error{"metadata failed: " + RdKafka::err2str(err)};
+            }
+            std::unique_ptr<RdKafka::Metadata> metadata{pMetadata};
+            for (const auto *partition : *(*metadata->topics())[0]->partitions())
+            {
+                partitions.push_back(partition->id());
+            }
+        }
+        else
+        {
+            for (const char *p = partitionList.c_str(); p && *p;)
+            {
+                partitions.push_back(atoi(p));
+                if ((p = strchr(p, ',')))
+                {
+                    p++;
+                }
+            }
+        }
+
+        if (partitions.empty())
+        {
+            throw std::runtime_error{"no partitions to read"};
+        }
+
+        printf("%-14s %12s %14s %12s %10s\n", "mode", "messages", "msgs/sec", "MB/sec", "seconds");
+        for (auto mode : {Mode::Consume, Mode::PartitionCallback, Mode::SharedQueue})
+        {
+            BenchState state;
+            state.limit = count;
+            const auto elapsed = runMode(mode, brokers, topicName, partitions, state);
+            if (state.failed)
+            {
+                return 1;
+            }
+            printf("%-14s %12llu %14.0f %12.2f %10.3f\n", modeName(mode), static_cast<unsigned long long>(state.messages),
+                   state.messages / elapsed, state.bytes / elapsed / (1024 * 1024), elapsed);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "% Benchmark failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    RdKafka::wait_destroyed(5000);
+    return 0;
+}
@@ -0,0 +1,965 @@
+/*
+ * batch_decoder.cpp
+ */
+#include "batch_decoder.h"
+#include "librdkafka/rdkafkacpp.h"
+#include "schema_cache.h"
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef KAFKA_WITH_SIMDJSON
+#include <simdjson.h>
+#endif
+
+void BatchDecoder::prepare(ColumnarBatch &batch, size_t rows)
+{
+    bool same = batch.columns.size() == layout_.size();
+    for (size_t i = 0; same && i < layout_.size(); i++)
+    {
+        same = batch.columns[i].name == layout_[i].first && batch.columns[i].type == layout_[i].second;
+    }
+    if (!same)
+    {
+        batch.columns.clear();
+        for (const auto &col : layout_)
+        {
+            batch.columns.emplace_back(col.first, col.second);
+        }
+    }
+
+    batch.clear();
+    for (auto &col : batch.columns)
+    {
+        col.reserve(rows);
+    }
+}
+
+int BatchDecoder::column(ColumnarBatch &batch, const std::string &name, Column::Type type)
+{
+    for (size_t i = 0; i < layout_.size(); i++)
+    {
+        if (layout_[i].first == name)
+        {
+            return layout_[i].second == type ? static_cast<int>(i) : -1;
+        }
+    }
+    layout_.emplace_back(name, type);
+    return batch.addColumn(name, type);
+}
+
+void BatchDecoder::decode(const std::vector<RdKafka::Message *> &messages, ColumnarBatch &batch)
+{
+    prepare(batch, messages.size());
+    for (const auto *msg : messages)
+    {
+        decodeOne(static_cast<const char *>(msg->payload()), msg->len(), batch);
+    }
+}
+
+void BatchDecoder::decodeOne(const char *payload, size_t len, ColumnarBatch &batch)
+{
+    if (payload && !decodeRow(payload, len, batch))
+    {
+        batch.abortRow();
+    }
+    batch.endRow();
+}
+
+namespace
+{
+struct JsonField
+{
+    std::string name;
+    Column::Type type;
+    bool isBool;
+    int column;
+};
+
+/*
+ * JSON objects, listed top level fields only.
+ */
+class JsonDecoder : public BatchDecoder
+{
+public:
+    explicit JsonDecoder(const std::string &spec)
+    {
+        // name:type,name:type..
+        for (size_t pos = 0; pos < spec.size();)
+        {
+            auto end = spec.find(',', pos);
+            end = end == std::string::npos ? spec.size() : end;
+            const auto item = spec.substr(pos, end - pos);
+            pos = end + 1;
+
+            const auto colon = item.rfind(':');
+            if (colon == std::string::npos || colon == 0)
+            {
+                throw std::invalid_argument{"expected name:type, not " + item};
+            }
+            const auto type = item.substr(colon + 1);
+            JsonField field{item.substr(0, colon), Column::Type::Int64, type == "bool", -1};
+            if (type == "double")
+            {
+                field.type = Column::Type::Double;
+            }
+            else if (type == "string")
+            {
+                field.type = Column::Type::String;
+            }
+            else if (type != "int" && type != "bool")
+            {
+                throw std::invalid_argument{"unknown type " + type + " of field " + field.name};
+            }
+            fields_.push_back(field);
+        }
+        if (fields_.empty())
+        {
+            throw std::invalid_argument{"json decoding needs a field list"};
+        }
+    }
+
+protected:
+    bool decodeRow(const char *payload, size_t len, ColumnarBatch &batch) override
+    {
+        if (!bound_)
+        {
+            for (auto &field : fields_)
+            {
+                field.column = column(batch, field.name, field.type);
+            }
+            bound_ = true;
+        }
+        return parse(payload, len, batch);
+    }
+
+private:
+    const JsonField *find(const char *key, size_t len) const
+    {
+        for (const auto &field : fields_)
+        {
+            if (field.column >= 0 && field.name.size() == len && memcmp(field.name.data(), key, len) == 0)
+            {
+                return &field;
+            }
+        }
+        return nullptr;
+    }
+
+#ifdef KAFKA_WITH_SIMDJSON
+    /*
+     * On Demand parsing: fields are visited in document order, values of unlisted fields are skipped
+     * without being parsed. simdjson reads past the end of its input, so the payload is copied into a
+     * padded buffer that is reused for every message.
+     */
+    bool parse(const char *payload, size_t len, ColumnarBatch &batch)
+    {
+        if (padded_.size() < len + simdjson::SIMDJSON_PADDING)
+        {
+            padded_.resize(len + simdjson::SIMDJSON_PADDING);
+        }
+        memcpy(padded_.data(), payload, len);
+
+        simdjson::ondemand::document doc;
+        simdjson::ondemand::object object;
+        if (parser_.iterate(padded_.data(), len, padded_.size()).get(doc) || doc.get_object().get(object))
+        {
+            return false;
+        }
+
+        for (auto member : object)
+        {
+            std::string_view key;
+            if (member.unescaped_key().get(key))
+            {
+                return false;
+            }
+            const auto *field = find(key.data(), key.size());
+            if (!field || batch.columns[field->column].filled(batch.rows))
+            {
+                continue;
+            }
+            auto &col = batch.columns[field->column];
+
+            simdjson::ondemand::value value;
+            simdjson::ondemand::json_type type;
+            if (member.value().get(value) || value.type().get(type))
+            {
+                return false;
+            }
+            if (type == simdjson::ondemand::json_type::null)
+            {
+                continue;
+            }
+
+            switch (col.type)
+            {
+            case Column::Type::Int64:
+                if (field->isBool)
+                {
+                    bool b;
+                    if (value.get_bool().get(b))
+                    {
+                        return false;
+                    }
+                    col.appendInt(b);
+                }
+                else
+                {
+                    int64_t v;
+                    if (value.get_int64().get(v))
+                    {
+                        return false;
+                    }
+                    col.appendInt(v);
+                }
+                break;
+            case Column::Type::Double:
+            {
+                double v;
+                if (value.get_double().get(v))
+                {
+                    return false;
+                }
+                col.appendDouble(v);
+                break;
+            }
+            case Column::Type::String:
+            {
+                std::string_view s;
+                if (type == simdjson::ondemand::json_type::string)
+                {
+                    if (value.get_string().get(s))
+                    {
+                        return false;
+                    }
+                }
+                else if (type == simdjson::ondemand::json_type::number || type == simdjson::ondemand::json_type::boolean)
+                {
+                    s = value.raw_json_token();
+                    while (!s.empty() && isspace(static_cast<unsigned char>(s.back())))
+                    {
+                        s.remove_suffix(1);
+                    }
+                }
+                else
+                {
+                    continue;   // objects and arrays are skipped, the value is null
+                }
+                col.appendString(s.data(), s.size());
+                break;
+            }
+            }
+        }
+        return true;
+    }
+
+    simdjson::ondemand::parser parser_;
+    std::vector<char> padded_;
+#else
+    /*
+     * Scalar fallback: one pass over the document, values of unlisted fields are skipped.
+     */
+    bool parse(const char *payload, size_t len, ColumnarBatch &batch)
+    {
+        const char *p = payload, *end = payload + len;
+        skipSpace(p, end);
+        if (p == end || *p++ != '{')
+        {
+            return false;
+        }
+        skipSpace(p, end);
+        if (p < end && *p == '}')
+        {
+            return true;
+        }
+
+        for (;;)
+        {
+            skipSpace(p, end);
+            const char *key;
+            size_t keyLen;
+            if (!readString(p, end, key, keyLen))
+            {
+                return false;
+            }
+            skipSpace(p, end);
+            if (p == end || *p++ != ':')
+            {
+                return false;
+            }
+            skipSpace(p, end);
+
+            const auto *field = find(key, keyLen);
+            if (!field || batch.columns[field->column].filled(batch.rows))
+            {
+                if (!skipValue(p, end, 0))
+                {
+                    return false;
+                }
+            }
+            else if (!readValue(p, end, *field, batch.columns[field->column]))
+            {
+                return false;
+            }
+
+            skipSpace(p, end);
+            if (p == end)
+            {
+                return false;
+            }
+            if (*p == '}')
+            {
+                return true;
+            }
+            if (*p++ != ',')
+            {
+                return false;
+            }
+        }
+    }
+
+    static void skipSpace(const char *&p, const char *end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        {
+            p++;
+        }
+    }
+
+    // A string, unescaped into scratch_ only if it contains escapes
+    bool readString(const char *&p, const char *end, const char *&out, size_t &len)
+    {
+        if (p == end || *p != '"')
+        {
+            return false;
+        }
+        const char *start = ++p;
+        while (p < end && *p != '"' && *p != '\\')
+        {
+            p++;
+        }
+        if (p < end && *p == '"')
+        {
+            out = start;
+            len = static_cast<size_t>(p++ - start);
+            return true;
+        }
+
+        scratch_.assign(start, p);
+        while (p < end && *p != '"')
+        {
+            if (*p != '\\')
+            {
+                scratch_ += *p++;
+                continue;
+            }
+            if (++p == end)
+            {
+                return false;
+            }
+            switch (*p++)
+            {
+            case 'n':
+                scratch_ += '\n';
+                break;
+            case 't':
+                scratch_ += '\t';
+                break;
+            case 'r':
+                scratch_ += '\r';
+                break;
+            case 'b':
+                scratch_ += '\b';
+                break;
+            case 'f':
+                scratch_ += '\f';
+                break;
+            case 'u':
+            {
+                unsigned cp = 0;
+                if (end - p < 4 || std::from_chars(p, p + 4, cp, 16).ptr != p + 4)
+                {
+                    return false;
+                }
+                p += 4;
+                // surrogate pairs are kept as two 3 byte sequences
+                if (cp < 0x80)
+                {
+                    scratch_ += static_cast<char>(cp);
+                }
+                else if (cp < 0x800)
+                {
+                    scratch_ += static_cast<char>(0xC0 | (cp >> 6));
+                    scratch_ += static_cast<char>(0x80 | (cp & 0x3F));
+                }
+                else
+                {
+                    scratch_ += static_cast<char>(0xE0 | (cp >> 12));
+                    scratch_ += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+                    scratch_ += static_cast<char>(0x80 | (cp & 0x3F));
+                }
+                break;
+            }
+            default:
+                scratch_ += p[-1];
+            }
+        }
+        if (p == end)
+        {
+            return false;
+        }
+        p++;
+        out = scratch_.data();
+        len = scratch_.size();
+        return true;
+    }
+
+    static bool skipValue(const char *&p, const char *end, int depth)
+    {
+        if (p == end || depth > 256)
+        {
+            return false;
+        }
+        if (*p == '"')
+        {
+            for (p++; p < end && *p != '"'; p++)
+            {
+                if (*p == '\\')
+                {
+                    p++;
+                }
+            }
+            if (p >= end)
+            {
+                return false;
+            }
+            p++;
+            return true;
+        }
+        if (*p == '{' || *p == '[')
+        {
+            const char close = *p == '{' ? '}' : ']';
+            p++;
+            skipSpace(p, end);
+            if (p < end && *p == close)
+            {
+                p++;
+                return true;
+            }
+            for (;;)
+            {
+                skipSpace(p, end);
+                if (close == '}')
+                {
+                    if (!skipValue(p, end, depth + 1))  // key
+                    {
+                        return false;
+                    }
+                    skipSpace(p, end);
+                    if (p == end || *p++ != ':')
+                    {
+                        return false;
+                    }
+                    skipSpace(p, end);
+                }
+                if (!skipValue(p, end, depth + 1))
+                {
+                    return false;
+                }
+                skipSpace(p, end);
+                if (p == end)
+                {
+                    return false;
+                }
+                if (*p == close)
+                {
+                    p++;
+                    return true;
+                }
+                if (*p++ != ',')
+                {
+                    return false;
+                }
+            }
+        }
+        // number, true, false, null
+        const char *start = p;
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\t' && *p != '\r')
+        {
+            p++;
+        }
+        return p > start;
+    }
+
+    bool readValue(const char *&p, const char *end, const JsonField &field, Column &col)
+    {
+        if (end - p >= 4 && memcmp(p, "null", 4) == 0)
+        {
+            p += 4;
+            return true;
+        }
+
+        const char *start = p;
+        switch (col.type)
+        {
+        case Column::Type::Int64:
+            if (field.isBool)
+            {
+                if (end - p >= 4 && memcmp(p, "true", 4) == 0)
+                {
+                    p += 4;
+                    col.appendInt(1);
+                    return true;
+                }
+                if (end - p >= 5 && memcmp(p, "false", 5) == 0)
+                {
+                    p += 5;
+                    col.appendInt(0);
+                    return true;
+                }
+                return false;
+            }
+            else
+            {
+                int64_t v;
+                const auto r = std::from_chars(p, end, v);
+                if (r.ec != std::errc() || (r.ptr < end && (*r.ptr == '.' || *r.ptr == 'e' || *r.ptr == 'E')))
+                {
+                    return false;
+                }
+                p = r.ptr;
+                col.appendInt(v);
+                return true;
+            }
+        case Column::Type::Double:
+        {
+            double v;
+            const auto r = std::from_chars(p, end, v);
+            if (r.ec != std::errc())
+            {
+                return false;
+            }
+            p = r.ptr;
+            col.appendDouble(v);
+            return true;
+        }
+        case Column::Type::String:
+            if (*p == '"')
+            {
+                const char *s;
+                size_t len;
+                if (!readString(p, end, s, len))
+                {
+                    return false;
+                }
+                col.appendString(s, len);
+                return true;
+            }
+            if (*p == '{' || *p == '[')
+            {
+                return skipValue(p, end, 0);    // objects and arrays are skipped, the value is null
+            }
+            if (!skipValue(p, end, 0))
+            {
+                return false;
+            }
+            col.appendString(start, static_cast<size_t>(p - start));
+            return true;
+        }
+        return false;
+    }
+
+    std::string scratch_;
+#endif
+
+    std::vector<JsonField> fields_;
+    bool bound_{false};
+};
+
+/*
+ * Confluent wire format: 0x00 | schema id ( 4 bytes big endian ) | Avro binary or Protobuf message
+ */
+class RegistryDecoder : public BatchDecoder
+{
+public:
+    explicit RegistryDecoder(const std::string &schemaDir) : schemas_{schemaDir} {}
+
+protected:
+    bool decodeRow(const char *payload, size_t len, ColumnarBatch &batch) override
+    {
+        if (len < 5 || payload[0] != 0)
+        {
+            return false;
+        }
+        const auto *u = reinterpret_cast<const uint8_t *>(payload);
+        const auto id = static_cast<int32_t>(uint32_t{u[1]} << 24 | uint32_t{u[2]} << 16 | uint32_t{u[3]} << 8 | u[4]);
+
+        // consecutive messages usually share the schema
+        if (!last_ || last_->schema->id != id)
+        {
+            last_ = binding(id, batch);
+            if (!last_)
+            {
+                return false;
+            }
+        }
+
+        const char *p = payload + 5, *end = payload + len;
+        return last_->schema->format == Schema::Format::Avro ? decodeAvro(p, end, *last_, batch)
+                                                              : decodeProtobuf(p, end, *last_, batch);
+    }
+
+private:
+    // a schema and the column of each of its fields
+    struct Binding
+    {
+        const Schema *schema;
+        std::vector<int> columns;
+    };
+
+    Binding *binding(int32_t id, ColumnarBatch &batch)
+    {
+        auto it = bindings_.find(id);
+        if (it != bindings_.end())
+        {
+            return it->second.schema ? &it->second : nullptr;
+        }
+
+        auto &b = bindings_[id];
+        b.schema = schemas_.get(id);
+        if (!b.schema)
+        {
+            std::cerr << "% Schema " << id << ": " << schemas_.error(id) << std::endl;
+            return nullptr;
+        }
+        for (const auto &field : b.schema->fields)
+        {
+            b.columns.push_back(field.type == SchemaField::Type::Null ? -1 : column(batch, field.name, field.columnType()));
+        }
+        return &b;
+    }
+
+    static bool varint(const char *&p, const char *end, uint64_t &v)
+    {
+        v = 0;
+        for (int shift = 0; shift < 64 && p < end; shift += 7)
+        {
+            const auto b = static_cast<uint8_t>(*p++);
+            v |= uint64_t{b & 0x7Fu} << shift;
+            if (!(b & 0x80))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool zigzag(const char *&p, const char *end, int64_t &v)
+    {
+        uint64_t u;
+        if (!varint(p, end, u))
+        {
+            return false;
+        }
+        v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+        return true;
+    }
+
+    template <typename T>
+    static bool fixed(const char *&p, const char *end, T &v)
+    {
+        if (end - p < static_cast<ptrdiff_t>(sizeof(T)))
+        {
+            return false;
+        }
+        memcpy(&v, p, sizeof(T));   // little endian on the wire and on the supported hosts
+        p += sizeof(T);
+        return true;
+    }
+
+    // Avro binary: the fields in schema order, no tags
+    static bool decodeAvro(const char *p, const char *end, const Binding &b, ColumnarBatch &batch)
+    {
+        for (size_t i = 0; i < b.schema->fields.size(); i++)
+        {
+            const auto &field = b.schema->fields[i];
+            Column *col = b.columns[i] >= 0 ? &batch.columns[b.columns[i]] : nullptr;
+
+            if (field.nullBranch >= 0)
+            {
+                int64_t branch;
+                if (!zigzag(p, end, branch) || branch < 0 || branch > 1)
+                {
+                    return false;
+                }
+                if (branch == field.nullBranch)
+                {
+                    continue;
+                }
+            }
+
+            switch (field.type)
+            {
+            case SchemaField::Type::Null:
+                break;
+            case SchemaField::Type::Boolean:
+                if (p == end)
+                {
+                    return false;
+                }
+                if (col)
+                {
+                    col->appendInt(*p != 0);
+                }
+                p++;
+                break;
+            case SchemaField::Type::Int:
+            {
+                int64_t v;
+                if (!zigzag(p, end, v))
+                {
+                    return false;
+                }
+                if (col)
+                {
+                    col->appendInt(v);
+                }
+                break;
+            }
+            case SchemaField::Type::Float:
+            {
+                float v;
+                if (!fixed(p, end, v))
+                {
+                    return false;
+                }
+                if (col)
+                {
+                    col->appendDouble(v);
+                }
+                break;
+            }
+            case SchemaField::Type::Double:
+            {
+                double v;
+                if (!fixed(p, end, v))
+                {
+                    return false;
+                }
+                if (col)
+                {
+                    col->appendDouble(v);
+                }
+                break;
+            }
+            case SchemaField::Type::String:
+            case SchemaField::Type::Bytes:
+            {
+                int64_t len;
+                if (!zigzag(p, end, len) || len < 0 || len > end - p)
+                {
+                    return false;
+                }
+                if (col)
+                {
+                    col->appendString(p, static_cast<size_t>(len));
+                }
+                p += len;
+                break;
+            }
+            case SchemaField::Type::Enum:
+            {
+                int64_t index;
+                if (!zigzag(p, end, index) || index < 0 || static_cast<size_t>(index) >= field.symbols.size())
+                {
+                    return false;
+                }
+                if (col)
+                {
+                    col->appendString(field.symbols[index].data(), field.symbols[index].size());
+                }
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        return p == end;
+    }
+
+    // Protobuf: message indexes, then tagged fields in any order
+    static bool decodeProtobuf(const char *p, const char *end, const Binding &b, ColumnarBatch &batch)
+    {
+        // [0] is encoded as a single 0, anything else selects a nested or later message
+        int64_t count;
+        if (!zigzag(p, end, count))
+        {
+            return false;
+        }
+        for (int64_t i = 0; i < count; i++)
+        {
+            int64_t index;
+            if (!zigzag(p, end, index) || index != 0 || count != 1)
+            {
+                return false;
+            }
+        }
+
+        const auto &byNumber = b.schema->byNumber;
+        while (p < end)
+        {
+            uint64_t tag;
+            if (!varint(p, end, tag))
+            {
+                return false;
+            }
+            const auto number = tag >> 3;
+            const auto wire = tag & 7;
+            const int f = number < byNumber.size() ? byNumber[number] : -1;
+            const SchemaField *field = f >= 0 ? &b.schema->fields[f] : nullptr;
+            Column *col = f >= 0 && b.columns[f] >= 0 ? &batch.columns[b.columns[f]] : nullptr;
+            if (col && col->filled(batch.rows))
+            {
+                col = nullptr;  // repeated occurrence, the first one is kept
+            }
+
+            switch (wire)
+            {
+            case 0:
+            {
+                uint64_t v;
+                if (!varint(p, end, v))
+                {
+                    return false;
+                }
+                if (!col)
+                {
+                    break;
+                }
+                if (field->type == SchemaField::Type::SInt)
+                {
+                    col->appendInt(static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1));
+                }
+                else if (field->type == SchemaField::Type::Int || field->type == SchemaField::Type::Enum ||
+                         field->type == SchemaField::Type::Boolean)
+                {
+                    col->appendInt(static_cast<int64_t>(v));
+                }
+                break;
+            }
+            case 1:
+            {
+                uint64_t v;
+                if (!fixed(p, end, v))
+                {
+                    return false;
+                }
+                if (!col)
+                {
+                    break;
+                }
+                if (field->type == SchemaField::Type::Double)
+                {
+                    double d;
+                    memcpy(&d, &v, 8);
+                    col->appendDouble(d);
+                }
+                else if (field->type == SchemaField::Type::Fixed64)
+                {
+                    col->appendInt(static_cast<int64_t>(v));
+                }
+                break;
+            }
+            case 5:
+            {
+                uint32_t v;
+                if (!fixed(p, end, v))
+                {
+                    return false;
+                }
+                if (!col)
+                {
+                    break;
+                }
+                if (field->type == SchemaField::Type::Float)
+                {
+                    float d;
+                    memcpy(&d, &v, 4);
+                    col->appendDouble(d);
+                }
+                else if (field->type == SchemaField::Type::Fixed32)
+                {
+                    col->appendInt(field->isSigned ? int64_t{static_cast<int32_t>(v)} : int64_t{v});
+                }
+                break;
+            }
+            case 2:
+            {
+                uint64_t len;
+                if (!varint(p, end, len) || len > static_cast<uint64_t>(end - p))
+                {
+                    return false;
+                }
+                if (col && (field->type == SchemaField::Type::String || field->type == SchemaField::Type::Bytes))
+                {
+                    col->appendString(p, static_cast<size_t>(len));
+                }
+                p += len;
+                break;
+            }
+            default:
+                return false;   // groups are not supported
+            }
+        }
+
+        // proto3 leaves out fields holding their default
+        for (size_t f = 0; f < b.schema->fields.size(); f++)
+        {
+            const auto &field = b.schema->fields[f];
+            Column *col = b.columns[f] >= 0 ? &batch.columns[b.columns[f]] : nullptr;
+            if (!field.implicitDefault || !col || col->filled(batch.rows))
+            {
+                continue;
+            }
+            switch (col->type)
+            {
+            case Column::Type::Int64:
+                col->appendInt(0);
+                break;
+            case Column::Type::Double:
+                col->appendDouble(0);
+                break;
+            default:
+                col->appendString("", 0);
+                break;
+            }
+        }
+        return true;
+    }
+
+    SchemaCache schemas_;
+    std::unordered_map<int32_t, Binding> bindings_;
+    Binding *last_{nullptr};
+};
+}
+
+std::unique_ptr<BatchDecoder> BatchDecoder::create(const std::string &format, const std::string &fields,
+                                                   const std::string &schemaDir)
+{
+    if (format == "json")
+    {
+        return std::unique_ptr<BatchDecoder>{new JsonDecoder{fields}};
+    }
+    if (format == "avro" || format == "protobuf")
+    {
+        if (schemaDir.empty())
+        {
+            throw std::invalid_argument{format + " decoding needs a schema directory"};
+        }
+        return std::unique_ptr<BatchDecoder>{new RegistryDecoder{schemaDir}};
+    }
+    throw std::invalid_argument{"unknown format " + format};
+}
@@ -0,0 +1,65 @@
+/*
+ * batch_decoder.h
+ *
+ * Decodes the payloads of a consumed batch into a ColumnarBatch, one row per message in batch order.
+ *  - json      : top level fields of JSON objects, listed as name:type ( int, double, bool, string ).
+ *                Parsed with the simdjson On Demand API when built with KAFKA_WITH_SIMDJSON: only the
+ *                listed fields are materialised, no DOM is built. Otherwise a scalar parser is used.
+ *  - avro      : Confluent wire format, schemas from a SchemaCache. Columns follow the schema fields.
+ *  - protobuf  : Confluent wire format ( first message of the schema ), schemas from a SchemaCache.
+ *                Fields missing from a message are null.
+ *
+ * The per message work is only the parse itself: parser state, scratch buffers, column storage and the
+ * schema to column mapping are set up once and reused for every batch.
+ *
+ * Malformed payloads become rows that are null in every column and are counted in ColumnarBatch::errors;
+ * null payloads ( tombstones ) become null rows.
+ *
+ * Not thread safe, use one decoder ( and one ColumnarBatch ) per consumer thread.
+ */
+#pragma once
+
+#include "columnar_batch.h"
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace RdKafka
+{
+class Message;
+}
+
+class BatchDecoder
+{
+public:
+    virtual ~BatchDecoder() = default;
+
+    /*
+     * @param format      json, avro or protobuf
+     * @param fields      json only: comma separated name:type list
+     * @param schemaDir   avro and protobuf only: directory of <id>.avsc / <id>.proto files
+     * @throws std::invalid_argument on an unknown format or malformed field list
+     */
+    static std::unique_ptr<BatchDecoder> create(const std::string &format, const std::string &fields,
+                                                const std::string &schemaDir);
+
+    // Decode the payloads of messages into batch, which is cleared first
+    void decode(const std::vector<RdKafka::Message *> &messages, ColumnarBatch &batch);
+
+    // Decode a single payload as the next row of batch
+    void decodeOne(const char *payload, size_t len, ColumnarBatch &batch);
+
+protected:
+    // Append the values of one payload, @returns false if it is malformed
+    virtual bool decodeRow(const char *payload, size_t len, ColumnarBatch &batch) = 0;
+
+    // Column index for a field, adding the column on first use; -1 if the name exists with another type
+    int column(ColumnarBatch &batch, const std::string &name, Column::Type type);
+
+private:
+    // Give batch the columns known so far, in case it is not the batch decoded into last time
+    void prepare(ColumnarBatch &batch, size_t rows);
+
+    std::vector<std::pair<std::string, Column::Type>> layout_;
+};
@@ -0,0 +1,352 @@
+/*
+ * capture_file.cpp
+ */
+#include "capture_file.h"
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+const char MAGIC[8] = {'K', 'C', 'A', 'P', 'T', '0', '0', '1'};
+const size_t FILE_HEADER_BYTES = 16;    // magic, capture start
+const uint32_t NULL_LEN = UINT32_MAX;
+
+enum RecordKind : uint16_t
+{
+    MESSAGE = 1,
+    TOPIC = 2
+};
+
+struct RecordHeader
+{
+    uint32_t size;              // whole record, padding included
+    uint16_t kind;
+    uint16_t topic;             // id of the message's topic, or the id a topic record defines
+    int32_t partition;
+    uint32_t keyLen;            // NULL_LEN: null key; topic record: name length
+    int64_t offset;
+    int64_t timestamp;
+    int64_t captureUs;
+    uint32_t valueLen;          // NULL_LEN: null value
+    uint16_t headerCount;
+    uint8_t timestampType;
+    uint8_t reserved;
+};
+static_assert(sizeof(RecordHeader) == 48, "RecordHeader is part of the file format");
+
+size_t padded(size_t len)
+{
+    return (len + 7) & ~size_t{7};
+}
+
+std::runtime_error sysError(const std::string &what)
+{
+    return std::runtime_error{what + ": " + strerror(errno)};
+}
+
+int64_t steadyNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+}
+
+CaptureWriter::CaptureWriter(const std::string &path)
+    : path_{path}, file_{fopen(path.c_str(), "wb")}, buffer_(1 << 20), startNs_{steadyNs()}
+{
+    if (!file_)
+    {
+        throw sysError("create " + path);
+    }
+    setvbuf(file_, buffer_.data(), _IOFBF, buffer_.size());
+
+    const int64_t startMs =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    write(MAGIC, sizeof(MAGIC));
+    write(&startMs, sizeof(startMs));
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    fclose(file_);
+}
+
+void CaptureWriter::write(const void *data, size_t len)
+{
+    if (fwrite(data, 1, len, file_) != len)
+    {
+        throw sysError("write " + path_);
+    }
+    bytes_ += len;
+}
+
+void CaptureWriter::flush()
+{
+    if (fflush(file_) != 0)
+    {
+        throw sysError("write " + path_);
+    }
+}
+
+uint16_t CaptureWriter::topicId(const std::string &topic)
+{
+    auto it = topics_.find(topic);
+    if (it != topics_.end())
+    {
+        return it->second;
+    }
+    if (topics_.size() > UINT16_MAX)
+    {
+        throw std::runtime_error{"capture " + path_ + ": too many topics"};
+    }
+
+    const auto id = static_cast<uint16_t>(topics_.size());
+    RecordHeader header = {};
+    header.size = static_cast<uint32_t>(padded(sizeof(header) + topic.size()));
+    header.kind = TOPIC;
+    header.topic = id;
+    header.keyLen = static_cast<uint32_t>(topic.size());
+    write(&header, sizeof(header));
+    write(topic.data(), topic.size());
+    static const char zeros[8] = {};
+    write(zeros, header.size - sizeof(header) - topic.size());
+    topics_.emplace(topic, id);
+    return id;
+}
+
+void CaptureWriter::append(RdKafka::Message &message)
+{
+    RecordHeader header = {};
+    header.kind = MESSAGE;
+    header.topic = topicId(message.topic_name());
+    header.partition = message.partition();
+    header.offset = message.offset();
+    const auto timestamp = message.timestamp();
+    header.timestamp = timestamp.timestamp;
+    header.timestampType = static_cast<uint8_t>(timestamp.type);
+    header.captureUs = (steadyNs() - startNs_) / 1000;
+
+    const void *key = message.key_pointer();
+    header.keyLen = key ? static_cast<uint32_t>(message.key_len()) : NULL_LEN;
+    const void *value = message.payload();
+    header.valueLen = value ? static_cast<uint32_t>(message.len()) : NULL_LEN;
+
+    // header list of the message, owned by it
+    RdKafka::Headers *headers = message.headers();
+    std::vector<RdKafka::Headers::Header> list;
+    size_t size = sizeof(header) + (key ? message.key_len() : 0) + (value ? message.len() : 0);
+    if (headers)
+    {
+        list = headers->get_all();
+        if (list.size() > UINT16_MAX)
+        {
+            list.erase(list.begin() + UINT16_MAX, list.end());
+        }
+        for (const auto &h : list)
+        {
+            size += 8 + h.key().size() + (h.value() ? h.value_size() : 0);
+        }
+    }
+    header.headerCount = static_cast<uint16_t>(list.size());
+    header.size = static_cast<uint32_t>(padded(size));
+
+    write(&header, sizeof(header));
+    if (key)
+    {
+        write(key, message.key_len());
+    }
+    if (value)
+    {
+        write(value, message.len());
+    }
+    for (size_t i = 0; i < header.headerCount; i++)
+    {
+        const auto &h = list[i];
+        const uint32_t lens[2] = {static_cast<uint32_t>(h.key().size()),
+                                  h.value() ? static_cast<uint32_t>(h.value_size()) : NULL_LEN};
+        write(lens, sizeof(lens));
+        write(h.key().data(), h.key().size());
+        if (h.value())
+        {
+            write(h.value(), h.value_size());
+        }
+    }
+    static const char zeros[8] = {};
+    write(zeros, header.size - size);
+    messages_++;
+}
+
+void CaptureWriter::append(const std::string &topic, int32_t partition, const void *key, size_t keyLen,
+                           const void *value, size_t valueLen, int64_t timestamp)
+{
+    RecordHeader header = {};
+    header.kind = MESSAGE;
+    header.topic = topicId(topic);
+    header.partition = partition;
+    header.offset = -1;
+    header.timestamp = timestamp;
+    header.timestampType = static_cast<uint8_t>(RdKafka::MessageTimestamp::MSG_TIMESTAMP_CREATE_TIME);
+    header.captureUs = (steadyNs() - startNs_) / 1000;
+    header.keyLen = key ? static_cast<uint32_t>(keyLen) : NULL_LEN;
+    header.valueLen = value ? static_cast<uint32_t>(valueLen) : NULL_LEN;
+    const size_t size = sizeof(header) + (key ? keyLen : 0) + (value ? valueLen : 0);
+    header.size = static_cast<uint32_t>(padded(size));
+
+    write(&header, sizeof(header));
+    if (key)
+    {
+        write(key, keyLen);
+    }
+    if (value)
+    {
+        write(value, valueLen);
+    }
+    static const char zeros[8] = {};
+    write(zeros, header.size - size);
+    messages_++;
+}
+
+CaptureReader::CaptureReader(const std::string &path)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw sysError("open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw sysError("stat " + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ < FILE_HEADER_BYTES)
+    {
+        close(fd);
+        throw std::runtime_error{path + " is not a capture"};
+    }
+
+    void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        throw sysError("mmap " + path);
+    }
+    data_ = static_cast<const char *>(data);
+    // read once front to back: read ahead aggressively, drop pages behind
+    madvise(data, size_, MADV_SEQUENTIAL);
+
+    if (memcmp(data_, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        munmap(data, size_);
+        throw std::runtime_error{path + " is not a capture"};
+    }
+    memcpy(&startMs_, data_ + sizeof(MAGIC), sizeof(startMs_));
+    pos_ = FILE_HEADER_BYTES;
+}
+
+CaptureReader::~CaptureReader()
+{
+    munmap(const_cast<char *>(data_), size_);
+}
+
+void CaptureReader::rewind()
+{
+    pos_ = FILE_HEADER_BYTES;
+    truncated_ = false;
+}
+
+bool CaptureReader::next(CapturedMessage &message)
+{
+    while (pos_ < size_)
+    {
+        // records are 8 byte aligned, and so is the mapping
+        if (size_ - pos_ < sizeof(RecordHeader))
+        {
+            truncated_ = true;
+            return false;
+        }
+        const auto *header = reinterpret_cast<const RecordHeader *>(data_ + pos_);
+        if (header->size < sizeof(RecordHeader) || header->size > size_ - pos_)
+        {
+            truncated_ = true;
+            return false;
+        }
+        const char *p = data_ + pos_ + sizeof(RecordHeader);
+        const char *end = data_ + pos_ + header->size;
+        pos_ += header->size;
+
+        if (header->kind == TOPIC)
+        {
+            if (header->keyLen > static_cast<size_t>(end - p))
+            {
+                truncated_ = true;
+                return false;
+            }
+            if (header->topic >= topics_.size())
+            {
+                topics_.resize(header->topic + 1);
+            }
+            topics_[header->topic].assign(p, header->keyLen);
+            continue;
+        }
+        if (header->kind != MESSAGE || header->topic >= topics_.size())
+        {
+            truncated_ = true;
+            return false;
+        }
+
+        message.topic = &topics_[header->topic];
+        message.partition = header->partition;
+        message.offset = header->offset;
+        message.timestamp = header->timestamp;
+        message.timestampType = header->timestampType;
+        message.captureUs = header->captureUs;
+
+        const size_t keyLen = header->keyLen == NULL_LEN ? 0 : header->keyLen;
+        const size_t valueLen = header->valueLen == NULL_LEN ? 0 : header->valueLen;
+        if (keyLen + valueLen > static_cast<size_t>(end - p))
+        {
+            truncated_ = true;
+            return false;
+        }
+        message.key = header->keyLen == NULL_LEN ? nullptr : p;
+        message.keyLen = keyLen;
+        p += keyLen;
+        message.value = header->valueLen == NULL_LEN ? nullptr : p;
+        message.valueLen = valueLen;
+        p += valueLen;
+
+        message.headers.clear();
+        for (uint16_t i = 0; i < header->headerCount; i++)
+        {
+            uint32_t lens[2];
+            if (static_cast<size_t>(end - p) < sizeof(lens))
+            {
+                truncated_ = true;
+                return false;
+            }
+            memcpy(lens, p, sizeof(lens));
+            p += sizeof(lens);
+            const size_t hValueLen = lens[1] == NULL_LEN ? 0 : lens[1];
+            if (static_cast<size_t>(lens[0]) + hValueLen > static_cast<size_t>(end - p))
+            {
+                truncated_ = true;
+                return false;
+            }
+            message.headers.push_back(CapturedHeader{p, lens[0], lens[1] == NULL_LEN ? nullptr : p + lens[0], hValueLen});
+            p += lens[0] + hValueLen;
+        }
+        return true;
+    }
+    return false;
+}
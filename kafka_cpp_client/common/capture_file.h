@@ -0,0 +1,122 @@
+/*
+ * capture_file.h
+ *
+ * Captures of consumed traffic, to reproduce production load offline.
+ *  1) CaptureWriter appends every message handed to it ( topic, partition, offset, timestamp, key, value, headers )
+ *     with the time it was captured, through a large stdio buffer: sequential writes, no per message system call.
+ *  2) CaptureReader maps the file and walks it in order. Records are 8 byte aligned and hold their bytes inline,
+ *     so a CapturedMessage only points into the mapping: a replayer can hand the value to produce() without copying
+ *     it, as long as the reader outlives the producer's flush.
+ *
+ * File: magic | capture start ( epoch ms ) | records
+ * Record: RecordHeader | key | value | ( name length, value length ( ~0 = null ), name, value ) * headers | padding
+ * A topic record ( kind Topic ) names a topic id before its first message, so messages carry the id only.
+ *
+ * Integers are written in host byte order: replay on the architecture that captured. A capture cut short by a
+ * crash is read up to its last complete record.
+ *
+ * Not thread safe.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace RdKafka
+{
+class Message;
+}
+
+struct CapturedHeader
+{
+    const char *name;
+    size_t nameLen;
+    const char *value;      // nullptr for a null value
+    size_t valueLen;
+};
+
+// Points into the reader's mapping
+struct CapturedMessage
+{
+    const std::string *topic;
+    int32_t partition;
+    int64_t offset;
+    int64_t timestamp;      // ms, as consumed
+    int timestampType;      // RdKafka::MessageTimestamp::MessageTimestampType
+    int64_t captureUs;      // since the capture started
+    const char *key;        // nullptr for a null key
+    size_t keyLen;
+    const char *value;      // nullptr for a null value
+    size_t valueLen;
+    std::vector<CapturedHeader> headers;
+};
+
+class CaptureWriter
+{
+public:
+    // @throws std::runtime_error if path can not be created
+    explicit CaptureWriter(const std::string &path);
+    ~CaptureWriter();
+
+    CaptureWriter(const CaptureWriter &) = delete;
+    CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+    // Append a consumed message, throws std::runtime_error on write errors
+    void append(RdKafka::Message &message);
+
+    // Append a message that was never produced ( offset -1, no headers ), e.g. one still waiting for queue room
+    void append(const std::string &topic, int32_t partition, const void *key, size_t keyLen, const void *value,
+                size_t valueLen, int64_t timestamp);
+
+    // Write out the buffer, e.g. before exit
+    void flush();
+
+    uint64_t messages() const { return messages_; }
+    uint64_t bytes() const { return bytes_; }
+
+private:
+    void write(const void *data, size_t len);
+    uint16_t topicId(const std::string &topic);
+
+    std::string path_;
+    FILE *file_;
+    std::vector<char> buffer_;
+    std::unordered_map<std::string, uint16_t> topics_;
+    int64_t startNs_;
+    uint64_t messages_{0};
+    uint64_t bytes_{0};
+};
+
+class CaptureReader
+{
+public:
+    // @throws std::runtime_error if path can not be mapped or is not a capture
+    explicit CaptureReader(const std::string &path);
+    ~CaptureReader();
+
+    CaptureReader(const CaptureReader &) = delete;
+    CaptureReader &operator=(const CaptureReader &) = delete;
+
+    // Next message in capture order, reusing message's header vector. @returns false at the end
+    bool next(CapturedMessage &message);
+
+    // Start over from the first record
+    void rewind();
+
+    int64_t startMs() const { return startMs_; }
+    // The capture ended in a torn record
+    bool truncated() const { return truncated_; }
+
+private:
+    const char *data_{nullptr};
+    size_t size_{0};
+    size_t pos_{0};
+    int64_t startMs_{0};
+    bool truncated_{false};
+    std::deque<std::string> topics_;   // by id, stable for CapturedMessage::topic
+};
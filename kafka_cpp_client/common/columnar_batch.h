@@ -0,0 +1,179 @@
+/*
+ * columnar_batch.h
+ *
+ * A batch of decoded messages stored column by column: one contiguous array per field instead of one
+ * object per message, so later stages scan only the fields they need.
+ *  - Int64 ( also booleans and enums ) and Double columns hold one value per row.
+ *  - String ( also bytes ) columns hold all values back to back in data, row i is
+ *    data[offsets[i], offsets[i + 1]).
+ *  - valid[i] == 0 marks a null / missing value, the value slot is then 0 or empty.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Column
+{
+    enum class Type
+    {
+        Int64,
+        Double,
+        String
+    };
+
+    std::string name;
+    Type type;
+    std::vector<int64_t> ints;
+    std::vector<double> doubles;
+    std::vector<uint32_t> offsets{0};
+    std::string data;
+    std::vector<uint8_t> valid;
+
+    Column(std::string name, Type type) : name{std::move(name)}, type{type} {}
+
+    size_t size() const { return valid.size(); }
+
+    void reserve(size_t rows)
+    {
+        valid.reserve(rows);
+        if (type == Type::Int64)
+        {
+            ints.reserve(rows);
+        }
+        else if (type == Type::Double)
+        {
+            doubles.reserve(rows);
+        }
+        else
+        {
+            offsets.reserve(rows + 1);
+        }
+    }
+
+    void clear()
+    {
+        ints.clear();
+        doubles.clear();
+        offsets.assign(1, 0);
+        data.clear();
+        valid.clear();
+    }
+
+    void appendInt(int64_t v)
+    {
+        ints.push_back(v);
+        valid.push_back(1);
+    }
+
+    void appendDouble(double v)
+    {
+        doubles.push_back(v);
+        valid.push_back(1);
+    }
+
+    void appendString(const char *s, size_t len)
+    {
+        data.append(s, len);
+        offsets.push_back(static_cast<uint32_t>(data.size()));
+        valid.push_back(1);
+    }
+
+    void appendNull()
+    {
+        if (type == Type::Int64)
+        {
+            ints.push_back(0);
+        }
+        else if (type == Type::Double)
+        {
+            doubles.push_back(0);
+        }
+        else
+        {
+            offsets.push_back(static_cast<uint32_t>(data.size()));
+        }
+        valid.push_back(0);
+    }
+
+    // true if the current row ( rows decoded so far ) already has a value, e.g. a duplicate JSON key
+    bool filled(size_t rows) const { return valid.size() > rows; }
+
+    std::string stringAt(size_t row) const { return data.substr(offsets[row], offsets[row + 1] - offsets[row]); }
+};
+
+struct ColumnarBatch
+{
+    std::vector<Column> columns;
+    size_t rows{0};
+    size_t errors{0};   // rows that failed to decode, null in every column
+    std::vector<size_t> failed;     // their row numbers
+
+    // index of the column named name, -1 if there is none
+    int find(const std::string &name) const
+    {
+        for (size_t i = 0; i < columns.size(); i++)
+        {
+            if (columns[i].name == name)
+            {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    // Add a column, null in the rows decoded so far. @returns its index
+    int addColumn(const std::string &name, Column::Type type)
+    {
+        columns.emplace_back(name, type);
+        for (size_t i = 0; i < rows; i++)
+        {
+            columns.back().appendNull();
+        }
+        return static_cast<int>(columns.size() - 1);
+    }
+
+    void clear()
+    {
+        for (auto &column : columns)
+        {
+            column.clear();
+        }
+        rows = 0;
+        errors = 0;
+        failed.clear();
+    }
+
+    // Drop the values appended for the current row, e.g. when its message turned out to be malformed
+    void abortRow()
+    {
+        for (auto &column : columns)
+        {
+            if (column.size() > rows)
+            {
+                column.valid.resize(rows);
+                column.ints.resize(column.type == Column::Type::Int64 ? rows : 0);
+                column.doubles.resize(column.type == Column::Type::Double ? rows : 0);
+                column.offsets.resize(rows + 1);
+                column.data.resize(column.offsets[rows]);
+            }
+        }
+        errors++;
+        failed.push_back(rows);
+    }
+
+    // Pad every column that did not get a value in the current row with a null, then start the next row
+    void endRow()
+    {
+        rows++;
+        for (auto &column : columns)
+        {
+            if (column.size() < rows)
+            {
+                column.appendNull();
+            }
+        }
+    }
+};
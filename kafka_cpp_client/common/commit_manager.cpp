@@ -0,0 +1,258 @@
+/*
+ * commit_manager.cpp
+ */
+#include "commit_manager.h"
+#include "trace.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+RdKafka::ErrorCode commit(RdKafka::KafkaConsumer *consumer, std::vector<RdKafka::TopicPartition *> &offsets, bool async)
+{
+    TraceScope<TraceStage::Commit> probe;
+    probe.value(offsets.size());
+    return async ? consumer->commitAsync(offsets) : consumer->commitSync(offsets);
+}
+
+RdKafka::TopicPartition *offsetOf(const std::string &topic, int32_t partition, int64_t offset,
+                                  const std::string &metadata)
+{
+    auto *tp = RdKafka::TopicPartition::create(topic, partition, offset);
+    if (!metadata.empty())
+    {
+        std::vector<unsigned char> bytes{metadata.begin(), metadata.end()};
+        tp->set_metadata(bytes);
+    }
+    return tp;
+}
+}
+
+CommitManager::CommitManager(const Policy &policy)
+    : policy_{policy}, nextCommitMs_{CoarseClock::nowMs() + policy.intervalMs}
+{
+}
+
+void CommitManager::processed(const RdKafka::Message &message)
+{
+    processed(message.topic_name(), message.partition(), message.offset());
+}
+
+void CommitManager::processed(const std::string &topic, int32_t partition, int64_t offset)
+{
+    // the committed offset is the next one to consume
+    auto &next = pending_[Key{topic, partition}].offset;
+    next = std::max(next, offset + 1);
+    pendingMessages_++;
+}
+
+void CommitManager::processed(const std::string &topic, int32_t partition, int64_t offset, const std::string &metadata)
+{
+    processed(topic, partition, offset);
+    pending_[Key{topic, partition}].metadata = metadata;
+}
+
+CommitManager::CommitTag CommitManager::tagOf(const std::vector<RdKafka::TopicPartition *> &offsets)
+{
+    CommitTag tag;
+    tag.reserve(offsets.size());
+    for (const auto *tp : offsets)
+    {
+        tag.emplace_back(tp->topic(), tp->partition(), tp->offset());
+    }
+    std::sort(tag.begin(), tag.end());
+    return tag;
+}
+
+std::vector<RdKafka::TopicPartition *> CommitManager::takePending(const std::vector<RdKafka::TopicPartition *> *only)
+{
+    std::vector<RdKafka::TopicPartition *> offsets;
+
+    if (!only)
+    {
+        offsets.reserve(pending_.size());
+        for (const auto &entry : pending_)
+        {
+            offsets.push_back(offsetOf(entry.first.topic, entry.first.partition, entry.second.offset,
+                                       entry.second.metadata));
+        }
+        metrics_.messagesCoalesced += pendingMessages_;
+        pending_.clear();
+        pendingMessages_ = 0;
+        return offsets;
+    }
+
+    for (const auto *tp : *only)
+    {
+        auto it = pending_.find(Key{tp->topic(), tp->partition()});
+        if (it != pending_.end())
+        {
+            offsets.push_back(offsetOf(it->first.topic, it->first.partition, it->second.offset, it->second.metadata));
+            pending_.erase(it);
+        }
+    }
+    if (pending_.empty())
+    {
+        metrics_.messagesCoalesced += pendingMessages_;
+        pendingMessages_ = 0;
+    }
+    return offsets;
+}
+
+bool CommitManager::maybeCommit(RdKafka::KafkaConsumer *consumer)
+{
+    if (pending_.empty())
+    {
+        return false;
+    }
+
+    const auto nowMs = CoarseClock::nowMs();
+    if (pendingMessages_ < policy_.maxMessages && nowMs < nextCommitMs_)
+    {
+        return false;
+    }
+
+    auto offsets = takePending(nullptr);
+    auto tag = tagOf(offsets);
+    const auto start = Clock::now();
+    const auto err = commit(consumer, offsets, true);
+    metrics_.offsetsCommitted += offsets.size();
+    RdKafka::TopicPartition::destroy(offsets);
+    nextCommitMs_ = nowMs + policy_.intervalMs;
+
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        metrics_.failures++;
+        metrics_.lastError = err;
+        std::cerr << "% Async commit failed: " << RdKafka::err2str(err) << std::endl;
+        return false;
+    }
+
+    inFlight_.push_back(InFlight{start, std::move(tag)});
+    metrics_.inFlight = inFlight_.size();
+    return true;
+}
+
+RdKafka::ErrorCode CommitManager::commitSync(RdKafka::KafkaConsumer *consumer)
+{
+    if (pending_.empty())
+    {
+        return RdKafka::ERR_NO_ERROR;
+    }
+
+    const auto start = Clock::now();
+    auto offsets = takePending(nullptr);
+    const auto err = commit(consumer, offsets, false);
+    metrics_.offsetsCommitted += offsets.size();
+    RdKafka::TopicPartition::destroy(offsets);
+    nextCommitMs_ = CoarseClock::nowMs() + policy_.intervalMs;
+
+    metrics_.commits++;
+    recordLatency(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count());
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        metrics_.failures++;
+        metrics_.lastError = err;
+        std::cerr << "% Commit failed: " << RdKafka::err2str(err) << std::endl;
+    }
+    return err;
+}
+
+void CommitManager::revoke(RdKafka::KafkaConsumer *consumer, const std::vector<RdKafka::TopicPartition *> &partitions)
+{
+    auto offsets = takePending(&partitions);
+    if (offsets.empty())
+    {
+        return;
+    }
+
+    const auto start = Clock::now();
+    const auto err = commit(consumer, offsets, false);
+    metrics_.offsetsCommitted += offsets.size();
+    RdKafka::TopicPartition::destroy(offsets);
+
+    metrics_.commits++;
+    recordLatency(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count());
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        metrics_.failures++;
+        metrics_.lastError = err;
+        std::cerr << "% Commit on revoke failed: " << RdKafka::err2str(err) << std::endl;
+    }
+}
+
+void CommitManager::revokeAll(RdKafka::KafkaConsumer *consumer)
+{
+    commitSync(consumer);
+}
+
+void CommitManager::offset_commit_cb(RdKafka::ErrorCode err, std::vector<RdKafka::TopicPartition *> &offsets)
+{
+    /*
+     * Results of synchronous commits ( commitSync(), revoke() ) come here too but are accounted for by the caller:
+     * only a result with the offsets of an async commit in flight is one. Pending offsets only grow, so no sync
+     * commit sends the same offsets.
+     */
+    if (inFlight_.empty())
+    {
+        return;
+    }
+    const auto tag = tagOf(offsets);
+    const auto it = std::find_if(inFlight_.begin(), inFlight_.end(), [&](const InFlight &f) { return f.tag == tag; });
+    if (it == inFlight_.end())
+    {
+        return;
+    }
+
+    const auto start = it->start;
+    inFlight_.erase(it);
+    metrics_.inFlight = inFlight_.size();
+    metrics_.commits++;
+    recordLatency(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count());
+
+    // ERR__NO_OFFSET : nothing to commit, not a failure
+    if (err != RdKafka::ERR_NO_ERROR && err != RdKafka::ERR__NO_OFFSET)
+    {
+        metrics_.failures++;
+        metrics_.lastError = err;
+        std::cerr << "% Commit of " << offsets.size() << " offset(s) failed: " << RdKafka::err2str(err) << std::endl;
+        return;
+    }
+
+    // per partition errors, e.g. a partition revoked while the commit was in flight
+    for (const auto *tp : offsets)
+    {
+        if (tp->err() != RdKafka::ERR_NO_ERROR)
+        {
+            metrics_.failures++;
+            metrics_.lastError = tp->err();
+            std::cerr << "% Commit of " << tp->topic() << " [" << tp->partition() << "] failed: "
+                      << RdKafka::err2str(tp->err()) << std::endl;
+        }
+    }
+}
+
+void CommitManager::recordLatency(int64_t ms)
+{
+    windowCommits_++;
+    metrics_.latencyAvgMs += (ms - metrics_.latencyAvgMs) / windowCommits_;
+    metrics_.latencyMaxMs = std::max(metrics_.latencyMaxMs, ms);
+}
+
+std::string CommitManager::report()
+{
+    std::ostringstream out;
+    out << "commits " << metrics_.commits << " failed " << metrics_.failures << " offsets " << metrics_.offsetsCommitted
+        << " messages " << metrics_.messagesCoalesced << " in-flight " << metrics_.inFlight << " pending "
+        << pendingMessages_ << " latency avg " << metrics_.latencyAvgMs << " ms max " << metrics_.latencyMaxMs << " ms";
+    if (metrics_.lastError != RdKafka::ERR_NO_ERROR)
+    {
+        out << " last error " << RdKafka::err2str(metrics_.lastError);
+    }
+
+    windowCommits_ = 0;
+    metrics_.latencyAvgMs = 0;
+    metrics_.latencyMaxMs = 0;
+    return out.str();
+}
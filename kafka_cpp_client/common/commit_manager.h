@@ -0,0 +1,115 @@
+/*
+ * commit_manager.h
+ *
+ * Explicit offset commits for a KafkaConsumer with enable.auto.commit=false.
+ *  1) The application reports every processed message, only the highest offset per partition is kept.
+ *  2) Pending offsets are committed asynchronously in one request once maxMessages messages were processed
+ *     or intervalMs passed since the last commit, whichever comes first. The interval is checked against the
+ *     coarse clock, so calling maybeCommit() for every message costs no system call.
+ *  3) On revoke and shutdown the pending offsets are committed synchronously, so nothing processed is
+ *     redelivered after a clean rebalance.
+ *
+ * Register the manager as "offset_commit_cb" to get commit latency and failure metrics.
+ * Not thread safe: use from the thread that polls the consumer ( the commit callback is served there ).
+ */
+#pragma once
+
+#include "librdkafka/rdkafkacpp.h"
+#include "timer_wheel.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+class CommitManager : public RdKafka::OffsetCommitCb
+{
+public:
+    struct Policy
+    {
+        size_t maxMessages{1000};
+        int64_t intervalMs{1000};
+    };
+
+    struct Metrics
+    {
+        uint64_t commits{0};            // commit requests completed
+        uint64_t failures{0};           // commit requests failed
+        uint64_t offsetsCommitted{0};   // partition offsets sent
+        uint64_t messagesCoalesced{0};  // processed messages covered by those offsets
+        double latencyAvgMs{0};
+        int64_t latencyMaxMs{0};
+        size_t inFlight{0};
+        RdKafka::ErrorCode lastError{RdKafka::ERR_NO_ERROR};
+    };
+
+    explicit CommitManager(const Policy &policy);
+
+    void processed(const RdKafka::Message &message);
+    void processed(const std::string &topic, int32_t partition, int64_t offset);
+    // metadata is committed along with the offset, and replaces what was given for the partition before
+    void processed(const std::string &topic, int32_t partition, int64_t offset, const std::string &metadata);
+
+    /*
+     * Commit asynchronously if the policy says so
+     * @returns true if a commit was issued
+     */
+    bool maybeCommit(RdKafka::KafkaConsumer *consumer);
+
+    // Commit everything pending and wait for the result
+    RdKafka::ErrorCode commitSync(RdKafka::KafkaConsumer *consumer);
+
+    // Partitions are being revoked : commit what was processed on them and forget them
+    void revoke(RdKafka::KafkaConsumer *consumer, const std::vector<RdKafka::TopicPartition *> &partitions);
+    void revokeAll(RdKafka::KafkaConsumer *consumer);
+
+    void offset_commit_cb(RdKafka::ErrorCode err, std::vector<RdKafka::TopicPartition *> &offsets);
+
+    const Metrics &metrics() const { return metrics_; }
+
+    // One line summary of the metrics since the last report, resets the latency window
+    std::string report();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Key
+    {
+        std::string topic;
+        int32_t partition;
+        bool operator==(const Key &o) const { return partition == o.partition && topic == o.topic; }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key &k) const { return std::hash<std::string>()(k.topic) * 31 + k.partition; }
+    };
+
+    // The offsets of an async commit, sorted: its result is told apart from the results of sync commits by them
+    typedef std::vector<std::tuple<std::string, int32_t, int64_t>> CommitTag;
+    struct InFlight
+    {
+        Clock::time_point start;
+        CommitTag tag;
+    };
+
+    static CommitTag tagOf(const std::vector<RdKafka::TopicPartition *> &offsets);
+    std::vector<RdKafka::TopicPartition *> takePending(const std::vector<RdKafka::TopicPartition *> *only);
+    void recordLatency(int64_t ms);
+
+    Policy policy_;
+    struct Pending
+    {
+        int64_t offset{0};      // next offset to commit
+        std::string metadata;
+    };
+
+    std::unordered_map<Key, Pending, KeyHash> pending_; // per partition
+    size_t pendingMessages_{0};
+    int64_t nextCommitMs_;                              // CoarseClock, interval commit due
+    std::deque<InFlight> inFlight_;                     // async commits, oldest first
+    Metrics metrics_;
+    uint64_t windowCommits_{0};
+};
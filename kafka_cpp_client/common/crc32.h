@@ -0,0 +1,40 @@
+/*
+ * crc32.h
+ *
+ * CRC-32 ( IEEE, as zlib ) of on-disk records, to find the torn tail of a log after a crash. Table driven, a byte
+ * at a time: records are checked once when read back, not on a hot path.
+ *
+ *  uint32_t crc = crc32(0, header, sizeof(header));
+ *  crc = crc32(crc, payload, len);
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+inline uint32_t crc32(uint32_t crc, const void *data, size_t len)
+{
+    static uint32_t table[256];
+    static const bool init = []
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)init;
+
+    const auto *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    while (len--)
+    {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
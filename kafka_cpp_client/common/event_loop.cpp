@@ -0,0 +1,155 @@
+/*
+ * event_loop.cpp
+ */
+#include "event_loop.h"
+#include "librdkafka/rdkafka.h"
+#include "librdkafka/rdkafkacpp.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+std::runtime_error systemError(const std::string &what)
+{
+    return std::runtime_error{what + ": " + strerror(errno)};
+}
+}
+
+EventLoop::EventLoop() : epoll_{epoll_create1(EPOLL_CLOEXEC)}
+{
+    if (epoll_ < 0)
+    {
+        throw systemError("epoll_create1");
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    while (!queues_.empty())
+    {
+        unwatchQueue(queues_.begin()->first);
+    }
+    close(epoll_);
+}
+
+void EventLoop::watch(int fd, std::function<void()> fn)
+{
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        // regular files ( e.g. stdin redirected from one ) can not be polled, and are always readable
+        if (errno != EPERM)
+        {
+            throw systemError("epoll_ctl");
+        }
+        alwaysReady_.insert(fd);
+    }
+    watchers_[fd] = std::move(fn);
+}
+
+void EventLoop::unwatch(int fd)
+{
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+    alwaysReady_.erase(fd);
+    watchers_.erase(fd);
+}
+
+int EventLoop::watchQueue(rd_kafka_queue_s *queue, std::function<void()> fn)
+{
+    const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+    {
+        rd_kafka_queue_destroy(queue);
+        throw systemError("eventfd");
+    }
+    watch(fd, [fd, fn]
+    {
+        uint64_t count;
+        (void)read(fd, &count, sizeof(count));
+        fn();
+    });
+    queues_[fd] = queue;
+
+    // librdkafka writes the payload once per empty -> non empty transition, an eventfd wants 8 bytes
+    const uint64_t one = 1;
+    rd_kafka_queue_io_event_enable(queue, fd, &one, sizeof(one));
+    return fd;
+}
+
+int EventLoop::watchMain(RdKafka::Handle *handle, std::function<void()> fn)
+{
+    return watchQueue(rd_kafka_queue_get_main(handle->c_ptr()), std::move(fn));
+}
+
+int EventLoop::watchConsumer(RdKafka::KafkaConsumer *consumer, std::function<void()> fn)
+{
+    return watchQueue(rd_kafka_queue_get_consumer(consumer->c_ptr()), std::move(fn));
+}
+
+void EventLoop::unwatchQueue(int id)
+{
+    auto it = queues_.find(id);
+    if (it == queues_.end())
+    {
+        return;
+    }
+    rd_kafka_queue_io_event_enable(it->second, -1, nullptr, 0);
+    rd_kafka_queue_destroy(it->second);
+    queues_.erase(it);
+    unwatch(id);
+    close(id);
+}
+
+size_t EventLoop::runOnce(int maxWaitMs)
+{
+    struct epoll_event events[64];
+    const int n = epoll_wait(epoll_, events, 64, alwaysReady_.empty() ? timers_.timeout(maxWaitMs) : 0);
+    if (n < 0 && errno != EINTR)
+    {
+        throw systemError("epoll_wait");
+    }
+
+    size_t ran = 0;
+    for (int i = 0; i < n; i++)
+    {
+        // an earlier callback may have unwatched this fd
+        auto it = watchers_.find(events[i].data.fd);
+        if (it != watchers_.end())
+        {
+            auto fn = it->second;
+            fn();
+            ran++;
+        }
+    }
+    if (!alwaysReady_.empty())
+    {
+        const std::vector<int> ready(alwaysReady_.begin(), alwaysReady_.end());
+        for (int fd : ready)
+        {
+            auto it = watchers_.find(fd);
+            if (it != watchers_.end())
+            {
+                auto fn = it->second;
+                fn();
+                ran++;
+            }
+        }
+    }
+    return ran + timers_.advance();
+}
+
+void EventLoop::run()
+{
+    while (!stopped_)
+    {
+        runOnce(1000);
+    }
+}
@@ -0,0 +1,89 @@
+/*
+ * event_loop.h
+ *
+ * One epoll wait for everything a client thread reacts to: librdkafka queues, application fds ( stdin, sockets )
+ * and timers.
+ *
+ * librdkafka can write to a file descriptor when one of its queues becomes non empty ( io_event_enable ). Every
+ * watched queue gets an eventfd for that, so a loop wakes as soon as a message, delivery report, rebalance or admin
+ * result is ready, instead of waking up every consume() / poll() timeout to look. Queues to watch:
+ *  main queue      events, logs, errors; delivery reports of a producer                   watchMain()
+ *  consumer queue  messages and rebalances of a KafkaConsumer ( its main queue is forwarded there ) watchConsumer()
+ *  any other       e.g. a queue from rd_kafka_queue_new() passed to admin requests for their results  watchQueue()
+ *
+ * librdkafka only signals the transition from empty, so a queue callback must serve the queue until it is empty,
+ * or come back to it ( e.g. schedule(0, ..) ) if it stops early.
+ *
+ *  EventLoop loop;
+ *  loop.watchMain(producer, [&] { producer->poll(0); });
+ *  loop.watch(STDIN_FILENO, [&] { readInput(); });
+ *  while (run)
+ *  {
+ *      loop.runOnce(1000);
+ *  }
+ *
+ * Not thread safe: callbacks run on the thread calling runOnce().
+ */
+#pragma once
+
+#include "timer_wheel.h"
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+struct rd_kafka_queue_s;
+
+namespace RdKafka
+{
+class Handle;
+class KafkaConsumer;
+}
+
+class EventLoop
+{
+public:
+    // @throws std::runtime_error if epoll is not available
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    /*
+     * Call fn whenever fd is readable ( level triggered ) until unwatch(fd). A regular file, which epoll refuses, is
+     * always readable: fn is called every runOnce(), which then does not wait. @throws std::runtime_error
+     */
+    void watch(int fd, std::function<void()> fn);
+    void unwatch(int fd);
+
+    /*
+     * Call fn whenever queue becomes non empty. The loop takes over the queue reference and destroys it in
+     * unwatchQueue() ( or with the loop ).
+     * @returns an id for unwatchQueue()
+     */
+    int watchQueue(rd_kafka_queue_s *queue, std::function<void()> fn);
+    int watchMain(RdKafka::Handle *handle, std::function<void()> fn);
+    int watchConsumer(RdKafka::KafkaConsumer *consumer, std::function<void()> fn);
+    void unwatchQueue(int id);
+
+    /*
+     * Wait at most maxWaitMs ( less if a timer is due sooner ), then run the callbacks of ready fds and the due
+     * timers. Returns early on a signal.
+     * @returns the number of callbacks and timers that ran
+     */
+    size_t runOnce(int maxWaitMs);
+
+    // runOnce() until stop()
+    void run();
+    void stop() { stopped_ = true; }
+    bool stopped() const { return stopped_; }
+
+    TimerWheel &timers() { return timers_; }
+
+private:
+    int epoll_;
+    std::unordered_map<int, std::function<void()>> watchers_;
+    std::unordered_set<int> alwaysReady_;                  // watched fds epoll does not support
+    std::unordered_map<int, rd_kafka_queue_s *> queues_;   // eventfd -> queue signalling it
+    TimerWheel timers_;
+    bool stopped_{false};
+};
@@ -0,0 +1,321 @@
+/*
+ * failure_router.cpp
+ */
+#include "failure_router.h"
+#include "librdkafka/rdkafka.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+const char *const kAttempt = "x-retry-attempt";
+const char *const kRetryAt = "x-retry-at";
+const char *const kOriginalTopic = "x-original-topic";
+const char *const kOriginalPartition = "x-original-partition";
+const char *const kOriginalOffset = "x-original-offset";
+const char *const kError = "x-error";
+
+// Last value of a header, read in place
+bool header(RdKafka::Message &message, const char *name, std::string &value)
+{
+    rd_kafka_headers_t *hdrs;
+    const void *data;
+    size_t size;
+    if (rd_kafka_message_headers(message.c_ptr(), &hdrs) != RD_KAFKA_RESP_ERR_NO_ERROR ||
+        rd_kafka_header_get_last(hdrs, name, &data, &size) != RD_KAFKA_RESP_ERR_NO_ERROR || !data)
+    {
+        return false;
+    }
+    value.assign(static_cast<const char *>(data), size);
+    return true;
+}
+
+bool ours(const char *name)
+{
+    for (const auto *own : {kAttempt, kRetryAt, kOriginalTopic, kOriginalPartition, kOriginalOffset, kError})
+    {
+        if (!strcmp(name, own))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+}
+
+FailureRouter::FailureRouter(const Policy &policy, RdKafka::Conf *producerConf) : policy_{policy}
+{
+    if (policy_.delaysMs.empty())
+    {
+        policy_.maxAttempts = 1;
+    }
+
+    std::string errstr;
+    if (producerConf->set("dr_cb", this, errstr) != RdKafka::Conf::CONF_OK)
+    {
+        throw std::runtime_error{errstr};
+    }
+    producer_.reset(RdKafka::Producer::create(producerConf, errstr));
+    if (!producer_)
+    {
+        throw std::runtime_error{"failure router producer: " + errstr};
+    }
+}
+
+FailureRouter::~FailureRouter()
+{
+    for (auto &pending : backlog_)
+    {
+        delete pending.headers;
+    }
+    RdKafka::TopicPartition::destroy(due_);
+}
+
+bool FailureRouter::isMessageError(const RdKafka::Message &message)
+{
+    if (message.offset() < 0)
+    {
+        return false;
+    }
+    switch (message.err())
+    {
+    case RdKafka::ERR__BAD_MSG:
+    case RdKafka::ERR__BAD_COMPRESSION:
+    case RdKafka::ERR_CORRUPT_MESSAGE:
+    case RdKafka::ERR_MSG_SIZE_TOO_LARGE:
+    case RdKafka::ERR_INVALID_RECORD:
+    case RdKafka::ERR__KEY_DESERIALIZATION:
+    case RdKafka::ERR__VALUE_DESERIALIZATION:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void FailureRouter::skip(RdKafka::KafkaConsumer *consumer, const RdKafka::Message &message)
+{
+    std::unique_ptr<RdKafka::TopicPartition> tp{
+        RdKafka::TopicPartition::create(message.topic_name(), message.partition(), message.offset() + 1)};
+    consumer->seek(*tp, 0);
+}
+
+std::vector<std::string> FailureRouter::retryTopics(const std::string &topic) const
+{
+    std::vector<std::string> topics;
+    for (const auto delay : policy_.delaysMs)
+    {
+        const auto name = topic + "-retry-" + std::to_string(delay);
+        if (std::find(topics.begin(), topics.end(), name) == topics.end())
+        {
+            topics.push_back(name);
+        }
+    }
+    return topics;
+}
+
+void FailureRouter::route(RdKafka::Message &message, const std::string &reason, bool retriable)
+{
+    // a message from a retry topic keeps its original coordinates
+    std::string topic = message.topic_name(), partition = std::to_string(message.partition()),
+                offset = std::to_string(message.offset()), value;
+    int attempt = 1;
+    if (header(message, kOriginalTopic, value))
+    {
+        topic = value;
+        header(message, kOriginalPartition, partition);
+        header(message, kOriginalOffset, offset);
+        if (header(message, kAttempt, value))
+        {
+            attempt = atoi(value.c_str()) + 1;
+        }
+    }
+
+    Pending pending;
+    auto *headers = RdKafka::Headers::create();
+    pending.headers = headers;
+
+    if (!retriable || attempt >= policy_.maxAttempts)
+    {
+        pending.topic = topic + "-dlq";
+        metrics_.deadLettered++;
+    }
+    else
+    {
+        const auto tier = std::min(static_cast<size_t>(attempt - 1), policy_.delaysMs.size() - 1);
+        pending.topic = topic + "-retry-" + std::to_string(policy_.delaysMs[tier]);
+        headers->add(kRetryAt, std::to_string(CoarseClock::wallMs() + policy_.delaysMs[tier]));
+        metrics_.retried++;
+    }
+    headers->add(kAttempt, std::to_string(attempt));
+    headers->add(kOriginalTopic, topic);
+    headers->add(kOriginalPartition, partition);
+    headers->add(kOriginalOffset, offset);
+    headers->add(kError, reason);
+
+    // application headers are kept, in order
+    rd_kafka_headers_t *hdrs;
+    if (rd_kafka_message_headers(message.c_ptr(), &hdrs) == RD_KAFKA_RESP_ERR_NO_ERROR)
+    {
+        const char *name;
+        const void *data;
+        size_t size;
+        for (size_t i = 0; rd_kafka_header_get_all(hdrs, i, &name, &data, &size) == RD_KAFKA_RESP_ERR_NO_ERROR; i++)
+        {
+            if (!ours(name))
+            {
+                headers->add(name, data, size);
+            }
+        }
+    }
+
+    if (message.key_pointer())
+    {
+        pending.key.reset(new std::string{static_cast<const char *>(message.key_pointer()), message.key_len()});
+    }
+    if (message.payload())
+    {
+        pending.payload.reset(new std::string{static_cast<const char *>(message.payload()), message.len()});
+    }
+
+    inFlight_++;
+    if (!backlog_.empty() || !produce(pending))
+    {
+        backlog_.push_back(std::move(pending));
+    }
+}
+
+// @returns false if the queue is full and pending should be tried again
+bool FailureRouter::produce(Pending &pending)
+{
+    const auto err = producer_->produce(pending.topic, RdKafka::Topic::PARTITION_UA, RdKafka::Producer::RK_MSG_COPY,
+                                        pending.payload ? &(*pending.payload)[0] : nullptr,
+                                        pending.payload ? pending.payload->size() : 0,
+                                        pending.key ? pending.key->data() : nullptr, pending.key ? pending.key->size() : 0,
+                                        0, pending.headers, nullptr);
+    if (err == RdKafka::ERR__QUEUE_FULL)
+    {
+        return false;
+    }
+
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        std::cerr << "% Routing to " << pending.topic << " failed: " << RdKafka::err2str(err) << std::endl;
+        delete pending.headers;     // owned by librdkafka only on success
+        inFlight_--;
+        metrics_.deliveryFailures++;
+        failed_ = true;
+    }
+    pending.headers = nullptr;
+    return true;
+}
+
+bool FailureRouter::hold(RdKafka::KafkaConsumer *consumer, RdKafka::Message &message)
+{
+    std::string value;
+    if (!header(message, kRetryAt, value))
+    {
+        return false;
+    }
+    // x-retry-at is wall clock time, it was written by another process
+    const auto delayMs = strtoll(value.c_str(), nullptr, 10) - CoarseClock::wallMs();
+    if (delayMs <= 0)
+    {
+        return false;
+    }
+
+    // seek back so the message is consumed again once the partition is resumed
+    std::vector<RdKafka::TopicPartition *> tp{
+        RdKafka::TopicPartition::create(message.topic_name(), message.partition(), message.offset())};
+    consumer->pause(tp);
+    consumer->seek(*tp[0], 0);
+    RdKafka::TopicPartition::destroy(tp);
+
+    auto key = std::make_pair(message.topic_name(), message.partition());
+    wheel_.cancel(paused_[key]);
+    paused_[key] = wheel_.schedule(delayMs, [this, key]
+    {
+        paused_.erase(key);
+        due_.push_back(RdKafka::TopicPartition::create(key.first, key.second));
+    });
+    metrics_.held++;
+    return true;
+}
+
+bool FailureRouter::poll(RdKafka::KafkaConsumer *consumer)
+{
+    producer_->poll(0);
+    while (!backlog_.empty() && produce(backlog_.front()))
+    {
+        backlog_.pop_front();
+    }
+
+    wheel_.advance();
+    if (!due_.empty())
+    {
+        consumer->resume(due_);
+        RdKafka::TopicPartition::destroy(due_);
+        due_.clear();
+    }
+    return !failed_;
+}
+
+void FailureRouter::revoke(const std::vector<RdKafka::TopicPartition *> &partitions)
+{
+    for (const auto *tp : partitions)
+    {
+        auto it = paused_.find(std::make_pair(tp->topic(), tp->partition()));
+        if (it != paused_.end())
+        {
+            wheel_.cancel(it->second);
+            paused_.erase(it);
+        }
+    }
+}
+
+void FailureRouter::revokeAll()
+{
+    for (const auto &entry : paused_)
+    {
+        wheel_.cancel(entry.second);
+    }
+    paused_.clear();
+}
+
+bool FailureRouter::flush(int timeoutMs)
+{
+    const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (!backlog_.empty() && std::chrono::steady_clock::now() < end)
+    {
+        producer_->poll(10);
+        while (!backlog_.empty() && produce(backlog_.front()))
+        {
+            backlog_.pop_front();
+        }
+    }
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now());
+    producer_->flush(static_cast<int>(std::max<int64_t>(0, remaining.count())));
+    return canCommit();
+}
+
+void FailureRouter::dr_cb(RdKafka::Message &message)
+{
+    inFlight_--;
+    if (message.err() != RdKafka::ERR_NO_ERROR)
+    {
+        std::cerr << "% Routing to " << message.topic_name() << " failed: " << message.errstr() << std::endl;
+        metrics_.deliveryFailures++;
+        failed_ = true;
+    }
+}
+
+std::string FailureRouter::report() const
+{
+    std::ostringstream out;
+    out << "retried " << metrics_.retried << ", dead lettered " << metrics_.deadLettered << ", held "
+        << metrics_.held << ", in flight " << inFlight_ << ", delivery failures " << metrics_.deliveryFailures;
+    return out.str();
+}
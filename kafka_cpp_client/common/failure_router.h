@@ -0,0 +1,124 @@
+/*
+ * failure_router.h
+ *
+ * Moves messages that failed processing out of the way, so that one poison message does not stop its partition:
+ *  1) A failed message is produced to <topic>-retry-<delay ms> for its next delay tier, or to <topic>-dlq once it
+ *     failed maxAttempts times ( or is not worth retrying ). Key, payload and headers are kept; x-retry-attempt,
+ *     x-retry-at, x-original-topic/partition/offset and x-error are added.
+ *  2) Retry topics are consumed like the original topic. A retried message that is not due yet pauses its
+ *     partition and is sought back to, a timer resumes the partition once it is due. Every retry topic has one
+ *     delay, so its messages are due in offset order and nothing behind the paused one is due earlier.
+ *
+ * Producing is asynchronous: route() never waits, a full producer queue is retried from poll(). Offsets of routed
+ * messages must only be committed once they are delivered, see canCommit().
+ *
+ * Not thread safe: use from the thread that polls the consumer.
+ */
+#pragma once
+
+#include "librdkafka/rdkafkacpp.h"
+#include "timer_wheel.h"
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class FailureRouter : public RdKafka::DeliveryReportCb
+{
+public:
+    struct Policy
+    {
+        std::vector<int64_t> delaysMs{1000, 10000, 60000};  // retry tiers, the last one repeats
+        int maxAttempts{4};                                 // failures before the dead letter topic
+    };
+
+    struct Metrics
+    {
+        uint64_t retried{0};
+        uint64_t deadLettered{0};
+        uint64_t held{0};           // retried messages consumed before they were due
+        uint64_t deliveryFailures{0};
+    };
+
+    /*
+     * @param producerConf  global configuration of the router's own producer ( bootstrap.servers .. )
+     * @throws std::runtime_error if the producer can not be created
+     */
+    FailureRouter(const Policy &policy, RdKafka::Conf *producerConf);
+    ~FailureRouter();
+
+    /*
+     * Consume errors that concern one message ( corrupt, too large, not deserializable ) rather than the consumer,
+     * such a message can be routed like a processing failure and skipped
+     */
+    static bool isMessageError(const RdKafka::Message &message);
+
+    // Seek past a message that can not be consumed, e.g. after routing a message error
+    static void skip(RdKafka::KafkaConsumer *consumer, const RdKafka::Message &message);
+
+    // Retry topics of topic, to subscribe to next to it
+    std::vector<std::string> retryTopics(const std::string &topic) const;
+
+    /*
+     * Send a failed message to its next retry tier, or to the dead letter topic after maxAttempts failures or
+     * when retriable is false. The message is copied, it may be deleted when this returns.
+     */
+    void route(RdKafka::Message &message, const std::string &reason, bool retriable = true);
+
+    /*
+     * A retried message that is not due yet: its partition is paused and sought back to it.
+     * @returns true if the message was held and must not be processed ( nor committed )
+     */
+    bool hold(RdKafka::KafkaConsumer *consumer, RdKafka::Message &message);
+
+    /*
+     * Serve delivery reports, retry produces that found the queue full and resume partitions that are due.
+     * Cheap enough for every consumed message: nothing is scanned unless a resume timer is due.
+     * @returns false once a routed message could not be delivered: its offset must never be committed
+     */
+    bool poll(RdKafka::KafkaConsumer *consumer);
+
+    // Partitions are being revoked, forget that they are paused
+    void revoke(const std::vector<RdKafka::TopicPartition *> &partitions);
+    void revokeAll();
+
+    // No routed message is in flight and none failed: processed offsets may be committed
+    bool canCommit() const { return inFlight_ == 0 && !failed_; }
+
+    // Nothing routed is left to deliver, whether or not it all succeeded
+    bool drained() const { return inFlight_ == 0 && backlog_.empty(); }
+
+    // Wait for routed messages to be delivered. @returns canCommit()
+    bool flush(int timeoutMs);
+
+    void dr_cb(RdKafka::Message &message);
+
+    const Metrics &metrics() const { return metrics_; }
+    std::string report() const;
+
+private:
+    // a produce that found the queue full
+    struct Pending
+    {
+        std::string topic;
+        std::unique_ptr<std::string> key;
+        std::unique_ptr<std::string> payload;
+        RdKafka::Headers *headers;
+    };
+
+    bool produce(Pending &pending);
+
+    Policy policy_;
+    std::unique_ptr<RdKafka::Producer> producer_;
+    std::deque<Pending> backlog_;
+    std::map<std::pair<std::string, int32_t>, TimerWheel::TimerId> paused_;   // partition -> resume timer
+    TimerWheel wheel_;
+    std::vector<RdKafka::TopicPartition *> due_;   // filled by resume timers, resumed by poll()
+    size_t inFlight_{0};
+    bool failed_{false};
+    Metrics metrics_;
+};
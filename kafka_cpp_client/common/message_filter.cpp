@@ -0,0 +1,516 @@
+/*
+ * message_filter.cpp
+ */
+#include "message_filter.h"
+#include "librdkafka/rdkafka.h"
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+/*
+ * What the predicates look at, read once per message. Headers are parsed by librdkafka on first access,
+ * so they are only fetched when a header predicate is evaluated.
+ */
+struct MessageFilter::Fields
+{
+    rd_kafka_message_t *message;
+    const char *key;
+    size_t keyLen;
+    bool hasTimestamp;
+    int64_t timestamp;
+    rd_kafka_headers_t *hdrs{nullptr};
+    bool hdrsLoaded{false};
+
+    rd_kafka_headers_t *headers()
+    {
+        if (!hdrsLoaded)
+        {
+            hdrsLoaded = true;
+            if (rd_kafka_message_headers(message, &hdrs) != RD_KAFKA_RESP_ERR_NO_ERROR)
+            {
+                hdrs = nullptr;
+            }
+        }
+        return hdrs;
+    }
+};
+
+MessageFilter::MessageFilter(const std::string &expression) : text_{expression}
+{
+    root_ = parseOr();
+    skipSpace();
+    if (pos_ != text_.size())
+    {
+        fail("unexpected input");
+    }
+}
+
+bool MessageFilter::matches(RdKafka::Message &message)
+{
+    const auto ts = message.timestamp();
+    Fields fields{message.c_ptr(),
+                  static_cast<const char *>(message.key_pointer()),
+                  message.key_len(),
+                  ts.type != RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE,
+                  ts.timestamp};
+
+    evaluated_++;
+    if (eval(root_, fields))
+    {
+        return true;
+    }
+    dropped_++;
+    return false;
+}
+
+bool MessageFilter::eval(int node, Fields &fields) const
+{
+    const auto &n = nodes_[node];
+    switch (n.op)
+    {
+    case Op::And:
+        for (const auto child : n.children)
+        {
+            if (!eval(child, fields))
+            {
+                return false;
+            }
+        }
+        return true;
+    case Op::Or:
+        for (const auto child : n.children)
+        {
+            if (eval(child, fields))
+            {
+                return true;
+            }
+        }
+        return false;
+    case Op::Not:
+        return !eval(n.children[0], fields);
+    case Op::KeyPrefix:
+        return fields.key && fields.keyLen >= n.value.size() && memcmp(fields.key, n.value.data(), n.value.size()) == 0;
+    case Op::KeyEquals:
+        return fields.key && fields.keyLen == n.value.size() && memcmp(fields.key, n.value.data(), n.value.size()) == 0;
+    case Op::HeaderExists:
+    case Op::HeaderPrefix:
+    case Op::HeaderEquals:
+    {
+        auto *hdrs = fields.headers();
+        const void *value;
+        size_t size;
+        if (!hdrs || rd_kafka_header_get_last(hdrs, n.name.c_str(), &value, &size) != RD_KAFKA_RESP_ERR_NO_ERROR)
+        {
+            return false;
+        }
+        if (n.op == Op::HeaderExists)
+        {
+            return true;
+        }
+        if (!value || size < n.value.size() || (n.op == Op::HeaderEquals && size != n.value.size()))
+        {
+            return false;
+        }
+        return memcmp(value, n.value.data(), n.value.size()) == 0;
+    }
+    case Op::TimeRange:
+        return fields.hasTimestamp && fields.timestamp >= n.lo && fields.timestamp <= n.hi;
+    }
+    return false;
+}
+
+/*
+ * Parser: recursive descent, || binds weaker than &&, ! binds strongest.
+ */
+int MessageFilter::parseOr()
+{
+    std::vector<int> operands{parseAnd()};
+    while (accept("||"))
+    {
+        operands.push_back(parseAnd());
+    }
+    return operands.size() == 1 ? operands[0] : combine(Op::Or, std::move(operands));
+}
+
+int MessageFilter::parseAnd()
+{
+    std::vector<int> operands{parseUnary()};
+    while (accept("&&"))
+    {
+        operands.push_back(parseUnary());
+    }
+    return operands.size() == 1 ? operands[0] : combine(Op::And, std::move(operands));
+}
+
+int MessageFilter::parseUnary()
+{
+    if (accept("!"))
+    {
+        const auto child = parseUnary();
+        if (nodes_[child].op == Op::Not)
+        {
+            return nodes_[child].children[0];
+        }
+        Node node;
+        node.op = Op::Not;
+        node.children.push_back(child);
+        nodes_.push_back(std::move(node));
+        return static_cast<int>(nodes_.size() - 1);
+    }
+    if (accept("("))
+    {
+        const auto node = parseOr();
+        expect(")");
+        return node;
+    }
+    return parsePredicate();
+}
+
+int MessageFilter::parsePredicate()
+{
+    skipSpace();
+    const auto field = parseName(false);
+    Node node;
+
+    if (field == "key")
+    {
+        if (accept("^="))
+        {
+            node.op = Op::KeyPrefix;
+        }
+        else
+        {
+            expect("==");
+            node.op = Op::KeyEquals;
+        }
+        node.value = parseString();
+    }
+    else if (field == "header")
+    {
+        if (accept("["))
+        {
+            node.name = parseString();
+            expect("]");
+        }
+        else
+        {
+            expect(".");
+            node.name = parseName(true);
+        }
+
+        node.op = Op::HeaderExists;
+        if (accept("^="))
+        {
+            node.op = Op::HeaderPrefix;
+            node.value = parseString();
+        }
+        else if (accept("=="))
+        {
+            node.op = Op::HeaderEquals;
+            node.value = parseString();
+        }
+    }
+    else if (field == "ts")
+    {
+        node.op = Op::TimeRange;
+        if (accept(">="))
+        {
+            node.lo = parseNumber();
+        }
+        else if (accept("<="))
+        {
+            node.hi = parseNumber();
+        }
+        else if (accept(">"))
+        {
+            const auto ts = parseNumber();
+            node.lo = ts == INT64_MAX ? ts : ts + 1;
+            node.hi = ts == INT64_MAX ? INT64_MIN : INT64_MAX;    // nothing is later
+        }
+        else if (accept("<"))
+        {
+            const auto ts = parseNumber();
+            node.hi = ts == INT64_MIN ? ts : ts - 1;
+            node.lo = ts == INT64_MIN ? INT64_MAX : INT64_MIN;    // nothing is earlier
+        }
+        else
+        {
+            expect("==");
+            node.lo = node.hi = parseNumber();
+        }
+    }
+    else
+    {
+        fail("unknown field '" + field + "', expected key, header or ts");
+    }
+
+    nodes_.push_back(std::move(node));
+    return static_cast<int>(nodes_.size() - 1);
+}
+
+int MessageFilter::cost(int node) const
+{
+    switch (nodes_[node].op)
+    {
+    case Op::TimeRange:
+        return 0;
+    case Op::KeyPrefix:
+    case Op::KeyEquals:
+        return 1;
+    case Op::HeaderExists:
+    case Op::HeaderPrefix:
+    case Op::HeaderEquals:
+        return 2;
+    case Op::Not:
+        return cost(nodes_[node].children[0]);
+    default:
+        return 3;
+    }
+}
+
+/*
+ * Flatten nested operators of the same kind, merge the time ranges of an && into one and order the operands
+ * cheapest first. Predicates have no side effects, so the order does not change the result.
+ */
+int MessageFilter::combine(Op op, std::vector<int> operands)
+{
+    Node node;
+    node.op = op;
+    int range = -1;
+
+    for (const auto operand : operands)
+    {
+        if (nodes_[operand].op == op)
+        {
+            const auto children = nodes_[operand].children;
+            node.children.insert(node.children.end(), children.begin(), children.end());
+        }
+        else
+        {
+            node.children.push_back(operand);
+        }
+    }
+
+    if (op == Op::And)
+    {
+        std::vector<int> merged;
+        for (const auto child : node.children)
+        {
+            if (nodes_[child].op != Op::TimeRange)
+            {
+                merged.push_back(child);
+            }
+            else if (range < 0)
+            {
+                range = child;
+                merged.push_back(child);
+            }
+            else
+            {
+                nodes_[range].lo = std::max(nodes_[range].lo, nodes_[child].lo);
+                nodes_[range].hi = std::min(nodes_[range].hi, nodes_[child].hi);
+            }
+        }
+        node.children.swap(merged);
+    }
+
+    std::stable_sort(node.children.begin(), node.children.end(), [this](int a, int b) { return cost(a) < cost(b); });
+
+    if (node.children.size() == 1)
+    {
+        return node.children[0];
+    }
+    nodes_.push_back(std::move(node));
+    return static_cast<int>(nodes_.size() - 1);
+}
+
+void MessageFilter::skipSpace()
+{
+    while (pos_ < text_.size() && isspace(static_cast<unsigned char>(text_[pos_])))
+    {
+        pos_++;
+    }
+}
+
+bool MessageFilter::accept(const char *token)
+{
+    skipSpace();
+    const auto len = strlen(token);
+    if (text_.compare(pos_, len, token) != 0)
+    {
+        return false;
+    }
+    pos_ += len;
+    return true;
+}
+
+void MessageFilter::expect(const char *token)
+{
+    if (!accept(token))
+    {
+        fail(std::string{"expected '"} + token + "'");
+    }
+}
+
+std::string MessageFilter::parseString()
+{
+    skipSpace();
+    if (pos_ == text_.size() || text_[pos_] != '"')
+    {
+        fail("expected a quoted string");
+    }
+
+    std::string value;
+    for (pos_++; pos_ < text_.size() && text_[pos_] != '"'; pos_++)
+    {
+        if (text_[pos_] == '\\' && pos_ + 1 < text_.size())
+        {
+            pos_++;
+        }
+        value += text_[pos_];
+    }
+    if (pos_ == text_.size())
+    {
+        fail("unterminated string");
+    }
+    pos_++;
+    return value;
+}
+
+// identifiers; header names may also contain '-' and '.', e.g. trace-id or app.version
+std::string MessageFilter::parseName(bool header)
+{
+    const auto start = pos_;
+    while (pos_ < text_.size() && (isalnum(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == '_' ||
+                                   (header && (text_[pos_] == '-' || text_[pos_] == '.'))))
+    {
+        pos_++;
+    }
+    if (pos_ == start)
+    {
+        fail("expected a name");
+    }
+    return text_.substr(start, pos_ - start);
+}
+
+int64_t MessageFilter::parseNumber()
+{
+    skipSpace();
+    const char *start = text_.c_str() + pos_;
+    char *end;
+    errno = 0;
+    const auto value = strtoll(start, &end, 10);
+    if (end == start || errno == ERANGE)
+    {
+        fail("expected a timestamp in milliseconds");
+    }
+    pos_ += static_cast<size_t>(end - start);
+    return value;
+}
+
+void MessageFilter::fail(const std::string &what) const
+{
+    throw std::invalid_argument{"filter: " + what + " at position " + std::to_string(pos_) + " of \"" + text_ + "\""};
+}
+
+static void quote(const std::string &value, std::string &out)
+{
+    out += '"';
+    for (const auto c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+        }
+        out += c;
+    }
+    out += '"';
+}
+
+void MessageFilter::print(int node, std::string &out) const
+{
+    const auto &n = nodes_[node];
+    switch (n.op)
+    {
+    case Op::And:
+    case Op::Or:
+        out += '(';
+        for (size_t i = 0; i < n.children.size(); i++)
+        {
+            if (i)
+            {
+                out += n.op == Op::And ? " && " : " || ";
+            }
+            print(n.children[i], out);
+        }
+        out += ')';
+        break;
+    case Op::Not:
+        out += "!(";
+        print(n.children[0], out);
+        out += ')';
+        break;
+    case Op::KeyPrefix:
+    case Op::KeyEquals:
+        out += n.op == Op::KeyPrefix ? "key ^= " : "key == ";
+        quote(n.value, out);
+        break;
+    case Op::HeaderExists:
+    case Op::HeaderPrefix:
+    case Op::HeaderEquals:
+        out += "header[";
+        quote(n.name, out);
+        out += ']';
+        if (n.op != Op::HeaderExists)
+        {
+            out += n.op == Op::HeaderPrefix ? " ^= " : " == ";
+            quote(n.value, out);
+        }
+        break;
+    case Op::TimeRange:
+        if (n.lo > n.hi)
+        {
+            out += "ts in []";
+        }
+        else if (n.lo == n.hi)
+        {
+            out += "ts == " + std::to_string(n.lo);
+        }
+        else if (n.hi == INT64_MAX)
+        {
+            out += "ts >= " + std::to_string(n.lo);
+        }
+        else if (n.lo == INT64_MIN)
+        {
+            out += "ts <= " + std::to_string(n.hi);
+        }
+        else
+        {
+            out += "ts in [" + std::to_string(n.lo) + ", " + std::to_string(n.hi) + "]";
+        }
+        break;
+    }
+}
+
+std::string MessageFilter::str() const
+{
+    std::string out;
+    print(root_, out);
+    return out;
+}
+
+std::string MessageFilter::report() const
+{
+    std::ostringstream out;
+    out << "evaluated " << evaluated_ << ", dropped " << dropped_;
+    if (evaluated_)
+    {
+        out << " (" << (100.0 * dropped_ / evaluated_) << "%)";
+    }
+    return out.str();
+}
@@ -0,0 +1,107 @@
+/*
+ * message_filter.h
+ *
+ * Drops messages on the consumer thread right after they are fetched, looking only at the key, the headers and
+ * the timestamp, before the payload is copied, decoded or queued.
+ *
+ * Expressions:
+ *  key ^= "prefix"                 key starts with prefix
+ *  key == "value"                  key equals value
+ *  header.name                     header present ( also header["any name"] )
+ *  header.name == "value"          last header of that name equals value
+ *  header.name ^= "prefix"         last header of that name starts with prefix
+ *  ts >= 1620000000000             message timestamp in ms, also > < <= ==; no timestamp never matches
+ *  a && b, a || b, !a, ( a )
+ *
+ * e.g. key ^= "eu-" && header.type == "order" && ts >= 1620000000000
+ *
+ * The expression is compiled once: timestamp comparisons in the same && are merged into one range, and the
+ * operands of && / || are reordered cheapest first ( timestamp, key, headers, nested expressions ) so that
+ * headers are only parsed when the cheaper tests did not already decide. Evaluation does not allocate.
+ *
+ * Not thread safe ( counters ).
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace RdKafka
+{
+class Message;
+}
+
+class MessageFilter
+{
+public:
+    // @throws std::invalid_argument naming the position of a syntax error
+    explicit MessageFilter(const std::string &expression);
+
+    // true if the message should be processed. Non-const message: headers are read through its C handle
+    bool matches(RdKafka::Message &message);
+
+    // The compiled expression, after merging and reordering
+    std::string str() const;
+
+    uint64_t evaluated() const { return evaluated_; }
+    uint64_t dropped() const { return dropped_; }
+
+    // One line summary of the counters
+    std::string report() const;
+
+private:
+    enum class Op
+    {
+        And,
+        Or,
+        Not,
+        KeyPrefix,
+        KeyEquals,
+        HeaderExists,
+        HeaderPrefix,
+        HeaderEquals,
+        TimeRange
+    };
+
+    struct Node
+    {
+        Op op{Op::And};
+        std::vector<int> children;
+        std::string name;       // header name
+        std::string value;      // key / header value or prefix
+        int64_t lo{INT64_MIN};  // TimeRange, inclusive
+        int64_t hi{INT64_MAX};
+    };
+
+    struct Fields;
+
+    // parser, see message_filter.cpp
+    int parseOr();
+    int parseAnd();
+    int parseUnary();
+    int parsePredicate();
+    int combine(Op op, std::vector<int> operands);
+    int cost(int node) const;
+
+    void skipSpace();
+    bool accept(const char *token);
+    void expect(const char *token);
+    std::string parseString();
+    std::string parseName(bool header);
+    int64_t parseNumber();
+    [[noreturn]] void fail(const std::string &what) const;
+
+    bool eval(int node, Fields &fields) const;
+    void print(int node, std::string &out) const;
+
+    std::vector<Node> nodes_;
+    int root_{-1};
+
+    std::string text_;  // expression being parsed
+    size_t pos_{0};
+
+    uint64_t evaluated_{0};
+    uint64_t dropped_{0};
+};
@@ -0,0 +1,366 @@
+/*
+ * metrics.cpp
+ */
+#include "metrics.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+std::atomic<size_t> nextShard{0};
+thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % MetricShard::kShards;
+
+size_t bucketOf(uint64_t value)
+{
+    const size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    return bucket < Histogram::kBuckets ? bucket : Histogram::kBuckets - 1;
+}
+
+std::runtime_error systemError(const std::string &what)
+{
+    return std::runtime_error{what + ": " + strerror(errno)};
+}
+}
+
+size_t MetricShard::current()
+{
+    return shard;
+}
+
+uint64_t Counter::value() const
+{
+    uint64_t sum = 0;
+    for (const auto &s : shards_)
+    {
+        sum += s.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+void Histogram::observe(uint64_t value)
+{
+    auto &s = shards_[MetricShard::current()];
+    s.buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const
+{
+    Snapshot snapshot;
+    for (const auto &s : shards_)
+    {
+        for (size_t i = 0; i < kBuckets; i++)
+        {
+            const auto n = s.buckets[i].load(std::memory_order_relaxed);
+            snapshot.buckets[i] += n;
+            snapshot.count += n;
+        }
+        snapshot.sum += s.sum.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const
+{
+    const auto rank = static_cast<uint64_t>(q * count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++)
+    {
+        seen += buckets[i];
+        if (seen > rank)
+        {
+            return (uint64_t{1} << i) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
+
+void *Metrics::find(const std::string &name, Type type, const std::string &help)
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    auto it = entries_.find(name);
+    if (it != entries_.end())
+    {
+        if (it->second.type != type)
+        {
+            throw std::runtime_error{"metric " + name + " registered with another type"};
+        }
+        it->second.exported = true;
+        return it->second.metric;
+    }
+
+    void *metric;
+    switch (type)
+    {
+    case Type::Counter:
+        metric = &counters_.emplace_back();
+        break;
+    case Type::Gauge:
+        metric = &gauges_.emplace_back();
+        break;
+    default:
+        metric = &histograms_.emplace_back();
+        break;
+    }
+    entries_.emplace(name, Entry{type, help, metric, true});
+    return metric;
+}
+
+Counter &Metrics::counter(const std::string &name, const std::string &help)
+{
+    return *static_cast<Counter *>(find(name, Type::Counter, help));
+}
+
+Gauge &Metrics::gauge(const std::string &name, const std::string &help)
+{
+    return *static_cast<Gauge *>(find(name, Type::Gauge, help));
+}
+
+Histogram &Metrics::histogram(const std::string &name, const std::string &help)
+{
+    return *static_cast<Histogram *>(find(name, Type::Histogram, help));
+}
+
+void Metrics::remove(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    auto it = entries_.find(name);
+    if (it != entries_.end())
+    {
+        it->second.exported = false;
+    }
+}
+
+std::string Metrics::label(const std::string &name, const std::string &value)
+{
+    std::string out = name + "=\"";
+    for (const char c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+std::string Metrics::exposition() const
+{
+    std::lock_guard<std::mutex> lock{lock_};
+
+    // the samples of a family must follow its TYPE line, "lag_ms" sorts between "lag" and "lag{..}"
+    std::map<std::string, std::vector<std::map<std::string, Entry>::const_iterator>> families;
+    for (auto it = entries_.begin(); it != entries_.end(); ++it)
+    {
+        if (it->second.exported)
+        {
+            families[it->first.substr(0, it->first.find('{'))].push_back(it);
+        }
+    }
+
+    std::ostringstream out;
+    for (const auto &family : families)
+    {
+        const auto &name = family.first;
+        const auto &first = family.second.front()->second;
+        if (!first.help.empty())
+        {
+            out << "# HELP " << name << " " << first.help << "\n";
+        }
+        out << "# TYPE " << name << " "
+            << (first.type == Type::Counter ? "counter" : first.type == Type::Gauge ? "gauge" : "histogram") << "\n";
+
+        for (const auto &it : family.second)
+        {
+            const auto &entry = it->second;
+            const auto labels = it->first.substr(name.size());  // "" or "{..}"
+            switch (entry.type)
+            {
+            case Type::Counter:
+                out << it->first << " " << static_cast<const Counter *>(entry.metric)->value() << "\n";
+                break;
+            case Type::Gauge:
+                out << it->first << " " << static_cast<const Gauge *>(entry.metric)->value() << "\n";
+                break;
+            case Type::Histogram:
+            {
+                const auto snapshot = static_cast<const Histogram *>(entry.metric)->snapshot();
+                // le joins the other labels
+                const auto prefix = labels.empty() ? std::string{"{"} : labels.substr(0, labels.size() - 1) + ",";
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i + 1 < Histogram::kBuckets; i++)
+                {
+                    cumulative += snapshot.buckets[i];
+                    out << name << "_bucket" << prefix << "le=\"" << ((uint64_t{1} << i) - 1) << "\"} " << cumulative
+                        << "\n";
+                }
+                out << name << "_bucket" << prefix << "le=\"+Inf\"} " << snapshot.count << "\n"
+                    << name << "_sum" << labels << " " << snapshot.sum << "\n"
+                    << name << "_count" << labels << " " << snapshot.count << "\n";
+                break;
+            }
+            }
+        }
+    }
+    return out.str();
+}
+
+MetricsExporter::MetricsExporter(const Metrics &metrics, const std::string &path, int port, int intervalMs)
+    : metrics_{metrics}, path_{path}, intervalMs_{intervalMs}
+{
+    if (pipe(wake_) < 0)
+    {
+        throw systemError("pipe");
+    }
+    if (port > 0)
+    {
+        listen_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const int one = 1;
+        setsockopt(listen_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (listen_ < 0 || bind(listen_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_, 16) < 0)
+        {
+            const auto error = systemError("metrics port " + std::to_string(port));
+            if (listen_ >= 0)
+            {
+                close(listen_);
+            }
+            close(wake_[0]);
+            close(wake_[1]);
+            throw error;
+        }
+    }
+    thread_ = std::thread{&MetricsExporter::run, this};
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    (void)write(wake_[1], "x", 1);
+    thread_.join();
+    // the final values
+    writeFile();
+    if (listen_ >= 0)
+    {
+        close(listen_);
+    }
+    close(wake_[0]);
+    close(wake_[1]);
+}
+
+void MetricsExporter::run()
+{
+    struct pollfd fds[2] = {{wake_[0], POLLIN, 0}, {listen_, POLLIN, 0}};
+    // a deadline, not the poll timeout: scrapes more frequent than the interval must not hold the file back
+    auto nextWrite = std::chrono::steady_clock::now() + std::chrono::milliseconds(intervalMs_);
+    for (;;)
+    {
+        int timeoutMs = -1;
+        if (!path_.empty())
+        {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(nextWrite -
+                                                                                    std::chrono::steady_clock::now());
+            timeoutMs = static_cast<int>(std::max<int64_t>(0, left.count()));
+        }
+        const int n = poll(fds, listen_ >= 0 ? 2 : 1, timeoutMs);
+        if (n < 0 && errno != EINTR)
+        {
+            return;
+        }
+        if (n > 0 && fds[0].revents)
+        {
+            return;
+        }
+        if (n > 0 && listen_ >= 0 && fds[1].revents)
+        {
+            serve();
+        }
+        if (!path_.empty() && std::chrono::steady_clock::now() >= nextWrite)
+        {
+            writeFile();
+            nextWrite += std::chrono::milliseconds(intervalMs_);
+            // behind by more than an interval ( e.g. a slow disk ): the next one a full interval from now
+            const auto now = std::chrono::steady_clock::now();
+            if (nextWrite <= now)
+            {
+                nextWrite = now + std::chrono::milliseconds(intervalMs_);
+            }
+        }
+    }
+}
+
+void MetricsExporter::writeFile()
+{
+    if (path_.empty())
+    {
+        return;
+    }
+    const auto body = metrics_.exposition();
+    const auto tmp = path_ + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "w");
+    if (!file)
+    {
+        return;
+    }
+    const bool written = fwrite(body.data(), 1, body.size(), file) == body.size();
+    if (fclose(file) == 0 && written)
+    {
+        rename(tmp.c_str(), path_.c_str());
+    }
+}
+
+// Any request gets the exposition: there is nothing else to serve
+void MetricsExporter::serve()
+{
+    const int client = accept4(listen_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0)
+    {
+        return;
+    }
+    // a stalled scraper must not stall the exporter
+    struct timeval timeout = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[4096];
+    (void)read(client, request, sizeof(request));
+
+    const auto body = metrics_.exposition();
+    const auto response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                          std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        const auto n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            break;
+        }
+        sent += n;
+    }
+    close(client);
+}
@@ -0,0 +1,172 @@
+/*
+ * metrics.h
+ *
+ * Counters, gauges and histograms any thread can update without a lock, and an exporter that snapshots them in the
+ * Prometheus text format to a file or an HTTP endpoint.
+ *
+ * A counter or histogram is kShards cache line sized slots: a thread always updates the slot of its shard ( threads
+ * are given shards round robin ) with relaxed atomics, so threads on different shards never share a cache line.
+ * Reading sums the shards: a snapshot is not atomic across metrics, but every value in it is one that was written.
+ *
+ *  Metrics metrics;
+ *  auto &consumed = metrics.counter("consumer_messages_total", "Messages consumed");
+ *  auto &size = metrics.histogram("consumer_message_bytes", "Payload size");
+ *  MetricsExporter exporter{metrics, "/var/lib/node_exporter/consumer.prom", 9464, 5000};
+ *  ...
+ *  consumed.add();
+ *  size.observe(msg->len());
+ *
+ * Registering is locked and returns references that stay valid as long as the registry: look metrics up once,
+ * not on the hot path.
+ *
+ * A name may carry labels, metrics.gauge("lag{group=\"g1\",partition=\"0\"}"): every name up to the '{' is one
+ * family in the exposition. Metrics::label() quotes a label value.
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace MetricShard
+{
+constexpr size_t kShards = 16;
+
+// Shard of the calling thread, fixed for its lifetime
+size_t current();
+}
+
+class Counter
+{
+public:
+    void add(uint64_t n = 1) { shards_[MetricShard::current()].value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const;
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Shard, MetricShard::kShards> shards_;
+};
+
+// Last value set; one cache line, gauges are set rarely ( assignment, connections, budgets )
+class Gauge
+{
+public:
+    void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+    void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    alignas(64) std::atomic<int64_t> value_{0};
+};
+
+/*
+ * Power of two buckets: bucket i counts values below 2^i ( and at least 2^(i-1) ), so 1 us to 1 hour in us, or
+ * 1 byte to 1 GB, fit in 40 buckets
+ */
+class Histogram
+{
+public:
+    static constexpr size_t kBuckets = 40;
+
+    void observe(uint64_t value);
+
+    struct Snapshot
+    {
+        std::array<uint64_t, kBuckets> buckets{};
+        uint64_t count{0};
+        uint64_t sum{0};
+
+        // upper bound of the bucket holding quantile q ( 0..1 )
+        uint64_t quantile(double q) const;
+    };
+    Snapshot snapshot() const;
+
+private:
+    struct alignas(64) Shard
+    {
+        std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+        std::atomic<uint64_t> sum{0};
+    };
+    std::array<Shard, MetricShard::kShards> shards_;
+};
+
+class Metrics
+{
+public:
+    Counter &counter(const std::string &name, const std::string &help = "");
+    Gauge &gauge(const std::string &name, const std::string &help = "");
+    Histogram &histogram(const std::string &name, const std::string &help = "");
+
+    /*
+     * Leave a metric out of the exposition, e.g. the labels of a partition that went away. References to it stay
+     * valid, registering the name again gives the same metric.
+     */
+    void remove(const std::string &name);
+
+    // Every metric in the Prometheus text exposition format
+    std::string exposition() const;
+
+    // name="value", escaped
+    static std::string label(const std::string &name, const std::string &value);
+
+private:
+    enum class Type
+    {
+        Counter,
+        Gauge,
+        Histogram
+    };
+
+    struct Entry
+    {
+        Type type;
+        std::string help;
+        void *metric;
+        bool exported;
+    };
+
+    void *find(const std::string &name, Type type, const std::string &help);
+
+    mutable std::mutex lock_;
+    std::map<std::string, Entry> entries_;
+    std::deque<Counter> counters_;
+    std::deque<Gauge> gauges_;
+    std::deque<Histogram> histograms_;
+};
+
+/*
+ * Exports a registry from its own thread: rewrites path every intervalMs ( written aside and renamed, readers never
+ * see half a file ), and answers every HTTP request on port with a fresh exposition. An empty path or port 0 turns
+ * that export off.
+ */
+class MetricsExporter
+{
+public:
+    // @throws std::runtime_error if port can not be listened on
+    MetricsExporter(const Metrics &metrics, const std::string &path, int port, int intervalMs = 5000);
+    ~MetricsExporter();
+    MetricsExporter(const MetricsExporter &) = delete;
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+private:
+    void run();
+    void writeFile();
+    void serve();
+
+    const Metrics &metrics_;
+    std::string path_;
+    int listen_{-1};
+    int wake_[2]{-1, -1};   // pipe, written to stop the thread
+    int intervalMs_;
+    std::thread thread_;
+};
@@ -0,0 +1,223 @@
+/*
+ * prefetch_budget.cpp
+ */
+#include "prefetch_budget.h"
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+PrefetchBudget::PrefetchBudget(int64_t budgetBytes, int64_t fetchBytes, double resumeRatio)
+    : budgetBytes_{budgetBytes}, fetchBytes_{std::max<int64_t>(1, fetchBytes)},
+      resumeBytes_{static_cast<int64_t>(budgetBytes * resumeRatio)}
+{
+}
+
+PrefetchBudget::PartitionBuffer *PrefetchBudget::find(const std::string &topic, int32_t partition)
+{
+    auto it = partitions_.find(Key{topic, partition});
+    return it == partitions_.end() ? nullptr : &it->second;
+}
+
+/*
+ * Newly assigned partitions start empty, but each may fetch fetchBytes right away.
+ * Only as many as fit the budget are left running, the others start paused and are resumed by enforce().
+ */
+void PrefetchBudget::assign(RdKafka::KafkaConsumer *consumer, const std::vector<RdKafka::TopicPartition *> &partitions)
+{
+    int64_t active = 0;
+    for (const auto &entry : partitions_)
+    {
+        active += entry.second.paused ? 0 : 1;
+    }
+    const auto fit = std::max<int64_t>(1, budgetBytes_ / fetchBytes_);
+
+    std::vector<PartitionBuffer *> toPause;
+    for (const auto *tp : partitions)
+    {
+        auto &pb = partitions_[Key{tp->topic(), tp->partition()}];
+        pb = PartitionBuffer{tp->topic(), tp->partition(), 0, 0, 0, false};
+        if (active >= fit)
+        {
+            toPause.push_back(&pb);
+        }
+        else
+        {
+            active++;
+        }
+    }
+    setPaused(consumer, toPause, true);
+}
+
+void PrefetchBudget::revoke(const std::vector<RdKafka::TopicPartition *> &partitions)
+{
+    for (const auto *tp : partitions)
+    {
+        const Key key{tp->topic(), tp->partition()};
+        partitions_.erase(key);
+        pausedOrder_.erase(std::remove(pausedOrder_.begin(), pausedOrder_.end(), key), pausedOrder_.end());
+    }
+}
+
+void PrefetchBudget::revokeAll()
+{
+    partitions_.clear();
+    pausedOrder_.clear();
+}
+
+void PrefetchBudget::consumed(const std::string &topic, int32_t partition, size_t bytes)
+{
+    if (auto *pb = find(topic, partition))
+    {
+        pb->consumedBytes += static_cast<int64_t>(bytes);
+        pb->inFlightBytes += static_cast<int64_t>(bytes);
+    }
+}
+
+void PrefetchBudget::processed(const std::string &topic, int32_t partition, size_t bytes)
+{
+    if (auto *pb = find(topic, partition))
+    {
+        pb->inFlightBytes = std::max<int64_t>(0, pb->inFlightBytes - static_cast<int64_t>(bytes));
+    }
+}
+
+void PrefetchBudget::observeStats(const ConsumerStats &stats)
+{
+    for (const auto &ps : stats.partitions)
+    {
+        if (auto *pb = find(ps.topic, ps.partition))
+        {
+            pb->fetchqBytes = ps.fetchqSize;
+            pb->consumedBytes = 0;
+        }
+    }
+}
+
+int64_t PrefetchBudget::buffered() const
+{
+    int64_t total = 0;
+    for (const auto &entry : partitions_)
+    {
+        total += entry.second.buffered();
+    }
+    return total;
+}
+
+/*
+ * Projected use = what is buffered now + one more fetch for every running partition.
+ * Over budget : pause the running partitions holding the most, they are furthest ahead of processing.
+ * Below the resume watermark : resume paused partitions in the order they were paused.
+ */
+void PrefetchBudget::enforce(RdKafka::KafkaConsumer *consumer)
+{
+    std::vector<PartitionBuffer *> running;
+    int64_t projected = 0;
+    for (auto &entry : partitions_)
+    {
+        auto &pb = entry.second;
+        projected += pb.buffered();
+        if (!pb.paused)
+        {
+            running.push_back(&pb);
+            projected += fetchBytes_;
+        }
+    }
+
+    if (projected > budgetBytes_ && running.size() > 1)
+    {
+        std::sort(running.begin(), running.end(), [](const PartitionBuffer *a, const PartitionBuffer *b)
+                  { return a->buffered() > b->buffered(); });
+
+        std::vector<PartitionBuffer *> toPause;
+        // always keep one partition running so processing makes progress
+        for (size_t i = 0; i + 1 < running.size() && projected > budgetBytes_; i++)
+        {
+            toPause.push_back(running[i]);
+            projected -= fetchBytes_;
+        }
+        setPaused(consumer, toPause, true);
+        return;
+    }
+
+    std::vector<PartitionBuffer *> toResume;
+    while (!pausedOrder_.empty() && projected + fetchBytes_ <= resumeBytes_)
+    {
+        if (auto *pb = find(pausedOrder_.front().topic, pausedOrder_.front().partition))
+        {
+            toResume.push_back(pb);
+            projected += fetchBytes_;
+        }
+        pausedOrder_.pop_front();
+    }
+    // nothing running and nothing fits: resume one anyway rather than stall
+    if (running.empty() && toResume.empty() && !pausedOrder_.empty())
+    {
+        if (auto *pb = find(pausedOrder_.front().topic, pausedOrder_.front().partition))
+        {
+            toResume.push_back(pb);
+        }
+        pausedOrder_.pop_front();
+    }
+    setPaused(consumer, toResume, false);
+}
+
+void PrefetchBudget::setPaused(RdKafka::KafkaConsumer *consumer, const std::vector<PartitionBuffer *> &parts, bool pause)
+{
+    if (parts.empty())
+    {
+        return;
+    }
+
+    std::vector<RdKafka::TopicPartition *> tps;
+    tps.reserve(parts.size());
+    for (auto *pb : parts)
+    {
+        tps.push_back(RdKafka::TopicPartition::create(pb->topic, pb->partition));
+    }
+
+    const auto err = pause ? consumer->pause(tps) : consumer->resume(tps);
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        std::cerr << "% " << (pause ? "Pause" : "Resume") << " failed: " << RdKafka::err2str(err) << std::endl;
+        if (!pause)
+        {
+            // retry on the next enforce(), still first in line
+            for (auto it = parts.rbegin(); it != parts.rend(); ++it)
+            {
+                pausedOrder_.push_front(Key{(*it)->topic, (*it)->partition});
+            }
+        }
+    }
+    else
+    {
+        for (auto *pb : parts)
+        {
+            pb->paused = pause;
+            if (pause)
+            {
+                pausedOrder_.push_back(Key{pb->topic, pb->partition});
+            }
+        }
+    }
+    RdKafka::TopicPartition::destroy(tps);
+}
+
+std::string PrefetchBudget::report() const
+{
+    std::vector<const PartitionBuffer *> parts;
+    parts.reserve(partitions_.size());
+    for (const auto &entry : partitions_)
+    {
+        parts.push_back(&entry.second);
+    }
+    std::sort(parts.begin(), parts.end(), [](const PartitionBuffer *a, const PartitionBuffer *b)
+              { return a->topic != b->topic ? a->topic < b->topic : a->partition < b->partition; });
+
+    std::ostringstream out;
+    for (const auto *pb : parts)
+    {
+        out << pb->topic << " [" << pb->partition << "] " << pb->buffered() << (pb->paused ? " paused" : "") << "\n";
+    }
+    return out.str();
+}
@@ -0,0 +1,102 @@
+/*
+ * prefetch_budget.h
+ *
+ * Global memory budget for everything a KafkaConsumer has fetched but the application has not processed yet,
+ * across all assigned partitions.
+ *
+ * librdkafka buffers up to max.partition.fetch.bytes per partition ( and more in flight ), so a consumer
+ * assigned hundreds of partitions during a rebalance can buffer far more than it can process. The budget
+ *  1) estimates buffered bytes per partition from the fetch queue sizes in the statistics, minus what the
+ *     application consumed since,
+ *  2) pauses the partitions holding the most buffered bytes when the total exceeds the budget, and
+ *  3) resumes paused partitions, longest paused first, once the total drops below the resume watermark.
+ *
+ * Not thread safe: call from the thread that polls the consumer ( statistics and rebalance callbacks
+ * are served there ).
+ */
+#pragma once
+
+#include "stats_parser.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace RdKafka
+{
+class KafkaConsumer;
+class TopicPartition;
+}
+
+class PrefetchBudget
+{
+public:
+    struct PartitionBuffer
+    {
+        std::string topic;
+        int32_t partition;
+        int64_t fetchqBytes;    // fetch queue size at the last statistics
+        int64_t consumedBytes;  // consumed by the application since the last statistics
+        int64_t inFlightBytes;  // consumed but not yet processed
+        bool paused;
+
+        // estimated bytes held for this partition
+        int64_t buffered() const
+        {
+            const auto queued = fetchqBytes > consumedBytes ? fetchqBytes - consumedBytes : 0;
+            return queued + inFlightBytes;
+        }
+    };
+
+    /*
+     * @param budgetBytes     bytes all partitions together may buffer
+     * @param fetchBytes      max.partition.fetch.bytes, what a resumed partition may add at once
+     * @param resumeRatio     resume paused partitions below budget * resumeRatio
+     */
+    PrefetchBudget(int64_t budgetBytes, int64_t fetchBytes, double resumeRatio = 0.7);
+
+    // Rebalance : track newly assigned partitions / forget revoked ones
+    void assign(RdKafka::KafkaConsumer *consumer, const std::vector<RdKafka::TopicPartition *> &partitions);
+    void revoke(const std::vector<RdKafka::TopicPartition *> &partitions);
+    void revokeAll();
+
+    // A message was returned by consume()
+    void consumed(const std::string &topic, int32_t partition, size_t bytes);
+    // Processing of a consumed message finished, for applications that process asynchronously
+    void processed(const std::string &topic, int32_t partition, size_t bytes);
+
+    void observeStats(const ConsumerStats &stats);
+
+    // Pause / resume partitions to keep within the budget
+    void enforce(RdKafka::KafkaConsumer *consumer);
+
+    int64_t buffered() const;
+    int64_t budget() const { return budgetBytes_; }
+    size_t pausedCount() const { return pausedOrder_.size(); }
+
+    // Buffered bytes per partition, one "topic [partition] bytes" line each
+    std::string report() const;
+
+private:
+    struct Key
+    {
+        std::string topic;
+        int32_t partition;
+        bool operator==(const Key &o) const { return partition == o.partition && topic == o.topic; }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key &k) const { return std::hash<std::string>()(k.topic) * 31 + k.partition; }
+    };
+
+    PartitionBuffer *find(const std::string &topic, int32_t partition);
+    void setPaused(RdKafka::KafkaConsumer *consumer, const std::vector<PartitionBuffer *> &parts, bool pause);
+
+    int64_t budgetBytes_;
+    int64_t fetchBytes_;
+    int64_t resumeBytes_;
+    std::unordered_map<Key, PartitionBuffer, KeyHash> partitions_;
+    std::deque<Key> pausedOrder_;   // oldest pause first
+};
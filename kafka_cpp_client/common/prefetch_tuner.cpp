@@ -0,0 +1,169 @@
+/*
+ * prefetch_tuner.cpp
+ */
+#include "prefetch_tuner.h"
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <cstdlib>
+
+// smoothing factor of the moving averages, roughly the last 10 observations
+static const double kAlpha = 0.2;
+// observations needed before the first decision
+static const size_t kMinBatches = 10;
+
+static const int64_t kMaxFetchMinBytes = 1024 * 1024;
+static const int64_t kMinFetchWaitMaxMs = 10;
+static const int64_t kMaxFetchWaitMaxMs = 500;
+static const int64_t kMinQueuedMaxKbytes = 1024;
+static const int64_t kMinPartitionFetchBytes = 64 * 1024;
+static const int64_t kMaxPartitionFetchBytes = 16 * 1024 * 1024;
+
+static double ewma(double avg, double v, bool first)
+{
+    return first ? v : avg + kAlpha * (v - avg);
+}
+
+bool PrefetchConfig::apply(RdKafka::Conf *conf, std::string &errstr) const
+{
+    return conf->set("fetch.min.bytes", std::to_string(fetchMinBytes), errstr) == RdKafka::Conf::CONF_OK &&
+           conf->set("fetch.wait.max.ms", std::to_string(fetchWaitMaxMs), errstr) == RdKafka::Conf::CONF_OK &&
+           conf->set("queued.max.messages.kbytes", std::to_string(queuedMaxKbytes), errstr) == RdKafka::Conf::CONF_OK &&
+           conf->set("max.partition.fetch.bytes", std::to_string(maxPartitionFetchBytes), errstr) == RdKafka::Conf::CONF_OK;
+}
+
+void PrefetchConfig::load(const RdKafka::Conf *conf)
+{
+    std::string value;
+    if (conf->get("fetch.min.bytes", value) == RdKafka::Conf::CONF_OK && !value.empty())
+        fetchMinBytes = strtoll(value.c_str(), nullptr, 10);
+    if (conf->get("fetch.wait.max.ms", value) == RdKafka::Conf::CONF_OK && !value.empty())
+        fetchWaitMaxMs = strtoll(value.c_str(), nullptr, 10);
+    if (conf->get("queued.max.messages.kbytes", value) == RdKafka::Conf::CONF_OK && !value.empty())
+        queuedMaxKbytes = strtoll(value.c_str(), nullptr, 10);
+    if (conf->get("max.partition.fetch.bytes", value) == RdKafka::Conf::CONF_OK && !value.empty())
+        maxPartitionFetchBytes = strtoll(value.c_str(), nullptr, 10);
+}
+
+std::string PrefetchConfig::str() const
+{
+    return "fetch.min.bytes=" + std::to_string(fetchMinBytes) + " fetch.wait.max.ms=" + std::to_string(fetchWaitMaxMs) +
+           " queued.max.messages.kbytes=" + std::to_string(queuedMaxKbytes) +
+           " max.partition.fetch.bytes=" + std::to_string(maxPartitionFetchBytes);
+}
+
+PrefetchTuner::PrefetchTuner(Goal goal, int64_t targetLatencyMs, int64_t memoryBudgetKb, const PrefetchConfig &initial,
+                             int64_t cooldownMs)
+    : goal_{goal}, targetLatencyMs_{targetLatencyMs}, memoryBudgetKb_{memoryBudgetKb}, cooldownMs_{cooldownMs},
+      current_{initial}
+{
+    clampToBudget(current_);
+}
+
+void PrefetchTuner::observeBatch(size_t messages, size_t batchSize, size_t bytes, int64_t elapsedMs)
+{
+    const bool first = batches_ == 0;
+    fill_ = ewma(fill_, batchSize ? static_cast<double>(messages) / batchSize : 0, first);
+    batchMs_ = ewma(batchMs_, static_cast<double>(elapsedMs), first);
+    batchBytes_ = ewma(batchBytes_, static_cast<double>(bytes), first);
+    batches_++;
+}
+
+void PrefetchTuner::observeStats(const ConsumerStats &stats)
+{
+    fetchqBytes_ = ewma(fetchqBytes_, static_cast<double>(stats.fetchqSize), statsSamples_ == 0);
+    partitions_ = std::max<size_t>(1, stats.partitions.size());
+    statsSamples_++;
+}
+
+/*
+ * The fetch queue and max.partition.fetch.bytes per assigned partition can both be filled at once,
+ * so together they must fit the budget.
+ */
+void PrefetchTuner::clampToBudget(PrefetchConfig &cfg) const
+{
+    const auto perPartitionCap = std::max<int64_t>(kMinPartitionFetchBytes, memoryBudgetKb_ * 1024 / 2 / partitions_);
+    cfg.maxPartitionFetchBytes = std::min(cfg.maxPartitionFetchBytes, std::min(perPartitionCap, kMaxPartitionFetchBytes));
+    cfg.queuedMaxKbytes = std::max(kMinQueuedMaxKbytes, std::min(cfg.queuedMaxKbytes, memoryBudgetKb_ / 2));
+    cfg.fetchMinBytes = std::min(cfg.fetchMinBytes, cfg.maxPartitionFetchBytes);
+}
+
+void PrefetchTuner::reset(int64_t nowMs)
+{
+    lastChangeMs_ = nowMs;
+    batches_ = 0;
+    statsSamples_ = 0;
+}
+
+bool PrefetchTuner::retune(int64_t nowMs, PrefetchConfig &next)
+{
+    if (lastChangeMs_ == 0)
+    {
+        lastChangeMs_ = nowMs;
+    }
+    if (nowMs - lastChangeMs_ < cooldownMs_ || batches_ < kMinBatches || statsSamples_ == 0)
+    {
+        return false;
+    }
+
+    next = current_;
+
+    // time a freshly fetched message waits in the fetch queue before the application gets it
+    const double drainBytesPerMs = batchMs_ > 0 ? batchBytes_ / batchMs_ : 0;
+    const double queueLatencyMs = drainBytesPerMs > 0 ? fetchqBytes_ / drainBytesPerMs : 0;
+    const bool starving = fetchqBytes_ < 0.25 * current_.queuedMaxKbytes * 1024;
+
+    if (goal_ == Goal::Throughput)
+    {
+        if (fill_ >= 0.9 && starving)
+        {
+            // batches fill instantly and the queue runs dry: fetch more per request and keep more in flight
+            next.fetchMinBytes = std::min(kMaxFetchMinBytes, std::max<int64_t>(next.fetchMinBytes * 4, 64 * 1024));
+            next.maxPartitionFetchBytes = next.maxPartitionFetchBytes * 2;
+            next.queuedMaxKbytes = next.queuedMaxKbytes * 2;
+        }
+        else if (fill_ < 0.5)
+        {
+            // trickling input: let the broker accumulate larger responses, fewer requests per message
+            next.fetchMinBytes = std::min(kMaxFetchMinBytes, std::max<int64_t>(next.fetchMinBytes * 4, 16 * 1024));
+            next.fetchWaitMaxMs = kMaxFetchWaitMaxMs;
+        }
+        else if (!starving && queueLatencyMs > 10.0 * batchMs_)
+        {
+            // prefetch far ahead of the application only costs memory
+            next.queuedMaxKbytes = next.queuedMaxKbytes / 2;
+        }
+    }
+    else
+    {
+        if (batchMs_ > targetLatencyMs_ && fill_ < 0.9)
+        {
+            // batches wait on the broker: answer fetches as soon as anything is available
+            next.fetchMinBytes = 1;
+            next.fetchWaitMaxMs = std::max(kMinFetchWaitMaxMs, std::min(next.fetchWaitMaxMs, targetLatencyMs_ / 2));
+        }
+        else if (queueLatencyMs > targetLatencyMs_)
+        {
+            // messages age in the fetch queue: keep less prefetched
+            next.queuedMaxKbytes = next.queuedMaxKbytes / 2;
+            next.maxPartitionFetchBytes = std::max(kMinPartitionFetchBytes, next.maxPartitionFetchBytes / 2);
+        }
+        else if (fill_ >= 0.9 && starving)
+        {
+            next.maxPartitionFetchBytes = next.maxPartitionFetchBytes * 2;
+        }
+    }
+
+    clampToBudget(next);
+
+    if (next.fetchMinBytes == current_.fetchMinBytes && next.fetchWaitMaxMs == current_.fetchWaitMaxMs &&
+        next.queuedMaxKbytes == current_.queuedMaxKbytes && next.maxPartitionFetchBytes == current_.maxPartitionFetchBytes)
+    {
+        // settled, look again after another window
+        reset(nowMs);
+        return false;
+    }
+
+    current_ = next;
+    reset(nowMs);
+    return true;
+}
@@ -0,0 +1,96 @@
+/*
+ * prefetch_tuner.h
+ *
+ * Adjusts consumer prefetch settings ( fetch.min.bytes, fetch.wait.max.ms, queued.max.messages.kbytes and
+ * max.partition.fetch.bytes ) to a latency or throughput goal, from
+ *  1) batch fill rate and batch formation time as seen by the application, and
+ *  2) fetch queue depth and receive rate from the librdkafka statistics.
+ *
+ * librdkafka cannot change these properties on a live consumer, so a new configuration is handed back
+ * to the caller who re-creates the consumer with it. A cooldown keeps that to one rebalance per window,
+ * and every setting stays within the memory budget.
+ *
+ * Not thread safe: feed it from the thread that polls the consumer ( event callbacks are served there ).
+ */
+#pragma once
+
+#include "stats_parser.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace RdKafka
+{
+class Conf;
+}
+
+struct PrefetchConfig
+{
+    int64_t fetchMinBytes{1};
+    int64_t fetchWaitMaxMs{500};
+    int64_t queuedMaxKbytes{65536};
+    int64_t maxPartitionFetchBytes{1048576};
+
+    /*
+     * Set the four properties on a consumer configuration
+     * @returns false and errstr on failure
+     */
+    bool apply(RdKafka::Conf *conf, std::string &errstr) const;
+
+    // Read current values from a configuration, keeping defaults for unset ones
+    void load(const RdKafka::Conf *conf);
+
+    std::string str() const;
+};
+
+class PrefetchTuner
+{
+public:
+    enum class Goal
+    {
+        Latency,
+        Throughput
+    };
+
+    PrefetchTuner(Goal goal, int64_t targetLatencyMs, int64_t memoryBudgetKb, const PrefetchConfig &initial,
+                  int64_t cooldownMs = 60 * 1000);
+
+    /*
+     * One batch returned by consume_batch()
+     * @param messages   messages in the batch
+     * @param batchSize  requested batch size
+     * @param bytes      payload bytes in the batch
+     * @param elapsedMs  time spent forming the batch
+     */
+    void observeBatch(size_t messages, size_t batchSize, size_t bytes, int64_t elapsedMs);
+
+    // Statistics event, see parseConsumerStats()
+    void observeStats(const ConsumerStats &stats);
+
+    /*
+     * @returns true with next filled in if the consumer should be re-created with a new configuration.
+     * The tuner assumes next is applied and restarts its observations.
+     */
+    bool retune(int64_t nowMs, PrefetchConfig &next);
+
+    const PrefetchConfig &current() const { return current_; }
+
+private:
+    void clampToBudget(PrefetchConfig &cfg) const;
+    void reset(int64_t nowMs);
+
+    Goal goal_;
+    int64_t targetLatencyMs_;
+    int64_t memoryBudgetKb_;
+    int64_t cooldownMs_;
+    PrefetchConfig current_;
+
+    int64_t lastChangeMs_{0};
+    size_t batches_{0};
+    size_t statsSamples_{0};
+    size_t partitions_{1};
+    double fill_{0};            // EWMA of messages / batchSize
+    double batchMs_{0};         // EWMA of batch formation time
+    double batchBytes_{0};      // EWMA of bytes per batch
+    double fetchqBytes_{0};     // EWMA of pre-fetched bytes waiting
+};
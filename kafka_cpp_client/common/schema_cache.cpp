@@ -0,0 +1,610 @@
+/*
+ * schema_cache.cpp
+ */
+#include "schema_cache.h"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace
+{
+/*
+ * Just enough JSON for schema files, which are small and read once.
+ */
+struct JsonValue
+{
+    enum class Kind
+    {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object
+    };
+
+    Kind kind{Kind::Null};
+    std::string str;
+    double number{0};
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    const JsonValue *get(const std::string &key) const
+    {
+        for (const auto &member : members)
+        {
+            if (member.first == key)
+            {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class JsonReader
+{
+public:
+    explicit JsonReader(const std::string &text) : p_{text.data()}, end_{text.data() + text.size()} {}
+
+    bool parse(JsonValue &value)
+    {
+        return parseValue(value, 0) && (skipSpace(), p_ == end_);
+    }
+
+private:
+    void skipSpace()
+    {
+        while (p_ < end_ && isspace(static_cast<unsigned char>(*p_)))
+        {
+            p_++;
+        }
+    }
+
+    bool literal(const char *word)
+    {
+        const auto len = strlen(word);
+        if (static_cast<size_t>(end_ - p_) < len || strncmp(p_, word, len) != 0)
+        {
+            return false;
+        }
+        p_ += len;
+        return true;
+    }
+
+    bool parseString(std::string &out)
+    {
+        if (p_ == end_ || *p_ != '"')
+        {
+            return false;
+        }
+        p_++;
+        while (p_ < end_ && *p_ != '"')
+        {
+            if (*p_ == '\\')
+            {
+                if (++p_ == end_)
+                {
+                    return false;
+                }
+                switch (*p_)
+                {
+                case 'n':
+                    out += '\n';
+                    break;
+                case 't':
+                    out += '\t';
+                    break;
+                case 'u':
+                    // names in schemas are ASCII, keep other code points as '?'
+                    if (end_ - p_ < 5)
+                    {
+                        return false;
+                    }
+                    out += '?';
+                    p_ += 4;
+                    break;
+                default:
+                    out += *p_;
+                }
+                p_++;
+                continue;
+            }
+            out += *p_++;
+        }
+        if (p_ == end_)
+        {
+            return false;
+        }
+        p_++;
+        return true;
+    }
+
+    bool parseValue(JsonValue &value, int depth)
+    {
+        skipSpace();
+        if (p_ == end_ || depth > 64)
+        {
+            return false;
+        }
+
+        switch (*p_)
+        {
+        case '{':
+            value.kind = JsonValue::Kind::Object;
+            p_++;
+            skipSpace();
+            if (p_ < end_ && *p_ == '}')
+            {
+                p_++;
+                return true;
+            }
+            for (;;)
+            {
+                std::pair<std::string, JsonValue> member;
+                skipSpace();
+                if (!parseString(member.first))
+                {
+                    return false;
+                }
+                skipSpace();
+                if (p_ == end_ || *p_++ != ':' || !parseValue(member.second, depth + 1))
+                {
+                    return false;
+                }
+                value.members.push_back(std::move(member));
+                skipSpace();
+                if (p_ == end_)
+                {
+                    return false;
+                }
+                if (*p_ == '}')
+                {
+                    p_++;
+                    return true;
+                }
+                if (*p_++ != ',')
+                {
+                    return false;
+                }
+            }
+        case '[':
+            value.kind = JsonValue::Kind::Array;
+            p_++;
+            skipSpace();
+            if (p_ < end_ && *p_ == ']')
+            {
+                p_++;
+                return true;
+            }
+            for (;;)
+            {
+                value.items.emplace_back();
+                if (!parseValue(value.items.back(), depth + 1))
+                {
+                    return false;
+                }
+                skipSpace();
+                if (p_ == end_)
+                {
+                    return false;
+                }
+                if (*p_ == ']')
+                {
+                    p_++;
+                    return true;
+                }
+                if (*p_++ != ',')
+                {
+                    return false;
+                }
+            }
+        case '"':
+            value.kind = JsonValue::Kind::String;
+            return parseString(value.str);
+        case 't':
+            value.kind = JsonValue::Kind::Bool;
+            value.number = 1;
+            return literal("true");
+        case 'f':
+            value.kind = JsonValue::Kind::Bool;
+            return literal("false");
+        case 'n':
+            return literal("null");
+        default:
+        {
+            char *next;
+            value.kind = JsonValue::Kind::Number;
+            value.number = strtod(p_, &next);
+            if (next == p_)
+            {
+                return false;
+            }
+            p_ = next;
+            return true;
+        }
+        }
+    }
+
+    const char *p_;
+    const char *end_;
+};
+
+bool avroPrimitive(const std::string &name, SchemaField::Type &type)
+{
+    static const std::map<std::string, SchemaField::Type> types{
+        {"null", SchemaField::Type::Null},     {"boolean", SchemaField::Type::Boolean},
+        {"int", SchemaField::Type::Int},       {"long", SchemaField::Type::Int},
+        {"float", SchemaField::Type::Float},   {"double", SchemaField::Type::Double},
+        {"string", SchemaField::Type::String}, {"bytes", SchemaField::Type::Bytes}};
+    const auto it = types.find(name);
+    if (it == types.end())
+    {
+        return false;
+    }
+    type = it->second;
+    return true;
+}
+
+// a field type that is not a union: "long", {"type": "long", "logicalType": ..}, {"type": "enum", ..}
+bool avroType(const JsonValue &json, SchemaField &field, std::string &error)
+{
+    if (json.kind == JsonValue::Kind::String)
+    {
+        if (!avroPrimitive(json.str, field.type))
+        {
+            error = "field " + field.name + ": unsupported type " + json.str;
+            return false;
+        }
+        return true;
+    }
+    if (json.kind == JsonValue::Kind::Object)
+    {
+        const auto *type = json.get("type");
+        if (type && type->kind == JsonValue::Kind::String && type->str == "enum")
+        {
+            const auto *symbols = json.get("symbols");
+            if (!symbols || symbols->kind != JsonValue::Kind::Array)
+            {
+                error = "field " + field.name + ": enum without symbols";
+                return false;
+            }
+            field.type = SchemaField::Type::Enum;
+            for (const auto &symbol : symbols->items)
+            {
+                field.symbols.push_back(symbol.str);
+            }
+            return true;
+        }
+        if (type && type->kind == JsonValue::Kind::String)
+        {
+            return avroType(*type, field, error);
+        }
+    }
+    error = "field " + field.name + ": nested records, arrays, maps and fixed are not supported";
+    return false;
+}
+
+bool protoScalar(const std::string &name, SchemaField &field)
+{
+    static const std::map<std::string, std::pair<SchemaField::Type, bool>> types{
+        {"int32", {SchemaField::Type::Int, true}},       {"int64", {SchemaField::Type::Int, true}},
+        {"uint32", {SchemaField::Type::Int, false}},     {"uint64", {SchemaField::Type::Int, false}},
+        {"sint32", {SchemaField::Type::SInt, true}},     {"sint64", {SchemaField::Type::SInt, true}},
+        {"bool", {SchemaField::Type::Boolean, false}},   {"fixed32", {SchemaField::Type::Fixed32, false}},
+        {"sfixed32", {SchemaField::Type::Fixed32, true}}, {"fixed64", {SchemaField::Type::Fixed64, false}},
+        {"sfixed64", {SchemaField::Type::Fixed64, true}}, {"float", {SchemaField::Type::Float, true}},
+        {"double", {SchemaField::Type::Double, true}},   {"string", {SchemaField::Type::String, false}},
+        {"bytes", {SchemaField::Type::Bytes, false}}};
+    const auto it = types.find(name);
+    if (it == types.end())
+    {
+        return false;
+    }
+    field.type = it->second.first;
+    field.isSigned = it->second.second;
+    return true;
+}
+
+// .proto tokens: identifiers ( with dots ), numbers, punctuation, string literals ( quoted ); comments dropped
+std::vector<std::string> protoTokens(const std::string &text)
+{
+    std::vector<std::string> tokens;
+    for (size_t i = 0; i < text.size();)
+    {
+        const char c = text[i];
+        if (isspace(static_cast<unsigned char>(c)))
+        {
+            i++;
+        }
+        else if (c == '/' && i + 1 < text.size() && text[i + 1] == '/')
+        {
+            i = text.find('\n', i);
+        }
+        else if (c == '/' && i + 1 < text.size() && text[i + 1] == '*')
+        {
+            i = text.find("*/", i + 2);
+            i = i == std::string::npos ? i : i + 2;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            const auto start = i;
+            i = text.find(c, i + 1);
+            i = i == std::string::npos ? i : i + 1;
+            tokens.push_back("\"" + text.substr(start + 1, (i == std::string::npos ? text.size() : i - 1) - start - 1) +
+                             "\"");
+        }
+        else if (isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '-')
+        {
+            const auto start = i;
+            while (i < text.size() && (isalnum(static_cast<unsigned char>(text[i])) || text[i] == '_' || text[i] == '.' || text[i] == '-'))
+            {
+                i++;
+            }
+            tokens.push_back(text.substr(start, i - start));
+        }
+        else
+        {
+            tokens.push_back(std::string(1, c));
+            i++;
+        }
+    }
+    return tokens;
+}
+}
+
+Column::Type SchemaField::columnType() const
+{
+    switch (type)
+    {
+    case Type::Float:
+    case Type::Double:
+        return Column::Type::Double;
+    case Type::String:
+    case Type::Bytes:
+        return Column::Type::String;
+    case Type::Enum:
+        // Avro enums decode to their symbol, Protobuf enums to their number
+        return symbols.empty() ? Column::Type::Int64 : Column::Type::String;
+    default:
+        return Column::Type::Int64;
+    }
+}
+
+bool parseAvroSchema(const std::string &text, Schema &schema, std::string &error)
+{
+    JsonValue json;
+    if (!JsonReader{text}.parse(json))
+    {
+        error = "malformed schema JSON";
+        return false;
+    }
+
+    const auto *type = json.get("type");
+    const auto *fields = json.get("fields");
+    if (!type || type->str != "record" || !fields || fields->kind != JsonValue::Kind::Array)
+    {
+        error = "not a record schema";
+        return false;
+    }
+    if (const auto *name = json.get("name"))
+    {
+        schema.name = name->str;
+    }
+    schema.format = Schema::Format::Avro;
+
+    for (const auto &f : fields->items)
+    {
+        SchemaField field;
+        const auto *name = f.get("name");
+        const auto *fieldType = f.get("type");
+        if (!name || !fieldType)
+        {
+            error = "field without name or type";
+            return false;
+        }
+        field.name = name->str;
+
+        if (fieldType->kind == JsonValue::Kind::Array)
+        {
+            // only ["null", T] / [T, "null"]
+            if (fieldType->items.size() != 2)
+            {
+                error = "field " + field.name + ": only unions of null and one type are supported";
+                return false;
+            }
+            for (int branch = 0; branch < 2; branch++)
+            {
+                const auto &item = fieldType->items[branch];
+                if (item.kind == JsonValue::Kind::String && item.str == "null")
+                {
+                    field.nullBranch = branch;
+                }
+            }
+            if (field.nullBranch < 0 || !avroType(fieldType->items[1 - field.nullBranch], field, error))
+            {
+                if (error.empty())
+                {
+                    error = "field " + field.name + ": only unions of null and one type are supported";
+                }
+                return false;
+            }
+        }
+        else if (!avroType(*fieldType, field, error))
+        {
+            return false;
+        }
+        schema.fields.push_back(std::move(field));
+    }
+    return true;
+}
+
+bool parseProtoSchema(const std::string &text, Schema &schema, std::string &error)
+{
+    const auto tokens = protoTokens(text);
+    schema.format = Schema::Format::Protobuf;
+
+    // enum names anywhere in the file decode as varints
+    std::vector<std::string> enums;
+    bool proto3 = false;
+    for (size_t i = 0; i + 1 < tokens.size(); i++)
+    {
+        if (tokens[i] == "enum")
+        {
+            enums.push_back(tokens[i + 1]);
+        }
+        if (tokens[i] == "syntax" && i + 2 < tokens.size() && tokens[i + 1] == "=")
+        {
+            proto3 = tokens[i + 2] == "\"proto3\"";
+        }
+    }
+
+    size_t i = 0;
+    while (i + 2 < tokens.size() && !(tokens[i] == "message" && tokens[i + 2] == "{"))
+    {
+        i++;
+    }
+    if (i + 2 >= tokens.size())
+    {
+        error = "no message definition";
+        return false;
+    }
+    schema.name = tokens[i + 1];
+    i += 3;
+
+    // statements of the first message, skipping nested definitions but not oneof groups
+    std::vector<bool> blocks;   // open blocks inside the message, true for a oneof
+    int nested = 0;
+    std::vector<std::string> statement;
+    for (; i < tokens.size(); i++)
+    {
+        const auto &tok = tokens[i];
+        if (tok == "{")
+        {
+            const bool oneof = !statement.empty() && statement[0] == "oneof";
+            blocks.push_back(oneof);
+            nested += oneof ? 0 : 1;
+            statement.clear();
+            continue;
+        }
+        if (tok == "}")
+        {
+            if (blocks.empty())
+            {
+                break;  // end of the message
+            }
+            nested -= blocks.back() ? 0 : 1;
+            blocks.pop_back();
+            statement.clear();
+            continue;
+        }
+        if (nested > 0)
+        {
+            continue;
+        }
+        if (tok != ";")
+        {
+            statement.push_back(tok);
+            continue;
+        }
+
+        // [optional|required] type name = number [ options ] ;
+        auto s = statement;
+        statement.clear();
+        const bool labelled = !s.empty() && (s[0] == "optional" || s[0] == "required");
+        if (labelled)
+        {
+            s.erase(s.begin());
+        }
+        if (s.size() < 4 || s[2] != "=" || s[0] == "repeated" || s[0] == "map" || s[0] == "reserved" ||
+            s[0] == "option" || s[0] == "extensions")
+        {
+            continue;
+        }
+
+        SchemaField field;
+        field.name = s[1];
+        field.number = atoi(s[3].c_str());
+        // proto3 does not write such a field holding its default: missing means the default, not null
+        field.implicitDefault = proto3 && !labelled && blocks.empty();
+        const auto shortType = s[0].substr(s[0].rfind('.') + 1);
+        if (!protoScalar(s[0], field))
+        {
+            bool isEnum = false;
+            for (const auto &e : enums)
+            {
+                isEnum = isEnum || e == shortType;
+            }
+            if (!isEnum)
+            {
+                continue;   // nested message, skipped when decoding
+            }
+            field.type = SchemaField::Type::Enum;
+        }
+        if (field.number <= 0 || field.number > 1 << 16)
+        {
+            continue;
+        }
+        if (schema.byNumber.size() <= static_cast<size_t>(field.number))
+        {
+            schema.byNumber.resize(field.number + 1, -1);
+        }
+        schema.byNumber[field.number] = static_cast<int>(schema.fields.size());
+        schema.fields.push_back(std::move(field));
+    }
+
+    if (schema.fields.empty())
+    {
+        error = "message " + schema.name + " has no scalar fields";
+        return false;
+    }
+    return true;
+}
+
+const Schema *SchemaCache::get(int32_t id)
+{
+    auto it = schemas_.find(id);
+    if (it != schemas_.end())
+    {
+        return it->second.schema.get();
+    }
+
+    auto &entry = schemas_[id];
+    std::unique_ptr<Schema> schema{new Schema};
+    schema->id = id;
+
+    const auto base = dir_ + "/" + std::to_string(id);
+    std::ifstream avro{base + ".avsc"};
+    std::ifstream proto;
+    if (!avro)
+    {
+        proto.open(base + ".proto");
+        if (!proto)
+        {
+            entry.error = "no " + base + ".avsc or .proto";
+            return nullptr;
+        }
+    }
+
+    std::stringstream text;
+    text << (avro ? avro.rdbuf() : proto.rdbuf());
+    const bool ok = avro ? parseAvroSchema(text.str(), *schema, entry.error)
+                         : parseProtoSchema(text.str(), *schema, entry.error);
+    if (!ok)
+    {
+        entry.error = base + (avro ? ".avsc: " : ".proto: ") + entry.error;
+        return nullptr;
+    }
+    entry.schema = std::move(schema);
+    return entry.schema.get();
+}
+
+const std::string &SchemaCache::error(int32_t id) const
+{
+    static const std::string none;
+    const auto it = schemas_.find(id);
+    return it == schemas_.end() ? none : it->second.error;
+}
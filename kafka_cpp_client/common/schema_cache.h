@@ -0,0 +1,97 @@
+/*
+ * schema_cache.h
+ *
+ * Schemas for Confluent wire format payloads ( magic byte 0, 4 byte big endian schema id, encoded message ),
+ * read from a local directory instead of the schema registry: <dir>/<id>.avsc for Avro, <dir>/<id>.proto
+ * for Protobuf, e.g. as saved from GET /schemas/ids/<id>.
+ *
+ * Only flat records are supported, which covers the columnar use: Avro records of primitive, enum and
+ * ["null", primitive] union fields, and the first message of a .proto file with scalar, string, bytes and
+ * enum fields. Other Avro fields make the schema unusable; other Protobuf fields are skipped when decoding.
+ * A proto3 field without presence ( not optional, not in a oneof ) missing from a message is its default ( 0, "",
+ * false, enum value 0 ), as the writer leaves out defaults; any other missing field is null.
+ *
+ * Each schema is loaded once, on first use. Not thread safe.
+ */
+#pragma once
+
+#include "columnar_batch.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct SchemaField
+{
+    enum class Type
+    {
+        Null,
+        Boolean,
+        Int,        // Avro int / long, Protobuf int32 int64 uint32 uint64 ( varint )
+        SInt,       // Protobuf sint32 sint64 ( zigzag varint )
+        Fixed32,    // Protobuf fixed32 sfixed32
+        Fixed64,    // Protobuf fixed64 sfixed64
+        Float,
+        Double,
+        String,
+        Bytes,
+        Enum
+    };
+
+    std::string name;
+    Type type{Type::Null};
+    bool isSigned{true};            // Protobuf fixed32 / fixed64 vs sfixed32 / sfixed64
+    int nullBranch{-1};             // Avro: index of "null" in a ["null", T] union, -1 if not a union
+    int32_t number{0};              // Protobuf field number
+    bool implicitDefault{false};    // Protobuf: proto3 field without presence, missing = default
+    std::vector<std::string> symbols;   // Avro enum symbols
+
+    Column::Type columnType() const;
+};
+
+struct Schema
+{
+    enum class Format
+    {
+        Avro,
+        Protobuf
+    };
+
+    int32_t id{0};
+    Format format{Format::Avro};
+    std::string name;
+    std::vector<SchemaField> fields;
+    std::vector<int> byNumber;      // Protobuf field number -> index in fields, -1 if not decoded
+};
+
+class SchemaCache
+{
+public:
+    explicit SchemaCache(std::string dir) : dir_{std::move(dir)} {}
+
+    /*
+     * @returns the schema with this id, nullptr if it is missing or unsupported ( see error() ).
+     *          Failures are remembered, the file is not read again.
+     */
+    const Schema *get(int32_t id);
+
+    const std::string &error(int32_t id) const;
+
+private:
+    struct Entry
+    {
+        std::unique_ptr<Schema> schema;
+        std::string error;
+    };
+
+    std::string dir_;
+    std::unordered_map<int32_t, Entry> schemas_;
+};
+
+/*
+ * Parse an Avro schema ( JSON ) or .proto source.
+ * @returns false and sets error if the schema is malformed or not a flat record
+ */
+bool parseAvroSchema(const std::string &text, Schema &schema, std::string &error);
+bool parseProtoSchema(const std::string &text, Schema &schema, std::string &error);
@@ -0,0 +1,86 @@
+/*
+ * shutdown.cpp
+ */
+#include "shutdown.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+const int SLICE_MS = 100;
+const int64_t PROGRESS_INTERVAL_MS = 1000;
+
+int64_t nowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+}
+
+ShutdownCoordinator::ShutdownCoordinator(int budgetMs) : budgetMs_{budgetMs}
+{
+}
+
+void ShutdownCoordinator::phase(const std::string &name, int maxMs, Step step, Progress progress)
+{
+    phases_.push_back(Phase{name, maxMs, std::move(step), std::move(progress), 0, false});
+}
+
+bool ShutdownCoordinator::run()
+{
+    const int64_t start = nowMs();
+    const int64_t deadline = start + budgetMs_;
+    bool clean = true;
+
+    for (auto &phase : phases_)
+    {
+        const int64_t phaseStart = nowMs();
+        const int64_t phaseEnd = phase.maxMs > 0 ? std::min(deadline, phaseStart + phase.maxMs) : deadline;
+        int64_t nextProgress = phaseStart + PROGRESS_INTERVAL_MS;
+
+        for (;;)
+        {
+            const int64_t now = nowMs();
+            const int slice = static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(SLICE_MS, phaseEnd - now)));
+            phase.done = phase.step(slice);
+            if (phase.done || nowMs() >= phaseEnd)
+            {
+                break;
+            }
+            if (phase.progress && nowMs() >= nextProgress)
+            {
+                std::cerr << "% Shutdown: " << phase.name << ": " << phase.progress() << std::endl;
+                nextProgress += PROGRESS_INTERVAL_MS;
+            }
+        }
+
+        phase.tookMs = nowMs() - phaseStart;
+        clean = clean && phase.done;
+    }
+
+    tookMs_ = nowMs() - start;
+    return clean;
+}
+
+std::string ShutdownCoordinator::report() const
+{
+    std::ostringstream out;
+    out << tookMs_ << " ms";
+    for (size_t i = 0; i < phases_.size(); i++)
+    {
+        const auto &phase = phases_[i];
+        out << (i == 0 ? ": " : ", ") << phase.name << " " << phase.tookMs << " ms";
+        if (!phase.done)
+        {
+            out << " ( unfinished";
+            if (phase.progress)
+            {
+                out << ", " << phase.progress();
+            }
+            out << " )";
+        }
+    }
+    return out.str();
+}
@@ -0,0 +1,63 @@
+/*
+ * shutdown.h
+ *
+ * Ordered shutdown under one time budget, instead of a fixed flush() and wait per step.
+ *
+ * A client registers its phases in order ( stop intake, drain in-flight work, commit, flush, spill, .. ). run()
+ * calls each phase's step repeatedly, every call blocking for at most a slice of ~100 ms, until the step reports
+ * it is done or the phase is out of time: a phase ends as soon as its work is, so an idle client shuts down in
+ * milliseconds and a stuck one within the budget. A phase may be capped below what is left of the budget, to keep
+ * time for the ones after it ( e.g. flush for at most 5 s so undelivered messages can still be spilled ). Every phase
+ * is stepped at least once, with a slice of 0 once the budget is used up, so that cleanup phases always run.
+ *
+ * While a phase runs, its progress ( e.g. "1200 message(s) in queue" ) is printed every second.
+ *
+ *  ShutdownCoordinator shutdown{10000};
+ *  shutdown.phase("flush", 5000, [&](int sliceMs) { producer->flush(sliceMs); return producer->outq_len() == 0; },
+ *                 [&] { return std::to_string(producer->outq_len()) + " message(s) in queue"; });
+ *  shutdown.phase("spill", 0, [&](int) { return spillUndelivered(); });
+ *  bool clean = shutdown.run();
+ *  std::cerr << "% Shutdown: " << shutdown.report() << std::endl;
+ *
+ * Not thread safe: run from the thread that owns the clients.
+ */
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+class ShutdownCoordinator
+{
+public:
+    // Blocking for at most sliceMs, @returns true once the phase's work is done
+    typedef std::function<bool(int sliceMs)> Step;
+    typedef std::function<std::string()> Progress;
+
+    explicit ShutdownCoordinator(int budgetMs);
+
+    // Add a phase, run after the ones added before. maxMs 0: up to the rest of the budget
+    void phase(const std::string &name, int maxMs, Step step, Progress progress = Progress());
+
+    // Run all phases. @returns true if every phase finished its work in time
+    bool run();
+
+    // Time taken by each phase, and the progress of the ones that did not finish
+    std::string report() const;
+
+private:
+    struct Phase
+    {
+        std::string name;
+        int maxMs;
+        Step step;
+        Progress progress;
+        int64_t tookMs;
+        bool done;
+    };
+
+    int budgetMs_;
+    int64_t tookMs_{0};
+    std::vector<Phase> phases_;
+};
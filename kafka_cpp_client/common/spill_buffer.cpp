@@ -0,0 +1,459 @@
+/*
+ * spill_buffer.cpp
+ */
+#include "spill_buffer.h"
+#include "crc32.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+const size_t BLOCK = 4096;                  // O_DIRECT alignment of buffer, offsets and lengths
+const size_t BUFFER_BYTES = 1 << 20;
+const size_t HEADER_BYTES = 12;             // crc32, key length, value length
+const uint32_t NULL_LEN = UINT32_MAX;
+
+std::runtime_error sysError(const std::string &what)
+{
+    return std::runtime_error{what + ": " + strerror(errno)};
+}
+
+int64_t nowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+size_t roundUp(size_t len)
+{
+    return (len + BLOCK - 1) & ~(BLOCK - 1);
+}
+
+uint32_t recordCrc(const uint32_t lens[2], const void *key, size_t keyLen, const void *value, size_t valueLen)
+{
+    auto crc = crc32(0, lens, 2 * sizeof(uint32_t));
+    crc = crc32(crc, key, keyLen);
+    return crc32(crc, value, valueLen);
+}
+}
+
+SpillBuffer::SpillBuffer(const std::string &dir, const Policy &policy) : dir_{dir}, policy_{policy}
+{
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        throw sysError("mkdir " + dir);
+    }
+
+    // segments of an earlier run, in sequence order
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        throw sysError("open " + dir);
+    }
+    std::vector<uint64_t> found;
+    while (struct dirent *entry = readdir(d))
+    {
+        uint64_t sequence;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%" SCNu64 ".%7s", &sequence, suffix) == 2 && strcmp(suffix, "spill") == 0)
+        {
+            found.push_back(sequence);
+        }
+    }
+    closedir(d);
+    std::sort(found.begin(), found.end());
+    for (const auto sequence : found)
+    {
+        struct stat st;
+        if (stat(segmentPath(sequence).c_str(), &st) == 0)
+        {
+            sealed_.push_back(sequence);
+            sealedBytes_ += static_cast<uint64_t>(st.st_size);
+        }
+        nextSequence_ = sequence + 1;
+    }
+
+    void *buffer;
+    if (posix_memalign(&buffer, BLOCK, BUFFER_BYTES) != 0)
+    {
+        throw std::runtime_error{"spill buffer: out of memory"};
+    }
+    buffer_ = static_cast<char *>(buffer);
+    lastSyncMs_ = nowMs();
+}
+
+SpillBuffer::~SpillBuffer()
+{
+    if (activeFd_ >= 0)
+    {
+        // what is appended stays for the next run
+        try
+        {
+            writeBuffer(policy_.syncIntervalMs >= 0);
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+        close(activeFd_);
+        if (activeRecords_ == 0)
+        {
+            unlink(segmentPath(activeSequence_).c_str());
+        }
+    }
+    // a partly popped segment, or one with undelivered records, is read again from its start next time
+    if (reading_)
+    {
+        munmap(const_cast<char *>(readData_), readSize_);
+    }
+    free(buffer_);
+}
+
+std::string SpillBuffer::segmentPath(uint64_t sequence) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%020" PRIu64 ".spill", sequence);
+    return dir_ + "/" + name;
+}
+
+void SpillBuffer::openActive()
+{
+    activeSequence_ = nextSequence_++;
+    const auto path = segmentPath(activeSequence_);
+    activeFd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (policy_.directIo ? O_DIRECT : 0), 0644);
+    if (activeFd_ < 0)
+    {
+        throw sysError("create " + path);
+    }
+    activeRecords_ = 0;
+    activeOpenedMs_ = nowMs();
+    fileOffset_ = 0;
+    bufferUsed_ = 0;
+}
+
+/*
+ * Write the buffer, its last block zero padded. Full blocks are done with, a partial last block stays in the buffer
+ * and is written again, at the same offset, once there is more.
+ */
+void SpillBuffer::writeBuffer(bool sync)
+{
+    const size_t len = roundUp(bufferUsed_);
+    memset(buffer_ + bufferUsed_, 0, len - bufferUsed_);
+    size_t written = 0;
+    while (written < len)
+    {
+        const ssize_t n = pwrite(activeFd_, buffer_ + written, len - written, static_cast<off_t>(fileOffset_ + written));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            throw sysError("write " + segmentPath(activeSequence_));
+        }
+        written += static_cast<size_t>(n);
+    }
+    if (sync && fdatasync(activeFd_) != 0)
+    {
+        throw sysError("sync " + segmentPath(activeSequence_));
+    }
+    if (sync)
+    {
+        lastSyncMs_ = nowMs();
+    }
+    dirty_ = false;
+
+    const size_t full = bufferUsed_ & ~(BLOCK - 1);
+    memmove(buffer_, buffer_ + full, bufferUsed_ - full);
+    fileOffset_ += full;
+    bufferUsed_ -= full;
+}
+
+void SpillBuffer::buffer(const void *data, size_t len)
+{
+    const auto *p = static_cast<const char *>(data);
+    while (len > 0)
+    {
+        const size_t n = std::min(len, BUFFER_BYTES - bufferUsed_);
+        memcpy(buffer_ + bufferUsed_, p, n);
+        bufferUsed_ += n;
+        p += n;
+        len -= n;
+        if (bufferUsed_ == BUFFER_BYTES)
+        {
+            writeBuffer(false);
+        }
+    }
+}
+
+void SpillBuffer::append(const void *key, size_t keyLen, const void *value, size_t valueLen)
+{
+    const size_t size = HEADER_BYTES + (key ? keyLen : 0) + valueLen;
+    if (activeFd_ >= 0 && activeRecords_ > 0 && fileOffset_ + bufferUsed_ + size > policy_.segmentBytes)
+    {
+        seal();
+    }
+    if (activeFd_ < 0)
+    {
+        openActive();
+    }
+
+    /*
+     * A torn record would end the segment for the reader, and every record after it with it: on failure back to
+     * where the record started. Filling the buffer writes it out, so the partial block the record starts in is kept.
+     */
+    const uint64_t startOffset = fileOffset_;
+    const size_t startUsed = bufferUsed_;
+    const size_t mark = startUsed & ~(BLOCK - 1);
+    char head[BLOCK];
+    memcpy(head, buffer_ + mark, startUsed - mark);
+    try
+    {
+        const uint32_t lens[2] = {key ? static_cast<uint32_t>(keyLen) : NULL_LEN, static_cast<uint32_t>(valueLen)};
+        const uint32_t crc = recordCrc(lens, key, key ? keyLen : 0, value, valueLen);
+        buffer(&crc, sizeof(crc));
+        buffer(lens, sizeof(lens));
+        if (key)
+        {
+            buffer(key, keyLen);
+        }
+        buffer(value, valueLen);
+
+        if (policy_.syncIntervalMs == 0)
+        {
+            writeBuffer(true);
+        }
+        else if (policy_.syncIntervalMs > 0 && nowMs() - lastSyncMs_ >= policy_.syncIntervalMs)
+        {
+            writeBuffer(true);
+        }
+    }
+    catch (const std::runtime_error &)
+    {
+        if (fileOffset_ == startOffset)
+        {
+            bufferUsed_ = startUsed;
+        }
+        else
+        {
+            // written out up to the record: only its partial first block is still needed in the buffer
+            memcpy(buffer_, head, startUsed - mark);
+            fileOffset_ = startOffset + mark;
+            bufferUsed_ = startUsed - mark;
+        }
+        // what was written of the record goes too, a complete one must not be read back
+        (void)ftruncate(activeFd_, static_cast<off_t>(fileOffset_ + bufferUsed_));
+        throw;
+    }
+    activeRecords_++;
+    appended_++;
+    dirty_ = true;
+}
+
+void SpillBuffer::sync()
+{
+    if (activeFd_ < 0 || !dirty_)
+    {
+        return;
+    }
+    if (policy_.syncIntervalMs < 0)
+    {
+        writeBuffer(false);
+    }
+    else if (nowMs() - lastSyncMs_ >= policy_.syncIntervalMs)
+    {
+        writeBuffer(true);
+    }
+}
+
+void SpillBuffer::seal()
+{
+    writeBuffer(policy_.syncIntervalMs >= 0);
+    close(activeFd_);
+    activeFd_ = -1;
+    if (activeRecords_ > 0)
+    {
+        sealed_.push_back(activeSequence_);
+        sealedBytes_ += fileOffset_ + roundUp(bufferUsed_);
+    }
+    else
+    {
+        unlink(segmentPath(activeSequence_).c_str());
+    }
+    activeRecords_ = 0;
+    fileOffset_ = 0;
+    bufferUsed_ = 0;
+}
+
+bool SpillBuffer::openReader()
+{
+    for (;;)
+    {
+        if (sealed_.empty())
+        {
+            // caught up: what is appended is read from the active segment, once sealed
+            if (activeRecords_ == 0 ||
+                (fileOffset_ + bufferUsed_ < BUFFER_BYTES && nowMs() - activeOpenedMs_ < policy_.sealAfterMs))
+            {
+                return false;
+            }
+            seal();
+        }
+
+        const auto path = segmentPath(sealed_.front());
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw sysError("open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            throw sysError("stat " + path);
+        }
+        readSize_ = static_cast<size_t>(st.st_size);
+        if (readSize_ == 0)
+        {
+            close(fd);
+            unlink(path.c_str());
+            sealed_.pop_front();
+            continue;
+        }
+        void *data = mmap(nullptr, readSize_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            throw sysError("mmap " + path);
+        }
+        madvise(data, readSize_, MADV_SEQUENTIAL);
+        readData_ = static_cast<const char *>(data);
+        readPos_ = 0;
+        recordEnd_ = 0;
+        reading_ = true;
+        return true;
+    }
+}
+
+// The segment is read ( or ends in a torn record ): it goes, or waits for the deliveries of its records
+void SpillBuffer::closeReader()
+{
+    munmap(const_cast<char *>(readData_), readSize_);
+    const auto sequence = sealed_.front();
+    if (pending_.count(sequence))
+    {
+        retired_[sequence] = readSize_;
+    }
+    else
+    {
+        unlink(segmentPath(sequence).c_str());
+        sealedBytes_ -= std::min<uint64_t>(sealedBytes_, readSize_);
+    }
+    sealed_.pop_front();
+    reading_ = false;
+    readData_ = nullptr;
+}
+
+bool SpillBuffer::front(SpilledRecord &record)
+{
+    if (!requeued_.empty())
+    {
+        const auto &requeued = requeued_.front();
+        record.key = requeued.nullKey ? nullptr : requeued.key.data();
+        record.keyLen = requeued.key.size();
+        record.value = requeued.value.data();
+        record.valueLen = requeued.value.size();
+        record.segment = requeued.segment;
+        return true;
+    }
+
+    for (;;)
+    {
+        if (!reading_ && !openReader())
+        {
+            return false;
+        }
+
+        if (readSize_ - readPos_ >= HEADER_BYTES)
+        {
+            const char *p = readData_ + readPos_;
+            uint32_t crc, lens[2];
+            memcpy(&crc, p, sizeof(crc));
+            memcpy(lens, p + sizeof(crc), sizeof(lens));
+            const size_t keyLen = lens[0] == NULL_LEN ? 0 : lens[0];
+            const size_t valueLen = lens[1];
+            // zero padding fails the checksum too: the end of the segment
+            if (keyLen + valueLen <= readSize_ - readPos_ - HEADER_BYTES &&
+                recordCrc(lens, p + HEADER_BYTES, keyLen, p + HEADER_BYTES + keyLen, valueLen) == crc)
+            {
+                record.key = lens[0] == NULL_LEN ? nullptr : p + HEADER_BYTES;
+                record.keyLen = keyLen;
+                record.value = p + HEADER_BYTES + keyLen;
+                record.valueLen = valueLen;
+                record.segment = sealed_.front();
+                recordEnd_ = readPos_ + HEADER_BYTES + keyLen + valueLen;
+                return true;
+            }
+        }
+        closeReader();
+    }
+}
+
+void SpillBuffer::pop()
+{
+    // pending for its segment since it was popped the first time
+    if (!requeued_.empty())
+    {
+        requeued_.pop_front();
+        return;
+    }
+    if (reading_ && recordEnd_ > readPos_)
+    {
+        readPos_ = recordEnd_;
+        popped_++;
+        pending_[sealed_.front()]++;
+        undelivered_++;
+    }
+}
+
+void SpillBuffer::delivered(uint64_t segment)
+{
+    auto it = pending_.find(segment);
+    if (it == pending_.end())
+    {
+        return;
+    }
+    undelivered_--;
+    if (--it->second > 0)
+    {
+        return;
+    }
+    pending_.erase(it);
+
+    auto retired = retired_.find(segment);
+    if (retired != retired_.end())
+    {
+        unlink(segmentPath(segment).c_str());
+        sealedBytes_ -= std::min<uint64_t>(sealedBytes_, retired->second);
+        retired_.erase(retired);
+    }
+}
+
+void SpillBuffer::requeue(uint64_t segment, const void *key, size_t keyLen, const void *value, size_t valueLen)
+{
+    const auto *k = static_cast<const char *>(key);
+    const auto *v = static_cast<const char *>(value);
+    requeued_.push_back(Requeued{segment, !key, k ? std::string{k, keyLen} : std::string{},
+                                 v ? std::string{v, valueLen} : std::string{}});
+}
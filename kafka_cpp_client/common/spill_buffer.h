@@ -0,0 +1,140 @@
+/*
+ * spill_buffer.h
+ *
+ * Disk queue for messages the producer has no room for, so input never waits for the brokers.
+ *  1) append() writes records to the active segment file through an aligned buffer: large sequential writes, with
+ *     O_DIRECT if asked ( the spill does not evict the page cache the rest of the host relies on ).
+ *  2) The active segment is sealed once it reaches segmentBytes, or when the reader catches up with it and it holds
+ *     a buffer's worth ( 1 MB ) or is sealAfterMs old: a trickle of appends does not make a segment file per record.
+ *  3) front() / pop() read records back in append order from the oldest sealed segment, mapped. A segment is
+ *     deleted once all its records are popped and reported delivered(): a record handed to the producer is not
+ *     safe until its delivery report. One that fails is requeue()d: front() returns it again before any other
+ *     record, and its segment stays until it is delivered.
+ *  4) Segments left by an earlier run are read first, up to a torn tail ( checksum per record ). Since a segment is
+ *     deleted only when all its records are delivered, after a crash they are produced again: at least once.
+ *
+ * Durability follows syncIntervalMs: 0 syncs every record ( slow, nothing acknowledged upstream is lost ), > 0 every
+ * that many ms ( checked by append() and sync(), call it from a timer ), < 0 leaves it to the kernel ( a machine
+ * crash loses what was not written back ).
+ *
+ * Segments: <dir>/<sequence>.spill, records: crc32 | key length ( ~0 = null ) | value length | key | value,
+ * zero padded to the block size when sealed.
+ *
+ * Not thread safe.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+struct SpilledRecord
+{
+    const char *key;        // nullptr for a null key
+    size_t keyLen;
+    const char *value;
+    size_t valueLen;
+    uint64_t segment;       // for delivered(), once popped
+};
+
+class SpillBuffer
+{
+public:
+    struct Policy
+    {
+        size_t segmentBytes{64 << 20};
+        int sealAfterMs{1000};      // a caught up reader waits this long at most for a small active segment
+        int syncIntervalMs{1000};
+        bool directIo{false};
+    };
+
+    // Open dir ( created if missing ) and pick up its segments. @throws std::runtime_error
+    SpillBuffer(const std::string &dir, const Policy &policy);
+    ~SpillBuffer();
+
+    SpillBuffer(const SpillBuffer &) = delete;
+    SpillBuffer &operator=(const SpillBuffer &) = delete;
+
+    // @throws std::runtime_error if the record can not be written, e.g. the disk is full; nothing of it is kept then
+    void append(const void *key, size_t keyLen, const void *value, size_t valueLen);
+
+    /*
+     * Oldest record not popped yet ( a requeued one first ), pointing into a mapped segment or the requeued copy
+     * until the next pop().
+     * @returns false if there is none
+     */
+    bool front(SpilledRecord &record);
+    void pop();
+
+    // A popped record of segment is delivered: the segment goes once all its records are
+    void delivered(uint64_t segment);
+
+    // A popped record of segment failed to be delivered: copied, it is the next front() ( after earlier requeues )
+    void requeue(uint64_t segment, const void *key, size_t keyLen, const void *value, size_t valueLen);
+
+    // Nothing left to pop; popped records may still wait for delivered()
+    bool empty() const { return requeued_.empty() && !reading_ && sealed_.empty() && activeRecords_ == 0; }
+
+    // Write out the buffer and sync it if the policy's interval passed
+    void sync();
+
+    uint64_t appended() const { return appended_; }
+    uint64_t popped() const { return popped_; }
+    uint64_t undelivered() const { return undelivered_; }
+    // Segment bytes on disk, the one being read and the ones waiting for deliveries included
+    uint64_t diskBytes() const { return sealedBytes_ + (activeFd_ >= 0 ? fileOffset_ + bufferUsed_ : 0); }
+
+private:
+    std::string segmentPath(uint64_t sequence) const;
+    void openActive();
+    void writeBuffer(bool sync);
+    void buffer(const void *data, size_t len);
+    void seal();
+    bool openReader();
+    void closeReader();
+
+    std::string dir_;
+    Policy policy_;
+
+    // active segment
+    uint64_t nextSequence_{0};
+    uint64_t activeSequence_{0};
+    int activeFd_{-1};
+    uint64_t activeRecords_{0};
+    int64_t activeOpenedMs_{0};
+    uint64_t fileOffset_{0};    // block aligned, where buffer_ starts in the file
+    char *buffer_{nullptr};     // block aligned for O_DIRECT
+    size_t bufferUsed_{0};
+    int64_t lastSyncMs_{0};
+    bool dirty_{false};
+
+    // sealed segments, oldest first, and the one being read
+    std::deque<uint64_t> sealed_;
+    bool reading_{false};
+    const char *readData_{nullptr};
+    size_t readSize_{0};
+    size_t readPos_{0};
+    size_t recordEnd_{0};
+
+    struct Requeued
+    {
+        uint64_t segment;
+        bool nullKey;
+        std::string key;
+        std::string value;
+    };
+
+    // failed records, produced again before the segments; still pending for their segment
+    std::deque<Requeued> requeued_;
+
+    // popped records not delivered yet per segment, and segments read to the end that wait for them ( -> bytes )
+    std::unordered_map<uint64_t, uint64_t> pending_;
+    std::unordered_map<uint64_t, uint64_t> retired_;
+
+    uint64_t appended_{0};
+    uint64_t popped_{0};
+    uint64_t undelivered_{0};
+    uint64_t sealedBytes_{0};
+};
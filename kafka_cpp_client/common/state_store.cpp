@@ -0,0 +1,524 @@
+/*
+ * state_store.cpp
+ */
+#include "state_store.h"
+#include "crc32.h"
+#include "librdkafka/rdkafkacpp.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+const char LOG_MAGIC[8] = {'K', 'S', 'L', 'O', 'G', '0', '0', '1'};
+const char SNAPSHOT_MAGIC[8] = {'K', 'S', 'S', 'N', 'P', '0', '0', '1'};
+const uint32_t DELETED = UINT32_MAX;
+const size_t HEADER_BYTES = 12;     // crc32, key length, value length
+
+// checksum over the lengths, key and value
+uint32_t recordCrc(uint32_t keyLen, uint32_t valueLen, const void *key, const void *value)
+{
+    uint32_t lens[2] = {keyLen, valueLen};
+    auto crc = crc32(0, lens, sizeof(lens));
+    crc = crc32(crc, key, keyLen);
+    return valueLen == DELETED ? crc : crc32(crc, value, valueLen);
+}
+
+std::runtime_error sysError(const std::string &what)
+{
+    return std::runtime_error{what + ": " + strerror(errno)};
+}
+
+void writeAll(FILE *file, const void *data, size_t len, const std::string &path)
+{
+    if (fwrite(data, 1, len, file) != len)
+    {
+        throw sysError("write " + path);
+    }
+}
+}
+
+StateStore::StateStore(const std::string &dir, size_t initialLogBytes) : dir_{dir}
+{
+    mapSnapshot();
+    openLog(initialLogBytes);
+}
+
+StateStore::~StateStore()
+{
+    if (log_)
+    {
+        msync(log_, logEnd_, MS_SYNC);
+        munmap(log_, logCapacity_);
+    }
+    if (logFd_ >= 0)
+    {
+        close(logFd_);
+    }
+    if (snapshot_)
+    {
+        munmap(const_cast<char *>(snapshot_), snapshotSize_);
+    }
+}
+
+/*
+ * Snapshot: magic | partition count | ( partition, offset ) * count | records
+ */
+void StateStore::mapSnapshot()
+{
+    const auto path = dir_ + "/snapshot";
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return;
+        }
+        throw sysError("open " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw sysError("stat " + path);
+    }
+    snapshotSize_ = static_cast<size_t>(st.st_size);
+    if (snapshotSize_ < sizeof(SNAPSHOT_MAGIC) + 4)
+    {
+        close(fd);
+        throw std::runtime_error{path + " is truncated"};
+    }
+
+    void *map = mmap(nullptr, snapshotSize_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        throw sysError("mmap " + path);
+    }
+    snapshot_ = static_cast<const char *>(map);
+    madvise(map, snapshotSize_, MADV_SEQUENTIAL);
+
+    if (memcmp(snapshot_, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    {
+        throw std::runtime_error{path + " is not a state store snapshot"};
+    }
+    size_t pos = sizeof(SNAPSHOT_MAGIC);
+    uint32_t count;
+    memcpy(&count, snapshot_ + pos, 4);
+    pos += 4;
+    for (uint32_t i = 0; i < count && pos + 12 <= snapshotSize_; i++, pos += 12)
+    {
+        int32_t partition;
+        int64_t offset;
+        memcpy(&partition, snapshot_ + pos, 4);
+        memcpy(&offset, snapshot_ + pos + 4, 8);
+        changelogOffsets_[partition] = offset;
+    }
+
+    // a snapshot is renamed into place only when complete, so any damage is an error
+    size_t validEnd;
+    replay(snapshot_, pos, snapshotSize_, false, validEnd);
+    if (validEnd != snapshotSize_)
+    {
+        throw std::runtime_error{path + " is corrupt at " + std::to_string(validEnd)};
+    }
+    madvise(map, snapshotSize_, MADV_RANDOM);
+}
+
+void StateStore::openLog(size_t initialBytes)
+{
+    const auto path = dir_ + "/log";
+    logFd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (logFd_ < 0)
+    {
+        throw sysError("open " + path);
+    }
+
+    struct stat st;
+    if (fstat(logFd_, &st) != 0)
+    {
+        throw sysError("stat " + path);
+    }
+    const auto fileSize = static_cast<size_t>(st.st_size);
+    logCapacity_ = std::max(std::max(initialBytes, fileSize), size_t{4096});
+    if (ftruncate(logFd_, static_cast<off_t>(logCapacity_)) != 0)
+    {
+        throw sysError("truncate " + path);
+    }
+    void *map = mmap(nullptr, logCapacity_, PROT_READ | PROT_WRITE, MAP_SHARED, logFd_, 0);
+    if (map == MAP_FAILED)
+    {
+        throw sysError("mmap " + path);
+    }
+    log_ = static_cast<char *>(map);
+
+    if (fileSize == 0 || memcmp(log_, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0)
+    {
+        memcpy(log_, LOG_MAGIC, sizeof(LOG_MAGIC));
+        logEnd_ = sizeof(LOG_MAGIC);
+        return;
+    }
+
+    // the unused capacity is zero filled, a crash may leave a partial record: both fail the checksum
+    replay(log_, sizeof(LOG_MAGIC), logCapacity_, true, logEnd_);
+
+    // clear a torn record, so that what is appended next is not followed by parts of it
+    size_t torn = HEADER_BYTES;
+    if (logEnd_ + HEADER_BYTES <= logCapacity_)
+    {
+        uint32_t lens[2];
+        memcpy(lens, log_ + logEnd_ + 4, sizeof(lens));
+        torn += size_t{lens[0]} + (lens[1] == DELETED ? 0 : lens[1]);
+    }
+    memset(log_ + logEnd_, 0, std::min(logCapacity_ - logEnd_, torn));
+}
+
+/*
+ * Apply the records in base[begin, end) to the index.
+ * validEnd is set to the end of the last record with a valid checksum.
+ */
+void StateStore::replay(const char *base, size_t begin, size_t end, bool inLog, size_t &validEnd)
+{
+    size_t pos = begin;
+    while (pos + HEADER_BYTES <= end)
+    {
+        uint32_t crc, keyLen, valueLen;
+        memcpy(&crc, base + pos, 4);
+        memcpy(&keyLen, base + pos + 4, 4);
+        memcpy(&valueLen, base + pos + 8, 4);
+
+        const size_t dataLen = size_t{keyLen} + (valueLen == DELETED ? 0 : valueLen);
+        if (dataLen > end - pos - HEADER_BYTES)
+        {
+            break;
+        }
+        const char *key = base + pos + HEADER_BYTES;
+        if (crc != recordCrc(keyLen, valueLen, key, key + keyLen))
+        {
+            break;
+        }
+
+        std::string k{key, keyLen};
+        if (valueLen == DELETED)
+        {
+            index_.erase(k);
+        }
+        else
+        {
+            index_[std::move(k)] = Location{pos + HEADER_BYTES + keyLen, valueLen, inLog};
+        }
+        pos += HEADER_BYTES + dataLen;
+    }
+    validEnd = pos;
+}
+
+bool StateStore::get(const std::string &key, const char *&value, size_t &valueLen) const
+{
+    const auto it = index_.find(key);
+    if (it == index_.end())
+    {
+        return false;
+    }
+    value = (it->second.inLog ? log_ : snapshot_) + it->second.offset;
+    valueLen = it->second.len;
+    return true;
+}
+
+void StateStore::put(const std::string &key, const void *value, size_t valueLen)
+{
+    if (valueLen >= DELETED)
+    {
+        throw std::length_error{"state store values are limited to 4 GB"};
+    }
+    append(key, value, static_cast<uint32_t>(valueLen));
+    index_[key] = Location{logEnd_ - valueLen, static_cast<uint32_t>(valueLen), true};
+}
+
+void StateStore::remove(const std::string &key)
+{
+    if (index_.erase(key))
+    {
+        append(key, nullptr, DELETED);
+    }
+}
+
+void StateStore::append(const std::string &key, const void *value, uint32_t valueLen)
+{
+    const auto keyLen = static_cast<uint32_t>(key.size());
+    const size_t recordLen = HEADER_BYTES + keyLen + (valueLen == DELETED ? 0 : valueLen);
+    reserve(recordLen);
+
+    char *p = log_ + logEnd_;
+    const auto crc = recordCrc(keyLen, valueLen, key.data(), value);
+    memcpy(p, &crc, 4);
+    memcpy(p + 4, &keyLen, 4);
+    memcpy(p + 8, &valueLen, 4);
+    memcpy(p + HEADER_BYTES, key.data(), keyLen);
+    if (valueLen != DELETED)
+    {
+        memcpy(p + HEADER_BYTES + keyLen, value, valueLen);
+    }
+    logEnd_ += recordLen;
+}
+
+// Grow the log mapping so that bytes more fit, index entries hold offsets so the mapping may move
+void StateStore::reserve(size_t bytes)
+{
+    // keep a zeroed header after the last record, so a replay stops there
+    if (logEnd_ + bytes + HEADER_BYTES <= logCapacity_)
+    {
+        return;
+    }
+
+    auto capacity = logCapacity_;
+    while (logEnd_ + bytes + HEADER_BYTES > capacity)
+    {
+        capacity *= 2;
+    }
+    if (ftruncate(logFd_, static_cast<off_t>(capacity)) != 0)
+    {
+        throw sysError("grow " + dir_ + "/log");
+    }
+    void *map = mremap(log_, logCapacity_, capacity, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+    {
+        throw sysError("remap " + dir_ + "/log");
+    }
+    log_ = static_cast<char *>(map);
+    logCapacity_ = capacity;
+}
+
+int64_t StateStore::changelogOffset(int32_t partition) const
+{
+    const auto it = changelogOffsets_.find(partition);
+    return it == changelogOffsets_.end() ? -1 : it->second;
+}
+
+void StateStore::setChangelogOffset(int32_t partition, int64_t offset)
+{
+    auto &current = changelogOffsets_.emplace(partition, -1).first->second;
+    current = std::max(current, offset);
+}
+
+/*
+ * The new snapshot is complete on disk before the log is emptied. A crash in between leaves the old log
+ * next to the new snapshot; replaying it again yields the same state, the records are already included.
+ */
+void StateStore::snapshot()
+{
+    const auto path = dir_ + "/snapshot";
+    const auto tmpPath = path + ".tmp";
+    FILE *file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+    {
+        throw sysError("create " + tmpPath);
+    }
+    std::vector<char> buffer(1 << 20);
+    setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+
+    std::unordered_map<std::string, Location> index;
+    index.reserve(index_.size());
+    try
+    {
+        writeAll(file, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC), tmpPath);
+        const auto count = static_cast<uint32_t>(changelogOffsets_.size());
+        writeAll(file, &count, 4, tmpPath);
+        for (const auto &entry : changelogOffsets_)
+        {
+            writeAll(file, &entry.first, 4, tmpPath);
+            writeAll(file, &entry.second, 8, tmpPath);
+        }
+
+        uint64_t pos = sizeof(SNAPSHOT_MAGIC) + 4 + 12 * uint64_t{count};
+        for (const auto &entry : index_)
+        {
+            const auto keyLen = static_cast<uint32_t>(entry.first.size());
+            const auto valueLen = entry.second.len;
+            const char *value = (entry.second.inLog ? log_ : snapshot_) + entry.second.offset;
+            const uint32_t header[3] = {recordCrc(keyLen, valueLen, entry.first.data(), value), keyLen, valueLen};
+            writeAll(file, header, sizeof(header), tmpPath);
+            writeAll(file, entry.first.data(), keyLen, tmpPath);
+            writeAll(file, value, valueLen, tmpPath);
+
+            index.emplace(entry.first, Location{pos + HEADER_BYTES + keyLen, valueLen, false});
+            pos += HEADER_BYTES + keyLen + valueLen;
+        }
+
+        if (fflush(file) != 0 || fsync(fileno(file)) != 0)
+        {
+            throw sysError("sync " + tmpPath);
+        }
+    }
+    catch (...)
+    {
+        fclose(file);
+        unlink(tmpPath.c_str());
+        throw;
+    }
+    fclose(file);
+
+    if (rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        throw sysError("rename " + tmpPath);
+    }
+    const int dirFd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirFd >= 0)
+    {
+        fsync(dirFd);
+        close(dirFd);
+    }
+
+    if (snapshot_)
+    {
+        munmap(const_cast<char *>(snapshot_), snapshotSize_);
+        snapshot_ = nullptr;
+    }
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw sysError("open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw sysError("stat " + path);
+    }
+    snapshotSize_ = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, snapshotSize_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        throw sysError("mmap " + path);
+    }
+    snapshot_ = static_cast<const char *>(map);
+    index_.swap(index);
+
+    // empty log: zero what was written, the file keeps its size
+    memset(log_ + sizeof(LOG_MAGIC), 0, logEnd_ - sizeof(LOG_MAGIC));
+    logEnd_ = sizeof(LOG_MAGIC);
+    sync();
+}
+
+void StateStore::sync()
+{
+    if (msync(log_, std::min(logEnd_ + HEADER_BYTES, logCapacity_), MS_SYNC) != 0)
+    {
+        throw sysError("sync " + dir_ + "/log");
+    }
+}
+
+uint64_t restoreFromChangelog(StateStore &store, const RdKafka::Conf *conf, const std::string &topic,
+                              const std::vector<int32_t> &partitions, int timeoutMs)
+{
+    std::string errstr;
+    std::unique_ptr<RdKafka::KafkaConsumer> consumer{RdKafka::KafkaConsumer::create(conf, errstr)};
+    if (!consumer)
+    {
+        throw std::runtime_error{"restore consumer: " + errstr};
+    }
+
+    std::map<int32_t, int64_t> end;     // partition -> high watermark
+    std::vector<RdKafka::TopicPartition *> assignment;
+    for (const auto partition : partitions)
+    {
+        int64_t low = 0, high = 0;
+        const auto err = consumer->query_watermark_offsets(topic, partition, &low, &high, timeoutMs);
+        if (err != RdKafka::ERR_NO_ERROR)
+        {
+            RdKafka::TopicPartition::destroy(assignment);
+            throw std::runtime_error{"watermarks of " + topic + " [" + std::to_string(partition) + "]: " + RdKafka::err2str(err)};
+        }
+        const auto start = std::max(low, store.changelogOffset(partition) + 1);
+        if (start < high)
+        {
+            assignment.push_back(RdKafka::TopicPartition::create(topic, partition, start));
+            end[partition] = high;
+        }
+    }
+    if (assignment.empty())
+    {
+        return 0;
+    }
+
+    auto err = consumer->assign(assignment);
+    RdKafka::TopicPartition::destroy(assignment);
+    if (err != RdKafka::ERR_NO_ERROR)
+    {
+        throw std::runtime_error{"restore assign: " + RdKafka::err2str(err)};
+    }
+
+    uint64_t applied = 0;
+    auto lastProgress = std::chrono::steady_clock::now();
+
+    // compaction and transaction markers leave gaps, so completion is decided by the consumer position
+    auto finished = [&]
+    {
+        std::vector<RdKafka::TopicPartition *> positions;
+        for (const auto &entry : end)
+        {
+            positions.push_back(RdKafka::TopicPartition::create(topic, entry.first));
+        }
+        consumer->position(positions);
+        for (const auto *tp : positions)
+        {
+            if (tp->offset() >= end[tp->partition()])
+            {
+                end.erase(tp->partition());
+            }
+        }
+        RdKafka::TopicPartition::destroy(positions);
+        return end.empty();
+    };
+
+    while (!finished())
+    {
+        // one batch: whatever arrives within 100 ms, at most 10000 records
+        for (int i = 0; i < 10000; i++)
+        {
+            std::unique_ptr<RdKafka::Message> msg{consumer->consume(i ? 0 : 100)};
+            if (msg->err() == RdKafka::ERR__TIMED_OUT)
+            {
+                break;
+            }
+            if (msg->err() == RdKafka::ERR__PARTITION_EOF)
+            {
+                continue;
+            }
+            if (msg->err() != RdKafka::ERR_NO_ERROR)
+            {
+                throw std::runtime_error{"restore consume: " + msg->errstr()};
+            }
+
+            const std::string key{static_cast<const char *>(msg->key_pointer()), msg->key_len()};
+            if (msg->payload())
+            {
+                store.put(key, msg->payload(), msg->len());
+            }
+            else
+            {
+                store.remove(key);  // tombstone
+            }
+            store.setChangelogOffset(msg->partition(), msg->offset());
+            applied++;
+            lastProgress = std::chrono::steady_clock::now();
+        }
+
+        if (std::chrono::steady_clock::now() - lastProgress > std::chrono::milliseconds(timeoutMs))
+        {
+            throw std::runtime_error{"restore of " + topic + " made no progress for " + std::to_string(timeoutMs) + " ms"};
+        }
+    }
+
+    consumer->close();
+    return applied;
+}
@@ -0,0 +1,106 @@
+/*
+ * state_store.h
+ *
+ * Embedded key-value store for stateful consumers, backed by a compacted changelog topic.
+ *  1) Writes are appended to a memory-mapped log file and indexed in memory; values are read straight
+ *     from the mapping.
+ *  2) snapshot() writes the live entries and the changelog offsets they include to a new snapshot file
+ *     ( written aside, synced and renamed into place ) and starts an empty log.
+ *  3) Opening a store loads the snapshot and replays the log, whose torn tail after a crash is detected
+ *     by a checksum per record and cut off. restoreFromChangelog() then only reads the changelog after the
+ *     snapshot's offsets, so restart time is bounded by the snapshot size, not the changelog length.
+ *
+ * Record layout, in the log and the snapshot: crc32 | key length | value length ( ~0 = delete ) | key | value
+ *
+ * Not thread safe.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace RdKafka
+{
+class Conf;
+}
+
+class StateStore
+{
+public:
+    /*
+     * Open or create the store in directory dir ( which must exist )
+     * @param initialLogBytes   log file size to map up front, doubled whenever it fills up
+     */
+    explicit StateStore(const std::string &dir, size_t initialLogBytes = 64 << 20);
+    ~StateStore();
+
+    StateStore(const StateStore &) = delete;
+    StateStore &operator=(const StateStore &) = delete;
+
+    /*
+     * Look up a key.
+     * @returns false if not found. value points into the mapped files, valid until the next modification
+     */
+    bool get(const std::string &key, const char *&value, size_t &valueLen) const;
+
+    void put(const std::string &key, const void *value, size_t valueLen);
+    void remove(const std::string &key);
+
+    /*
+     * Highest changelog offset of the partition contained in the store, -1 if none.
+     * Set from delivery reports of changelog writes and while restoring.
+     */
+    int64_t changelogOffset(int32_t partition) const;
+    void setChangelogOffset(int32_t partition, int64_t offset);
+    const std::map<int32_t, int64_t> &changelogOffsets() const { return changelogOffsets_; }
+
+    // Write a snapshot and start an empty log
+    void snapshot();
+
+    // Flush the log mapping to disk
+    void sync();
+
+    size_t size() const { return index_.size(); }
+    size_t logBytes() const { return logEnd_; }
+    size_t snapshotBytes() const { return snapshotSize_; }
+
+private:
+    struct Location
+    {
+        uint64_t offset;    // of the value, in the file
+        uint32_t len;
+        bool inLog;         // else in the snapshot
+    };
+
+    void openLog(size_t initialBytes);
+    void mapSnapshot();
+    void replay(const char *base, size_t begin, size_t end, bool inLog, size_t &validEnd);
+    void append(const std::string &key, const void *value, uint32_t valueLen);
+    void reserve(size_t bytes);
+
+    std::string dir_;
+    std::unordered_map<std::string, Location> index_;
+    std::map<int32_t, int64_t> changelogOffsets_;
+
+    int logFd_{-1};
+    char *log_{nullptr};
+    size_t logCapacity_{0};
+    size_t logEnd_{0};
+
+    const char *snapshot_{nullptr};
+    size_t snapshotSize_{0};
+};
+
+/*
+ * Bring the store up to date with the changelog topic: every partition is read from the offset after
+ * the store's changelog offset up to the high watermark, in batches.
+ * conf needs bootstrap.servers and a group.id ( required by the consumer ), the partitions are assigned
+ * directly so no group is joined, and nothing is committed.
+ * @returns the number of changelog records applied, throws std::runtime_error on failure
+ */
+uint64_t restoreFromChangelog(StateStore &store, const RdKafka::Conf *conf, const std::string &topic,
+                              const std::vector<int32_t> &partitions, int timeoutMs);
@@ -0,0 +1,243 @@
+/*
+ * stats_parser.cpp
+ *
+ * Single pass over the statistics JSON without building a document: numeric leaves are matched
+ * against the path of object keys leading to them.
+ */
+#include "stats_parser.h"
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+
+class StatsReader
+{
+public:
+    StatsReader(const std::string &json, ConsumerStats &stats)
+        : p_{json.data()}, end_{json.data() + json.size()}, stats_{stats}
+    {
+    }
+
+    bool parse()
+    {
+        return value() && (skipWs(), p_ == end_);
+    }
+
+private:
+    void skipWs()
+    {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t'))
+        {
+            p_++;
+        }
+    }
+
+    bool string(std::string *out)
+    {
+        if (p_ >= end_ || *p_ != '"')
+        {
+            return false;
+        }
+        const char *start = ++p_;
+        while (p_ < end_ && *p_ != '"')
+        {
+            // keys and values librdkafka emits never need unescaping, only skipping
+            p_ += (*p_ == '\\') ? 2 : 1;
+        }
+        if (p_ >= end_)
+        {
+            return false;
+        }
+        if (out)
+        {
+            out->assign(start, p_ - start);
+        }
+        p_++;
+        return true;
+    }
+
+    bool value()
+    {
+        skipWs();
+        if (p_ >= end_)
+        {
+            return false;
+        }
+
+        switch (*p_)
+        {
+        case '{':
+            return object();
+        case '[':
+            return array();
+        case '"':
+            return string(nullptr);
+        case 't':
+        case 'f':
+        case 'n':
+            while (p_ < end_ && *p_ >= 'a' && *p_ <= 'z')
+            {
+                p_++;
+            }
+            return true;
+        default:
+        {
+            char *numEnd = nullptr;
+            const double v = strtod(p_, &numEnd);
+            if (numEnd == p_)
+            {
+                return false;
+            }
+            p_ = numEnd;
+            number(static_cast<int64_t>(v));
+            return true;
+        }
+        }
+    }
+
+    bool array()
+    {
+        p_++;
+        skipWs();
+        if (p_ < end_ && *p_ == ']')
+        {
+            p_++;
+            return true;
+        }
+        for (;;)
+        {
+            path_.emplace_back();
+            const bool ok = value();
+            path_.pop_back();
+            if (!ok)
+            {
+                return false;
+            }
+            skipWs();
+            if (p_ >= end_)
+            {
+                return false;
+            }
+            if (*p_++ == ']')
+            {
+                return true;
+            }
+        }
+    }
+
+    bool object()
+    {
+        p_++;
+        // topics.<topic>.partitions.<partition>
+        const bool isPartition = path_.size() == 4 && path_[0] == "topics" && path_[2] == "partitions";
+        if (isPartition)
+        {
+            partition_ = PartitionStats{};
+            partition_.topic = path_[1];
+            partition_.partition = atoi(path_[3].c_str());
+        }
+
+        skipWs();
+        if (p_ < end_ && *p_ == '}')
+        {
+            p_++;
+            return true;
+        }
+
+        for (;;)
+        {
+            skipWs();
+            std::string key;
+            if (!string(&key))
+            {
+                return false;
+            }
+            skipWs();
+            if (p_ >= end_ || *p_++ != ':')
+            {
+                return false;
+            }
+            path_.push_back(std::move(key));
+            const bool ok = value();
+            path_.pop_back();
+            if (!ok)
+            {
+                return false;
+            }
+            skipWs();
+            if (p_ >= end_)
+            {
+                return false;
+            }
+            const char c = *p_++;
+            if (c == '}')
+            {
+                break;
+            }
+            if (c != ',')
+            {
+                return false;
+            }
+        }
+
+        // the internal UA partition ( -1 ) holds messages not yet assigned a partition, producer side only
+        if (isPartition && partition_.partition >= 0)
+        {
+            stats_.fetchqCnt += partition_.fetchqCnt;
+            stats_.fetchqSize += partition_.fetchqSize;
+            stats_.partitions.push_back(partition_);
+        }
+        return true;
+    }
+
+    void number(int64_t v)
+    {
+        const auto depth = path_.size();
+        if (depth == 1)
+        {
+            const auto &key = path_[0];
+            if (key == "ts")
+                stats_.ts = v;
+            else if (key == "rxmsgs")
+                stats_.rxmsgs = v;
+            else if (key == "rxmsg_bytes")
+                stats_.rxmsgBytes = v;
+        }
+        else if (depth == 4 && path_[0] == "brokers" && path_[2] == "rtt" && path_[3] == "avg" && v > 0)
+        {
+            // running mean over the brokers that have been talked to
+            rttBrokers_++;
+            stats_.rttAvgUs += (v - stats_.rttAvgUs) / rttBrokers_;
+        }
+        else if (depth == 5 && path_[0] == "topics" && path_[2] == "partitions")
+        {
+            const auto &key = path_[4];
+            if (key == "fetchq_cnt")
+                partition_.fetchqCnt = v;
+            else if (key == "fetchq_size")
+                partition_.fetchqSize = v;
+            else if (key == "consumer_lag")
+                partition_.consumerLag = v;
+            else if (key == "rxmsgs")
+                partition_.rxmsgs = v;
+            else if (key == "rxbytes")
+                partition_.rxbytes = v;
+        }
+    }
+
+    const char *p_;
+    const char *end_;
+    ConsumerStats &stats_;
+    std::vector<std::string> path_;
+    PartitionStats partition_;
+    int64_t rttBrokers_{0};
+};
+
+} // namespace
+
+bool parseConsumerStats(const std::string &json, ConsumerStats &stats)
+{
+    stats = ConsumerStats{};
+    return StatsReader{json, stats}.parse();
+}
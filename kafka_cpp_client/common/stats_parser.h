@@ -0,0 +1,41 @@
+/*
+ * stats_parser.h
+ *
+ * Minimal reader for the librdkafka statistics JSON delivered as RdKafka::Event::EVENT_STATS
+ * ( enable with statistics.interval.ms ).
+ * Only the consumer fetch counters used for tuning are extracted, see
+ * https://github.com/edenhill/librdkafka/blob/master/STATISTICS.md
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct PartitionStats
+{
+    std::string topic;
+    int32_t partition{-1};
+    int64_t fetchqCnt{0};       // pre-fetched messages waiting in the fetch queue
+    int64_t fetchqSize{0};      // bytes of pre-fetched messages waiting in the fetch queue
+    int64_t consumerLag{-1};
+    int64_t rxmsgs{0};
+    int64_t rxbytes{0};
+};
+
+struct ConsumerStats
+{
+    int64_t ts{0};              // librdkafka monotonic clock, microseconds
+    int64_t rxmsgs{0};
+    int64_t rxmsgBytes{0};
+    int64_t fetchqCnt{0};       // sum over all partitions
+    int64_t fetchqSize{0};      // sum over all partitions
+    int64_t rttAvgUs{0};        // average broker round trip time
+    std::vector<PartitionStats> partitions;
+};
+
+/*
+ * Parse a statistics JSON document.
+ * @returns false if the document is malformed, stats is then partially filled
+ */
+bool parseConsumerStats(const std::string &json, ConsumerStats &stats);
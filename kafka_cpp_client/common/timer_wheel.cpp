@@ -0,0 +1,276 @@
+/*
+ * timer_wheel.cpp
+ */
+#include "timer_wheel.h"
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+
+TimerWheel::TimerWheel(int64_t tickMs, int64_t nowMs)
+    : tickMs_{tickMs}, originMs_{nowMs}, heads_(kLevels * kSlots, kNil)
+{
+    if (tickMs_ <= 0)
+    {
+        throw std::invalid_argument{"timer wheel tick must be positive"};
+    }
+}
+
+TimerWheel::TimerId TimerWheel::id(uint32_t index, uint32_t generation)
+{
+    return static_cast<TimerId>(generation) << 32 | index;
+}
+
+// whole ticks, rounded up: a timer never fires early
+uint64_t TimerWheel::ticks(int64_t ms) const
+{
+    return ms <= 0 ? 0 : static_cast<uint64_t>((ms + tickMs_ - 1) / tickMs_);
+}
+
+TimerWheel::TimerId TimerWheel::schedule(int64_t delayMs, std::function<void()> fn)
+{
+    return add(delayMs, 0, std::move(fn));
+}
+
+TimerWheel::TimerId TimerWheel::every(int64_t intervalMs, std::function<void()> fn)
+{
+    return add(intervalMs, static_cast<int64_t>(std::max<uint64_t>(1, ticks(intervalMs))), std::move(fn));
+}
+
+TimerWheel::TimerId TimerWheel::add(int64_t delayMs, int64_t intervalTicks, std::function<void()> fn)
+{
+    uint32_t index;
+    if (!free_.empty())
+    {
+        index = free_.back();
+        free_.pop_back();
+    }
+    else
+    {
+        index = static_cast<uint32_t>(timers_.size());
+        timers_.emplace_back();
+    }
+
+    auto &timer = timers_[index];
+    timer.fn = std::move(fn);
+    timer.expiry = now_ + std::max<uint64_t>(1, ticks(delayMs));
+    timer.interval = intervalTicks;
+    timer.generation++;
+    file(index);
+    size_++;
+    return id(index, timer.generation);
+}
+
+TimerWheel::Timer *TimerWheel::lookup(TimerId id)
+{
+    const auto index = static_cast<uint32_t>(id & UINT32_MAX);
+    if (index >= timers_.size() || timers_[index].generation != static_cast<uint32_t>(id >> 32) ||
+        !timers_[index].fn)
+    {
+        return nullptr;
+    }
+    return &timers_[index];
+}
+
+bool TimerWheel::cancel(TimerId id)
+{
+    auto *timer = lookup(id);
+    if (!timer)
+    {
+        return false;
+    }
+    const auto index = static_cast<uint32_t>(timer - &timers_[0]);
+    unlink(index);
+    release(index);
+    return true;
+}
+
+// File a timer in the finest level whose revolution still covers its expiry
+void TimerWheel::file(uint32_t index)
+{
+    auto &timer = timers_[index];
+    const auto delta = timer.expiry > now_ ? timer.expiry - now_ : 0;
+
+    int level = 0;
+    while (level < kLevels - 1 && delta >= kSlots << (kBits * level))
+    {
+        level++;
+    }
+    // beyond the last level: file at its far end, re-filed when that slot cascades
+    const auto expiry = std::min<uint64_t>(std::max(timer.expiry, now_), now_ + (kSlots << (kBits * level)) - 1);
+    const auto slot = static_cast<int32_t>(level * kSlots + ((expiry >> (kBits * level)) & kMask));
+
+    timer.slot = slot;
+    timer.prev = kNil;
+    timer.next = heads_[slot];
+    if (timer.next != kNil)
+    {
+        timers_[timer.next].prev = index;
+    }
+    heads_[slot] = index;
+    filed_[level]++;
+}
+
+void TimerWheel::unlink(uint32_t index)
+{
+    auto &timer = timers_[index];
+    if (timer.slot < 0)
+    {
+        return;
+    }
+    if (timer.prev != kNil)
+    {
+        timers_[timer.prev].next = timer.next;
+    }
+    else
+    {
+        heads_[timer.slot] = timer.next;
+    }
+    if (timer.next != kNil)
+    {
+        timers_[timer.next].prev = timer.prev;
+    }
+    filed_[timer.slot / kSlots]--;
+    timer.slot = -1;
+    timer.prev = timer.next = kNil;
+}
+
+void TimerWheel::release(uint32_t index)
+{
+    timers_[index].fn = nullptr;
+    free_.push_back(index);
+    size_--;
+}
+
+// The slot of level that the wheel just entered covers the next revolution of the level below: re-file its timers
+void TimerWheel::cascade(int level)
+{
+    const auto slot = level * kSlots + ((now_ >> (kBits * level)) & kMask);
+    auto index = heads_[slot];
+    heads_[slot] = kNil;
+    while (index != kNil)
+    {
+        auto &timer = timers_[index];
+        const auto next = timer.next;
+        filed_[level]--;
+        timer.slot = -1;
+        file(index);
+        index = next;
+    }
+}
+
+size_t TimerWheel::advance(int64_t nowMs)
+{
+    if (nowMs < originMs_)
+    {
+        return 0;
+    }
+    const auto target = static_cast<uint64_t>((nowMs - originMs_) / tickMs_);
+    if (size_ == 0)
+    {
+        now_ = std::max(now_, target);
+        return 0;
+    }
+
+    size_t ran = 0;
+    while (now_ < target)
+    {
+        now_++;
+        for (int level = 1; level < kLevels && (now_ & ((uint64_t{1} << (kBits * level)) - 1)) == 0; level++)
+        {
+            cascade(level);
+        }
+
+        // detach the slot first: callbacks may schedule into it or cancel timers that are about to run
+        const auto slot = now_ & kMask;
+        firing_.clear();
+        for (auto index = heads_[slot]; index != kNil; index = timers_[index].next)
+        {
+            firing_.push_back(id(index, timers_[index].generation));
+        }
+        heads_[slot] = kNil;
+        for (const auto fired : firing_)
+        {
+            auto &timer = timers_[static_cast<uint32_t>(fired & UINT32_MAX)];
+            filed_[0]--;
+            timer.slot = -1;
+            timer.prev = timer.next = kNil;
+        }
+
+        for (const auto fired : firing_)
+        {
+            auto *timer = lookup(fired);
+            if (!timer)
+            {
+                continue;   // cancelled by an earlier callback
+            }
+            const auto index = static_cast<uint32_t>(fired & UINT32_MAX);
+            if (timer->expiry > now_)
+            {
+                file(index);
+                continue;
+            }
+
+            // the callback runs on its own copy of the function: it may cancel its timer or grow timers_
+            auto fn = std::move(timer->fn);
+            if (timer->interval > 0)
+            {
+                timer->fn = [] {};
+                // keep the cadence, but do not catch up on intervals missed by a late advance()
+                timer->expiry += static_cast<uint64_t>(timer->interval);
+                if (timer->expiry <= target)
+                {
+                    timer->expiry = target + static_cast<uint64_t>(timer->interval);
+                }
+                file(index);
+                fn();
+                if ((timer = lookup(fired)))
+                {
+                    timer->fn = std::move(fn);
+                }
+            }
+            else
+            {
+                release(index);
+                fn();
+            }
+            ran++;
+        }
+
+        // nothing left to run: skip the empty ticks
+        if (size_ == 0)
+        {
+            now_ = target;
+        }
+    }
+    return ran;
+}
+
+int TimerWheel::timeout(int maxMs, int64_t nowMs) const
+{
+    if (size_ == 0)
+    {
+        return maxMs;
+    }
+
+    // first non empty level 0 slot, or the next cascade if coarser levels hold timers
+    uint64_t due = UINT64_MAX;
+    for (uint64_t tick = now_ + 1; filed_[0] > 0 && tick <= now_ + kSlots; tick++)
+    {
+        if (heads_[tick & kMask] != kNil)
+        {
+            due = tick;
+            break;
+        }
+    }
+    if (filed_[0] < size_)
+    {
+        due = std::min(due, (now_ | kMask) + 1);
+    }
+    if (due == UINT64_MAX)
+    {
+        return maxMs;
+    }
+
+    const auto waitMs = originMs_ + static_cast<int64_t>(due) * tickMs_ - nowMs;
+    return static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(waitMs, maxMs)));
+}
@@ -0,0 +1,121 @@
+/*
+ * timer_wheel.h
+ *
+ * Deadlines for consume loops without reading the clock for every message.
+ *
+ * CoarseClock reads CLOCK_MONOTONIC_COARSE / CLOCK_REALTIME_COARSE: served from the vDSO without a system call, at
+ * the resolution of the kernel tick ( 1 - 4 ms ), which is all a batch timeout or a commit interval needs.
+ *
+ * TimerWheel is a hierarchical timing wheel: 4 levels of 64 slots, level 0 one tick per slot, every level above 64
+ * times coarser ( 1 ms ticks cover 4.6 hours, later deadlines are re-filed as they come closer ). Scheduling and
+ * cancelling are O(1), advance() touches only the slots that elapsed and cascades a coarser slot into the finer
+ * ones once per revolution. Timers fire from advance(), on the thread that calls it, never early and at most one
+ * tick late.
+ *
+ *  TimerWheel wheel;
+ *  wheel.every(1000, [&] { commitDue = true; });
+ *  while (run)
+ *  {
+ *      auto *msg = consumer->consume(wheel.timeout(1000));
+ *      ...
+ *      wheel.advance();
+ *  }
+ *
+ * Not thread safe: use from the thread that polls the consumer ( or producer ).
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <vector>
+
+namespace CoarseClock
+{
+// ms since an arbitrary point, never goes back
+inline int64_t nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ms since the epoch, for timestamps that leave the process ( headers, log lines )
+inline int64_t wallMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+}
+
+class TimerWheel
+{
+public:
+    // Identifies a scheduled timer, stays invalid once it fired or was cancelled. 0 is never a timer.
+    typedef uint64_t TimerId;
+
+    explicit TimerWheel(int64_t tickMs = 1, int64_t nowMs = CoarseClock::nowMs());
+
+    // Run fn once, delayMs from the last advance()
+    TimerId schedule(int64_t delayMs, std::function<void()> fn);
+
+    // Run fn every intervalMs, until cancelled. A late advance() runs it once, not once per missed interval.
+    TimerId every(int64_t intervalMs, std::function<void()> fn);
+
+    // @returns false if the timer already fired ( one shot ) or was cancelled
+    bool cancel(TimerId id);
+
+    // Move the wheel to nowMs, running every timer that is due. Timers may schedule and cancel timers.
+    // @returns the number of timers that ran
+    size_t advance(int64_t nowMs = CoarseClock::nowMs());
+
+    /*
+     * How long a poll may block without missing a timer, at most maxMs. Exact for timers due within 64 ticks,
+     * for later ones the wait ends early at the next cascade ( a spurious wakeup, not a late timer ).
+     */
+    int timeout(int maxMs, int64_t nowMs = CoarseClock::nowMs()) const;
+
+    // Time of the last advance()
+    int64_t nowMs() const { return originMs_ + static_cast<int64_t>(now_) * tickMs_; }
+
+    size_t size() const { return size_; }
+
+private:
+    static constexpr int kLevels = 4;
+    static constexpr int kBits = 6;
+    static constexpr uint64_t kSlots = 1 << kBits;
+    static constexpr uint64_t kMask = kSlots - 1;
+    static constexpr uint32_t kNil = UINT32_MAX;
+
+    struct Timer
+    {
+        std::function<void()> fn;
+        uint64_t expiry{0};     // tick
+        int64_t interval{0};    // ticks, 0 for a one shot timer
+        uint32_t generation{0}; // bumped on reuse, stale ids do not match
+        uint32_t prev{kNil};
+        uint32_t next{kNil};
+        int32_t slot{-1};       // level * kSlots + index, -1 if not filed
+    };
+
+    TimerId add(int64_t delayMs, int64_t intervalTicks, std::function<void()> fn);
+    Timer *lookup(TimerId id);
+    void file(uint32_t index);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+    void cascade(int level);
+    static TimerId id(uint32_t index, uint32_t generation);
+    uint64_t ticks(int64_t ms) const;
+
+    int64_t tickMs_;
+    int64_t originMs_;
+    uint64_t now_{0};       // last tick that ran
+    std::vector<Timer> timers_;
+    std::vector<uint32_t> free_;
+    std::vector<uint32_t> heads_;   // kLevels * kSlots list heads
+    size_t filed_[kLevels]{};       // timers per level
+    std::vector<TimerId> firing_;   // reused by advance()
+    size_t size_{0};
+};
@@ -0,0 +1,210 @@
+/*
+ * trace.cpp
+ */
+#include "trace.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#ifdef KAFKA_HAVE_USDT
+// the probe points reference their semaphores, for the tracer to find them
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+extern "C"
+{
+#define KAFKA_SEMAPHORE(name) volatile unsigned short kafka_client_##name##_semaphore __attribute__((section(".probes"))) = 0
+KAFKA_SEMAPHORE(produce_enqueue);
+KAFKA_SEMAPHORE(delivery_report);
+KAFKA_SEMAPHORE(consume_return);
+KAFKA_SEMAPHORE(batch_formed);
+KAFKA_SEMAPHORE(commit);
+#undef KAFKA_SEMAPHORE
+}
+#endif
+
+namespace
+{
+struct Event
+{
+    uint64_t start;
+    uint64_t duration;
+    uint64_t value;
+    TraceStage stage;
+};
+
+struct Ring
+{
+    static constexpr size_t kSize = 4096;     // power of two
+
+    size_t thread;
+    uint64_t next{0};
+    std::array<Event, kSize> events;
+};
+
+const char *stageName(TraceStage stage)
+{
+    switch (stage)
+    {
+    case TraceStage::ProduceEnqueue:
+        return "produce_enqueue";
+    case TraceStage::DeliveryReport:
+        return "delivery_report";
+    case TraceStage::ConsumeReturn:
+        return "consume_return";
+    case TraceStage::BatchFormed:
+        return "batch_formed";
+    case TraceStage::Commit:
+        return "commit";
+    default:
+        return "?";
+    }
+}
+
+bool envEnabled()
+{
+    const char *env = getenv("KAFKA_TRACE");
+    return env && *env && strcmp(env, "0") != 0;
+}
+
+// Rings outlive their threads, for report()
+std::mutex ringsLock;
+std::vector<std::unique_ptr<Ring>> rings;
+thread_local Ring *ring = nullptr;
+
+// Ticks and ns at startup: ticks are converted to ns with the rate measured since then
+const uint64_t anchorTicks = Trace::ticks();
+const auto anchorTime = std::chrono::steady_clock::now();
+
+double nsPerTick()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    const auto ticks = Trace::ticks() - anchorTicks;
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - anchorTime);
+    return ticks > 0 ? static_cast<double>(ns.count()) / ticks : 1.0;
+#else
+    return 1.0;
+#endif
+}
+}
+
+std::atomic<bool> Trace::on{envEnabled()};
+
+void Trace::enable(bool enable)
+{
+    on.store(enable, std::memory_order_relaxed);
+}
+
+void Trace::record(TraceStage stage, uint64_t start, uint64_t end, uint64_t value)
+{
+    // only a tracer attached: the probe point alone
+    if (enabled())
+    {
+        if (!ring)
+        {
+            std::lock_guard<std::mutex> lock{ringsLock};
+            rings.push_back(std::make_unique<Ring>());
+            rings.back()->thread = rings.size() - 1;
+            ring = rings.back().get();
+        }
+        ring->events[ring->next++ & (Ring::kSize - 1)] = Event{start, end - start, value, stage};
+    }
+
+#ifdef KAFKA_HAVE_USDT
+    // one probe point per stage: USDT probe names are compile time
+    const uint64_t duration = end - start;
+    switch (stage)
+    {
+    case TraceStage::ProduceEnqueue:
+        DTRACE_PROBE2(kafka_client, produce_enqueue, value, duration);
+        break;
+    case TraceStage::DeliveryReport:
+        DTRACE_PROBE2(kafka_client, delivery_report, value, duration);
+        break;
+    case TraceStage::ConsumeReturn:
+        DTRACE_PROBE2(kafka_client, consume_return, value, duration);
+        break;
+    case TraceStage::BatchFormed:
+        DTRACE_PROBE2(kafka_client, batch_formed, value, duration);
+        break;
+    case TraceStage::Commit:
+        DTRACE_PROBE2(kafka_client, commit, value, duration);
+        break;
+    default:
+        break;
+    }
+#endif
+}
+
+std::string Trace::report()
+{
+    const double scale = nsPerTick();
+    std::array<std::vector<uint64_t>, static_cast<size_t>(TraceStage::Count)> durations;
+    std::array<uint64_t, static_cast<size_t>(TraceStage::Count)> values{};
+
+    {
+        std::lock_guard<std::mutex> lock{ringsLock};
+        for (const auto &r : rings)
+        {
+            const uint64_t n = std::min<uint64_t>(r->next, Ring::kSize);
+            for (uint64_t i = 0; i < n; i++)
+            {
+                const auto &event = r->events[i];
+                const auto stage = static_cast<size_t>(event.stage);
+                durations[stage].push_back(static_cast<uint64_t>(event.duration * scale));
+                values[stage] += event.value;
+            }
+        }
+    }
+
+    std::ostringstream out;
+    for (size_t stage = 0; stage < durations.size(); stage++)
+    {
+        auto &d = durations[stage];
+        if (d.empty())
+        {
+            continue;
+        }
+        std::sort(d.begin(), d.end());
+        if (out.tellp() > 0)
+        {
+            out << ", ";
+        }
+        out << stageName(static_cast<TraceStage>(stage)) << " " << d.size() << " p50 " << d[d.size() / 2]
+            << " ns p99 " << d[d.size() * 99 / 100] << " ns max " << d.back() << " ns value avg "
+            << values[stage] / d.size();
+    }
+    return out.tellp() > 0 ? out.str() : "no events";
+}
+
+bool Trace::dump(const std::string &path)
+{
+    std::ofstream out{path};
+    if (!out)
+    {
+        return false;
+    }
+    const double scale = nsPerTick();
+    out << "thread,stage,start_ns,duration_ns,value\n";
+
+    std::lock_guard<std::mutex> lock{ringsLock};
+    for (const auto &r : rings)
+    {
+        // oldest first once the ring wrapped
+        const uint64_t first = r->next > Ring::kSize ? r->next - Ring::kSize : 0;
+        for (uint64_t i = first; i < r->next; i++)
+        {
+            const auto &event = r->events[i & (Ring::kSize - 1)];
+            out << r->thread << ',' << stageName(event.stage) << ','
+                << static_cast<int64_t>((static_cast<int64_t>(event.start - anchorTicks)) * scale) << ','
+                << static_cast<uint64_t>(event.duration * scale) << ',' << event.value << '\n';
+        }
+    }
+    return static_cast<bool>(out);
+}
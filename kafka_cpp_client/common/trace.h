@@ -0,0 +1,176 @@
+/*
+ * trace.h
+ *
+ * Probes on the hot paths of the examples, to attribute latency to stages in production:
+ *  ProduceEnqueue  produce() call                      value: payload bytes
+ *  DeliveryReport  dr_cb()                             value: librdkafka's produce -> report latency ( us )
+ *  ConsumeReturn   consume() call                      value: payload bytes ( 0 on timeout )
+ *  BatchFormed     filling one batch                   value: messages
+ *  Commit          commitAsync() / commitSync() call   value: partitions
+ *
+ * When enabled, every probe records the time stamp counter at its start and its duration into a ring buffer of the
+ * calling thread ( the last 4096 events ), so probes never contend. Where <sys/sdt.h> is available every probe is
+ * also a USDT probe point ( provider kafka_client, arguments value and duration in ticks ) with a semaphore: bpftrace
+ * or perf attached to a running process get the events whether tracing is enabled or not, no restart needed.
+ *
+ * Costs:
+ *  - built with KAFKA_TRACE_DISABLED ( cmake -DKAFKA_TRACE=OFF ): none, Trace::kCompiled is false and every probe is
+ *    compiled out
+ *  - compiled in, not enabled: one relaxed atomic load and one load of the probe's semaphore per probe
+ *  - enabled ( KAFKA_TRACE=1 in the environment, or Trace::enable() ): two rdtsc and a ring buffer store
+ *  - a tracer attached to the probe point: two rdtsc and the probe's trap
+ *
+ *  {
+ *      TraceScope<TraceStage::ConsumeReturn> probe;
+ *      msg = consumer->consume(1000);
+ *      probe.value(msg->len());
+ *  }
+ *  ...
+ *  if (Trace::enabled())
+ *  {
+ *      std::cerr << Trace::report() << std::endl;
+ *  }
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if !defined(KAFKA_TRACE_DISABLED) && __has_include(<sys/sdt.h>)
+#define KAFKA_HAVE_USDT
+// Incremented by the tracer while attached to the probe point ( defined in trace.cpp )
+extern "C"
+{
+extern volatile unsigned short kafka_client_produce_enqueue_semaphore;
+extern volatile unsigned short kafka_client_delivery_report_semaphore;
+extern volatile unsigned short kafka_client_consume_return_semaphore;
+extern volatile unsigned short kafka_client_batch_formed_semaphore;
+extern volatile unsigned short kafka_client_commit_semaphore;
+}
+#endif
+
+enum class TraceStage : uint8_t
+{
+    ProduceEnqueue,
+    DeliveryReport,
+    ConsumeReturn,
+    BatchFormed,
+    Commit,
+    Count
+};
+
+namespace Trace
+{
+#ifdef KAFKA_TRACE_DISABLED
+constexpr bool kCompiled = false;
+#else
+constexpr bool kCompiled = true;
+#endif
+
+extern std::atomic<bool> on;
+
+inline bool enabled()
+{
+    return kCompiled && on.load(std::memory_order_relaxed);
+}
+
+void enable(bool enable);
+
+// A tracer is attached to the stage's USDT probe point
+inline bool attached(TraceStage stage)
+{
+#ifdef KAFKA_HAVE_USDT
+    switch (stage)
+    {
+    case TraceStage::ProduceEnqueue:
+        return kafka_client_produce_enqueue_semaphore != 0;
+    case TraceStage::DeliveryReport:
+        return kafka_client_delivery_report_semaphore != 0;
+    case TraceStage::ConsumeReturn:
+        return kafka_client_consume_return_semaphore != 0;
+    case TraceStage::BatchFormed:
+        return kafka_client_batch_formed_semaphore != 0;
+    case TraceStage::Commit:
+        return kafka_client_commit_semaphore != 0;
+    default:
+        return false;
+    }
+#else
+    (void)stage;
+    return false;
+#endif
+}
+
+// The probe of stage has to fire: tracing is enabled or a tracer is attached
+inline bool active(TraceStage stage)
+{
+    return enabled() || (kCompiled && attached(stage));
+}
+
+// Time stamp counter where there is one, ns of the monotonic clock elsewhere
+inline uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Out of line: the probe sites only pay for a call when active(). Stores into the ring only when enabled()
+void record(TraceStage stage, uint64_t start, uint64_t end, uint64_t value);
+
+/*
+ * Count, p50 / p99 / max duration and mean value per stage over what the rings hold. Reads the rings of every thread
+ * that traced: call once they stopped.
+ */
+std::string report();
+
+// Every event in the rings as CSV ( thread,stage,start_ns,duration_ns,value ). @returns false if path can not be written
+bool dump(const std::string &path);
+}
+
+/*
+ * Probe around a scope, records on destruction
+ */
+template <TraceStage Stage>
+class TraceScope
+{
+public:
+    TraceScope() : start_{Trace::active(Stage) ? Trace::ticks() : 0} {}
+
+    ~TraceScope()
+    {
+        if (Trace::kCompiled && start_ != 0)
+        {
+            Trace::record(Stage, start_, Trace::ticks(), value_);
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    void value(uint64_t value) { value_ = value; }
+
+private:
+    uint64_t start_;
+    uint64_t value_{0};
+};
+
+// Probe without a duration
+template <TraceStage Stage>
+inline void tracePoint(uint64_t value)
+{
+    if (Trace::active(Stage))
+    {
+        const auto now = Trace::ticks();
+        Trace::record(Stage, now, now, value);
+    }
+}
@@ -0,0 +1,266 @@
+/*
+ * window_aggregator.cpp
+ */
+#include "window_aggregator.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+// 64 bit hash reading 8 bytes at a time, murmur3 finalizer
+uint64_t hashKey(const char *key, size_t len)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ (len * 0xC2B2AE3D27D4EB4Full);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, key + i, 8);
+        h = (h ^ (w * 0x87C37B91114253D5ull)) * 0x4CF5AD432745937Full;
+        h = (h << 31) | (h >> 33);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, key + i, len - i);
+    h ^= tail * 0x87C37B91114253D5ull;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h ? h : 1;   // 0 marks an empty slot
+}
+
+int64_t floorDiv(int64_t a, int64_t b)
+{
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+}
+
+/*
+ * One window: keys in an open-addressing table with linear probing.
+ * Slots are 32 bytes, two per cache line; the key bytes live in an arena and are only compared when
+ * the full 64 bit hash matches.
+ */
+class WindowAggregator::Window
+{
+public:
+    explicit Window(int64_t start) : start_{start}, slots_(16), mask_{15} {}
+
+    void add(const char *key, size_t keyLen, double value)
+    {
+        if ((used_ + 1) * 10 > slots_.size() * 7)
+        {
+            grow();
+        }
+
+        const auto h = hashKey(key, keyLen);
+        for (size_t i = h & mask_;; i = (i + 1) & mask_)
+        {
+            auto &slot = slots_[i];
+            if (slot.hash == 0)
+            {
+                if (arena_.size() + keyLen > UINT32_MAX)
+                {
+                    throw std::length_error{"window key arena exceeds 4 GB"};
+                }
+                slot.hash = h;
+                slot.keyOffset = static_cast<uint32_t>(arena_.size());
+                slot.keyLen = static_cast<uint32_t>(keyLen);
+                slot.count = 1;
+                slot.sum = value;
+                arena_.append(key, keyLen);
+                used_++;
+                return;
+            }
+            if (slot.hash == h && slot.keyLen == keyLen && memcmp(arena_.data() + slot.keyOffset, key, keyLen) == 0)
+            {
+                slot.count++;
+                slot.sum += value;
+                return;
+            }
+        }
+    }
+
+    void track(int32_t source, int64_t offset)
+    {
+        if (source < 0 || offset < 0)
+        {
+            return;
+        }
+        if (firstOffset_.size() <= static_cast<size_t>(source))
+        {
+            firstOffset_.resize(source + 1, -1);
+        }
+        auto &first = firstOffset_[source];
+        first = first < 0 ? offset : std::min(first, offset);
+    }
+
+    void emit(int64_t sizeMs, const std::function<void(const Result &)> &fn) const
+    {
+        for (const auto &slot : slots_)
+        {
+            if (slot.hash)
+            {
+                fn(Result{arena_.data() + slot.keyOffset, slot.keyLen, start_, start_ + sizeMs, slot.count, slot.sum});
+            }
+        }
+    }
+
+    int64_t firstOffset(int32_t source) const
+    {
+        return static_cast<size_t>(source) < firstOffset_.size() ? firstOffset_[source] : -1;
+    }
+
+    int64_t start() const { return start_; }
+    size_t size() const { return used_; }
+
+private:
+    struct Slot
+    {
+        uint64_t hash{0};
+        uint32_t keyOffset{0};
+        uint32_t keyLen{0};
+        uint64_t count{0};
+        double sum{0};
+    };
+
+    void grow()
+    {
+        std::vector<Slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        mask_ = slots_.size() - 1;
+        for (const auto &slot : old)
+        {
+            if (slot.hash)
+            {
+                size_t i = slot.hash & mask_;
+                while (slots_[i].hash)
+                {
+                    i = (i + 1) & mask_;
+                }
+                slots_[i] = slot;
+            }
+        }
+    }
+
+    int64_t start_;
+    std::vector<Slot> slots_;
+    size_t mask_;
+    size_t used_{0};
+    std::string arena_;
+    std::vector<int64_t> firstOffset_;  // per source
+};
+
+WindowAggregator::WindowAggregator(int64_t sizeMs, int64_t advanceMs, int64_t graceMs)
+    : sizeMs_{sizeMs}, advanceMs_{advanceMs}, graceMs_{graceMs}
+{
+    if (sizeMs_ <= 0 || advanceMs_ <= 0 || advanceMs_ > sizeMs_ || graceMs_ < 0)
+    {
+        throw std::invalid_argument{"window size and advance must be > 0, advance <= size, grace >= 0"};
+    }
+}
+
+WindowAggregator::~WindowAggregator() = default;
+
+bool WindowAggregator::add(const char *key, size_t keyLen, int64_t timestampMs, double value, int32_t source, int64_t offset)
+{
+    maxTimestamp_ = std::max(maxTimestamp_, timestampMs);
+    auto wm = watermark();
+    if (source >= 0 && static_cast<size_t>(source) < closedUntil_.size())
+    {
+        wm = std::max(wm, closedUntil_[source]);
+    }
+
+    // windows containing the timestamp start in ( timestamp - size, timestamp ], on multiples of advance
+    bool counted = false;
+    for (auto start = floorDiv(timestampMs, advanceMs_) * advanceMs_; start > timestampMs - sizeMs_; start -= advanceMs_)
+    {
+        if (start + sizeMs_ <= wm)
+        {
+            break;  // this and all earlier windows are closed
+        }
+
+        Window *window = last_;
+        if (!window || window->start() != start)
+        {
+            auto &slot = windows_[start];
+            if (!slot)
+            {
+                slot.reset(new Window{start});
+            }
+            window = slot.get();
+        }
+        window->add(key, keyLen, value);
+        window->track(source, offset);
+        last_ = window;
+        counted = true;
+    }
+
+    if (!counted)
+    {
+        late_++;
+    }
+    return counted;
+}
+
+size_t WindowAggregator::evict(const std::function<void(const Result &)> &emit)
+{
+    const auto wm = watermark();
+    size_t emitted = 0;
+    while (!windows_.empty() && windows_.begin()->first + sizeMs_ <= wm)
+    {
+        auto &window = *windows_.begin()->second;
+        window.emit(sizeMs_, emit);
+        emitted += window.size();
+        if (last_ == &window)
+        {
+            last_ = nullptr;
+        }
+        windows_.erase(windows_.begin());
+    }
+    return emitted;
+}
+
+int64_t WindowAggregator::firstOffset(int32_t source) const
+{
+    int64_t first = -1;
+    for (const auto &entry : windows_)
+    {
+        const auto offset = entry.second->firstOffset(source);
+        if (offset >= 0 && (first < 0 || offset < first))
+        {
+            first = offset;
+        }
+    }
+    return first;
+}
+
+void WindowAggregator::closedUntil(int32_t source, int64_t windowEndMs)
+{
+    if (static_cast<size_t>(source) >= closedUntil_.size())
+    {
+        closedUntil_.resize(source + 1, INT64_MIN);
+    }
+    closedUntil_[source] = std::max(closedUntil_[source], windowEndMs);
+}
+
+void WindowAggregator::clear()
+{
+    windows_.clear();
+    last_ = nullptr;
+    maxTimestamp_ = INT64_MIN;
+    closedUntil_.clear();
+}
+
+size_t WindowAggregator::keys() const
+{
+    size_t total = 0;
+    for (const auto &entry : windows_)
+    {
+        total += entry.second->size();
+    }
+    return total;
+}
@@ -0,0 +1,84 @@
+/*
+ * window_aggregator.h
+ *
+ * Event-time windowed count and sum per message key.
+ *  1) Windows are tumbling ( advance == size ) or hopping / sliding ( advance < size, a message then counts
+ *     in size / advance overlapping windows ).
+ *  2) Each window keeps its keys in its own open-addressing table ( linear probing, keys in one arena ), so
+ *     an update is a hash, a probe over adjacent slots and two adds, and closing a window frees it whole.
+ *  3) The watermark is the highest timestamp seen minus the grace period; windows ending at or before it
+ *     are closed and handed to evict(). Messages only falling into closed windows are counted as late.
+ *
+ * Each add() may also carry a source ( e.g. a partition ) and offset, so the caller can tell the lowest
+ * offset still held in open windows per source, i.e. the offset that is safe to commit. Windows a source's
+ * messages were already emitted in by an earlier run can be closed for that source with closedUntil().
+ *
+ * Not thread safe.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class WindowAggregator
+{
+public:
+    struct Result
+    {
+        const char *key;
+        size_t keyLen;
+        int64_t windowStart;    // ms, inclusive
+        int64_t windowEnd;      // ms, exclusive
+        uint64_t count;
+        double sum;
+    };
+
+    /*
+     * @param sizeMs      window length
+     * @param advanceMs   distance between window starts, == sizeMs for tumbling windows
+     * @param graceMs     how far behind the highest timestamp a message may be and still be counted
+     */
+    WindowAggregator(int64_t sizeMs, int64_t advanceMs, int64_t graceMs);
+    ~WindowAggregator();
+
+    /*
+     * Add a message to every open window containing timestampMs.
+     * @param source    small dense id of where the message came from, -1 if offsets are not tracked
+     * @returns false if the message was late for all its windows
+     */
+    bool add(const char *key, size_t keyLen, int64_t timestampMs, double value, int32_t source = -1, int64_t offset = -1);
+
+    // Hand every closed window's results to emit, then drop the window. @returns results emitted
+    size_t evict(const std::function<void(const Result &)> &emit);
+
+    // Lowest offset of source held in an open window, -1 if none
+    int64_t firstOffset(int32_t source) const;
+
+    // Messages of source only count in windows ending after windowEndMs, e.g. the watermark of the last emit
+    void closedUntil(int32_t source, int64_t windowEndMs);
+
+    // Drop all state, e.g. when partitions are revoked
+    void clear();
+
+    int64_t watermark() const { return maxTimestamp_ == INT64_MIN ? INT64_MIN : maxTimestamp_ - graceMs_; }
+    size_t openWindows() const { return windows_.size(); }
+    size_t keys() const;
+    uint64_t late() const { return late_; }
+
+private:
+    class Window;
+
+    int64_t sizeMs_;
+    int64_t advanceMs_;
+    int64_t graceMs_;
+    int64_t maxTimestamp_{INT64_MIN};
+    uint64_t late_{0};
+    std::map<int64_t, std::unique_ptr<Window>> windows_;    // by window start
+    Window *last_{nullptr};                                 // most recently updated, usually the next one too
+    std::vector<int64_t> closedUntil_;                      // per source
+};